@@ -79,6 +79,52 @@ def do_programming(server, adcs, instructions):
                     continue
                 program_adc(server, this_adc, addr, value)
 
+def send_command(server, *args):
+    # Sent as a RESP array so arguments can contain spaces and newlines
+    args = [x if type(x) == bytes else str(x).encode("ascii") for x in args]
+    command = b"*%i\r\n" % len(args)
+    for arg in args:
+        command += b"$%i\r\n%s\r\n" % (len(arg), arg)
+    server.sendall(command)
+    return grab_response(server)
+
+def do_bulk_programming(server, devices, program_text, instructions):
+    # The whole file is executed server side by the spi_program command,
+    # pauses just make the server wait for the preceding writes to finish.
+    adc_bits = {SPI_Device.ADC_A: 0x1, SPI_Device.ADC_B: 0x2,
+                SPI_Device.ADC_C: 0x4, SPI_Device.ADC_D: 0x8}
+    adc_mask = 0
+    lmk_mask = 0
+    for device in devices:
+        adc_mask |= adc_bits.get(device, 0)
+    if(adc_mask & 0x3):
+        lmk_mask |= 0x1
+    if(adc_mask & 0xC):
+        lmk_mask |= 0x2
+    if(SPI_Device.CERES_LMK in devices):
+        lmk_mask |= 0x4
+
+    resp = send_command(server, "spi_program", adc_mask, lmk_mask, program_text)
+    if(type(resp) == list and len(resp) > 0 and type(resp[0]) != int):
+        # CERES server, one reply per XEM in the active mask
+        xem_resps = resp
+    else:
+        xem_resps = [resp]
+    success = True
+    for xem, xem_resp in enumerate(xem_resps):
+        prefix = "XEM reply %i: " % xem if len(xem_resps) > 1 else ""
+        if(type(xem_resp) != list):
+            print("%sProgramming failed: %s" % (prefix, str(xem_resp)))
+            success = False
+            continue
+        failures = [(i, status) for i, status in enumerate(xem_resp) if status != 0]
+        for i, status in failures:
+            step = instructions[i] if len(instructions) == len(xem_resp) else "step %i" % i
+            print("%sFailed (%i): %s" % (prefix, status, str(step)))
+        if(failures):
+            success = False
+    return success
+
 def program_clock(server, which_lmk, addr, value):
     # First make sure instructions are in order
     # Remove anything that locks/unlocks stuff, this function handles that
@@ -136,6 +182,7 @@ def main():
     parser.add_argument("--ti", action="store_true", help="Use commands for TI board")
     parser.add_argument("--do_reset", action="store_true", help="Do hard reset (applies to both ADCs)")
     parser.add_argument("--xem-mask", type=str, default=None, help="Mask to indicate which XEMs should recieve programming, default is none.")
+    parser.add_argument("--interactive", action="store_true", help="Send each register write as a separate command and wait for enter at each pause, instead of programming everything in one go")
 
     args = parser.parse_args()
 
@@ -153,6 +200,8 @@ def main():
 
     with open(fn, 'r') as f:
         instructions = parse_config_file(f)
+    with open(fn, 'rb') as f:
+        program_text = f.read()
 
     fpga_conn = connect_to_fpga(port=args.port)
 
@@ -178,7 +227,10 @@ def main():
             print("Doing reset")
             adc_hard_reset(fpga_conn, devices)
 
-        do_programming(fpga_conn, devices, instructions)
+        if(args.interactive):
+            do_programming(fpga_conn, devices, instructions)
+        else:
+            do_bulk_programming(fpga_conn, devices, program_text, instructions)
 
     #fpga_conn[0].write("jesd_sys_reset\n".encode("ascii"))
     #_ = fpga_conn[1].readline()
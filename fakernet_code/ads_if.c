@@ -28,10 +28,8 @@ uint32_t read_ads_if(AXI_QSPI* adc, uint32_t offset) {
     return read_qspi_addr(adc, offset);
 }
 
-uint32_t write_adc_spi(AXI_QSPI* qspi, uint32_t* args) {
-    uint32_t wmpch = args[0];
-    uint32_t adc_addr = args[1];
-    uint32_t adc_data = args[2];
+// Queues the SPI transaction for a single ADC register access on a batch
+int batch_write_adc_spi(RegBatch* batch, AXI_QSPI* qspi, uint32_t wmpch, uint32_t adc_addr, uint32_t adc_data) {
     uint8_t word_buf[3];
 
     wmpch &= 0xF;
@@ -43,5 +41,12 @@ uint32_t write_adc_spi(AXI_QSPI* qspi, uint32_t* args) {
     word_buf[2] = adc_data;
 
     uint8_t ssr = 0x0;
-    return write_spi(qspi, ssr, word_buf, 3);
+    return batch_write_spi(batch, qspi, ssr, word_buf, 3);
+}
+
+uint32_t write_adc_spi(AXI_QSPI* qspi, uint32_t* args) {
+    RegBatch batch;
+    reg_batch_init(&batch);
+    batch_write_adc_spi(&batch, qspi, args[0], args[1], args[2]);
+    return commit_spi_batch(&batch, qspi);
 }
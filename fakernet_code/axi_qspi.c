@@ -2,6 +2,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "axi_qspi.h"
 
 #define SRR_OFFSET 0x40
@@ -26,6 +27,9 @@
 #define SPI_CR_SPI_ENABLE_LOC 1
 #define SPI_CR_LOOPBACK_LOC 0
 
+#define SPI_FINISH_TRIES 20 // Status polls waiting for a transaction to shift out
+#define SPI_FINISH_POLL_US 100
+
 // These functions should be provided by the "main" program
 int read_addr(uint32_t, uint32_t, uint32_t*);
 int double_read_addr(uint32_t, uint32_t, uint32_t*);
@@ -56,6 +60,14 @@ uint32_t read_qspi_addr(AXI_QSPI* qspi, uint32_t offset) {
     return ret;
 }
 
+int batch_write_qspi_addr(RegBatch* batch, AXI_QSPI* qspi, uint32_t offset, uint32_t data) {
+    return reg_batch_write(batch, qspi->axi_addr, offset, data);
+}
+
+int batch_read_qspi_addr(RegBatch* batch, AXI_QSPI* qspi, uint32_t offset, uint32_t* result) {
+    return reg_batch_read(batch, qspi->axi_addr, offset, result);
+}
+
 uint32_t spi_cr_to_bits(struct SPI_CR spi_cr) {
     uint32_t out = 0;
     out |= spi_cr.lsb_first << SPI_CR_LSB_FIRST_LOC;
@@ -86,19 +98,84 @@ SPI_CR bits_to_spi_cr(uint32_t word) {
     return out;
 }
 
-int write_spi(AXI_QSPI* qspi, uint8_t ssr, uint8_t* data, int nwords) {
+// Queues one SPI transaction (SS low, 'nwords' bytes out, SS high) on a batch.
+// SPE is left set: clearing it tri-states the SPI outputs, so it can't be
+// cleared until the status register shows the TX FIFO is empty. Either
+// send the batch with commit_spi_batch or clear it with batch_spi_disable
+// once the transaction is known to be done.
+int batch_write_spi(RegBatch* batch, AXI_QSPI* qspi, uint8_t ssr, uint8_t* data, int nwords) {
     int i;
-    qspi->spi_cr.spi_enable = 0;
-    write_qspi_addr(qspi, SPICR_OFFSET, spi_cr_to_bits(qspi->spi_cr));
-    write_qspi_addr(qspi, SPISSR_OFFSET, ssr);
+    int ret = 0;
+    // Work on a copy, the same AXI_QSPI can be used for several XEMs at once
+    SPI_CR spi_cr = qspi->spi_cr;
+
+    spi_cr.spi_enable = 0;
+    ret |= batch_write_qspi_addr(batch, qspi, SPICR_OFFSET, spi_cr_to_bits(spi_cr));
+    ret |= batch_write_qspi_addr(batch, qspi, SPISSR_OFFSET, ssr);
     for(i=0; i<nwords; i++) {
-        write_qspi_addr(qspi, SPI_DTR_OFFSET, data[i]);
+        ret |= batch_write_qspi_addr(batch, qspi, SPI_DTR_OFFSET, data[i]);
     }
-    qspi->spi_cr.spi_enable = 1;
-    write_qspi_addr(qspi, SPICR_OFFSET, spi_cr_to_bits(qspi->spi_cr));
-    qspi->spi_cr.spi_enable = 0;
-    write_qspi_addr(qspi, SPICR_OFFSET, spi_cr_to_bits(qspi->spi_cr));
-    return 0;
+    spi_cr.spi_enable = 1;
+    ret |= batch_write_qspi_addr(batch, qspi, SPICR_OFFSET, spi_cr_to_bits(spi_cr));
+    return ret;
+}
+
+int batch_spi_disable(RegBatch* batch, AXI_QSPI* qspi) {
+    SPI_CR spi_cr = qspi->spi_cr;
+    spi_cr.spi_enable = 0;
+    return batch_write_qspi_addr(batch, qspi, SPICR_OFFSET, spi_cr_to_bits(spi_cr));
+}
+
+// Sends a batch that ends with a batch_write_spi, waits for the transaction
+// to shift out, then clears SPE. The first status check rides along in the
+// batch, so a transaction that's already done by then costs one extra write.
+int commit_spi_batch(RegBatch* batch, AXI_QSPI* qspi) {
+    SPI_CR spi_cr = qspi->spi_cr;
+    uint32_t status = 0;
+    int ret;
+    int i;
+
+    batch_read_qspi_status(batch, qspi, &status);
+    ret = commit_reg_batch(batch);
+    for(i=0; ret == 0 && !(status & SPI_SR_TX_EMPTY); i++) {
+        if(i == SPI_FINISH_TRIES) {
+            ret = -1;
+            break;
+        }
+        usleep(SPI_FINISH_POLL_US);
+        status = read_qspi_status(qspi);
+        if(status == 0xFFFFFFFF) {
+            // read_qspi_addr's error value
+            ret = -1;
+        }
+    }
+    // Cleared even if something went wrong, same as it always was
+    spi_cr.spi_enable = 0;
+    ret |= write_qspi_addr(qspi, SPICR_OFFSET, spi_cr_to_bits(spi_cr));
+    return ret;
+}
+
+// Empties the receive FIFO without having to pop each word out of it.
+// The reset bit clears itself.
+int batch_reset_spi_rx_fifo(RegBatch* batch, AXI_QSPI* qspi) {
+    SPI_CR spi_cr = qspi->spi_cr;
+    spi_cr.spi_enable = 0;
+    spi_cr.rx_fifo_reset = 1;
+    return batch_write_qspi_addr(batch, qspi, SPICR_OFFSET, spi_cr_to_bits(spi_cr));
+}
+
+int batch_read_qspi_status(RegBatch* batch, AXI_QSPI* qspi, uint32_t* result) {
+    return batch_read_qspi_addr(batch, qspi, SPISR_OFFSET, result);
+}
+
+// The whole transaction gets sent as a single batch, so this is one UDP
+// round trip regardless of the number of words (plus one to clear SPE once
+// it's done).
+int write_spi(AXI_QSPI* qspi, uint8_t ssr, uint8_t* data, int nwords) {
+    RegBatch batch;
+    reg_batch_init(&batch);
+    batch_write_spi(&batch, qspi, ssr, data, nwords);
+    return commit_spi_batch(&batch, qspi);
 }
 
 int spi_drr_pop(AXI_QSPI* qspi) {
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include "reg_batch.h"
 
 
 typedef struct SPI_CR {
@@ -27,10 +28,19 @@ typedef struct AXI_QSPI {
 AXI_QSPI* new_axi_qspi(const char* name, uint32_t axi_addr);
 int write_qspi_addr(AXI_QSPI* qspi, uint32_t offset, uint32_t data);
 uint32_t read_qspi_addr(AXI_QSPI* qspi, uint32_t offset);
+int batch_write_qspi_addr(RegBatch* batch, AXI_QSPI* qspi, uint32_t offset, uint32_t data);
+int batch_read_qspi_addr(RegBatch* batch, AXI_QSPI* qspi, uint32_t offset, uint32_t* result);
 uint32_t spi_cr_to_bits(struct SPI_CR spi_cr);
 SPI_CR bits_to_spi_cr(uint32_t word);
 int write_spi(AXI_QSPI* qspi, uint8_t ssr, uint8_t* data, int nwords);
+int batch_write_spi(RegBatch* batch, AXI_QSPI* qspi, uint8_t ssr, uint8_t* data, int nwords);
+int batch_spi_disable(RegBatch* batch, AXI_QSPI* qspi);
+int commit_spi_batch(RegBatch* batch, AXI_QSPI* qspi);
+int batch_reset_spi_rx_fifo(RegBatch* batch, AXI_QSPI* qspi);
+int batch_read_qspi_status(RegBatch* batch, AXI_QSPI* qspi, uint32_t* result);
 int spi_drr_pop(AXI_QSPI* qspi);
 int spi_drr_data_available(AXI_QSPI* qspi);
 uint32_t read_qspi_status(AXI_QSPI *qspi);
+// Bit of the status register that's set when the transmit FIFO is empty
+#define SPI_SR_TX_EMPTY (1<<2)
 #endif
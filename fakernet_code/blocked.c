@@ -49,7 +49,7 @@ void processUnblockedClients(void) {
         if (!(c->flags & CLIENT_BLOCKED)) {
             /* If we have a queued command, execute it now. */
             if (c->querybuf && sdslen(c->querybuf) > 0) {
-                return processInputBuffer(c);
+                processInputBuffer(c);
             }
         }
     }
@@ -62,7 +62,15 @@ void unblockClient(client *c) {
 
     c->flags &= ~CLIENT_BLOCKED;
     c->blocking_data = NULL;
+    commandUnblocked(c);
 
+    /* Commands the client sent while it was blocked are still sitting in its
+     * query buffer, get them processed before the next event loop iteration.
+     * (freeClient() unblocks too, but removes the client from the list.) */
+    if (!(c->flags & CLIENT_UNBLOCKED)) {
+        c->flags |= CLIENT_UNBLOCKED;
+        listAddNodeTail(server.unblocked_clients,c);
+    }
 }
 
 /* This function gets called when a blocked client timed out in order to
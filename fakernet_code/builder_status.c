@@ -0,0 +1,54 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "builder_status.h"
+
+#define READ_RETRIES 1000 // Updates are short, a reader should never need many
+
+BuilderStatus* builder_status_create(int num) {
+    void* mem = mmap(NULL, num*sizeof(BuilderStatus), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+    // mmap hands back zeroed memory, so every status starts out unpublished
+    return (BuilderStatus*)mem;
+}
+
+void builder_status_destroy(BuilderStatus* statuses, int num) {
+    if(statuses) {
+        munmap(statuses, num*sizeof(BuilderStatus));
+    }
+}
+
+void builder_status_clear(BuilderStatus* status) {
+    memset(status, 0, sizeof(BuilderStatus));
+}
+
+void builder_status_publish(BuilderStatus* status, const BuilderStatus* values) {
+    uint32_t seq = status->seq;
+    __atomic_store_n(&status->seq, seq + 1, __ATOMIC_RELAXED);
+    // The odd seq has to be visible before any of the new values are
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*)status + sizeof(status->seq), (const char*)values + sizeof(values->seq),
+           sizeof(BuilderStatus) - sizeof(status->seq));
+    __atomic_store_n(&status->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int builder_status_read(const BuilderStatus* status, BuilderStatus* out) {
+    uint32_t before, after;
+    int i;
+    for(i=0; i<READ_RETRIES; i++) {
+        before = __atomic_load_n(&status->seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            continue;
+        }
+        memcpy(out, status, sizeof(BuilderStatus));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&status->seq, __ATOMIC_RELAXED);
+        if(before == after) {
+            out->seq = before;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,44 @@
+#ifndef __BUILDER_STATUS__
+#define __BUILDER_STATUS__
+#include <stdint.h>
+
+// A data builder's current state, kept in memory shared with whoever started
+// it (zookeeper) so it can be looked at without sending the builder a command
+// and waiting for it to get around to answering.
+//
+// There's a single writer, the builder, and it never waits on anybody.
+// Readers use the sequence number to tell when they've read a half-written
+// update and retry (a seqlock): it's odd while an update is being written and
+// goes up by two for every complete one. Zero means nothing's been written.
+typedef struct BuilderStatus {
+    uint32_t seq;
+    int32_t pid;
+    int32_t device_id; // From the most recent event
+    int32_t connected_to_fpga;
+    int32_t reeling; // 1 if the builder is reeling right now
+    uint32_t reeling_count; // Number of times the builder has started reeling
+    uint32_t event_count;
+    uint32_t trigger_id; // Most recent event's trigger_id
+    uint64_t latest_timestamp; // Most recent event's clock timestamp
+    uint64_t bytes_read; // From the FPGA
+    uint64_t bytes_written; // To disk
+    uint64_t ring_used; // Bytes in the ring buffer that haven't been built in to events yet
+    uint64_t ring_size;
+    double start_time; // In microseconds (since Epoch start)
+    double uptime; // In microseconds
+    int64_t update_time_us; // When this was written, microseconds since Epoch start
+} __attribute__((aligned(64))) BuilderStatus; // Builders don't share cache lines
+
+// Makes 'num' zeroed statuses in an anonymous shared mapping, so they're
+// shared with every process forked after this. Returns NULL on failure.
+BuilderStatus* builder_status_create(int num);
+void builder_status_destroy(BuilderStatus* statuses, int num);
+// Only call when the builder for this status isn't running
+void builder_status_clear(BuilderStatus* status);
+// Writer side, copies everything but 'seq' from 'values'
+void builder_status_publish(BuilderStatus* status, const BuilderStatus* values);
+// Reader side. Returns 0 with a consistent copy in 'out', or -1 if one
+// couldn't be had (the builder died part way through an update).
+// If nothing has been published yet out->seq is zero.
+int builder_status_read(const BuilderStatus* status, BuilderStatus* out);
+#endif
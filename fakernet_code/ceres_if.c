@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include "ceres_if.h"
 #include "gpio.h"
 #include "iic.h"
@@ -9,6 +10,11 @@
 #include "reset_gen_if.h"
 #include "data_pipeline.h"
 #include "clock_wiz.h"
+#include "spi_program.h"
+#include "jesd_scan.h"
+#include "tdc_align.h"
+#include "server.h"
+#include "daq_logger.h"
 
 #define  ADC_A_AXI_ADDR             0x100100
 #define  ADC_B_AXI_ADDR             0x100200
@@ -52,6 +58,29 @@
 
 const uint32_t CERES_SAFE_READ_ADDRESS = GPIO_AXI_ADDR;
 
+#define QSPI_FIFO_START 0x68 // TX then RX data registers
+#define QSPI_FIFO_END 0x70
+
+// Registers that only the server writes can be cached, see reg_cache.h
+const RegMapEntry ceres_register_map[] = {
+    {DATA_PIPELINE_0_ADDR + 0x0,   DATA_PIPELINE_0_ADDR + 0x4,   REG_RESET},
+    {DATA_PIPELINE_0_ADDR + 0x4,   DATA_PIPELINE_0_ADDR + 0xC,   REG_CONFIG}, // Threshold & channel mask
+    {DATA_PIPELINE_0_ADDR + 0x18,  DATA_PIPELINE_0_ADDR + 0x30,  REG_CONFIG}, // Trigger settings
+    {DATA_PIPELINE_0_ADDR + 0x34,  DATA_PIPELINE_0_ADDR + 0x38,  REG_CONFIG}, // Global depth
+    {DATA_PIPELINE_0_ADDR + 0x100, DATA_PIPELINE_0_ADDR + 0x200, REG_CONFIG}, // Channel depths
+    {DATA_PIPELINE_0_ADDR + 0x804, DATA_PIPELINE_0_ADDR + 0x808, REG_CONFIG}, // Build info
+    {GPIO_AXI_ADDR,                GPIO_AXI_ADDR + 0x1C,         REG_CONFIG}, // Output ports
+    {RESET_GEN_AXI_ADDR,           RESET_GEN_AXI_ADDR + 0x1000,  REG_RESET},
+    {LMK_A_AXI_ADDR + QSPI_FIFO_START,     LMK_A_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {LMK_B_AXI_ADDR + QSPI_FIFO_START,     LMK_B_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {CERES_LMK_AXI_ADDR + QSPI_FIFO_START, CERES_LMK_AXI_ADDR + QSPI_FIFO_END, REG_FIFO},
+    {ADC_A_AXI_ADDR + QSPI_FIFO_START,     ADC_A_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {ADC_B_AXI_ADDR + QSPI_FIFO_START,     ADC_B_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {ADC_C_AXI_ADDR + QSPI_FIFO_START,     ADC_C_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {ADC_D_AXI_ADDR + QSPI_FIFO_START,     ADC_D_AXI_ADDR + QSPI_FIFO_END,     REG_FIFO},
+    {0, 0, REG_VOLATILE} // Must be last
+};
+
 struct CERES_IF {
     AXI_QSPI* lmk_a;
     AXI_QSPI* lmk_b;
@@ -77,8 +106,11 @@ struct CERES_IF {
 };
 
 static struct CERES_IF* ceres = NULL;
+static pthread_once_t ceres_once = PTHREAD_ONCE_INIT;
 
-static struct CERES_IF* get_ceres_handle() {
+// ceres_server can run commands on several XEMs from different threads, so the
+// handle is only ever created once
+static void init_ceres_handle(void) {
     if(ceres == NULL) {
         ceres = malloc(sizeof(struct CERES_IF));
         ceres->lmk_a = new_lmk_spi("lmk_a", LMK_A_AXI_ADDR);
@@ -102,6 +134,10 @@ static struct CERES_IF* get_ceres_handle() {
         ceres->pipeline = new_data_pipeline_if("dp0", DATA_PIPELINE_0_ADDR);
         ceres->clk_wiz = new_clock_wiz("clock_wiz", CLOCK_WIZARD_ADDR);
     }
+}
+
+static struct CERES_IF* get_ceres_handle(void) {
+    pthread_once(&ceres_once, init_ceres_handle);
     return ceres;
 }
 
@@ -529,6 +565,293 @@ static uint32_t adc_reset_command(uint32_t* args) {
     return 0;
 }
 
+// Same as adc_hard_reset in ceres_fpga_spi.py
+static int adc_hard_reset(void* privdata) {
+    uint32_t mask = *(uint32_t*)privdata;
+    if(write_gpio_value(get_ceres_handle()->axi_gpio, GPIO_ADC_RESET_OFFSET, mask) || flush_reg_writes()) {
+        return -1;
+    }
+    usleep(200e3);
+    if(write_gpio_value(get_ceres_handle()->axi_gpio, GPIO_ADC_RESET_OFFSET, 0x0) || flush_reg_writes()) {
+        return -1;
+    }
+    usleep(1000e3);
+    return 0;
+}
+
+// spi_program <adc_mask> <lmk_mask> <program>
+// Writes a whole LMK/ADC register program (the contents of a config file,
+// or '@' followed by the name of one in the server's --spi-program-dir) in
+// one go. See spi_program.h for the format. Bits 0-3 of the ADC mask are
+// ADCs A-D, bits 0-2 of the LMK mask are LMK A, LMK B, and the CERES LMK.
+// Replies with one status per step of the program, 0 for success.
+static void spi_program_command(client* c, int argc, sds* argv) {
+    UNUSED(argc);
+    SpiProgram* program;
+    SpiTargets targets;
+    char err[256];
+    int* status;
+    int i;
+    uint32_t adc_mask = strtoul(argv[1], NULL, 0);
+    uint32_t lmk_mask = strtoul(argv[2], NULL, 0);
+    AXI_QSPI* lmks[3] = {get_ceres_handle()->lmk_a, get_ceres_handle()->lmk_b, get_ceres_handle()->ceres_lmk};
+
+    if(adc_mask > 0xF || lmk_mask > 0x7) {
+        addReplyError(c, "Invalid ADC or LMK mask");
+        return;
+    }
+    if(argv[3][0] == '@') {
+        program = spi_program_load(argv[3]+1, err, sizeof(err));
+    }
+    else {
+        program = spi_program_parse(argv[3], sdslen(argv[3]), err, sizeof(err));
+    }
+    if(!program) {
+        addReplyError(c, err);
+        return;
+    }
+
+    memset(&targets, 0, sizeof(targets));
+    for(i=0; i<4; i++) {
+        if(adc_mask & (1<<i)) {
+            targets.adcs[targets.num_adcs++] = adc_switch(i);
+        }
+    }
+    for(i=0; i<3; i++) {
+        if(lmk_mask & (1<<i)) {
+            targets.lmks[targets.num_lmks++] = lmks[i];
+        }
+    }
+    if(adc_mask) {
+        targets.reset = adc_hard_reset;
+        targets.reset_data = &adc_mask;
+    }
+
+    status = malloc(sizeof(int)*(program->num_steps ? program->num_steps : 1));
+    if(!status) {
+        addReplyError(c, "Out of memory");
+        spi_program_free(program);
+        return;
+    }
+    spi_program_run(program, &targets, status);
+    addReplyLongLongWithPrefix(c, program->num_steps, '*');
+    for(i=0; i<program->num_steps; i++) {
+        addReplyLongLong(c, status[i]);
+    }
+    free(status);
+    spi_program_free(program);
+}
+
+// A jesd_scan run from a timer so the server keeps serving everyone else while
+// it waits on the links. Every board the command was sent to is scanned at
+// the same time and the replies go out once they're all done.
+#define JESD_SCAN_MAX_BOARDS 32
+typedef struct JesdScanBoard {
+    int board;
+    JesdScan scan;
+    JesdScanTargets targets;
+    JesdScanResult* results; // One per grid point
+    int failed; // Current point failed, skip the rest of its steps
+} JesdScanBoard;
+
+typedef struct JesdScanRun {
+    client* c;
+    JesdScanBoard* boards[JESD_SCAN_MAX_BOARDS];
+    int num_boards;
+    int num_points;
+    int point;
+    JesdScanStep step;
+    long dwell_us;
+    long long timer_id;
+} JesdScanRun;
+
+static void add_jesd_scan_reply(client* c, JesdScan* scan, JesdScanTargets* targets, JesdScanResult* results) {
+    JesdScanResult* result;
+    int i, j, k;
+
+    addReplyLongLongWithPrefix(c, scan->num_points, '*');
+    for(i=0; i<scan->num_points; i++) {
+        result = &results[i];
+        if(!result->ok) {
+            addReplyErrorFormat(c, "Failed at grid point %i", i);
+            continue;
+        }
+        addReplyLongLongWithPrefix(c, 3 + scan->num_params + JESD_NUM_LANES*targets->num_jesds, '*');
+        addReplyLongLong(c, result->timestamp_us);
+        addReplyLongLong(c, result->dwell_us);
+        for(j=0; j<scan->num_params; j++) {
+            addReplyLongLong(c, result->values[j]);
+        }
+        addReplyLongLong(c, result->sync_mask);
+        for(j=0; j<targets->num_jesds; j++) {
+            for(k=0; k<JESD_NUM_LANES; k++) {
+                addReplyLongLong(c, result->errors[j][k]);
+            }
+        }
+    }
+}
+
+static void free_jesd_scan_run(JesdScanRun* run) {
+    int i;
+    for(i=0; i<run->num_boards; i++) {
+        free(run->boards[i]->results);
+        free(run->boards[i]);
+    }
+    free(run);
+}
+
+static void jesd_scan_client_freed(client* c, void* data) {
+    UNUSED(c);
+    JesdScanRun* run = data;
+    aeDeleteTimeEvent(server.el, run->timer_id);
+    free_jesd_scan_run(run);
+}
+
+static int jesd_scan_timer(aeEventLoop* el, long long id, void* data) {
+    UNUSED(el);
+    UNUSED(id);
+    JesdScanRun* run = data;
+    JesdScanBoard* board;
+    long wait_us = 0;
+    long ret;
+    int saved_board = active_board();
+    int i;
+
+    for(i=0; i<run->num_boards; i++) {
+        board = run->boards[i];
+        if(board->failed) {
+            continue;
+        }
+        set_active_board(board->board);
+        ret = jesd_scan_step(&board->scan, run->point, run->step, &board->targets, run->dwell_us, &board->results[run->point]);
+        if(ret < 0) {
+            board->results[run->point].ok = 0;
+            board->failed = 1;
+        }
+        else if(ret > wait_us) {
+            wait_us = ret;
+        }
+    }
+    set_active_board(saved_board);
+
+    if(run->step < JESD_SCAN_STEP_FINISH) {
+        run->step++;
+        return (wait_us + 999)/1000;
+    }
+    run->step = JESD_SCAN_STEP_WRITE;
+    for(i=0; i<run->num_boards; i++) {
+        run->boards[i]->failed = 0;
+    }
+    if(++run->point < run->num_points) {
+        return (wait_us + 999)/1000;
+    }
+
+    // Every board is done, the reply's array header went out with the command
+    for(i=0; i<run->num_boards; i++) {
+        board = run->boards[i];
+        add_jesd_scan_reply(run->c, &board->scan, &board->targets, board->results);
+    }
+    unblockClient(run->c);
+    free_jesd_scan_run(run);
+    return AE_NOMORE;
+}
+
+// jesd_scan <adc_mask> <dwell_ms> <param> [param...]
+// Sweeps ADC and/or JESD core registers over a grid and counts JESD lane
+// errors at each point, see jesd_scan.h for how parameters are given.
+// Replies with one array per grid point:
+//      [unix time (us), dwell (us), param values..., sync mask, errors...]
+// where the sync mask has a bit set for each scanned ADC whose link was
+// synced and the errors are the 4 lane error counts for each scanned ADC.
+// The scan runs from a timer with the client blocked, each XEM in the mask
+// gets added to the same run as the command is called for it.
+static void jesd_scan_command(client* c, int argc, sds* argv) {
+    JesdScanBoard* board;
+    JesdScanRun* run = NULL;
+    char err[256];
+    char* end;
+    int i;
+    uint32_t adc_mask = strtoul(argv[1], NULL, 0);
+    long dwell_ms = strtol(argv[2], &end, 0);
+
+    if(adc_mask == 0 || adc_mask > 0xF) {
+        addReplyError(c, "Invalid ADC mask");
+        return;
+    }
+    if(end == argv[2] || *end != '\0' || dwell_ms < 0) {
+        addReplyErrorFormat(c, "'%s' is not a valid dwell time", argv[2]);
+        return;
+    }
+    // Too big for the stack
+    board = calloc(1, sizeof(JesdScanBoard));
+    if(!board) {
+        addReplyError(c, "Out of memory");
+        return;
+    }
+    if(jesd_scan_init(&board->scan, argc-3, argv+3, err, sizeof(err))) {
+        addReplyError(c, err);
+        free(board);
+        return;
+    }
+    board->results = calloc(board->scan.num_points, sizeof(JesdScanResult));
+    if(!board->results) {
+        addReplyError(c, "Out of memory");
+        free(board);
+        return;
+    }
+    board->board = active_board();
+
+    for(i=0; i<4; i++) {
+        if(adc_mask & (1<<i)) {
+            board->targets.jesds[board->targets.num_jesds] = jesd_switch(i);
+            board->targets.adcs[board->targets.num_jesds] = adc_switch(i);
+            board->targets.num_jesds++;
+        }
+    }
+    board->targets.reset_gen = get_ceres_handle()->reset_gen;
+    board->targets.jesd_reset_mask = 1<<RESET_GEN_JESD_BIT;
+
+    // Inside an EXEC the replies have to go out in order, so do it the blocking way
+    if(c->flags & CLIENT_MULTI) {
+        for(i=0; i<board->scan.num_points; i++) {
+            jesd_scan_point(&board->scan, i, &board->targets, dwell_ms*1000, &board->results[i]);
+        }
+        add_jesd_scan_reply(c, &board->scan, &board->targets, board->results);
+        free(board->results);
+        free(board);
+        return;
+    }
+
+    // Called once per XEM, the first one starts the run and blocks the client
+    if(c->flags & CLIENT_BLOCKED) {
+        run = c->blocking_data;
+    }
+    else {
+        run = calloc(1, sizeof(JesdScanRun));
+        if(run) {
+            run->timer_id = aeCreateTimeEvent(server.el, 0, jesd_scan_timer, run, NULL);
+            if(run->timer_id == AE_ERR) {
+                free(run);
+                run = NULL;
+            }
+        }
+        if(!run) {
+            addReplyError(c, "Could not start the scan");
+            free(board->results);
+            free(board);
+            return;
+        }
+        run->c = c;
+        run->num_points = board->scan.num_points;
+        run->step = JESD_SCAN_STEP_WRITE;
+        run->dwell_us = dwell_ms*1000;
+        blockClient(c, run, jesd_scan_client_freed);
+    }
+    // Can't go over with a 32-bit XEM mask
+    assert(run->num_boards < JESD_SCAN_MAX_BOARDS);
+    run->boards[run->num_boards++] = board;
+}
+
 static uint32_t read_data_pipeline_command(uint32_t* args) {
     uint32_t offset =  args[0];
     return read_data_pipeline_value(get_ceres_handle()->pipeline, offset);
@@ -859,10 +1182,12 @@ static uint32_t read_jesd_rx_lane_buffer_adj_command(uint32_t* args) {
     AXI_JESD* jesd = jesd_switch(which_jesd);
     if(!jesd) { return -1; }
 
+    RegBatch batch;
+    reg_batch_init(&batch);
     for(i=0; i<4;i++) {
-        args[i] = read_jesd(jesd, rx_lane_offset[i]);
+        batch_read_jesd(&batch, jesd, rx_lane_offset[i], &args[i]);
     }
-    return 0;
+    return commit_reg_batch(&batch);
 }
 
 static uint32_t write_sma_swap_command(uint32_t* args) {
@@ -989,6 +1314,32 @@ static uint32_t read_tdc_value_command(uint32_t* args) {
     return read_gpio_value(get_ceres_handle()->axi_gpio, 1, channel);
 }
 
+// tdc_align <sync_length> <resolution>
+// Shifts the clock phase until the FONTUS sync lands in the middle of the
+// clock period, see tdc_align.h. 'resolution' is in thousandths of a degree.
+// Returns the phase shift applied, the final mean TDC phase in thousandths
+// of a clock period (500 is ideal), and the number of syncs it took.
+static uint32_t tdc_align_command(uint32_t* args) {
+    uint32_t sync_length = args[0];
+    uint32_t resolution = args[1];
+    char err[LEGACY_ERROR_MAX - 32];
+    TdcAlignResult result;
+    TdcAlignTargets targets;
+
+    targets.clk_wiz = get_ceres_handle()->clk_wiz;
+    targets.gpio = get_ceres_handle()->axi_gpio;
+    targets.tdc_channel = 2; // Same as read_tdc_value
+    if(tdc_align_run(&targets, sync_length, resolution, &result, err, sizeof(err))) {
+        daq_log(LOG_ERROR, "TDC alignment failed: %s", err);
+        snprintf(legacy_error, sizeof(legacy_error), "TDC alignment failed: %s", err);
+        return -1;
+    }
+    args[0] = result.shift;
+    args[1] = (uint32_t)(result.phase*1000 + 0.5);
+    args[2] = result.num_samples;
+    return 0;
+}
+
 static uint32_t read_watchdog_mask_command(uint32_t* args) {
     // See below funtions for definition of watchdog bits
     UNUSED(args);
@@ -1062,6 +1413,8 @@ ServerCommand ceres_commands[] = {
 {"set_adc_pdn",NULL,                               set_adc_pdn_command,                                    2,  1, 0, 0},
 {"get_adc_pdn",NULL,                               get_adc_pdn_command,                                    1,  1, 0, 0},
 {"adc_reset",NULL,                                 adc_reset_command,                                      2,  1, 0, 0},
+{"spi_program",                                    spi_program_command, NULL,                              4,  0, 0, 0},
+{"jesd_scan",                                      jesd_scan_command, NULL,                               -4,  0, 0, 0},
 {"read_data_pipeline_threshold",NULL,              read_data_pipeline_threshold_command,                   1,  1, 0, 0},
 {"write_data_pipeline_threshold",NULL,             write_data_pipeline_threshold_command,                  2,  1, 0, 0},
 {"read_data_pipeline_channel_mask",NULL,           read_data_pipeline_channel_mask_command,                1,  1, 0, 0},
@@ -1120,6 +1473,7 @@ ServerCommand ceres_commands[] = {
 {"increment_clock_wiz_phase",NULL,                 increment_clock_wiz_phase_command,                      2,  1, 0, 0},
 {"decrement_clock_wiz_phase",NULL,                 decrement_clock_wiz_phase_command,                      2,  1, 0, 0},
 {"read_tdc_value",NULL,                            read_tdc_value_command,                                 1,  1, 0, 0},
+{"tdc_align",NULL,                                 tdc_align_command,                                      3,  3, 0, 0},
 {"read_watchdog_mask",NULL,                        read_watchdog_mask_command,                             1,  1, 0, 0},
 {"write_watchdog_mask",NULL,                       write_watchdog_mask_command,                            2,  1, 0, 0},
 {"read_fifo_occupancy",NULL,                       read_fifo_occupancy_command,                            2,  1, 0, 0},
@@ -3,9 +3,11 @@
 #include "server_common.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include "reg_cache.h"
 
 // TODO I need some way to link between IIC Addresses and R/W sizes for each chip
 extern ServerCommand ceres_commands[];
 extern const uint32_t CERES_SAFE_READ_ADDRESS;
+extern const RegMapEntry ceres_register_map[];
 
 #endif
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "fnet_client.h"
 #include "server_common.h"
 #include "server.h"
@@ -17,6 +18,13 @@
 #include "ceres_if.h"
 #include "resp.h"
 #include "daq_logger.h"
+#include "reg_batch.h"
+#include "fnet_async.h"
+#include "poll_groups.h"
+#include "reg_cache.h"
+#include "reg_block.h"
+#include "tdc_align.h"
+#include "spi_program.h"
 
 // For doing "double" reads the 2nd read should be from this register
 #define NUM_XEMS 8
@@ -39,11 +47,31 @@ uint32_t SAFE_READ_ADDRESS;
 
 typedef struct XEMConn {
     struct fnet_ctrl_client* fnet_client;
+    FnetAsyncConn* async; // For accesses that shouldn't block the server
     int device_id;
     const char* ip;
+    RegCache* cache;
+    // While an EXEC is running single register writes are held here and go
+    // out with the next read or batch, see flush_reg_writes
+    RegBatch deferred_writes;
+    int deferred_write_failed;
 } XEMConn;
 XEMConn XEMS[NUM_XEMS];
-XEMConn* active_xem;
+// Each fan-out thread talks to its own XEM, so the active XEM is per thread
+__thread XEMConn* active_xem;
+static int defer_writes = 0;
+
+// One board's share of a command that's being run on several XEMs at once
+typedef struct XEMJob {
+    pthread_t thread;
+    XEMConn* xem;
+    ServerCommand* cmd;
+    uint32_t args_uint[LEGACY_MAX_INTS];
+    uint32_t resp;
+    int started;
+    long long wait_usec; // Time the thread spent waiting on its XEM
+    char err[LEGACY_ERROR_MAX]; // The thread's legacy_error
+} XEMJob;
 
 char command_buffer[BUFFER_SIZE];
 char resp_buffer[BUFFER_SIZE];
@@ -258,7 +286,11 @@ int read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
         *result = 0xDEADBEEF;
         return 0;
     }
+    if(flush_reg_writes()) {
+        return -1;
+    }
 
+    fnet_async_flush(active_xem->async);
     fnet_ctrl_get_send_recv_bufs(active_xem->fnet_client, &send, &recv);
 
     addr = base + addr;
@@ -291,13 +323,47 @@ int read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
 // A better solution would be to have a super-secret address that says just return
 // whatever the most recent read result was. Then I do a read from the desired address,
 // then I read from that super-secret address
+// With --slow-reads the two reads are done as separate round trips with a
+// sleep in between, the way it used to be done.
 int double_read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
+    if(dummy_mode) {
+        *result = 0xDEADBEEF;
+        return 0;
+    }
+    if(active_xem->deferred_writes.num_accesses > 0) {
+        // The read has to come after the held back writes, so it might as
+        // well go in the same packet
+        if(active_xem->deferred_writes.num_accesses < REG_BATCH_MAX_ACCESSES) {
+            reg_batch_read(&active_xem->deferred_writes, base, addr, result);
+            return flush_reg_writes();
+        }
+        if(flush_reg_writes()) {
+            return -1;
+        }
+    }
+    if(reg_cache_lookup(active_xem->cache, base + addr, result)) {
+        return 0;
+    }
 
-    if(read_addr(base, addr, result)) {
-        return -1;
+    // Do both reads in one packet. The FPGA does them back to back, so there's
+    // no need to wait between them.
+    if(reg_batch_pipelined_reads) {
+        fnet_async_flush(active_xem->async);
+        if(reg_read_pipelined(active_xem->fnet_client, base + addr, SAFE_READ_ADDRESS, result)) {
+            return -1;
+        }
     }
-    usleep(100);
-    return read_addr(SAFE_READ_ADDRESS, 0x0, result);
+    else {
+        if(read_addr(base, addr, result)) {
+            return -1;
+        }
+        usleep(100);
+        if(read_addr(SAFE_READ_ADDRESS, 0x0, result)) {
+            return -1;
+        }
+    }
+    reg_cache_fill(active_xem->cache, base + addr, *result);
+    return 0;
 }
 
 int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
@@ -306,6 +372,14 @@ int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
 
       if(dummy_mode) { return 0; }
 
+      if(defer_writes) {
+          if(active_xem->deferred_writes.num_accesses >= REG_BATCH_MAX_ACCESSES && flush_reg_writes()) {
+              return -1;
+          }
+          return reg_batch_write(&active_xem->deferred_writes, base, addr, data);
+      }
+
+      fnet_async_flush(active_xem->async);
       addr = addr+base;
       fnet_ctrl_get_send_recv_bufs(active_xem->fnet_client, &send, &recv);
 
@@ -318,18 +392,249 @@ int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
       int ret = fnet_ctrl_send_recv_regacc(active_xem->fnet_client, num_items);
       
       // Pretty sure "ret" will be the number of UDP reg-accs dones
-      if(ret == 0) {
+      if(ret <= 0) {
           printf("ERROR %i\n", ret);
           char* last_error = fnet_ctrl_last_error(active_xem->fnet_client);
           if(last_error) {
               printf("%s\n", last_error);
           }
           printf("%s\n", strerror(errno));
+          // Might or might not have been written
+          reg_cache_invalidate(active_xem->cache, addr);
           return -1;
       }
+      reg_cache_write(active_xem->cache, addr, data);
       return 0;
 }
 
+int commit_reg_batch(RegBatch* batch) {
+    int i;
+    if(dummy_mode) {
+        for(i=0; i<batch->num_accesses; i++) {
+            if(batch->accesses[i].is_read && batch->accesses[i].result) {
+                *(batch->accesses[i].result) = 0xDEADBEEF;
+            }
+        }
+        reg_batch_init(batch);
+        return 0;
+    }
+    if(batch != &active_xem->deferred_writes && active_xem->deferred_writes.num_accesses > 0) {
+        // Send the held back writes first, in the same packets if they fit
+        if(reg_batch_append(&active_xem->deferred_writes, batch) == 0) {
+            reg_batch_init(batch);
+            return flush_reg_writes();
+        }
+        if(flush_reg_writes()) {
+            return -1;
+        }
+    }
+    if(reg_cache_batch_lookup(active_xem->cache, batch)) {
+        return 0;
+    }
+    fnet_async_flush(active_xem->async);
+    // Sending empties the batch
+    int num_accesses = batch->num_accesses;
+    int ret = reg_batch_send(active_xem->fnet_client, batch, SAFE_READ_ADDRESS);
+    reg_cache_batch_done(active_xem->cache, batch->accesses, num_accesses, ret == 0);
+    return ret;
+}
+
+int flush_reg_writes(void) {
+    if(!active_xem || active_xem->deferred_writes.num_accesses == 0) {
+        return 0;
+    }
+    if(commit_reg_batch(&active_xem->deferred_writes)) {
+        // The commands that made these writes have already said they worked
+        active_xem->deferred_write_failed = 1;
+        reg_batch_init(&active_xem->deferred_writes);
+        return -1;
+    }
+    return 0;
+}
+
+static void transaction_begin(client* c) {
+    int ixem;
+    UNUSED(c);
+    for(ixem=0; ixem<NUM_XEMS; ixem++) {
+        reg_batch_init(&XEMS[ixem].deferred_writes);
+        XEMS[ixem].deferred_write_failed = 0;
+    }
+    defer_writes = 1;
+}
+
+// Sends whatever each XEM still has held back, one batch per XEM
+static int transaction_end(client* c) {
+    int ixem;
+    int failed = 0;
+    UNUSED(c);
+    for(ixem=0; ixem<NUM_XEMS; ixem++) {
+        active_xem = &XEMS[ixem];
+        flush_reg_writes();
+        failed |= active_xem->deferred_write_failed;
+    }
+    active_xem = NULL;
+    defer_writes = 0;
+    return failed;
+}
+
+// State for a read_addr/write_addr that's waiting on one or more XEMs
+typedef struct AsyncRegCommand AsyncRegCommand;
+typedef struct AsyncRegSlot {
+    AsyncRegCommand* cmd;
+    XEMConn* xem;
+    int result;
+    uint32_t value;
+} AsyncRegSlot;
+
+struct AsyncRegCommand {
+    client* c; // Set to NULL if the client disconnects while waiting
+    int is_read;
+    uint32_t addr;
+    uint32_t val;
+    int num_xems;
+    int num_outstanding;
+    AsyncRegSlot slots[NUM_XEMS];
+};
+
+static void async_reg_client_freed(client* c, void* data) {
+    UNUSED(c);
+    // Requests are still in flight, so the last reply callback frees it
+    ((AsyncRegCommand*)data)->c = NULL;
+}
+
+// Every XEM is done, reply in XEM order same as any other command
+static void async_reg_finish(AsyncRegCommand* cmd) {
+    int i;
+    if(cmd->c) {
+        addReplyLongLongWithPrefix(cmd->c, cmd->num_xems, '*');
+        for(i=0; i<cmd->num_xems; i++) {
+            if(cmd->slots[i].result <= 0) {
+                addReplyErrorFormat(cmd->c, "failed to %s value %s FPGA.", cmd->is_read ? "read" : "write", cmd->is_read ? "from" : "to");
+            }
+            else if(cmd->is_read) {
+                addReplyLongLong(cmd->c, cmd->slots[i].value);
+            }
+            else {
+                addReplyStatus(cmd->c, "OK");
+            }
+        }
+        unblockClient(cmd->c);
+    }
+    free(cmd);
+}
+
+static void async_reg_done(int result, const fakernet_reg_acc_item* recv, int num_items, void* privdata) {
+    AsyncRegSlot* slot = privdata;
+    AsyncRegCommand* cmd = slot->cmd;
+
+    slot->result = result;
+    if(result > 0 && cmd->is_read) {
+        // Last item is the safe read, which holds the value (1-read latency)
+        slot->value = ntohl(recv[num_items-1].data);
+        reg_cache_fill(slot->xem->cache, cmd->addr, slot->value);
+    }
+    else if(!cmd->is_read) {
+        if(result > 0) {
+            reg_cache_write(slot->xem->cache, cmd->addr, cmd->val);
+        }
+        else {
+            reg_cache_invalidate(slot->xem->cache, cmd->addr);
+        }
+    }
+    if(--cmd->num_outstanding == 0) {
+        async_reg_finish(cmd);
+    }
+}
+
+// Sends a register read or write to every XEM in the mask without waiting on
+// the replies. The client is blocked until all of them answer (or time out)
+// so the server keeps serving everyone else, even if a board is unreachable.
+// Returns 0 if the client was taken care of, otherwise the caller should do
+// the command the blocking way.
+static int async_reg_command(client* c, int xem_mask, int is_read) {
+    fakernet_reg_acc_item items[2];
+    int num_items = 0;
+    long addr;
+    long val = 0;
+    char* valid;
+    int ixem;
+
+    if(dummy_mode || (is_read && !reg_batch_pipelined_reads)) {
+        return -1;
+    }
+    for(ixem=0; ixem<NUM_XEMS; ixem++) {
+        if(((1<<ixem) & xem_mask) && !XEMS[ixem].async) {
+            return -1;
+        }
+    }
+
+    addr = strtol(c->argv[1], &valid, 0);
+    if(addr == 0 && valid == c->argv[1]) {
+        addReplyErrorFormat(c, "'%s' is not a valid number", c->argv[1]);
+        return 0;
+    }
+    if(!is_read) {
+        val = strtol(c->argv[2], &valid, 0);
+        if(val == 0 && valid == c->argv[2]) {
+            addReplyErrorFormat(c, "'%s' is not a valid number", c->argv[2]);
+            return 0;
+        }
+    }
+
+    addr &= 0x3FFFFFF; // Only the first 25-bits are valid
+    if(is_read) {
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | addr);
+        items[num_items].data = htonl(0x0);
+        num_items++;
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | (SAFE_READ_ADDRESS & 0x3FFFFFF));
+        items[num_items].data = htonl(0x0);
+        num_items++;
+    }
+    else {
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_WRITE | addr);
+        items[num_items].data = htonl(val);
+        num_items++;
+    }
+
+    AsyncRegCommand* cmd = malloc(sizeof(AsyncRegCommand));
+    if(!cmd) {
+        return -1;
+    }
+    cmd->c = c;
+    cmd->is_read = is_read;
+    cmd->addr = addr;
+    cmd->val = val;
+    cmd->num_xems = 0;
+    // Hold one extra count while submitting so a request that fails right
+    // away can't finish the whole command early
+    cmd->num_outstanding = 1;
+    blockClient(c, cmd, async_reg_client_freed);
+
+    for(ixem=0; ixem<NUM_XEMS; ixem++) {
+        if(((1<<ixem) & xem_mask) == 0) {
+            continue;
+        }
+        AsyncRegSlot* slot = &cmd->slots[cmd->num_xems++];
+        slot->cmd = cmd;
+        slot->xem = &XEMS[ixem];
+        slot->result = 0;
+        slot->value = 0;
+        if(is_read && reg_cache_lookup(XEMS[ixem].cache, addr, &slot->value)) {
+            slot->result = 1;
+            continue;
+        }
+        cmd->num_outstanding++;
+        if(fnet_async_submit(XEMS[ixem].async, items, num_items, async_reg_done, slot)) {
+            async_reg_done(-1, NULL, 0, slot);
+        }
+    }
+    // Drop the extra count, this replies if everything is already done
+    if(--cmd->num_outstanding == 0) {
+        async_reg_finish(cmd);
+    }
+    return 0;
+}
+
 void write_addr_command(client* c, int argc, sds* args) {
     UNUSED(argc);
     //write_addr((char*)args[0], 0, args[1]);
@@ -350,7 +655,10 @@ void write_addr_command(client* c, int argc, sds* args) {
         return;
     }
 
-    write_addr(addr, 0, val);
+    if(write_addr(addr, 0, val)) {
+        addReplyError(c, "failed to write value to FPGA.");
+        return;
+    }
     addReplyStatus(c, "OK");
 }
 
@@ -386,10 +694,32 @@ void sleep_command(client* c, int argc, sds* args) {
         addReplyErrorFormat(c, "'%s' is not a valid number", args[1]);
         return;
     }
+    flush_reg_writes();
     sleep((unsigned int) val);
     addReplyStatus(c, "OK");
 }
 
+// Poll targets are added in XEM index order, so the client's active XEM mask
+// is the poll target mask.
+uint32_t poll_target_mask(client* c) {
+    if(!c->server_data || *(int*)c->server_data <= 0) {
+        return 0;
+    }
+    return *(int*)c->server_data;
+}
+
+RegCache* active_reg_cache(void) {
+    return active_xem ? active_xem->cache : NULL;
+}
+
+int active_board(void) {
+    return active_xem ? (int)(active_xem - XEMS) : -1;
+}
+
+void set_active_board(int board) {
+    active_xem = (board >= 0 && board < NUM_XEMS) ? &XEMS[board] : NULL;
+}
+
 static ServerCommand default_commands[] = {
     {"write_addr", write_addr_command, NULL, 3, 1, 0, 0},
     {"read_addr", read_addr_command, NULL, 2, 1, 0, 0},
@@ -397,6 +727,12 @@ static ServerCommand default_commands[] = {
     {"get_active_xem_mask", get_active_xem_mask_command, NULL, 1, 0, 0, 0},
     {"get_available_xems", get_available_xems_command , NULL, 1, 0, 0, 0},
     {"sleep",  sleep_command, NULL, 2, 1, 0, 0},
+    {"poll_add", poll_add_command, NULL, -7, 0, 0, 0},
+    {"poll_remove", poll_remove_command, NULL, 2, 0, 0, 0},
+    {"poll_list", poll_list_command, NULL, 1, 0, 0, 0},
+    {"cache_stats", cache_stats_command, NULL, 1, 0, 0, 0},
+    {"invalidate", invalidate_command, NULL, -1, 0, 0, 0},
+    {"read_block", read_block_command, NULL, -3, 0, 0, 0},
     {"", NULL, NULL, 0, 0, 0, 0} // Must be last
 };
 
@@ -426,30 +762,103 @@ ServerCommand* combine_command_tables() {
     return combined_table;
 }
 
-ServerCommand* search_for_command(ServerCommand* table, const char* command_name) {
-    int cmd_index = 0;
-    while(table[cmd_index].func != NULL) {
-        if(strcmp(table[cmd_index].name, command_name) == 0) {
-            break;
-        }
-        cmd_index +=1;
-    }
-    return &(table[cmd_index]);
-}
-
 
 // For arguements with a values
 enum ArgIDs {
     ARG_NONE=0,
-    ARG_PORT
+    ARG_PORT,
+    ARG_SYNC_SERVER,
+    ARG_SPI_PROGRAM_DIR,
+    ARG_LOG_RATE
 };
 
 void print_help_message() {
-    printf("usage: ceres_server [--dummy] [--port] [--help]\n");
+    printf("usage: ceres_server [--dummy] [--slow-reads] [--port] [--sync-server HOST:PORT] [--spi-program-dir DIR] [--log-rate " LOG_RATE_OPTION_HELP "] [--help]\n"
+           "--spi-program-dir\tDirectory spi_program can load '@' programs from, " SPI_PROGRAM_DEFAULT_DIR " by default.\n"
+           "--log-rate\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). Can be given once per level. ERRORs aren't limited by default.\n");
+}
+
+static void* xem_job_thread(void* arg) {
+    XEMJob* job = arg;
+    long long wait_start = fnet_ctrl_wait_usec;
+    active_xem = job->xem;
+    legacy_error[0] = '\0';
+    job->resp = job->cmd->legacy_func(job->args_uint);
+    memcpy(job->err, legacy_error, sizeof(job->err));
+    active_xem = NULL;
+    job->wait_usec = fnet_ctrl_wait_usec - wait_start;
+    return NULL;
+}
+
+// Runs a legacy command on every XEM in the mask, one thread per XEM, so
+// talking to N boards takes about as long as talking to one. The replies are
+// added in XEM order once every board is done.
+static void fan_out_legacy_command(client* c, ServerCommand* real_cmd, int xem_mask) {
+    XEMJob jobs[NUM_XEMS];
+    int num_jobs = 0;
+    long long max_thread_wait = 0;
+    int ixem, i;
+
+    // Parse once, each board gets its own copy below since multi-value
+    // commands return their results in the argument array
+    for(i=1; i<real_cmd->nargs; i++) {
+        c->legacy_args[i-1] = strtoul(c->argv[i], NULL, 0);
+    }
+
+    for(ixem=0; ixem<NUM_XEMS; ixem++) {
+        if(((1<<ixem) & xem_mask) == 0) {
+            continue;
+        }
+        // Anything still in flight for this XEM has to finish here in the
+        // main thread, the worker threads can't run the reply callbacks
+        fnet_async_flush(XEMS[ixem].async);
+
+        XEMJob* job = &jobs[num_jobs++];
+        job->xem = &XEMS[ixem];
+        job->cmd = real_cmd;
+        job->resp = 0;
+        job->started = 0;
+        job->wait_usec = 0;
+        memcpy(job->args_uint, c->legacy_args, sizeof(job->args_uint));
+    }
+
+    if(num_jobs == 1 || dummy_mode) {
+        // Not worth starting threads for
+        for(i=0; i<num_jobs; i++) {
+            xem_job_thread(&jobs[i]);
+        }
+    }
+    else {
+        for(i=0; i<num_jobs; i++) {
+            if(pthread_create(&jobs[i].thread, NULL, xem_job_thread, &jobs[i]) == 0) {
+                jobs[i].started = 1;
+            }
+            else {
+                daq_log(LOG_WARN, "Could not start thread for XEM%i, running command serially", jobs[i].xem->device_id);
+            }
+        }
+        for(i=0; i<num_jobs; i++) {
+            if(jobs[i].started) {
+                pthread_join(jobs[i].thread, NULL);
+                if(jobs[i].wait_usec > max_thread_wait) {
+                    max_thread_wait = jobs[i].wait_usec;
+                }
+            }
+            else {
+                xem_job_thread(&jobs[i]);
+            }
+        }
+        // The boards were waited on at the same time, so as far as the
+        // command's latency goes only the slowest one counts
+        fnet_ctrl_wait_usec += max_thread_wait;
+    }
+
+    for(i=0; i<num_jobs; i++) {
+        addReplyLegacy(c, real_cmd, jobs[i].resp, jobs[i].args_uint, jobs[i].err);
+    }
 }
 
 void ceres_call(client *c) {
-    int i;
     ServerCommand *real_cmd = c->cmd;
 
     // Need to set the active XEM to the current client's specified one.
@@ -462,6 +871,14 @@ void ceres_call(client *c) {
             send_command_table(c, c->argc, c->argv);
             return;
         }
+        else if (real_cmd->func == command_stats) {
+            command_stats(c, c->argc, c->argv);
+            return;
+        }
+        else if (isTransactionCommand(real_cmd)) {
+            real_cmd->func(c, c->argc, c->argv);
+            return;
+        }
         else if (real_cmd->func == get_active_xem_mask_command) {
             get_active_xem_mask_command(c, c->argc, c->argv);
             return;
@@ -470,6 +887,12 @@ void ceres_call(client *c) {
             get_available_xems_command(c, c->argc, c->argv);
             return;
         }
+        else if (real_cmd->func == poll_add_command ||
+                 real_cmd->func == poll_remove_command ||
+                 real_cmd->func == poll_list_command) {
+            real_cmd->func(c, c->argc, c->argv);
+            return;
+        }
 
         if(!c->server_data || *(int*)c->server_data < 0) {
             addReplyErrorFormat(c, "Cannot perform command until XEM ID is set");
@@ -489,7 +912,22 @@ void ceres_call(client *c) {
         active_xem_count+=1;
     }
 
+    // Inside an EXEC these are done the blocking way so the replies stay in order
+    if((real_cmd->func == read_addr_command || real_cmd->func == write_addr_command) && !(c->flags & CLIENT_MULTI)) {
+        if(async_reg_command(c, xem_mask, real_cmd->func == read_addr_command) == 0) {
+            return;
+        }
+    }
+
     addReplyLongLongWithPrefix(c, active_xem_count, '*');
+
+    if(!real_cmd->func) {
+        // Legacy commands only touch their own arguments, so they get run on
+        // all the XEMs at the same time
+        fan_out_legacy_command(c, real_cmd, xem_mask);
+        return;
+    }
+
     for(ixem=0; ixem<NUM_XEMS; ixem++) {
         if(((1<<ixem) & xem_mask) == 0) {
             continue;
@@ -497,39 +935,7 @@ void ceres_call(client *c) {
         active_xem = &XEMS[ixem];
 
         /* Call the command. */
-        if(real_cmd->func) {
-            c->cmd->func(c, c->argc, c->argv);
-        }
-        else {
-            // Use legacy_func
-            int num_ints_needed = real_cmd->nargs > real_cmd->nresp ? real_cmd->nargs : real_cmd->nresp;
-            uint32_t* args_uint = malloc(sizeof(uint32_t)*num_ints_needed);
-            for(i=1; i<real_cmd->nargs; i++) {
-                args_uint[i-1] = strtoul(c->argv[i], NULL, 0);
-            }
-            uint32_t resp = real_cmd->legacy_func(args_uint);
-            if(real_cmd->nresp == 0) {
-                addReplyStatus(c, "OK");
-            }
-            else if(real_cmd->nresp == 1) {
-                addReplyLongLong(c, (long long)resp);
-            }
-            else {
-                if(resp != 0) {
-                    // TODO! need to add low level error string!
-                    addReplyErrorFormat(c, "Error performing command '%s'", real_cmd->name);
-                }
-                else {
-                    // RESP array is *N\r\n where N is the length of the array, followed
-                    // by the elements of the array
-                    addReplyLongLongWithPrefix(c, (long long)real_cmd->nresp, '*');
-                    for(i=0; i<real_cmd->nresp; i++) {
-                        addReplyLongLong(c, (long long)args_uint[i]);
-                    }
-                }
-            }
-            free(args_uint);
-        }
+        c->cmd->func(c, c->argc, c->argv);
     }
 
     // Unset the server's active xem
@@ -556,6 +962,18 @@ int main(int argc, char** argv) {
                 if(strcmp(argv[i], "--port") == 0) {
                     expecting_value = ARG_PORT;
                 }
+                else if(strcmp(argv[i], "--slow-reads") == 0) {
+                    reg_batch_pipelined_reads = 0;
+                }
+                else if(strcmp(argv[i], "--sync-server") == 0) {
+                    expecting_value = ARG_SYNC_SERVER;
+                }
+                else if(strcmp(argv[i], "--spi-program-dir") == 0) {
+                    expecting_value = ARG_SPI_PROGRAM_DIR;
+                }
+                else if(strcmp(argv[i], "--log-rate") == 0) {
+                    expecting_value = ARG_LOG_RATE;
+                }
                 else if(strcmp(argv[i], "--dry") == 0 || strcmp(argv[i], "--dummy") == 0) {
                     printf("DUMMY MODE ENGAGED\n");
                     dummy_mode = 1;
@@ -576,6 +994,18 @@ int main(int argc, char** argv) {
                             printf("Invalid port given, will be using the default port");
                         }
                         break;
+                    case ARG_SYNC_SERVER:
+                        tdc_align_sync_server = argv[i];
+                        break;
+                    case ARG_SPI_PROGRAM_DIR:
+                        spi_program_dir = argv[i];
+                        break;
+                    case ARG_LOG_RATE:
+                        if(daq_log_parse_rate_limit(argv[i])) {
+                            printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", argv[i]);
+                            return 1;
+                        }
+                        break;
                     case ARG_NONE:
                     default:
                         break;
@@ -599,6 +1029,7 @@ int main(int argc, char** argv) {
     // First connect to FPGAs
     for(i=0;i<NUM_XEMS;i++) {
         XEMConn* xem = &XEMS[i];
+        xem->cache = reg_cache_new(ceres_register_map);
         if(setup_udp(xem)) {
             daq_log(LOG_ERROR, "Cannot connect to XEM%i", xem->device_id);
         }
@@ -628,7 +1059,30 @@ int main(int argc, char** argv) {
     server_command_table = commandTable;
     initServer();
 
+    for(i=0; i<NUM_XEMS; i++) {
+        XEMS[i].async = NULL;
+        if(XEMS[i].fnet_client) {
+            XEMS[i].async = fnet_async_new(server.el, XEMS[i].fnet_client);
+            if(!XEMS[i].async) {
+                daq_log(LOG_WARN, "Could not set up non-blocking access to XEM%i", XEMS[i].device_id);
+            }
+        }
+    }
+    poll_groups_init(server.el, DEFAULT_REDIS_HOST, SAFE_READ_ADDRESS);
+    for(i=0; i<NUM_XEMS; i++) {
+        // A NULL connection means dummy mode to poll_groups, so a real XEM
+        // without one still gets a target (poll_target_mask() is indexed by
+        // XEM) but it's never polled
+        if(!dummy_mode && !XEMS[i].async) {
+            daq_log(LOG_ERROR, "Register polling is disabled for XEM%i", XEMS[i].device_id);
+            poll_groups_add_disabled_target(XEMS[i].device_id);
+            continue;
+        }
+        poll_groups_add_target(XEMS[i].device_id, dummy_mode ? NULL : XEMS[i].async);
+    }
+
     serverSetCustomCall(ceres_call);
+    serverSetTransactionHooks(transaction_begin, transaction_end);
     aeSetBeforeSleepProc(server.el, beforeSleep);
     //aeSetAfterSleepProc(server.el,afterSleep);
     aeMain(server.el);
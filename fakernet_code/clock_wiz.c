@@ -10,6 +10,7 @@ int write_addr(uint32_t, uint32_t, uint32_t);
 #define WIDTH_BETWEEN_CLOCKS    12
 #define RESET_OFFSET            0x0
 #define RESET_VALUE             0xA
+#define STATUS_OFFSET           0x4
 #define DIVIDER_OFFSET          0x208
 #define PHASE_OFFSET            0x20C
 #define DUTY_OFFSET             0x210
@@ -52,3 +53,27 @@ uint32_t read_clock_wiz_reg(AXI_CLOCK_WIZ* wiz, uint32_t offset) {
     }
     return ret;
 }
+
+int batch_clock_wiz_read_phases(RegBatch* batch, AXI_CLOCK_WIZ* wiz, uint32_t* phases) {
+    int i;
+    for(i=0; i<CLOCK_WIZ_NUM_CLOCKS; i++) {
+        if(reg_batch_read(batch, wiz->axi_addr, PHASE_OFFSET + i*WIDTH_BETWEEN_CLOCKS, &phases[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int batch_clock_wiz_write_phases(RegBatch* batch, AXI_CLOCK_WIZ* wiz, const uint32_t* phases) {
+    int i;
+    for(i=0; i<CLOCK_WIZ_NUM_CLOCKS; i++) {
+        if(reg_batch_write(batch, wiz->axi_addr, PHASE_OFFSET + i*WIDTH_BETWEEN_CLOCKS, phases[i])) {
+            return -1;
+        }
+    }
+    return reg_batch_write(batch, wiz->axi_addr, CLOCK_CHANGES_OFFSET, 3);
+}
+
+int batch_clock_wiz_read_status(RegBatch* batch, AXI_CLOCK_WIZ* wiz, uint32_t* result) {
+    return reg_batch_read(batch, wiz->axi_addr, STATUS_OFFSET, result);
+}
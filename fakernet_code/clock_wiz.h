@@ -2,6 +2,12 @@
 #define __CLOCK_WIZ__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
+
+#define CLOCK_WIZ_NUM_CLOCKS 4
+// 360 degrees, the phase registers are in thousandths of a degree
+#define CLOCK_WIZ_FULL_PHASE 360000
+#define CLOCK_WIZ_STATUS_LOCKED_BIT 0x1
 
 typedef struct AXI_CLOCK_WIZ {
     const char* name;
@@ -14,4 +20,9 @@ uint32_t clock_wiz_write_phase(AXI_CLOCK_WIZ* wiz, int which_clock, uint32_t val
 uint32_t clock_wiz_register_changes(AXI_CLOCK_WIZ* wiz);
 uint32_t clock_wiz_reset(AXI_CLOCK_WIZ* wiz);
 uint32_t read_clock_wiz_reg(AXI_CLOCK_WIZ* wiz, uint32_t offset);
+
+int batch_clock_wiz_read_phases(RegBatch* batch, AXI_CLOCK_WIZ* wiz, uint32_t* phases);
+// Writes all the phases and has the wizard apply them, which makes it re-lock
+int batch_clock_wiz_write_phases(RegBatch* batch, AXI_CLOCK_WIZ* wiz, const uint32_t* phases);
+int batch_clock_wiz_read_status(RegBatch* batch, AXI_CLOCK_WIZ* wiz, uint32_t* result);
 #endif
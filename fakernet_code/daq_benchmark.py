@@ -0,0 +1,573 @@
+"""
+End-to-end throughput benchmark for the DAQ chain
+
+    fake_data_gen --> {ceres,fontus}_data_builder --> redis --> zipper --> disk
+
+Everything runs on this machine. A private redis-server is started for each
+run (on a unix socket in the work directory, so it won't touch the real DB),
+fake_data_gen runs in farm mode with one builder per fake board, and the zipper
+writes to a file in the work directory.
+
+For every combination of event rate, waveform length, and board count the
+following gets measured over a fixed window (after a warm up period):
+    - events/s and MB/s at each stage
+    - CPU usage of each process (from /proc/<pid>/stat)
+    - latency percentiles between the board's clock and the event being
+      published by the builder, and being written to disk by the zipper.
+      fake_data_gen's farm boards count their clock in microseconds since the
+      epoch, so the clock can be compared directly to wall-clock time.
+    - dropped events between stages, after letting the chain drain
+
+The results are written as JSON to the report file.
+
+    usage: python3 daq_benchmark.py --rates 100 1000 --lengths 100 400 --boards 1 4
+"""
+import os
+import sys
+import json
+import time
+import errno
+import socket
+import signal
+import struct
+import argparse
+import itertools
+import threading
+import subprocess
+import hiredis
+
+CERES_HEADER_SIZE = 20
+FONTUS_HEADER_SIZE = 52
+EVENT_HEADER_SIZE = 16 # zipper's per-event header
+CERES_NUM_CHANNELS = 16
+FONTUS_NUM_CHANNELS = 4
+FONTUS_DEVICE_ID = 0
+FIRST_CERES_DEVICE_ID = 4
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+
+def now_us():
+    return time.time()*1e6
+
+def percentiles(values):
+    if not values:
+        return None
+    values = sorted(values)
+    def pick(p):
+        return values[min(len(values)-1, int(p*len(values)))]
+    return {"count": len(values),
+            "p50": pick(0.50),
+            "p90": pick(0.90),
+            "p99": pick(0.99),
+            "p999": pick(0.999),
+            "max": values[-1]}
+
+def cpu_ticks(pid):
+    """ Returns utime+stime for the given process, in clock ticks """
+    try:
+        with open("/proc/%i/stat" % pid) as f:
+            stat = f.read()
+    except OSError:
+        return None
+    # The process name can have spaces in it, so split after the closing paren
+    fields = stat[stat.rindex(")")+2:].split()
+    return int(fields[11]) + int(fields[12])
+
+def wait_for_path(path, timeout):
+    end = time.time() + timeout
+    while not os.path.exists(path):
+        if time.time() > end:
+            return False
+        time.sleep(0.05)
+    return True
+
+
+def resp_command(*args):
+    out = b"*%i\r\n" % len(args)
+    for arg in args:
+        if not isinstance(arg, bytes):
+            arg = str(arg).encode()
+        out += b"$%i\r\n%s\r\n" % (len(arg), arg)
+    return out
+
+
+class StatsMonitor(object):
+    """ Follows the builder_stats & zipper_stats streams """
+
+    def __init__(self, sock_path):
+        self.conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.conn.connect(sock_path)
+        self.reader = hiredis.Reader()
+        self.ids = {b"builder_stats": b"$", b"zipper_stats": b"$"}
+        self.built = {} # device_id -> events built
+        self.zipped = 0 # Events built by the zipper
+
+    def handle_entry(self, stream, fields, lock):
+        fields = dict(zip(fields[::2], fields[1::2]))
+        with lock:
+            if stream == b"builder_stats":
+                self.built[int(float(fields[b"device_id"]))] = int(fields[b"event_count"])
+            elif stream == b"zipper_stats":
+                self.zipped = int(fields[b"event_count"])
+
+    def poll(self, lock):
+        """ Waits up to half a second for new entries, returns False if the
+        connection is gone """
+        streams = list(self.ids)
+        self.conn.sendall(resp_command(b"XREAD", b"BLOCK", 500, b"STREAMS",
+                                       *(streams + [self.ids[s] for s in streams])))
+        reply = False
+        while reply is False:
+            buf = self.conn.recv(1 << 20)
+            if not buf:
+                return False
+            self.reader.feed(buf)
+            reply = self.reader.gets()
+        for stream, entries in reply or []:
+            for entry_id, fields in entries:
+                self.ids[stream] = entry_id
+                self.handle_entry(stream, fields, lock)
+        return True
+
+
+class RedisMonitor(threading.Thread):
+    """ Subscribes to the builder's header stream and follows the builder's
+    & zipper's stats streams. Records the builder's publish latency for
+    every event. """
+
+    def __init__(self, sock_path):
+        threading.Thread.__init__(self, daemon=True)
+        self.conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.conn.connect(sock_path)
+        self.conn.sendall(b"SUBSCRIBE header_stream\r\n")
+        self.reader = hiredis.Reader()
+        self.lock = threading.Lock()
+        self.recording = False
+        self.latencies = []
+        self.stats = StatsMonitor(sock_path)
+        self.stats_thread = threading.Thread(target=self.follow_stats, daemon=True)
+        self.running = True
+
+    @property
+    def built(self):
+        return self.stats.built
+
+    @property
+    def zipped(self):
+        return self.stats.zipped
+
+    def follow_stats(self):
+        while self.running:
+            try:
+                if not self.stats.poll(self.lock):
+                    break
+            except OSError:
+                break
+
+    def handle_message(self, channel, data, t):
+        if channel == b"header_stream":
+            if len(data) < 19:
+                return
+            clock = struct.unpack(">Q", data[8:16])[0]
+            with self.lock:
+                if self.recording:
+                    self.latencies.append(t - clock)
+
+    def run(self):
+        self.stats_thread.start()
+        while self.running:
+            try:
+                buf = self.conn.recv(1 << 20)
+            except OSError:
+                break
+            if not buf:
+                break
+            t = now_us()
+            self.reader.feed(buf)
+            msg = self.reader.gets()
+            while msg is not False:
+                if isinstance(msg, list) and len(msg) == 3 and msg[0] == b"message":
+                    self.handle_message(msg[1], msg[2], t)
+                msg = self.reader.gets()
+
+    def start_recording(self):
+        with self.lock:
+            self.recording = True
+            self.latencies = []
+
+    def stop_recording(self):
+        with self.lock:
+            self.recording = False
+            return self.latencies
+
+    def stop(self):
+        self.running = False
+        for conn in (self.conn, self.stats.conn):
+            try:
+                conn.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            conn.close()
+
+
+class ZipperFileMonitor(threading.Thread):
+    """ Follows the zipper's output file, parsing each event as it gets written
+    and recording the latency between the newest CERES clock and the time the
+    event showed up on disk. """
+
+    def __init__(self, filename, poll_interval=0.005):
+        threading.Thread.__init__(self, daemon=True)
+        self.filename = filename
+        self.poll_interval = poll_interval
+        self.lock = threading.Lock()
+        self.recording = False
+        self.latencies = []
+        self.events = 0
+        self.incomplete = 0
+        self.bytes = 0
+        self.device_counts = {}
+        self.running = True
+
+    def parse_event(self, buf, offset):
+        """ Returns the size of the event starting at 'offset', or None if it
+        hasn't been completely written yet """
+        if len(buf) - offset < EVENT_HEADER_SIZE:
+            return None
+        _, status, _, mask = struct.unpack(">IHHQ", buf[offset:offset+EVENT_HEADER_SIZE])
+        pos = offset + EVENT_HEADER_SIZE
+        # FONTUS gets written first, then the other devices in order
+        devices = [i for i in range(64) if mask & (1 << i) and i != FONTUS_DEVICE_ID]
+        if mask & (1 << FONTUS_DEVICE_ID):
+            devices.insert(0, FONTUS_DEVICE_ID)
+        newest_clock = 0
+        for device in devices:
+            is_fontus = device == FONTUS_DEVICE_ID
+            header_size = FONTUS_HEADER_SIZE if is_fontus else CERES_HEADER_SIZE
+            if len(buf) - pos < header_size:
+                return None
+            clock, length = struct.unpack(">QH", buf[pos+8:pos+18])
+            if is_fontus:
+                pos += header_size + FONTUS_NUM_CHANNELS*(length+1)*4
+            else:
+                pos += header_size + CERES_NUM_CHANNELS*(length+2)*4
+                newest_clock = max(newest_clock, clock)
+            if len(buf) < pos:
+                return None
+        return pos - offset, status, devices, newest_clock
+
+    def run(self):
+        buf = b""
+        while self.running and not os.path.exists(self.filename):
+            time.sleep(self.poll_interval)
+        if not self.running:
+            return
+        with open(self.filename, "rb") as f:
+            while self.running:
+                chunk = f.read(1 << 20)
+                if not chunk:
+                    time.sleep(self.poll_interval)
+                    continue
+                t = now_us()
+                buf += chunk
+                offset = 0
+                while True:
+                    try:
+                        ev = self.parse_event(buf, offset)
+                    except struct.error:
+                        ev = None
+                    if ev is None:
+                        break
+                    size, status, devices, clock = ev
+                    offset += size
+                    with self.lock:
+                        self.events += 1
+                        self.bytes += size
+                        self.incomplete += 1 if status else 0
+                        for device in devices:
+                            self.device_counts[device] = self.device_counts.get(device, 0) + 1
+                        if self.recording and clock:
+                            self.latencies.append(t - clock)
+                buf = buf[offset:]
+
+    def snapshot(self):
+        with self.lock:
+            return self.events, self.bytes
+
+    def start_recording(self):
+        with self.lock:
+            self.recording = True
+            self.latencies = []
+
+    def stop_recording(self):
+        with self.lock:
+            self.recording = False
+            return self.latencies
+
+    def stop(self):
+        self.running = False
+
+
+class FarmMonitor(threading.Thread):
+    """ Reads fake_data_gen's stdout and keeps track of how many events each
+    board has sent """
+    def __init__(self, proc):
+        threading.Thread.__init__(self, daemon=True)
+        self.proc = proc
+        self.lock = threading.Lock()
+        self.sent = {} # device_id -> events sent
+        self.faults = {}
+
+    def run(self):
+        for line in self.proc.stdout:
+            fields = line.replace(",", " ").replace("(", " ").split()
+            try:
+                if fields[0] == "TOTAL":
+                    device = int(fields[2].lstrip("#"))
+                    with self.lock:
+                        self.sent[device] = int(fields[4])
+                        self.faults[device] = int(fields[9])
+                elif "total)" in fields:
+                    device = int(fields[1].lstrip("#"))
+                    with self.lock:
+                        self.sent[device] = int(fields[fields.index("total)")-1])
+            except (IndexError, ValueError):
+                continue
+
+    def total_sent(self):
+        with self.lock:
+            return sum(self.sent.values())
+
+
+class Chain(object):
+    """ One instance of the whole DAQ chain """
+
+    def __init__(self, args, rate, length, num_boards, workdir):
+        self.args = args
+        self.rate = rate
+        self.length = length
+        self.num_boards = num_boards
+        self.workdir = workdir
+        self.redis_sock = os.path.join(workdir, "redis.sock")
+        self.data_file = os.path.join(workdir, "zipper.dat")
+        self.procs = {}
+        self.devices = [] # (device_id, builder stage name)
+
+        self.event_mask = 0
+        for i in range(num_boards):
+            self.event_mask |= 1 << (FIRST_CERES_DEVICE_ID + i)
+        if args.fontus:
+            self.event_mask |= 1 << FONTUS_DEVICE_ID
+
+    def binary(self, name):
+        return os.path.join(self.args.bin_dir, name)
+
+    def spawn(self, name, cmd, **kwargs):
+        log = open(os.path.join(self.workdir, "%s.out" % name), "w")
+        stdout = kwargs.pop("stdout", log)
+        self.procs[name] = subprocess.Popen(cmd, stdout=stdout, stderr=log,
+                                            stdin=subprocess.DEVNULL, cwd=self.workdir, **kwargs)
+        return self.procs[name]
+
+    def start(self):
+        for f in (self.redis_sock, self.data_file):
+            if os.path.exists(f):
+                os.remove(f)
+
+        self.spawn("redis", [self.args.redis_server, "--port", "0",
+                             "--unixsocket", self.redis_sock,
+                             "--save", "", "--appendonly", "no",
+                             "--client-output-buffer-limit", "pubsub 0 0 0"])
+        if not wait_for_path(self.redis_sock, 5):
+            raise RuntimeError("redis-server didn't start")
+
+        self.redis = RedisMonitor(self.redis_sock)
+        self.redis.start()
+        self.file_monitor = ZipperFileMonitor(self.data_file)
+        self.file_monitor.start()
+
+        self.spawn("zipper", [self.binary("zipper"), "-o", self.data_file,
+                              "-m", "0x%x" % self.event_mask,
+                              "-u", self.redis_sock,
+                              "-l", os.path.join(self.workdir, "zipper.log")])
+
+        gen_cmd = [self.binary("fake_data_gen"), "--farm", str(self.num_boards),
+                   "--rate", str(self.rate), "--length", str(self.length),
+                   "--encoding", self.args.encoding]
+        if self.args.fontus:
+            gen_cmd.append("--fontus")
+        proc = self.spawn("fake_data_gen", gen_cmd, stdout=subprocess.PIPE, universal_newlines=True)
+        self.farm = FarmMonitor(proc)
+        self.farm.start()
+        time.sleep(0.5) # Let the boards start listening
+
+        # Farm board i listens on 127.0.1.<i+1>, FONTUS comes first
+        boards = []
+        if self.args.fontus:
+            boards.append(("fontus_data_builder", FONTUS_DEVICE_ID))
+        for i in range(self.num_boards):
+            boards.append(("ceres_data_builder", FIRST_CERES_DEVICE_ID + i))
+        for i, (program, device) in enumerate(boards):
+            name = "builder_%i" % device
+            self.devices.append((device, name))
+            self.spawn(name, [self.binary(program), "--ip", "127.0.1.%i" % (i+1),
+                              "--dry-run", "--no-save",
+                              "--redis-sock", self.redis_sock,
+                              "--log-file", os.path.join(self.workdir, "%s.log" % name)])
+
+    def cpu_snapshot(self):
+        return dict((name, cpu_ticks(proc.pid)) for name, proc in self.procs.items())
+
+    def check_alive(self):
+        dead = [name for name, proc in self.procs.items() if proc.poll() is not None]
+        if dead:
+            raise RuntimeError("Process(es) died: %s" % ", ".join(dead))
+
+    def stop_generator(self):
+        proc = self.procs["fake_data_gen"]
+        proc.send_signal(signal.SIGINT)
+        try:
+            proc.wait(5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+        self.farm.join(2)
+
+    def stop(self):
+        self.redis.stop()
+        self.file_monitor.stop()
+        for name, proc in self.procs.items():
+            if proc.poll() is None:
+                proc.terminate()
+        for name, proc in self.procs.items():
+            try:
+                proc.wait(5)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+                proc.wait()
+
+
+def run_one(args, rate, length, num_boards):
+    workdir = os.path.join(args.workdir, "r%s_l%i_b%i" % (rate, length, num_boards))
+    try:
+        os.makedirs(workdir)
+    except OSError as e:
+        if e.errno != errno.EEXIST:
+            raise
+
+    print("Running rate=%s length=%i boards=%i" % (rate, length, num_boards))
+    chain = Chain(args, rate, length, num_boards, workdir)
+    result = {"rate": rate, "length": length, "boards": num_boards}
+    try:
+        chain.start()
+        time.sleep(args.warmup)
+        chain.check_alive()
+
+        # Measurement window
+        cpu_start = chain.cpu_snapshot()
+        sent_start = chain.farm.total_sent()
+        events_start, bytes_start = chain.file_monitor.snapshot()
+        chain.redis.start_recording()
+        chain.file_monitor.start_recording()
+        t_start = time.time()
+
+        time.sleep(args.duration)
+
+        elapsed = time.time() - t_start
+        builder_latency = chain.redis.stop_recording()
+        zipper_latency = chain.file_monitor.stop_recording()
+        events_end, bytes_end = chain.file_monitor.snapshot()
+        sent_end = chain.farm.total_sent()
+        cpu_end = chain.cpu_snapshot()
+        chain.check_alive()
+
+        # Stop the generator, then let everything downstream drain before
+        # counting what made it all the way through
+        chain.stop_generator()
+        time.sleep(args.drain)
+
+        cpu = {}
+        for name in cpu_start:
+            if cpu_start[name] is None or cpu_end.get(name) is None:
+                continue
+            cpu[name] = 100.0*(cpu_end[name] - cpu_start[name])/CLK_TCK/elapsed
+
+        with chain.farm.lock:
+            sent = dict(chain.farm.sent)
+        with chain.redis.lock:
+            built = dict(chain.redis.built)
+            zipped = chain.redis.zipped
+        fm = chain.file_monitor
+        with fm.lock:
+            written = dict(fm.device_counts)
+            events_written = fm.events
+            incomplete = fm.incomplete
+
+        drops = {}
+        for device, name in chain.devices:
+            drops[name] = {"sent": sent.get(device, 0),
+                           "built": built.get(device, 0),
+                           "written": written.get(device, 0),
+                           "dropped_by_builder": sent.get(device, 0) - built.get(device, 0),
+                           "dropped_by_zipper": built.get(device, 0) - written.get(device, 0)}
+
+        result.update({
+            "window_s": elapsed,
+            "generated_hz": (sent_end - sent_start)/elapsed/max(1, len(chain.devices)),
+            "written_hz": (events_end - events_start)/elapsed,
+            "written_MBps": (bytes_end - bytes_start)/elapsed/1e6,
+            "cpu_percent": cpu,
+            "busiest_stage": max(cpu, key=cpu.get) if cpu else None,
+            "latency_us": {"builder_publish": percentiles(builder_latency),
+                           "zipper_write": percentiles(zipper_latency)},
+            "drops": drops,
+            "zipper_events_built": zipped,
+            "events_written": events_written,
+            "incomplete_events": incomplete,
+        })
+    except RuntimeError as e:
+        print("Run failed: %s" % e)
+        result["error"] = str(e)
+    finally:
+        chain.stop()
+    return result
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="End-to-end benchmark of the DAQ chain")
+    parser.add_argument("--rates", default=[100, 1000], type=float, nargs='+', help="Event rates (per board) to sweep over. 0 is as fast as possible")
+    parser.add_argument("--lengths", default=[400], type=int, nargs='+', help="Waveform lengths (sample pairs per channel) to sweep over")
+    parser.add_argument("--boards", default=[1], type=int, nargs='+', help="Number of CERES boards to sweep over")
+    parser.add_argument("--no-fontus", dest="fontus", action="store_false", help="Don't include a FONTUS board")
+    parser.add_argument("--encoding", default="raw", choices=["raw", "compressed", "mixed"], help="CERES sample encoding")
+    parser.add_argument("--duration", default=10, type=float, help="Length of each measurement window in seconds")
+    parser.add_argument("--warmup", default=3, type=float, help="Seconds to wait before measuring")
+    parser.add_argument("--drain", default=3, type=float, help="Seconds to wait after stopping the generator before counting drops")
+    parser.add_argument("--bin-dir", default=os.path.dirname(os.path.abspath(__file__)), help="Directory containing the DAQ programs")
+    parser.add_argument("--redis-server", default="redis-server", help="redis-server executable")
+    parser.add_argument("--workdir", default="daq_benchmark_work", help="Directory for sockets, logs and data files")
+    parser.add_argument("--report", default="daq_benchmark.json", help="File the JSON report is written to")
+    args = parser.parse_args()
+    args.workdir = os.path.abspath(args.workdir)
+
+    for board_count in args.boards:
+        if board_count + args.fontus > 30:
+            print("Too many boards, the zipper only handles devices up to 34")
+            sys.exit(1)
+
+    results = []
+    for rate, length, num_boards in itertools.product(args.rates, args.lengths, args.boards):
+        result = run_one(args, rate, length, num_boards)
+        results.append(result)
+        # Write after each run so a crash part way through isn't a total loss
+        with open(args.report, "w") as f:
+            json.dump({"host": socket.gethostname(),
+                       "time": time.time(),
+                       "encoding": args.encoding,
+                       "fontus": args.fontus,
+                       "duration": args.duration,
+                       "runs": results}, f, indent=2)
+        if "error" not in result:
+            lat = result["latency_us"]["zipper_write"]
+            print("\t%0.1f ev/s generated, %0.1f ev/s written (%0.1f MB/s), zipper latency p50/p99 = %s us, busiest = %s" %
+                  (result["generated_hz"], result["written_hz"], result["written_MBps"],
+                   "%0.0f/%0.0f" % (lat["p50"], lat["p99"]) if lat else "n/a",
+                   result["busiest_stage"]))
+    print("Report written to %s" % args.report)
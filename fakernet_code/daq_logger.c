@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "hiredis/hiredis.h"
 #include "daq_logger.h"
 
@@ -9,16 +15,466 @@
 
 Logger* the_logger = NULL;
 static const char* log_levels[5] = {"", "DEBUG", "INFO", "WARN", "ERROR"};
+// What new loggers start with, by level
+static LogRateLimit default_rate_limits[LOG_ERROR+1] = {
+    [LOG_DEBUG] = {LOG_DEFAULT_RATE, LOG_DEFAULT_BURST},
+    [LOG_INFO] = {LOG_DEFAULT_RATE, LOG_DEFAULT_BURST},
+    [LOG_WARN] = {LOG_DEFAULT_RATE, LOG_DEFAULT_BURST},
+    [LOG_ERROR] = {0, LOG_DEFAULT_BURST},
+};
+
+// One slot in the ring. 'seq' is what makes the ring work without locks,
+// it's the same scheme as Dmitry Vyukov's bounded MPMC queue. A slot at
+// position 'pos' is free for a producer when seq == pos, and holds a
+// finished message for the flusher when seq == pos+1. The flusher sets it
+// to pos+ring_size when it's done, which frees it for the next lap.
+typedef struct LogRecord {
+    unsigned long seq;
+    int level;
+    struct timeval tv;
+    const char* format;
+    // Messages from the same call site that were rate limited since the
+    // last one that got through
+    unsigned long long suppressed;
+    char message[];
+} LogRecord;
+
+// Rate limiting state for one call site, i.e. one format string. Sites are
+// found by the address of the format string, which is a constant for any
+// given daq_log() call, so nothing has to be compared or formatted to
+// decide if a message gets dropped.
+typedef struct LogSite {
+    const char* format; // NULL if the slot isn't used yet
+    char lock;
+    int level;
+    double tokens;
+    long long last_refill_us;
+    unsigned long long suppressed;
+} LogSite;
+
+#define LOG_SITE_TABLE_SIZE 1024 // Must be a power of 2
+#define LOG_SITE_MAX_PROBES 16
+
+static long long now_ms(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000LL + tv.tv_usec/1000;
+}
+
+static LogRecord* record_at(Logger* logger, unsigned long pos) {
+    return (LogRecord*)(logger->ring + (pos & (logger->ring_size-1))*logger->record_size);
+}
+
+// Returns a record for the caller to fill in, or NULL if the ring is full
+static LogRecord* claim_record(Logger* logger, unsigned long* pos_out) {
+    unsigned long pos = __atomic_load_n(&logger->write_pos, __ATOMIC_RELAXED);
+    for(;;) {
+        LogRecord* record = record_at(logger, pos);
+        long diff = (long)(__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&logger->write_pos, &pos, pos+1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return record;
+            }
+            // Someone else got it, 'pos' has been updated
+        }
+        else if(diff < 0) {
+            // The flusher hasn't got to this one yet from the last lap
+            return NULL;
+        }
+        else {
+            pos = __atomic_load_n(&logger->write_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static LogSite* find_site(Logger* logger, const char* format) {
+    // Fibonacci hashing of the pointer, the low bits are mostly alignment
+    unsigned long i = ((uintptr_t)format * 11400714819323198485ull) >> 32;
+    int probe;
+    for(probe=0; probe<LOG_SITE_MAX_PROBES; probe++, i++) {
+        LogSite* site = &logger->sites[i & (LOG_SITE_TABLE_SIZE-1)];
+        const char* expected = NULL;
+        const char* current = __atomic_load_n(&site->format, __ATOMIC_ACQUIRE);
+        if(current == format) {
+            return site;
+        }
+        if(!current) {
+            if(__atomic_compare_exchange_n(&site->format, &expected, format, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == format) {
+                return site;
+            }
+        }
+    }
+    // Table's full, this site just doesn't get limited
+    return NULL;
+}
+
+static void lock_site(LogSite* site) {
+    while(__atomic_test_and_set(&site->lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void unlock_site(LogSite* site) {
+    __atomic_clear(&site->lock, __ATOMIC_RELEASE);
+}
+
+// Token bucket for the call site. Returns 1 if the message should be
+// logged, in which case 'suppressed' is how many were dropped before it.
+static int rate_limit_allows(Logger* logger, int level, const char* format, long long now_us,
+                             unsigned long long* suppressed) {
+    LogRateLimit limit;
+    LogSite* site;
+    int allowed = 0;
+
+    *suppressed = 0;
+    if(level < LOG_DEBUG || level > LOG_ERROR) {
+        return 1;
+    }
+    limit = logger->rate_limits[level];
+    if(limit.per_second <= 0 || !(site = find_site(logger, format))) {
+        return 1;
+    }
+
+    lock_site(site);
+        if(site->last_refill_us == 0) {
+            site->tokens = limit.burst;
+        }
+        else {
+            site->tokens += (now_us - site->last_refill_us)*limit.per_second/1e6;
+            if(site->tokens > limit.burst) {
+                site->tokens = limit.burst;
+            }
+        }
+        site->last_refill_us = now_us;
+        site->level = level;
+        if(site->tokens >= 1) {
+            site->tokens -= 1;
+            *suppressed = site->suppressed;
+            site->suppressed = 0;
+            allowed = 1;
+        }
+        else {
+            site->suppressed++;
+        }
+    unlock_site(site);
+    return allowed;
+}
+
+static void redis_read_replies(redisContext* redis) {
+    redisReply* reply = NULL;
+    do {
+        if(redisBufferRead(redis) == REDIS_ERR) {
+            // TODO should handle this better
+        }
+        if(redisGetReply(redis, (void**)&reply) == REDIS_ERR) {
+            // TODO, should handle this better
+        }
+        freeReplyObject(reply);
+    } while(reply);
+}
+
+static void redis_append_message(Logger* logger, int level, struct timeval tv, const char* message) {
+    redisAppendCommand(logger->redis, "XADD %s MAXLEN ~ 500 * logger_ID %s "
+                                      "tag %i tv_sec %ld tv_usec %ld message %s",
+                                      DEFAULT_REDIS_LOG_STREAM_ID, logger->name,
+                                      level, tv.tv_sec, tv.tv_usec,
+                                      message);
+}
+
+static void redis_send_appended(Logger* logger) {
+    int done;
+    do {
+        if(redisBufferWrite(logger->redis, &done) == REDIS_ERR) {
+            // Not sure how this ought to be handled probably should disconnect
+            // and setup some system to try and re-connect
+            return;
+        }
+    } while(!done);
+}
+
+// Formats one message and sends it wherever it's supposed to go. Only the
+// file & stdout writes happen here, the XADDs are queued up and sent by the
+// caller in one go.
+static int write_message(Logger* logger, int level, struct timeval tv, const char* message) {
+    int offset;
+    struct tm tm_time;
+    const char *tag = (level >= LOG_DEBUG && level <= LOG_ERROR) ? log_levels[level] : "???";
+    const char* my_format_string = logger->add_newlines ? "%s\n" : "%s";
+    int sent_redis = 0;
+
+    localtime_r(&tv.tv_sec, &tm_time);
+    offset = strftime(logger->message_buffer, logger->message_max_length, "%D %T", &tm_time);
+    snprintf(logger->message_buffer+offset, logger->message_max_length-offset, " [%s]: %s", tag, message);
+
+    if(logger->file && level >= logger->verbosity_file) {
+        fprintf(logger->file, my_format_string, logger->message_buffer);
+        logger->file_dirty = 1;
+        if(level >= LOG_ERROR) {
+            logger->file_urgent = 1;
+        }
+    }
+    if(level >= logger->verbosity_stdout) {
+        printf(my_format_string, logger->message_buffer);
+        logger->stdout_dirty = 1;
+    }
+    if(logger->redis && level >= logger->verbosity_redis) {
+        redis_append_message(logger, level, tv, message);
+        sent_redis = 1;
+    }
+    return sent_redis;
+}
+
+static int write_suppressed_summary(Logger* logger, int level, struct timeval tv,
+                                   const char* format, unsigned long long count) {
+    char message[256];
+    int len = strlen(format);
+    // The format's own newline would end up in the middle of the line
+    if(len > 0 && format[len-1] == '\n') {
+        len--;
+    }
+    snprintf(message, sizeof(message), "Suppressed %llu more messages like \"%.*s\"", count, len, format);
+    return write_message(logger, level, tv, message);
+}
+
+static int write_repeat_summary(Logger* logger, struct timeval tv) {
+    char message[64];
+    if(logger->repeats == 0) {
+        return 0;
+    }
+    snprintf(message, sizeof(message), "Last message repeated %lu times", logger->repeats);
+    logger->repeats = 0;
+    return write_message(logger, logger->last_level, tv, message);
+}
+
+// Writes out the counts of messages that were rate limited, for call sites
+// that have gone quiet since (the rest get theirs with their next message)
+static int write_site_summaries(Logger* logger, struct timeval tv) {
+    int num_redis = 0;
+    int i;
+    for(i=0; i<LOG_SITE_TABLE_SIZE; i++) {
+        LogSite* site = &logger->sites[i];
+        unsigned long long count;
+        int level;
+        if(!__atomic_load_n(&site->format, __ATOMIC_ACQUIRE) || !site->suppressed) {
+            continue;
+        }
+        lock_site(site);
+            count = site->suppressed;
+            level = site->level;
+            site->suppressed = 0;
+        unlock_site(site);
+        if(count) {
+            num_redis += write_suppressed_summary(logger, level, tv, site->format, count);
+        }
+    }
+    return num_redis;
+}
+
+// Writes out everything in the ring. A message that's the same as the one
+// before it isn't written again, it gets counted and the count is written
+// when something else comes along or every LOG_SUMMARY_PERIOD_MS. If
+// 'final' is set everything that's being held on to is written out.
+// Called with flush_lock held.
+static void drain_ring(Logger* logger, int final) {
+    LogRecord* record;
+    unsigned long long dropped;
+    int num_redis = 0;
+    long long now;
+    struct timeval now_tv;
+
+    for(;;) {
+        record = record_at(logger, logger->read_pos);
+        if(__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != logger->read_pos+1) {
+            break;
+        }
+        if(record->level == logger->last_level && strcmp(record->message, logger->last_message) == 0) {
+            logger->repeats++;
+        }
+        else {
+            num_redis += write_repeat_summary(logger, record->tv);
+            if(record->suppressed) {
+                num_redis += write_suppressed_summary(logger, record->level, record->tv,
+                                                      record->format, record->suppressed);
+            }
+            num_redis += write_message(logger, record->level, record->tv, record->message);
+            logger->last_level = record->level;
+            strcpy(logger->last_message, record->message);
+        }
+        __atomic_store_n(&record->seq, logger->read_pos + logger->ring_size, __ATOMIC_RELEASE);
+        logger->read_pos++;
+    }
+
+    gettimeofday(&now_tv, NULL);
+    now = now_tv.tv_sec*1000LL + now_tv.tv_usec/1000;
+    if(final || now - logger->last_summary_ms >= LOG_SUMMARY_PERIOD_MS) {
+        num_redis += write_repeat_summary(logger, now_tv);
+        num_redis += write_site_summaries(logger, now_tv);
+        logger->last_summary_ms = now;
+    }
+
+    dropped = __atomic_load_n(&logger->dropped, __ATOMIC_RELAXED);
+    if(dropped != logger->dropped_reported) {
+        char message[128];
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        snprintf(message, sizeof(message), "Dropped %llu log messages, the logger couldn't keep up",
+                 dropped - logger->dropped_reported);
+        logger->dropped_reported = dropped;
+        num_redis += write_message(logger, LOG_WARN, tv, message);
+    }
+
+    if(num_redis) {
+        redis_read_replies(logger->redis);
+        redis_send_appended(logger);
+    }
+    if(logger->stdout_dirty) {
+        fflush(stdout);
+        logger->stdout_dirty = 0;
+    }
+    if(logger->file_dirty && (logger->file_urgent || now - logger->last_file_flush_ms >= LOG_FILE_FLUSH_MS)) {
+        fflush(logger->file);
+        logger->file_dirty = 0;
+        logger->file_urgent = 0;
+        logger->last_file_flush_ms = now;
+    }
+}
+
+// Writes out the ring, at least up through the record at 'pos'
+static void drain_ring_through(Logger* logger, unsigned long pos) {
+    int tries;
+    pthread_mutex_lock(&logger->flush_lock);
+        logger->file_urgent = 1;
+        drain_ring(logger, 0);
+        // A message logged just before this one might still be being
+        // formatted by another thread, give it a moment
+        for(tries=0; tries<1000 && (long)(pos - logger->read_pos) >= 0; tries++) {
+            sched_yield();
+            drain_ring(logger, 0);
+        }
+    pthread_mutex_unlock(&logger->flush_lock);
+}
+
+// Empties the ring every LOG_FLUSH_PERIOD_MS, or sooner if woken
+static void* flusher_thread(void* arg) {
+    Logger* logger = arg;
+    struct timespec deadline;
+
+    while(!__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&logger->flush_lock);
+            drain_ring(logger, 0);
+        pthread_mutex_unlock(&logger->flush_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_PERIOD_MS*1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&logger->wake_lock);
+            while(!__atomic_load_n(&logger->wake_pending, __ATOMIC_ACQUIRE) &&
+                  !__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)) {
+                if(pthread_cond_timedwait(&logger->wake, &logger->wake_lock, &deadline)) {
+                    break;
+                }
+            }
+            __atomic_store_n(&logger->wake_pending, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&logger->wake_lock);
+    }
+    return NULL;
+}
+
+// Never blocks the caller. A wake-up that races with the flusher going to
+// sleep can be missed, then the message just waits for the next period.
+static void wake_flusher(Logger* logger) {
+    __atomic_store_n(&logger->wake_pending, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&logger->wake);
+}
+
+static void init_wake(Logger* logger) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&logger->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&logger->wake_lock, NULL);
+    logger->wake_pending = 0;
+}
+
+// Forking while the flusher is half way through writing would leave the
+// child with locked stdio buffers, so hold off forks until it's done. The
+// child doesn't get the flusher thread, so it logs synchronously, and
+// anything still in the ring is the parent's to write, not the child's.
+static void logger_prepare_fork(void) {
+    if(the_logger) {
+        pthread_mutex_lock(&the_logger->flush_lock);
+        // Otherwise the child writes out the parent's buffered lines too
+        if(the_logger->file) {
+            fflush(the_logger->file);
+        }
+        fflush(stdout);
+    }
+}
+
+static void logger_parent_fork(void) {
+    if(the_logger) {
+        pthread_mutex_unlock(&the_logger->flush_lock);
+    }
+}
+
+static void logger_child_fork(void) {
+    LogRecord* record;
+    int i;
+    if(!the_logger) {
+        return;
+    }
+    // Some other thread might have been holding one of these
+    for(i=0; i<LOG_SITE_TABLE_SIZE; i++) {
+        __atomic_clear(&the_logger->sites[i].lock, __ATOMIC_RELAXED);
+    }
+    for(;;) {
+        record = record_at(the_logger, the_logger->read_pos);
+        if(record->seq != the_logger->read_pos+1) {
+            break;
+        }
+        record->seq = the_logger->read_pos + the_logger->ring_size;
+        the_logger->read_pos++;
+    }
+    the_logger->flusher_running = 0;
+    pthread_mutex_init(&the_logger->flush_lock, NULL);
+    init_wake(the_logger);
+}
 
 void setup_logger(const char* logID, const char* redis_host, const char* log_filename,
                   int verbosity_stdout, int verbosity_file, int verbosity_redis, size_t buffer_size) {
-    Logger* logger = malloc(sizeof(Logger));
+    static int registered_fork_handlers = 0;
+    Logger* logger = calloc(1, sizeof(Logger));
+    unsigned long i;
 
     logger->name = logID;
     logger->verbosity_stdout = verbosity_stdout;
     logger->message_buffer = malloc(buffer_size);
     logger->message_max_length = buffer_size;
 
+    // Each record holds the message as the caller formatted it, the
+    // timestamp and level get added by the flusher
+    logger->record_size = (sizeof(LogRecord) + buffer_size + 7) & ~(size_t)7;
+    logger->ring_size = LOG_RING_SIZE;
+    logger->ring = malloc(logger->record_size*logger->ring_size);
+    for(i=0; i<logger->ring_size; i++) {
+        record_at(logger, i)->seq = i;
+    }
+    pthread_mutex_init(&logger->flush_lock, NULL);
+    init_wake(logger);
+    logger->last_file_flush_ms = now_ms();
+    logger->last_summary_ms = logger->last_file_flush_ms;
+
+    logger->sites = calloc(LOG_SITE_TABLE_SIZE, sizeof(LogSite));
+    logger->last_message = calloc(1, buffer_size);
+    logger->last_level = LOG_NEVER;
+    memcpy(logger->rate_limits, default_rate_limits, sizeof(default_rate_limits));
+
     if(log_filename) {
         logger->file = fopen(log_filename, "a");;
         logger->verbosity_file = verbosity_file;
@@ -34,12 +490,20 @@ void setup_logger(const char* logID, const char* redis_host, const char* log_fil
         }
     } else {
         logger->redis = NULL;
-        verbosity_redis = LOG_NEVER;
+        logger->verbosity_redis = LOG_NEVER;
     }
     logger->add_newlines = 0;
 
     // The daq_logger code will use "the_logger"
     the_logger = logger;
+    if(!registered_fork_handlers) {
+        pthread_atfork(logger_prepare_fork, logger_parent_fork, logger_child_fork);
+        // So whatever was logged right before an exit() isn't lost
+        atexit(daq_log_flush);
+        registered_fork_handlers = 1;
+    }
+    // If the thread can't be started messages just get written straight away
+    logger->flusher_running = pthread_create(&logger->flusher, NULL, flusher_thread, logger) == 0;
 
     // If there were errors connecting/opening, handle those now.
     if(logger->file == NULL) {
@@ -53,11 +517,23 @@ void setup_logger(const char* logID, const char* redis_host, const char* log_fil
     }
 }
 
-void cleanup_logger() {
+void cleanup_logger(void) {
     if(!the_logger) {
         return;
     }
 
+    // Write out whatever's still waiting
+    if(the_logger->flusher_running) {
+        __atomic_store_n(&the_logger->stop, 1, __ATOMIC_RELEASE);
+        wake_flusher(the_logger);
+        pthread_join(the_logger->flusher, NULL);
+        the_logger->flusher_running = 0;
+    }
+    pthread_mutex_lock(&the_logger->flush_lock);
+        the_logger->file_urgent = 1;
+        drain_ring(the_logger, 1);
+    pthread_mutex_unlock(&the_logger->flush_lock);
+
     if(the_logger->redis) {
         redisFree(the_logger->redis);
         the_logger->redis = NULL;
@@ -66,38 +542,26 @@ void cleanup_logger() {
         fclose(the_logger->file);
         the_logger->file = NULL;
     }
+    pthread_mutex_destroy(&the_logger->flush_lock);
+    pthread_mutex_destroy(&the_logger->wake_lock);
+    pthread_cond_destroy(&the_logger->wake);
+    free(the_logger->ring);
+    free(the_logger->sites);
+    free(the_logger->last_message);
     free(the_logger->message_buffer);
     the_logger->message_buffer = NULL;
     free(the_logger);
     the_logger = NULL;
 }
 
-void redis_log_message(int level, struct timeval tv, char* message) {
-    const char* name = the_logger->name;
-    int done;
-    redisReply* reply = NULL;
-    do {
-        if(redisBufferRead(the_logger->redis) == REDIS_ERR) {
-            // TODO should handle this better
-        }
-        if(redisGetReply(the_logger->redis, (void**)&reply) == REDIS_ERR) {
-            // TODO, should handle this better
-        }
-        freeReplyObject(reply);
-    } while(reply);
-
-    redisAppendCommand(the_logger->redis, "XADD %s MAXLEN ~ 500 * logger_ID %s "
-                                            "tag %i tv_sec %ld tv_usec %ld message %s",
-                                            DEFAULT_REDIS_LOG_STREAM_ID, name,
-                                            level, tv.tv_sec, tv.tv_usec,
-                                            message);
-    do {
-        if(redisBufferWrite(the_logger->redis, &done) == REDIS_ERR) {
-            // Not sure how this ought to be handled probably should disconnect
-            // and setup some system to try and re-connect
-            return;
-        }
-    } while(!done);
+void daq_log_flush(void) {
+    if(!the_logger) {
+        return;
+    }
+    pthread_mutex_lock(&the_logger->flush_lock);
+        the_logger->file_urgent = 1;
+        drain_ring(the_logger, 1);
+    pthread_mutex_unlock(&the_logger->flush_lock);
 }
 
 void daq_log(int level, const char* restrict format, ...) {
@@ -106,8 +570,8 @@ void daq_log(int level, const char* restrict format, ...) {
     if(!the_logger) {
         return;
     }
-    if(level < the_logger->verbosity_file && 
-       level < the_logger->verbosity_redis && 
+    if(level < the_logger->verbosity_file &&
+       level < the_logger->verbosity_redis &&
        level < the_logger->verbosity_stdout) { return; }
 
     va_start(arglist, format);
@@ -115,37 +579,93 @@ void daq_log(int level, const char* restrict format, ...) {
     va_end(arglist);
 }
 
+// Only formats the caller's message in to the ring, the timestamp
+// formatting and all the I/O happen on the flusher thread. If the ring is
+// full the message gets dropped (and counted) rather than making the
+// caller wait. ERRORs wake the flusher so they're written straight away,
+// without doing any I/O here (exits are covered by daq_log_flush()).
 void daq_log_raw(int level, const char* format, va_list args) {
-    int offset;
-    struct tm* tm_time;
-    struct timeval tv_time;
-    const char *tag = (level >= LOG_DEBUG && level <= LOG_ERROR) ? log_levels[level] : "???";
+    LogRecord* record;
+    unsigned long pos;
+    struct timeval tv;
+    unsigned long long suppressed;
+    Logger* logger = the_logger;
 
-    if(!the_logger) {
+    if(!logger) {
         return;
     }
-    if(level < the_logger->verbosity_file &&
-       level < the_logger->verbosity_redis &&
-       level < the_logger->verbosity_stdout) { return; }
+    if(level < logger->verbosity_file &&
+       level < logger->verbosity_redis &&
+       level < logger->verbosity_stdout) { return; }
 
-    gettimeofday(&tv_time, NULL);
-    tm_time = localtime(&tv_time.tv_sec);
+    gettimeofday(&tv, NULL);
+    if(!rate_limit_allows(logger, level, format, tv.tv_sec*1000000LL + tv.tv_usec, &suppressed)) {
+        return;
+    }
+    record = claim_record(logger, &pos);
+    if(!record) {
+        __atomic_add_fetch(&logger->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    record->tv = tv;
+    record->level = level;
+    record->format = format;
+    record->suppressed = suppressed;
+    vsnprintf(record->message, logger->message_max_length, format, args);
+    __atomic_store_n(&record->seq, pos+1, __ATOMIC_RELEASE);
 
-    offset = strftime(the_logger->message_buffer, the_logger->message_max_length, "%D %T", tm_time);
-    offset += snprintf(the_logger->message_buffer+offset, the_logger->message_max_length-offset, " [%s]: ", tag);
+    if(!logger->flusher_running) {
+        drain_ring_through(logger, pos);
+    }
+    else if(level >= LOG_ERROR) {
+        wake_flusher(logger);
+    }
+}
 
-    vsnprintf(the_logger->message_buffer+offset, the_logger->message_max_length-offset, format, args);
+void daq_log_set_rate_limit(int level, double per_second, double burst) {
+    if(level < LOG_DEBUG || level > LOG_ERROR) {
+        return;
+    }
+    default_rate_limits[level].per_second = per_second;
+    default_rate_limits[level].burst = burst < 1 ? 1 : burst;
+    if(the_logger) {
+        the_logger->rate_limits[level] = default_rate_limits[level];
+    }
+}
 
-    const char* my_format_string = the_logger->add_newlines ? "%s\n" : "%s";
-    if(the_logger->file && level >= the_logger->verbosity_file) {
-        fprintf(the_logger->file, my_format_string, the_logger->message_buffer);
-        fflush(the_logger->file);
+int daq_log_parse_rate_limit(const char* spec) {
+    const char* colon = strchr(spec, ':');
+    double per_second;
+    double burst = LOG_DEFAULT_BURST;
+    char* end;
+    int level;
+
+    if(!colon) {
+        return -1;
     }
-    if(level >= the_logger->verbosity_stdout) {
-        printf(my_format_string, the_logger->message_buffer);
-        fflush(stdout);
+    for(level=LOG_DEBUG; level<=LOG_ERROR; level++) {
+        if(strncasecmp(spec, log_levels[level], colon - spec) == 0 &&
+           log_levels[level][colon - spec] == '\0') {
+            break;
+        }
+    }
+    if(level > LOG_ERROR) {
+        return -1;
+    }
+    per_second = strtod(colon+1, &end);
+    if(end == colon+1 || per_second < 0) {
+        return -1;
+    }
+    if(*end == ':') {
+        const char* burst_str = end+1;
+        burst = strtod(burst_str, &end);
+        if(end == burst_str) {
+            return -1;
+        }
     }
-    if(the_logger->redis && level >= the_logger->verbosity_redis) {
-        redis_log_message(level, tv_time, the_logger->message_buffer + offset);
+    if(*end != '\0') {
+        return -1;
     }
+    daq_log_set_rate_limit(level, per_second, burst);
+    return 0;
 }
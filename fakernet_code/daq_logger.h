@@ -2,6 +2,7 @@
 #define __DAQ_LOGGER_H__
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "hiredis/hiredis.h"
 
 #define LOG_NEVER 0
@@ -10,6 +11,33 @@
 #define LOG_WARN 3
 #define LOG_ERROR 4
 
+// Messages are put in a ring buffer by the thread that logs them and a
+// background thread does the formatting and writing, so logging never waits
+// on the disk or redis. If the ring fills up messages are dropped and the
+// number dropped gets logged once there's room again. ERRORs wake the
+// background thread so they get written right away, and whatever's left is
+// written at exit (or by daq_log_flush).
+#define LOG_RING_SIZE 1024 // Messages, must be a power of 2
+#define LOG_FLUSH_PERIOD_MS 10 // How often the background thread empties the ring
+#define LOG_FILE_FLUSH_MS 200 // How often the file gets fflush'd, ERRORs go right away
+
+// Each call site (each format string passed to daq_log) gets a token bucket,
+// sized by the message's level, so one message in a loop can't flood the
+// logs. Messages over the limit are counted and a "Suppressed N more
+// messages like ..." line is written once the site has tokens again, or
+// every LOG_SUMMARY_PERIOD_MS. Back to back identical messages are also
+// only written once, followed by "Last message repeated N times".
+// ERRORs aren't limited unless asked for, only repeats get collapsed.
+#define LOG_DEFAULT_RATE 10.0 // Messages per second per call site
+#define LOG_DEFAULT_BURST 50.0
+#define LOG_RATE_OPTION_HELP "LEVEL:RATE[:BURST]"
+#define LOG_SUMMARY_PERIOD_MS 1000
+
+typedef struct LogRateLimit {
+    double per_second; // <= 0 for no limit
+    double burst;
+} LogRateLimit;
+
 typedef struct Logger {
     FILE* file;
     redisContext* redis;
@@ -17,16 +45,53 @@ typedef struct Logger {
     int verbosity_stdout;
     int verbosity_redis;
     int verbosity_file;
-    char* message_buffer;
+    char* message_buffer; // Only used by whoever holds flush_lock
     int message_max_length;
     int add_newlines;
+
+    char* ring;
+    size_t record_size;
+    unsigned long ring_size;
+    unsigned long write_pos; // Next slot a message goes in
+    unsigned long read_pos; // Next slot to be written out
+    unsigned long long dropped;
+    unsigned long long dropped_reported;
+    pthread_t flusher;
+    int flusher_running;
+    int stop;
+    pthread_mutex_t flush_lock;
+    // For waking the flusher early, when there's an ERROR to write
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    int wake_pending;
+    int stdout_dirty;
+    int file_dirty;
+    int file_urgent;
+    long long last_file_flush_ms;
+
+    LogRateLimit rate_limits[LOG_ERROR+1]; // By level
+    struct LogSite* sites;
+    char* last_message; // For spotting repeats
+    int last_level;
+    unsigned long repeats;
+    long long last_summary_ms;
 } Logger;
 
 extern Logger* the_logger;
 void setup_logger(const char* logID, const char* redis_host, const char* log_filename,
                   int verbosity_stdout, int verbosity_file, int verbosity_redis, size_t buffer_size);
 void cleanup_logger(void);
+// Writes out everything that's been logged so far. Gets called at exit.
+void daq_log_flush(void);
 void daq_log_raw(int level, const char* format, va_list args);
+// Changes the call site rate limit for messages of 'level'. Can be called
+// before setup_logger, and carries over to loggers set up later (i.e. in
+// forked processes).
+void daq_log_set_rate_limit(int level, double per_second, double burst);
+// For a command line option, 'spec' is LEVEL:RATE[:BURST] where LEVEL is
+// debug, info, warn or error, and a RATE of 0 means no limit.
+// Returns 0 on success, -1 if 'spec' isn't valid.
+int daq_log_parse_rate_limit(const char* spec);
 
 // The below __attribute__ thingy tells the GNU compiler to avoid throw an
 // error/warning if the format and ensuing parameters don't match up.
@@ -48,7 +48,9 @@ Author: Eric Marzec <marzece@gmail.com>
 #include <sys/uio.h>
 #include "hiredis/hiredis.h"
 #include "fnet_client.h"
+#include "fnet_broker.h"
 #include "daq_logger.h"
+#include "metrics.h"
 
 #include "data_builder.h"
 
@@ -69,6 +71,7 @@ Author: Eric Marzec <marzece@gmail.com>
 #define LOG_MESSAGE_MAX 1024
 
 #define DEFAULT_REDIS_HOST  "127.0.0.1"
+#define DEFAULT_REDIS_SOCK "/var/run/redis/redis-server.sock"
 #define DEFAULT_ERROR_LOG_FILENAME "data_builder_error_log.log"
 
 // Every event header starts with this magic number
@@ -151,6 +154,7 @@ typedef struct ProcessingStats {
     int device_id; // Most recent event's device ID (shouldn't change event-by-event)
     unsigned long long latest_timestamp; // Most recent event's clock timestamp
     int reeling_happened; // Tracks if the data builder was in  the reeling state any time since the previous update.
+    unsigned int reeling_count; // Number of times reeling started (since program startup)
     double start_time; // In microseconds (since Epoch start)
     double uptime; // In microseconds
     unsigned int pid; // PID for this program
@@ -160,11 +164,29 @@ typedef struct ProcessingStats {
     int fifo_wpointer;
     // Would like to keep track of running compression factor?
 
-    // Would like to add these but its a bit of a pain
-    //unsigned int bytes_read;
-    //unsigned int bytes_written;
+    unsigned long long bytes_read; // From the FPGA
+    unsigned long long bytes_written; // To disk
 } ProcessingStats;
 
+// What gets published from ProcessingStats, see metrics.h
+typedef struct BuilderMetrics {
+    MetricSet set;
+    Metric* event_count;
+    Metric* trigger_id;
+    Metric* latest_timestamp;
+    Metric* device_id;
+    Metric* reeling_happened;
+    Metric* connected_to_fpga;
+    Metric* fifo_event_rpointer;
+    Metric* fifo_rpointer;
+    Metric* fifo_wpointer;
+    Metric* bytes_read;
+    Metric* bytes_written;
+    Metric* event_bytes;
+    Metric* pid;
+    Metric* uptime;
+} BuilderMetrics;
+
 // TODO could consider merging the contiguous & total space available functions
 // by have both values calculated and returned in argument pointers..and just only fill in
 // the non-NULL ones.
@@ -203,6 +225,17 @@ size_t ring_buffer_space_available(RingBuffer* ring_buffer) {
     return ring_buffer->write_pointer - ring_buffer->event_read_pointer;
 }
 
+// Bytes written in to the ring buffer that haven't been built in to an event yet
+size_t ring_buffer_bytes_used(const RingBuffer* ring_buffer) {
+    if(ring_buffer->is_empty) {
+        return 0;
+    }
+    if(ring_buffer->write_pointer > ring_buffer->event_read_pointer) {
+        return ring_buffer->write_pointer - ring_buffer->event_read_pointer;
+    }
+    return ring_buffer->write_pointer + (BUFFER_SIZE - ring_buffer->event_read_pointer);
+}
+
 size_t ring_buffer_contiguous_readable(RingBuffer* buffer) {
     /* This is a little bit tricky b/c of the two read pointers...but it's not too bad.
      * Basically there are two cases where are all three pointers are equal, full or empty,
@@ -338,6 +371,9 @@ void ring_buffer_update_read_pntr(RingBuffer* buffer, size_t nbytes) {
 typedef struct FPGA_IF {
     int fd; // File descriptor for tcp connection
     struct fnet_ctrl_client* udp_client; // UDP connection
+    FnetBrokerClient* broker; // Used instead of udp_client when going through fnet_broker
+    const char* broker_sock; // Set if going through fnet_broker, for re-connecting
+    const char* board; // Name the broker knows the FPGA by
     RingBuffer ring_buffer; // compressed data buffer
     EventBuffer event_buffer; // memory location for uncompressed event data
 } FPGA_IF;
@@ -380,7 +416,7 @@ typedef union EventHeader {
 struct BuilderProtocol {
     int(*reader_process)(FPGA_IF* fpga, EventHeader *ret);
     void (*display_process)(const EventHeader* header);
-    void (*write_event)(EventBuffer* eb, EventHeader* header);
+    size_t (*write_event)(EventBuffer* eb, EventHeader* header); // Returns the number of bytes written
     int (*validate_event)(const EventHeader* header, const EventBuffer* eb);
     void (*publish_event)(redisContext*c, EventBuffer eb, const unsigned int header_size);
     void (*update_stats)(ProcessingStats* stats, EventHeader* header);
@@ -684,7 +720,7 @@ static void sig_handler(int signum) {
     }
 }
 
-void ceres_write_to_disk(EventBuffer* eb, EventHeader* header) {
+size_t ceres_write_to_disk(EventBuffer* eb, EventHeader* header) {
     (void)header; // Unused
     size_t nwritten;
     nwritten = fwrite(eb->data, 1, eb->num_bytes, fdisk);
@@ -692,12 +728,13 @@ void ceres_write_to_disk(EventBuffer* eb, EventHeader* header) {
         // TODO check errno
         builder_log(LOG_ERROR, "Error writing event");
         // TODO close the file??
-        return;
+        return nwritten;
     }
     fflush(fdisk);
+    return nwritten;
 }
 
-void fontus_write_to_disk(EventBuffer* eb, EventHeader* header) {
+size_t fontus_write_to_disk(EventBuffer* eb, EventHeader* header) {
     (void)eb; // Unused
     FontusTrigHeader* ev = (FontusTrigHeader*)header;
     size_t nwritten;
@@ -735,10 +772,11 @@ void fontus_write_to_disk(EventBuffer* eb, EventHeader* header) {
         // TODO check errno (does fwrite set errno?)
         builder_log(LOG_ERROR, "Error writing event header!");
         // TODO do I want to close the file here?
-        return;
+        return nwritten;
     }
 
     fflush(fdisk);
+    return nwritten;
 }
 
 // Read 32 bits from read buffer
@@ -950,43 +988,48 @@ void publish_event(redisContext*c, EventBuffer eb, const unsigned int header_siz
     freeReplyObject(r);
 }
 
-void redis_publish_stats(redisContext* c, const ProcessingStats* stats) {
-    if(!c || !stats) {
+void initialize_metrics(BuilderMetrics* metrics) {
+    MetricSet* set = &metrics->set;
+    metrics_init(set, "builder_stats", "builder_");
+    metrics->event_count = metrics_add_counter(set, "event_count", "Events built since the builder started");
+    metrics->trigger_id = metrics_add_gauge(set, "trigger_id", "Most recent event's trigger ID");
+    metrics->latest_timestamp = metrics_add_gauge(set, "latest_timestamp", "Most recent event's clock timestamp");
+    metrics->device_id = metrics_add_gauge(set, "device_id", "Most recent event's device ID");
+    metrics->reeling_happened = metrics_add_gauge(set, "reeling_happened", "1 if the builder was reeling since the last update");
+    metrics->connected_to_fpga = metrics_add_gauge(set, "connected_to_fpga", "1 if the data connection to the FPGA is up");
+    metrics->fifo_event_rpointer = metrics_add_gauge(set, "fifo_event_rpointer", "Ring buffer event read pointer");
+    metrics->fifo_rpointer = metrics_add_gauge(set, "fifo_rpointer", "Ring buffer read pointer");
+    metrics->fifo_wpointer = metrics_add_gauge(set, "fifo_wpointer", "Ring buffer write pointer");
+    metrics->bytes_read = metrics_add_counter(set, "bytes_read", "Bytes read from the FPGA");
+    metrics->bytes_written = metrics_add_counter(set, "bytes_written", "Bytes of events written to disk");
+    metrics->event_bytes = metrics_add_histogram(set, "event_bytes", "Size of each built event");
+    metrics->pid = metrics_add_gauge(set, "pid", "PID of the builder");
+    metrics->uptime = metrics_add_gauge(set, "uptime", "Seconds since the builder started");
+}
+
+void redis_publish_stats(redisContext* c, BuilderMetrics* metrics, const ProcessingStats* stats) {
+    if(!stats) {
         return;
     }
+    metric_set_count(metrics->event_count, stats->event_count);
+    metric_set(metrics->trigger_id, stats->trigger_id);
+    metric_set(metrics->latest_timestamp, stats->latest_timestamp);
+    metric_set(metrics->device_id, stats->device_id);
+    metric_set(metrics->reeling_happened, stats->reeling_happened);
+    metric_set(metrics->connected_to_fpga, stats->connected_to_fpga);
+    metric_set(metrics->fifo_event_rpointer, stats->fifo_event_rpointer);
+    metric_set(metrics->fifo_rpointer, stats->fifo_rpointer);
+    metric_set(metrics->fifo_wpointer, stats->fifo_wpointer);
+    metric_set_count(metrics->bytes_read, stats->bytes_read);
+    metric_set_count(metrics->bytes_written, stats->bytes_written);
+    metric_set(metrics->pid, stats->pid);
+    metric_set(metrics->uptime, (int)(stats->uptime/1e6));
 
-    redisReply* r;
-    size_t arglens[3];
-    const char* args[3];
-
-    char buf[2048];
-
-    // Use a a Stream instead of a pub-sub for this?
-    // Or maybe just a key-value store?
-    args[0] = "PUBLISH";
-    arglens[0] = strlen(args[0]);
-
-    args[1] = "builder_stats";
-    arglens[1] = strlen(args[1]);
-
-    arglens[2] = snprintf(buf, 2048, "%i %u %llu %i %i %i %i %i %i %i", stats->event_count,
-                                                          stats->trigger_id,
-                                                          stats->latest_timestamp,
-                                                          stats->device_id,
-                                                          stats->reeling_happened,
-                                                          stats->fifo_event_rpointer,
-                                                          stats->fifo_rpointer,
-                                                          stats->fifo_wpointer,
-                                                          stats->pid,
-                                                          (int)(stats->uptime/1e6));
-    args[2] = buf;
-    r = redisCommandArgv(c, 3,  args,  arglens);
     // Only print an error if the redisContext variable has an error because sometimes the
     // reply can show up late
-    if(!r && c->err) {
+    if(metrics_publish(&metrics->set, c) && c && c->err) {
         builder_log(LOG_ERROR, "Error sending stats update to redis: %s", c->errstr);
     }
-    freeReplyObject(r);
 }
 
 struct fnet_ctrl_client* connect_fakernet_udp_client(const char* fnet_hname) {
@@ -1003,25 +1046,85 @@ struct fnet_ctrl_client* connect_fakernet_udp_client(const char* fnet_hname) {
     return fnet_client;
 }
 
-int send_tcp_reset(struct fnet_ctrl_client* client) {
-    if(!client) {
+FnetBrokerClient* connect_fnet_broker(const char* sock_path, const char* fnet_hname) {
+    FnetBrokerClient* broker = fnet_broker_connect(sock_path, fnet_hname);
+    if(!broker) {
+        builder_log(LOG_ERROR, "ERROR Connecting to fnet_broker at %s: %s. Will retry", sock_path, strerror(errno));
+        return NULL;
+    }
+    builder_log(LOG_INFO, "Connected to fnet_broker");
+    return broker;
+}
+
+int send_tcp_reset(FPGA_IF* fpga_if) {
+    // The broker might have been restarted since the last time
+    if(fpga_if->broker_sock && !fpga_if->broker) {
+        fpga_if->broker = connect_fnet_broker(fpga_if->broker_sock, fpga_if->board);
+        if(!fpga_if->broker) {
+            return -1;
+        }
+    }
+    if(!fpga_if->udp_client && !fpga_if->broker) {
         builder_log(LOG_ERROR, "Cannot send TCP reset: UDP client not established");
         return -1;
     }
     int ret;
     fakernet_reg_acc_item* send_buf;
-    fnet_ctrl_get_send_recv_bufs(client, &send_buf, NULL);
+    if(fpga_if->broker) {
+        fnet_broker_get_send_recv_bufs(fpga_if->broker, &send_buf, NULL);
+    }
+    else {
+        fnet_ctrl_get_send_recv_bufs(fpga_if->udp_client, &send_buf, NULL);
+    }
 
     send_buf[0].addr = htonl(FAKERNET_REG_ACCESS_ADDR_WRITE | FAKERNET_REG_ACCESS_ADDR_RESET_TCP);
     send_buf[0].data = htonl(0);
-    ret = fnet_ctrl_send_recv_regacc(client, 1);
-    if(ret == 0) {
+    if(fpga_if->broker) {
+        ret = fnet_broker_send_recv_regacc(fpga_if->broker, 1);
+        if(ret < 0) {
+            // Start over with a new connection next time
+            builder_log(LOG_ERROR, "fnet_broker error: %s", fnet_broker_last_error(fpga_if->broker));
+            fnet_broker_close(fpga_if->broker);
+            fpga_if->broker = NULL;
+        }
+    }
+    else {
+        ret = fnet_ctrl_send_recv_regacc(fpga_if->udp_client, 1);
+    }
+    if(ret <= 0) {
         builder_log(LOG_ERROR, "Error happened while doing TCP-Reset");
         return -1;
     }
     return 0;
 }
 
+// Cheap enough to do every time through the main loop, nothing here waits on
+// the readers.
+void update_builder_status(BuilderStatus* status, const ProcessingStats* stats, const FPGA_IF* fpga_if) {
+    BuilderStatus values;
+    struct timeval tv;
+    if(!status) {
+        return;
+    }
+    gettimeofday(&tv, NULL);
+    values.pid = stats->pid;
+    values.device_id = stats->device_id;
+    values.connected_to_fpga = stats->connected_to_fpga;
+    values.reeling = reeling ? 1 : 0;
+    values.reeling_count = stats->reeling_count;
+    values.event_count = stats->event_count;
+    values.trigger_id = stats->trigger_id;
+    values.latest_timestamp = stats->latest_timestamp;
+    values.bytes_read = stats->bytes_read;
+    values.bytes_written = stats->bytes_written;
+    values.ring_used = ring_buffer_bytes_used(&fpga_if->ring_buffer);
+    values.ring_size = BUFFER_SIZE;
+    values.start_time = stats->start_time;
+    values.uptime = stats->uptime;
+    values.update_time_us = tv.tv_sec*1000000LL + tv.tv_usec;
+    builder_status_publish(status, &values);
+}
+
 void initialize_stats(ProcessingStats* stats) {
     struct timeval tv;
     stats->event_count = 0;
@@ -1034,8 +1137,10 @@ void initialize_stats(ProcessingStats* stats) {
     stats->fifo_event_rpointer = 0;
     stats->fifo_rpointer = 0;
     stats->fifo_wpointer = 0;
-    //stats->bytes_read = 0;
-    //stats->bytes_written = 0;
+    stats->reeling_happened = 0;
+    stats->reeling_count = 0;
+    stats->bytes_read = 0;
+    stats->bytes_written = 0;
 
     gettimeofday(&tv, NULL);
     stats->start_time = tv.tv_sec*1e6 + tv.tv_usec;
@@ -1589,6 +1694,18 @@ void respond_to_manager_io(ManagerIO* manager_command, int* out_pipe) {
     manager_command->command = CMD_NONE;
 }
 
+// This is a stupid hack to make sure a manager process doesn't hang (or
+// decide this builder is hung) if it requests data to a builder that is stuck
+// trying to connect to an FPGA. TODO I really should come up with a better solution.
+void answer_manager_io_while_connecting(struct BuilderConfig* config) {
+    ManagerIO manager_command;
+    receive_manager_io(&manager_command, &config->in_pipe);
+    if(manager_command.command != CMD_NONE) {
+        manager_command.arg = 0;
+        respond_to_manager_io(&manager_command, &config->out_pipe);
+    }
+}
+
 int reset_connection(FPGA_IF* fpga_if, const char* ip_addr) {
     // Close the TCP connection
     close(fpga_if->fd);
@@ -1596,7 +1713,7 @@ int reset_connection(FPGA_IF* fpga_if, const char* ip_addr) {
 
     do {
         // Send a TCP reset_command
-        if(fpga_if->udp_client && send_tcp_reset(fpga_if->udp_client)) {
+        if((fpga_if->udp_client || fpga_if->broker_sock) && send_tcp_reset(fpga_if)) {
             builder_log(LOG_ERROR, "Error sending TCP reset. Will retry.");
             sleep(1);
             continue;
@@ -1623,6 +1740,10 @@ struct BuilderConfig default_builder_config(void) {
     config.output_filename = "/dev/null";
     config.error_filename = DEFAULT_ERROR_LOG_FILENAME;
     config.redis_host = DEFAULT_REDIS_HOST;
+    config.redis_sock = DEFAULT_REDIS_SOCK;
+    config.broker_sock = NULL;
+    config.metrics_port = 0;
+    config.status = NULL;
     config.in_pipe = -1; // Non-valid file descriptor
     config.out_pipe = -1; // Non-valid file descriptor
     config.exit_now = 0;
@@ -1640,6 +1761,7 @@ int data_builder_main(struct BuilderConfig config) {
     unsigned int  last_printf_built_count = 0;
     unsigned int  last_printf_reeling_count = 0;
     ProcessingStats the_stats;
+    BuilderMetrics metrics;
     EventHeader event_header;
 
     // Zero out the IO command, default behavior is NONE command
@@ -1689,6 +1811,7 @@ int data_builder_main(struct BuilderConfig config) {
     }
 
     initialize_stats(&the_stats);
+    initialize_metrics(&metrics);
 
     printf("FPGA IP set to %s\n", config.ip);
     setup_logger(config.log_name, config.redis_host, config.error_filename,
@@ -1701,6 +1824,7 @@ int data_builder_main(struct BuilderConfig config) {
     // initialize memory locations
     initialize_ring_buffer(&(fpga_if.ring_buffer));
     initialize_event_buffer(&(fpga_if.event_buffer));
+    update_builder_status(config.status, &the_stats, &fpga_if);
 
     // Set the I/O pipes to non-block
     {
@@ -1712,21 +1836,23 @@ int data_builder_main(struct BuilderConfig config) {
     }
 
     fpga_if.udp_client = NULL;
+    fpga_if.broker = NULL;
+    fpga_if.broker_sock = NULL;
+    fpga_if.board = config.ip;
     if(!config.dry_run) {
+        fpga_if.broker_sock = config.broker_sock;
         while(1) {
-            fpga_if.udp_client = connect_fakernet_udp_client(config.ip);
-            if(fpga_if.udp_client) {
+            if(config.broker_sock) {
+                fpga_if.broker = connect_fnet_broker(config.broker_sock, config.ip);
+            }
+            else {
+                fpga_if.udp_client = connect_fakernet_udp_client(config.ip);
+            }
+            if(fpga_if.udp_client || fpga_if.broker) {
                 break;
             }
 
-            // This is a stupid hack to make sure a manager process doesn't hang
-            // if it requests data to a builder that is stuck trying to connect
-            // to an FPGA. TODO I really should come up with a better solution.
-            receive_manager_io(&manager_command, &config.in_pipe);
-            if(manager_command.command != CMD_NONE) {
-                manager_command.arg = 0;
-                respond_to_manager_io(&manager_command, &config.out_pipe);
-            }
+            answer_manager_io_while_connecting(&config);
             sleep(1);
         }
     }
@@ -1734,7 +1860,7 @@ int data_builder_main(struct BuilderConfig config) {
     // connect to FPGA
     do {
         // Send a TCP reset_command
-        if(fpga_if.udp_client && send_tcp_reset(fpga_if.udp_client)) {
+        if((fpga_if.udp_client || fpga_if.broker_sock) && send_tcp_reset(&fpga_if)) {
             builder_log(LOG_ERROR, "Error sending TCP reset. Will retry.");
             sleep(1);
             continue;
@@ -1743,6 +1869,7 @@ int data_builder_main(struct BuilderConfig config) {
 
         if(fpga_if.fd < 0) {
             builder_log(LOG_ERROR, "error ocurred connecting to FPGA. Will retry.");
+            answer_manager_io_while_connecting(&config);
             sleep(1);
         }
     } while(fpga_if.fd < 0);
@@ -1767,8 +1894,7 @@ int data_builder_main(struct BuilderConfig config) {
     const int max_pipe = fpga_if.fd > config.in_pipe ? fpga_if.fd+1 : config.in_pipe+1;
 
     gettimeofday(&prev_time, NULL);
-    // TODO (important!), this should use the config structure, not a hardcoded string
-    redis = create_redis_unix_conn("/var/run/redis/redis-server.sock");
+    redis = create_redis_unix_conn(config.redis_sock);
     usleep(100000); // Give redis time to connect
 
     // Do authentication
@@ -1777,6 +1903,10 @@ int data_builder_main(struct BuilderConfig config) {
         freeReplyObject(redisCommand(redis, "AUTH numubarnuebar"));
     }
 
+    if(config.metrics_port && metrics_listen(&metrics.set, config.metrics_port)) {
+        builder_log(LOG_ERROR, "Could not serve metrics on port %i: %s", config.metrics_port, strerror(errno));
+    }
+
     // TODO, use sigaction instead of signal
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
@@ -1855,12 +1985,13 @@ int data_builder_main(struct BuilderConfig config) {
             respond_to_manager_io(&manager_command, &config.out_pipe);
         }
 
-        pull_from_fpga(&fpga_if);
+        the_stats.bytes_read += pull_from_fpga(&fpga_if);
         if(reeling) {
             the_stats.reeling_happened = 1;
             last_printf_reeling_count += 1;
             if(!did_warn_about_reeling) {
                 builder_log(LOG_ERROR, "Reeling");
+                the_stats.reeling_count++;
             }
             reeling = !find_event_start(&fpga_if, HEADER_MAGIC_VALUE);
             did_warn_about_reeling = reeling;
@@ -1894,10 +2025,11 @@ int data_builder_main(struct BuilderConfig config) {
             the_stats.fifo_wpointer = fpga_if.ring_buffer.write_pointer;
             the_stats.fifo_event_rpointer = fpga_if.ring_buffer.event_read_pointer;
             the_stats.fifo_rpointer = fpga_if.ring_buffer.read_pointer;
-            redis_publish_stats(redis, &the_stats);
+            redis_publish_stats(redis, &metrics, &the_stats);
             the_stats.reeling_happened = 0;
             last_status_update_time = the_stats.uptime;
         }
+        metrics_serve(&metrics.set);
 
         if(event_ready) {
             protocol.validate_event(&event_header, &fpga_if.event_buffer);
@@ -1908,8 +2040,9 @@ int data_builder_main(struct BuilderConfig config) {
                 protocol.display_process(&event_header);
             }
             if(!config.do_not_save) {
-                protocol.write_event(&fpga_if.event_buffer, &event_header);
+                the_stats.bytes_written += protocol.write_event(&fpga_if.event_buffer, &event_header);
             }
+            metric_observe(metrics.event_bytes, fpga_if.event_buffer.num_bytes);
             the_stats.event_count++;
             protocol.update_stats(&the_stats, &event_header);
 
@@ -1921,11 +2054,14 @@ int data_builder_main(struct BuilderConfig config) {
             // Finally clear the event buffer
             fpga_if.event_buffer.num_bytes = 0;
         }
+        update_builder_status(config.status, &the_stats, &fpga_if);
     }
 #ifdef DUMP_DATA
     fclose(fdump);
 #endif
     clean_up();
+    metrics_cleanup(&metrics.set);
+    fnet_broker_close(fpga_if.broker);
     close(fpga_if.fd);
     return 0;
 }
@@ -1,6 +1,7 @@
 #ifndef  __DATA_BUILDER_H__
 #define __DATA_BUILDER_H__
 #include <stdint.h>
+#include "builder_status.h"
 
 
 // Configuration parameters for running the data builder
@@ -15,6 +16,10 @@ struct BuilderConfig {
     const char* output_filename; // File to write data to
     const char* error_filename; // File to write log messages to
     const char* redis_host; // Redis DB hostname, used for publishing data & stats
+    const char* redis_sock; // Redis DB unix socket path, used for publishing data & stats
+    const char* broker_sock; // fnet_broker unix socket path, NULL to talk to the FPGA directly
+    int metrics_port; // Local TCP port to serve Prometheus metrics on, 0 to not
+    BuilderStatus* status; // Shared memory to keep the builder's state in, NULL to not
     int in_pipe;
     int out_pipe;
     int exit_now; // Exit the program. Mostly just used as a hack to stop the program from running if config isn't valid.
@@ -33,6 +38,7 @@ enum ManagerIOCommand {
     CMD_NUMBUILT,  // Returns the number of events built since the program started
     CMD_RESET_CONN,  // Returns the number of events built since the program started
     CMD_DISPLAY_HEADERS,  // Enables/disables printing header info for each event
+    CMD_ASSIGN_DEVICE, // Zookeeper only, tells a standby process which device it builds for
 };
 
 struct BuilderConfig default_builder_config(void);
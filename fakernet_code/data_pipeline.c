@@ -49,6 +49,14 @@ uint32_t write_data_pipeline_value(AXI_DATA_PIPELINE* dp_axi, uint32_t offset, u
     return write_addr(dp_axi->axi_addr, offset, data);
 }
 
+int batch_read_data_pipeline_value(RegBatch* batch, AXI_DATA_PIPELINE *dp_axi, uint32_t offset, uint32_t* result) {
+    return reg_batch_read(batch, dp_axi->axi_addr, offset, result);
+}
+
+int batch_write_data_pipeline_value(RegBatch* batch, AXI_DATA_PIPELINE* dp_axi, uint32_t offset, uint32_t data) {
+    return reg_batch_write(batch, dp_axi->axi_addr, offset, data);
+}
+
 uint32_t read_trig_sum_width(AXI_DATA_PIPELINE* dp_axi) {
     return read_data_pipeline_value(dp_axi, TRIGGER_SUM_WIDTH_OFFSET);
 }
@@ -2,6 +2,7 @@
 #define __DATA_PIPELINE__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
 
 typedef struct AXI_DATA_PIPELINE {
     const char* name;
@@ -11,6 +12,8 @@ typedef struct AXI_DATA_PIPELINE {
 AXI_DATA_PIPELINE* new_data_pipeline_if(const char* name, uint32_t axi_addr);
 uint32_t read_data_pipeline_value(AXI_DATA_PIPELINE *dp_axi, uint32_t offset);
 uint32_t write_data_pipeline_value(AXI_DATA_PIPELINE* dp_axi, uint32_t offset, uint32_t data);
+int batch_read_data_pipeline_value(RegBatch* batch, AXI_DATA_PIPELINE *dp_axi, uint32_t offset, uint32_t* result);
+int batch_write_data_pipeline_value(RegBatch* batch, AXI_DATA_PIPELINE* dp_axi, uint32_t offset, uint32_t data);
 uint32_t write_trig_sum_width(AXI_DATA_PIPELINE* dp_axi, uint32_t value);
 uint32_t read_trig_sum_width(AXI_DATA_PIPELINE* dp_axi);
 uint32_t read_threshold(AXI_DATA_PIPELINE* dp_axi);
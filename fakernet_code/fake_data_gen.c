@@ -12,6 +12,11 @@
  * so if someone disconnects I ought to "pop" that descriptor from the array.
  * But that "pop" operation is annoying to do with an array, a linked-list would
  * be more appropriate. So I should implement that linked-list strategy instead.
+ *
+ * Farm mode (--farm/--board) instead runs a number of independent simulated
+ * boards, each in its own thread listening on its own address. Each board
+ * has its own rate, clock skew, and can inject faults (dropped events,
+ * corrupted headers, truncated waveforms, and TCP stalls).
  */
 
 #include <unistd.h>
@@ -21,14 +26,24 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <getopt.h>
 #include <errno.h>
 #include <netdb.h>
 #include <string.h>
 #include <signal.h>
+#include <math.h>
+#include <pthread.h>
 
 #define PORT "5009"
 #define BACKLOG 10
+#define CERES_HEADER_SIZE 20
+#define FONTUS_HEADER_SIZE 52
+#define DEFAULT_WAVEFORM_LENGTH 400
+#define MAX_BATCH_SIZE 1024 // Linux's IOV_MAX
+#define MAX_BOARDS 64
+#define DEFAULT_FARM_POOL_SIZE 256
 
 typedef struct FontusTrigHeader{
     uint32_t magic_number;
@@ -56,6 +71,14 @@ void *get_in_addr(struct sockaddr *sa) {
         return &(((struct sockaddr_in*)sa)->sin_addr);
 }
 
+// rand() isn't safe to call from the farm's board threads, so every thread
+// has its own seed for rand_r. Boards get theirs from run_farm.
+static __thread unsigned int rand_seed = 1;
+
+static int rand_int(void) {
+    return rand_r(&rand_seed);
+}
+
 // This function produce fake FONTUS data with a correct CRC value and then
 // stuffs it in the given buffer ready to be sent out over the network.
 static size_t produce_fontus_data(unsigned char* buffer, const int number, const int length) {
@@ -128,7 +151,7 @@ static size_t produce_fontus_data(unsigned char* buffer, const int number, const
         buffer += 4;
 
         for(int i=0; i<length; i++){
-            uint32_t val =  rand() % 10;
+            uint32_t val =  rand_int() % 10;
             *((uint32_t*)buffer) = htonl(val);
             buffer += 4;
         }
@@ -137,13 +160,142 @@ static size_t produce_fontus_data(unsigned char* buffer, const int number, const
     return (buffer - start) + 4;
 }
 
+// Settings for how CERES samples are generated and encoded, set from the
+// command line.
+typedef enum SampleEncoding {
+    ENCODING_RAW=0, // Only uncompressed words (2 samples per 32-bit word)
+    ENCODING_COMPRESSED, // Samples are slew limited so every word that can be compressed is
+    ENCODING_MIXED, // Compress wherever the data allows it, like the firmware does
+} SampleEncoding;
+
+typedef enum PulseShape {
+    PULSE_NONE=0,
+    PULSE_SQUARE,
+    PULSE_GAUSS,
+    PULSE_PMT,
+} PulseShape;
+
+#define NUM_CERES_CHANNELS 16
+
+static struct {
+    SampleEncoding encoding;
+    PulseShape pulse_shape;
+    double pulse_probability; // Probability a given channel has a pulse in an event
+    double pulse_width; // Width of the pulse in samples
+    int amplitudes[NUM_CERES_CHANNELS]; // Pulse height in ADC counts, negative for a downward pulse
+    int baseline;
+    int noise; // Noise is uniform in [-noise, noise]
+} gen_config = {
+    .encoding = ENCODING_RAW,
+    .pulse_shape = PULSE_NONE,
+    .pulse_probability = 0.1,
+    .pulse_width = 8,
+    .amplitudes = {200, 200, 200, 200, 200, 200, 200, 200,
+                   200, 200, 200, 200, 200, 200, 200, 200},
+    .baseline = 124,
+    .noise = 4,
+};
+
+static double rand_uniform(void) {
+    return rand_int()/(RAND_MAX + 1.0);
+}
+
+// Value of the (unit height) pulse 't' samples after the pulse start
+static double pulse_value(const double t) {
+    const double w = gen_config.pulse_width;
+    switch(gen_config.pulse_shape) {
+        case PULSE_SQUARE:
+            return (t >= 0 && t < w) ? 1.0 : 0.0;
+        case PULSE_GAUSS:
+            // Start of the pulse is ~3 sigma before the peak
+            return exp(-0.5*((t - 3*w)/w)*((t - 3*w)/w));
+        case PULSE_PMT:
+            // Fast rise, exponential tail, peaks at t == w
+            return t > 0 ? (t/w)*exp(1 - t/w) : 0.0;
+        case PULSE_NONE:
+        default:
+            return 0.0;
+    }
+}
+
+static void generate_channel_samples(uint16_t* samples, const int nsamples, const int channel) {
+    int has_pulse = gen_config.pulse_shape != PULSE_NONE &&
+                    rand_uniform() < gen_config.pulse_probability;
+    double pulse_start = nsamples/4 + rand_int() % (nsamples/2 + 1);
+    int k;
+    int prev = 0;
+    for(k=0; k<nsamples; k++) {
+        int val = gen_config.baseline;
+        if(gen_config.noise > 0) {
+            val += (rand_int() % (2*gen_config.noise + 1)) - gen_config.noise;
+        }
+        if(has_pulse) {
+            val += (int)floor(gen_config.amplitudes[channel]*pulse_value(k - pulse_start) + 0.5);
+        }
+        if(gen_config.encoding == ENCODING_COMPRESSED && k > 0) {
+            // Limit the slope so every delta fits in a 5-bit compressed sample
+            val = val > prev + 15 ? prev + 15 : val;
+            val = val < prev - 16 ? prev - 16 : val;
+        }
+        val = val < 0 ? 0 : val;
+        val = val > 0x3FFF ? 0x3FFF : val;
+        samples[k] = val;
+        prev = val;
+    }
+}
+
+// Checks if the six samples starting at 'samples[k]' can be packed into a
+// single compressed word, i.e. each differs from the previous sample by an
+// amount that fits in a 5-bit signed integer.
+static int can_compress(const uint16_t* samples, const int k) {
+    int i;
+    for(i=0; i<6; i++) {
+        int delta = samples[k+i] - samples[k+i-1];
+        if(delta < -16 || delta > 15) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Delta encode one channel's samples into 'buffer'.
+// Returns a pointer to just past the last word written.
+static unsigned char* encode_channel(unsigned char* buffer, const uint16_t* samples, const int len) {
+    int j = 0; // Index of the sample pair being encoded
+    int i;
+    while(j < len) {
+        uint32_t word;
+        // The first word is never compressed, it holds the absolute value
+        // the following deltas are relative to. A compressed word holds
+        // 3 pairs so it can't be used for the last 1 or 2 pairs.
+        if(gen_config.encoding != ENCODING_RAW && j > 0 && j+3 <= len && can_compress(samples, 2*j)) {
+            word = 0x40000000;
+            for(i=0; i<6; i++) {
+                int delta = samples[2*j+i] - samples[2*j+i-1];
+                word |= (delta & 0x1F) << ((5-i)*5);
+            }
+            j += 3;
+        }
+        else {
+            int upper = j == 0 ? samples[0] : samples[2*j] - samples[2*j-1];
+            int lower = samples[2*j+1] - samples[2*j];
+            word = ((upper & 0x3FFF) << 16) | (lower & 0x3FFF);
+            j += 1;
+        }
+        *((uint32_t*)buffer) = htonl(word);
+        buffer += 4;
+    }
+    return buffer;
+}
+
 static size_t produce_data(unsigned char* buffer, const int number, const int device_id, const int len) {
-    const int NCHAN = 16;
     uint8_t i;
     unsigned char* start = buffer;
     struct timeval tv;
     gettimeofday(&tv, NULL);
     uint64_t timeticks = tv.tv_sec*1e6 + tv.tv_usec;
+    uint16_t samples[2*len];
+    uint32_t pairs[len];
 
     (*(uint32_t*)buffer) = 0xFFFFFFFF;
     buffer += 4;
@@ -169,103 +321,295 @@ static size_t produce_data(unsigned char* buffer, const int number, const int de
     *buffer = (crc ^ 0x55);
     buffer +=1;
 
-    for(i=0; i<NCHAN; i++) {
+    for(i=0; i<NUM_CERES_CHANNELS; i++) {
         buffer[0] = 0xFF;
         buffer[1] = i;
         buffer[2] = 0xFF;
         buffer[3] = i;
         buffer += 4;
 
-        unsigned char* channel_start = buffer;
-        for(int j=0; j<len; j++) {
-            uint16_t val = 128 + ((rand() % 9) - 8);
-            (*(uint16_t*)buffer) = val;
-            buffer += 2;
-
-            val = 128 + ((rand() % 9) - 8);
-            (*(uint16_t*)buffer) = val;
-            buffer += 2;
+        generate_channel_samples(samples, 2*len, i);
 
-            *(uint32_t*)(buffer-4) = htonl(*((uint32_t*)(buffer-4)));
+        // The CRC is calculated on the decoded (absolute) samples
+        for(int j=0; j<len; j++) {
+            pairs[j] = htonl((samples[2*j] << 16) | samples[2*j+1]);
         }
-        uint32_t channel_crc = crc32(0, (uint32_t*)channel_start, (buffer-channel_start));
-        *((uint32_t*)buffer) = htonl(channel_crc);
-        buffer += 4;
+        uint32_t channel_crc = crc32(0, pairs, len*sizeof(uint32_t));
 
-        // Now do delta-encoding
-        buffer = channel_start;
-        uint32_t word = ntohl(*((uint32_t*)buffer));
-        int16_t prev = ((word>>16) & 0x3fff);
-        uint16_t sample = (word & 0x3FFF);
-        int16_t new_sample = sample - prev;
-
-        (*(uint16_t*)buffer) = htons((prev & 0x3fff));
-        buffer += 2;
-        prev = sample;
-        (*(uint16_t*)buffer) = htons((new_sample & 0x3fff));
-        buffer += 2;
-
-
-        for(int j=1; j<len; j++) {
-            word = ntohl(*((uint32_t*)buffer));
-            sample = ((word>>16) & 0x3FFF);
-            new_sample = sample - prev;
-            prev = sample;
-            (*(int16_t*)buffer) = htons(new_sample & 0x3fff);
-            buffer += 2;
-
-            sample = (word & 0x3FFF);
-            new_sample = sample - prev;
-            (*(int16_t*)buffer) = htons(new_sample & 0x3fff);
-            prev = sample;
-            buffer += 2;
-        }
-        // Skip the CRC
+        buffer = encode_channel(buffer, samples, len);
+        *((uint32_t*)buffer) = htonl(channel_crc);
         buffer += 4;
     }
     return buffer - start;
 }
 
-void print_help_message(void) {
-    printf("fake_data_gen: Produces fake FONTUS/CERES. Will open a network socket on port 5009 and serve data to any connection.\n"
-            "\tusage: fake_data_gen [--rate rate] [--fontus] [--help]\n"
-            "\targuments:\n"
-            "\t--fontus -f\tWill produce fake FONTUS data for the first client to connect.\n"
-            "\t--rate -r\tEvent rate for fake data.\n");
+// Pool of pre-generated events used by the high-rate mode. All events are
+// produced once at start-up, afterwards only the header fields that change
+// from one event to the next get re-written before an event is sent.
+typedef struct EventPool {
+    unsigned char* data;
+    size_t* offsets; // Offset of each event in 'data'
+    size_t* sizes; // Size (in bytes) of each event
+    int num_events;
+    int is_fontus;
+} EventPool;
+
+static int create_event_pool(EventPool* pool, const int num_events, const int is_fontus, const int len) {
+    // Upper limit on the size of any one event
+    const size_t max_event_size = is_fontus ? FONTUS_HEADER_SIZE + 4*(4 + 4*len) :
+                                              CERES_HEADER_SIZE + 16*(4 + 4*len + 4);
+    int i;
+    size_t offset = 0;
+
+    pool->data = malloc(max_event_size*num_events);
+    pool->offsets = malloc(sizeof(size_t)*num_events);
+    pool->sizes = malloc(sizeof(size_t)*num_events);
+    if(!pool->data || !pool->offsets || !pool->sizes) {
+        free(pool->data);
+        free(pool->offsets);
+        free(pool->sizes);
+        return -1;
+    }
+    pool->num_events = num_events;
+    pool->is_fontus = is_fontus;
+
+    for(i=0; i<num_events; i++) {
+        pool->offsets[i] = offset;
+        pool->sizes[i] = is_fontus ? produce_fontus_data(pool->data + offset, i, len) :
+                                     produce_data(pool->data + offset, i, 0, len);
+        offset += pool->sizes[i];
+    }
+    return 0;
 }
 
-int main(int argc, char** argv) {
-    int create_fontus_data = 0;
-    float rate = 1;
-    struct option clargs[] = {
-        {"fontus", no_argument, NULL, 'f'},
-        {"rate", required_argument, NULL, 'r'},
-        {"help", no_argument, NULL, 'h'},
-        { 0, 0, 0, 0}};
+// Re-write the trigger number, clock and device ID of a pre-generated CERES
+// event and re-calculate the header CRC to match.
+static void patch_ceres_header(unsigned char* event, const uint32_t number, const uint64_t clock, const uint8_t device_id) {
+    uint8_t crc = 0;
+    int i;
+    *((uint32_t*)(event+4)) = htonl(number);
+    *((uint64_t*)(event+8)) = htonll(clock);
+    event[18] = device_id;
+    for(i=4; i<CERES_HEADER_SIZE-1; i++) {
+        crc8(&crc, event[i]);
+    }
+    event[CERES_HEADER_SIZE-1] = crc ^ 0x55;
+}
 
-    int optindex;
-    int opt;
-    while( (opt = getopt_long(argc, argv, "r:fh", clargs, &optindex)) != -1)  {
-        switch(opt) {
-            case 'f':
-                create_fontus_data = 1;
-                break;
-            case 'r':
-                rate = strtof(optarg, NULL);
-                break;
-            case 'h':
-            default:
-                print_help_message();
-                return 0; // exit the program
+// Same as above but for FONTUS, which uses a CRC32 for the header
+static void patch_fontus_header(unsigned char* event, const uint32_t number, const uint64_t clock) {
+    *((uint32_t*)(event+4)) = htonl(number);
+    *((uint64_t*)(event+8)) = htonll(clock);
+    *((uint32_t*)(event+FONTUS_HEADER_SIZE-4)) = htonl(crc32(0, (uint32_t*)(event+4), FONTUS_HEADER_SIZE-8));
+}
+
+// Write out all the given buffers, handling partial writes.
+// Returns 0 on success, -1 if the connection failed.
+static int send_iovecs(int fd, struct iovec* iov, int iovcnt) {
+    while(iovcnt > 0) {
+        ssize_t bytes = writev(fd, iov, iovcnt);
+        if(bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if(bytes <= 0) {
+            return -1;
+        }
+        // Skip past all the fully written buffers
+        while(iovcnt > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
         }
     }
+    return 0;
+}
 
-    sigignore(SIGPIPE);
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void sleep_seconds(double seconds) {
+    struct timespec ts;
+    if(seconds <= 0) {
+        return;
+    }
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec)*1e9);
+    nanosleep(&ts, NULL);
+}
+
+// Faults that can be injected into the data stream, each given as the
+// probability of it happening for any one event.
+typedef struct FaultConfig {
+    double drop; // Event is skipped, its trigger number is still used up
+    double corrupt; // Header CRC is broken
+    double truncate; // Event is cut off part way through the waveforms
+    double stall; // Connection goes quiet for 'stall_ms' after the event
+    int stall_ms;
+} FaultConfig;
+
+typedef struct SendStats {
+    unsigned long long events;
+    unsigned long long bytes;
+    unsigned long long dropped;
+    unsigned long long corrupted;
+    unsigned long long truncated;
+    unsigned long long stalls;
+} SendStats;
+
+// Send 'num' consecutive events from the pool, starting at trigger number
+// 'first_number', in as few system calls as possible. 'faults' and 'stats'
+// can be NULL.
+// Returns the number of bytes sent, or -1 if the connection failed.
+static ssize_t send_pooled_events(int fd, EventPool* pool, const uint32_t first_number, const int num,
+                                  const uint64_t clock, const uint8_t device_id,
+                                  const FaultConfig* faults, SendStats* stats) {
+    struct iovec iov[MAX_BATCH_SIZE];
+    const size_t header_size = pool->is_fontus ? FONTUS_HEADER_SIZE : CERES_HEADER_SIZE;
+    ssize_t total = 0;
+    int niov = 0;
+    int i;
+    for(i=0; i<num; i++) {
+        const int index = (first_number + i) % pool->num_events;
+        unsigned char* event = pool->data + pool->offsets[index];
+        size_t size = pool->sizes[index];
+
+        if(faults && rand_uniform() < faults->drop) {
+            if(stats) {
+                stats->dropped += 1;
+            }
+            continue;
+        }
+        if(pool->is_fontus) {
+            patch_fontus_header(event, first_number + i, clock + i);
+        }
+        else {
+            patch_ceres_header(event, first_number + i, clock + i, device_id);
+        }
+        // The header gets re-patched next time this event is used, so
+        // breaking it in the pool is fine.
+        if(faults && rand_uniform() < faults->corrupt) {
+            event[header_size-1] ^= 0xFF;
+            if(stats) {
+                stats->corrupted += 1;
+            }
+        }
+        if(faults && rand_uniform() < faults->truncate) {
+            size = header_size + rand_int() % (size - header_size);
+            if(stats) {
+                stats->truncated += 1;
+            }
+        }
+        iov[niov].iov_base = event;
+        iov[niov].iov_len = size;
+        niov += 1;
+        total += size;
+        if(stats) {
+            stats->events += 1;
+        }
+
+        if(faults && faults->stall_ms > 0 && rand_uniform() < faults->stall) {
+            // Get everything up to this event out, then go quiet
+            if(send_iovecs(fd, iov, niov)) {
+                return -1;
+            }
+            niov = 0;
+            sleep_seconds(faults->stall_ms*1e-3);
+            if(stats) {
+                stats->stalls += 1;
+            }
+        }
+    }
+    if(send_iovecs(fd, iov, niov)) {
+        return -1;
+    }
+    if(stats) {
+        stats->bytes += total;
+    }
+    return total;
+}
+
+// Parse a comma separated list of per-channel amplitudes. If fewer than 16
+// values are given the last one is used for the remaining channels.
+static int parse_amplitudes(const char* arg) {
+    int i;
+    char* end;
+    long val = 0;
+    for(i=0; i<NUM_CERES_CHANNELS; i++) {
+        if(*arg) {
+            val = strtol(arg, &end, 0);
+            if(end == arg || (*end && *end != ',')) {
+                return -1;
+            }
+            arg = *end ? end+1 : end;
+        }
+        gen_config.amplitudes[i] = val;
+    }
+    return 0;
+}
+
+// Pacing for the high-rate mode. Rather than waiting a fixed interval
+// between events the number of events that should've been sent since 'start'
+// is tracked, and however many are owed get sent at once (up to the batch
+// size).
+typedef struct Pacer {
+    double start;
+    long long sent; // -1 indicates pacing needs to be (re)started
+} Pacer;
+
+// Returns how many events should be sent right now. If none are due this
+// sleeps until the next one is (but for no longer than 'max_wait' seconds)
+// and returns 0. The caller is responsible for adding to 'sent'.
+static int pacer_events_due(Pacer* pacer, const double rate, const int batch_size, const double max_wait) {
+    double now = monotonic_seconds();
+    long long num_due;
+    if(pacer->sent < 0) {
+        pacer->start = now;
+        pacer->sent = 0;
+    }
+    if(rate <= 0) {
+        return batch_size;
+    }
+    num_due = (long long)((now - pacer->start)*rate) - pacer->sent;
+    if(num_due > rate) {
+        // Fell more than a second behind (e.g. a slow reader), so
+        // start the pacing over instead of sending a huge burst.
+        pacer->start = now;
+        pacer->sent = 0;
+        num_due = 1;
+    }
+    if(num_due <= 0) {
+        double wait = (pacer->sent + 1)/rate - (now - pacer->start);
+        sleep_seconds(wait < max_wait ? wait : max_wait);
+        return 0;
+    }
+    return num_due > batch_size ? batch_size : num_due;
+}
+
+// Close the connection in slot 'i' and mark that slot as available
+static void drop_connection(int* connected_fds, const int i, int* next_available_fd) {
+    if(*next_available_fd < 0 || i < *next_available_fd) {
+        // Choose the lowest available FD slot
+        // that way FONTUS will always be the next up if
+        // FONTUS builder disconnects
+        *next_available_fd = i;
+    }
+    close(connected_fds[i]);
+    connected_fds[i] = -1;
+}
 
-    int sockfd;  // listen on sock_fd, new connection on new_fd
+// Open a TCP socket listening on the given address ('ip' can be NULL to
+// listen on all addresses).
+// Returns the socket's file descriptor, or -1 on failure.
+static int open_listen_socket(const char* ip, const char* port) {
+    int sockfd = -1;
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
     int yes=1;
     int rv;
 
@@ -274,9 +618,9 @@ int main(int argc, char** argv) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(ip, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        return -1;
     }
 
     // loop through all the results and bind to the first we can
@@ -290,7 +634,9 @@ int main(int argc, char** argv) {
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
                 sizeof(int)) == -1) {
             perror("setsockopt");
-            exit(1);
+            close(sockfd);
+            freeaddrinfo(servinfo);
+            return -1;
         }
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -305,11 +651,460 @@ int main(int argc, char** argv) {
 
     if (p == NULL)  {
         fprintf(stderr, "server: failed to bind\n");
-        exit(1);
+        return -1;
     }
 
     if (listen(sockfd, BACKLOG) == -1) {
         perror("listen");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// A single simulated board in farm mode
+typedef struct FakeBoard {
+    int is_fontus;
+    char ip[64]; // Address to listen on, empty for all addresses
+    int port;
+    int device_id;
+    double rate; // Events per second, 0 for as fast as possible
+    int length; // Waveform length
+    int pool_size;
+    int batch_size;
+    double skew_ppm; // Clock runs fast (positive) or slow (negative) by this many parts per million
+    double clock_offset; // Clock offset in microseconds
+    FaultConfig faults;
+    unsigned int seed; // For the board thread's random numbers
+    // Only written to by the board's own thread, read by the main thread for
+    // printing stats.
+    SendStats stats;
+    int connected;
+    pthread_t thread;
+} FakeBoard;
+
+static FakeBoard boards[MAX_BOARDS];
+static int num_boards = 0;
+// Cleared by SIGINT/SIGTERM so the farm can print its final totals
+static volatile sig_atomic_t farm_running = 1;
+
+static void farm_sig_handler(int signum) {
+    (void)signum;
+    farm_running = 0;
+}
+
+// Parse a board specification of the form
+//      ceres|fontus[,key=value...]
+// 'board' should already hold the default settings, anything given in the
+// spec overrides them.
+static int parse_board_spec(const char* spec, FakeBoard* board) {
+    char buf[256];
+    char* saveptr;
+    char* token;
+
+    if(strlen(spec) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    token = strtok_r(buf, ",", &saveptr);
+    if(!token) {
+        return -1;
+    }
+    if(strcmp(token, "ceres") == 0) {
+        board->is_fontus = 0;
+    }
+    else if(strcmp(token, "fontus") == 0) {
+        board->is_fontus = 1;
+    }
+    else {
+        return -1;
+    }
+
+    while((token = strtok_r(NULL, ",", &saveptr))) {
+        char* value = strchr(token, '=');
+        if(!value) {
+            return -1;
+        }
+        *value = '\0';
+        value += 1;
+        if(strcmp(token, "ip") == 0) {
+            if(strlen(value) >= sizeof(board->ip)) {
+                return -1;
+            }
+            strcpy(board->ip, value);
+        }
+        else if(strcmp(token, "port") == 0) {
+            board->port = strtol(value, NULL, 0);
+        }
+        else if(strcmp(token, "device") == 0) {
+            board->device_id = strtol(value, NULL, 0);
+        }
+        else if(strcmp(token, "rate") == 0) {
+            board->rate = strtod(value, NULL);
+        }
+        else if(strcmp(token, "length") == 0) {
+            board->length = strtol(value, NULL, 0);
+        }
+        else if(strcmp(token, "skew") == 0) {
+            board->skew_ppm = strtod(value, NULL);
+        }
+        else if(strcmp(token, "offset") == 0) {
+            board->clock_offset = strtod(value, NULL);
+        }
+        else if(strcmp(token, "drop") == 0) {
+            board->faults.drop = strtod(value, NULL);
+        }
+        else if(strcmp(token, "corrupt") == 0) {
+            board->faults.corrupt = strtod(value, NULL);
+        }
+        else if(strcmp(token, "truncate") == 0) {
+            board->faults.truncate = strtod(value, NULL);
+        }
+        else if(strcmp(token, "stall") == 0) {
+            board->faults.stall = strtod(value, NULL);
+        }
+        else if(strcmp(token, "stall-ms") == 0) {
+            board->faults.stall_ms = strtol(value, NULL, 0);
+        }
+        else {
+            return -1;
+        }
+    }
+    if(board->length <= 0 || board->length > 0xFFFF) {
+        return -1;
+    }
+    return 0;
+}
+
+static void* board_thread(void* arg) {
+    FakeBoard* board = (FakeBoard*)arg;
+    EventPool pool;
+    char port[16];
+    const char* where = board->ip[0] ? board->ip : "*";
+    struct timeval tv;
+    uint32_t count = 0;
+
+    rand_seed = board->seed;
+
+    snprintf(port, sizeof(port), "%i", board->port);
+    int sockfd = open_listen_socket(board->ip[0] ? board->ip : NULL, port);
+    if(sockfd < 0) {
+        fprintf(stderr, "Board %s:%i could not listen for connections\n", where, board->port);
+        return NULL;
+    }
+    if(create_event_pool(&pool, board->pool_size, board->is_fontus, board->length)) {
+        fprintf(stderr, "Board %s:%i could not allocate memory for its events\n", where, board->port);
+        close(sockfd);
+        return NULL;
+    }
+    printf("%s board #%i waiting for connections on %s:%i\n",
+           board->is_fontus ? "FONTUS" : "CERES", board->device_id, where, board->port);
+
+    // Each board's clock starts at the current time (plus any offset) and
+    // counts up in microseconds, optionally a little fast or slow.
+    gettimeofday(&tv, NULL);
+    const double clock_start = tv.tv_sec*1e6 + tv.tv_usec + board->clock_offset;
+    const double start = monotonic_seconds();
+
+    while(1) {
+        int fd = accept(sockfd, NULL, NULL);
+        if(fd < 0) {
+            if(errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        printf("Board %s:%i got connection\n", where, board->port);
+        board->connected = 1;
+
+        Pacer pacer = {0, -1};
+        while(farm_running) {
+            int num = pacer_events_due(&pacer, board->rate, board->batch_size, 0.1);
+            if(num == 0) {
+                continue;
+            }
+            double elapsed = (monotonic_seconds() - start)*1e6;
+            uint64_t clock = (uint64_t)(clock_start + elapsed*(1 + board->skew_ppm*1e-6));
+            if(send_pooled_events(fd, &pool, count, num, clock, board->device_id,
+                                  &board->faults, &board->stats) < 0) {
+                break;
+            }
+            pacer.sent += num;
+            count += num;
+        }
+        printf("Board %s:%i lost connection\n", where, board->port);
+        board->connected = 0;
+        close(fd);
+    }
+    return NULL;
+}
+
+// Start all the farm's boards and print their stats once per second until
+// interrupted, then print each board's totals.
+static int run_farm(void) {
+    SendStats last[MAX_BOARDS];
+    int i;
+
+    memset(last, 0, sizeof(last));
+    signal(SIGINT, farm_sig_handler);
+    signal(SIGTERM, farm_sig_handler);
+    for(i=0; i<num_boards; i++) {
+        // Different for every board, but the same from run to run
+        boards[i].seed = i + 1;
+        if(pthread_create(&boards[i].thread, NULL, board_thread, &boards[i])) {
+            fprintf(stderr, "Could not start thread for board %i\n", i);
+            return 1;
+        }
+    }
+
+    while(farm_running) {
+        sleep(1);
+        if(!farm_running) {
+            break;
+        }
+        for(i=0; i<num_boards; i++) {
+            SendStats now = boards[i].stats;
+            printf("%-6s #%-2i %s:%i %s %llu ev/s (%llu total), %0.1f MB/s, faults: %llu dropped, "
+                   "%llu corrupted, %llu truncated, %llu stalls\n",
+                   boards[i].is_fontus ? "FONTUS" : "CERES",
+                   boards[i].device_id,
+                   boards[i].ip[0] ? boards[i].ip : "*", boards[i].port,
+                   boards[i].connected ? "connected" : "waiting",
+                   now.events - last[i].events, now.events,
+                   (now.bytes - last[i].bytes)*1e-6,
+                   now.dropped, now.corrupted, now.truncated, now.stalls);
+            last[i] = now;
+        }
+        fflush(stdout);
+    }
+
+    // Give the boards a moment to finish whatever batch they're sending so
+    // the totals are final.
+    usleep(200000);
+    for(i=0; i<num_boards; i++) {
+        printf("TOTAL %-6s #%-2i %s:%i %llu events, %llu bytes, faults: %llu dropped, "
+               "%llu corrupted, %llu truncated, %llu stalls\n",
+               boards[i].is_fontus ? "FONTUS" : "CERES",
+               boards[i].device_id,
+               boards[i].ip[0] ? boards[i].ip : "*", boards[i].port,
+               boards[i].stats.events, boards[i].stats.bytes,
+               boards[i].stats.dropped, boards[i].stats.corrupted,
+               boards[i].stats.truncated, boards[i].stats.stalls);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+void print_help_message(void) {
+    printf("fake_data_gen: Produces fake FONTUS/CERES. Will open a network socket on port 5009 and serve data to any connection.\n"
+            "\tusage: fake_data_gen [--rate rate] [--fontus] [--length samples] [--pool N [--batch N]] [--help]\n"
+            "\targuments:\n"
+            "\t--fontus -f\tWill produce fake FONTUS data for the first client to connect.\n"
+            "\t--rate -r\tEvent rate for fake data. With --pool a rate of 0 means send as fast as possible.\n"
+            "\t--length -l\tNumber of sample pairs per channel (default %i).\n"
+            "\t--pool -p\tHigh-rate mode. Pre-generate N events and only patch their headers before sending.\n"
+            "\t--batch -b\tIn high-rate mode, max number of events sent per system call (default 64, max %i).\n"
+            "\t--encoding -e\tCERES sample encoding, one of 'raw' (default), 'compressed', or 'mixed'.\n"
+            "\t--pulse -s\tPulse shape, one of 'none' (default), 'square', 'gauss', or 'pmt'.\n"
+            "\t--pulse-prob -P\tProbability of a channel having a pulse in an event (default %0.2f).\n"
+            "\t--pulse-width -w\tPulse width in samples (default %0.0f).\n"
+            "\t--amplitude -a\tComma separated per-channel pulse amplitudes in ADC counts (default %i).\n"
+            "\t--baseline -B\tBaseline in ADC counts (default %i).\n"
+            "\t--noise -n\tNoise amplitude in ADC counts (default %i).\n"
+            "\t--farm -F\tFarm mode. Simulate N CERES boards (plus one FONTUS board if --fontus is given).\n"
+            "\t\t\tBoard i listens on 127.0.1.<i+1>, port %s, so each needs its own builder.\n"
+            "\t--board -c\tAdd a farm board, can be given multiple times. Format is\n"
+            "\t\t\tceres|fontus[,key=value...] where the keys are:\n"
+            "\t\t\tip, port, device, rate, length, skew (ppm), offset (clock offset in us),\n"
+            "\t\t\tdrop, corrupt, truncate, stall (each a probability per event), stall-ms.\n",
+            DEFAULT_WAVEFORM_LENGTH, MAX_BATCH_SIZE, gen_config.pulse_probability, gen_config.pulse_width,
+            gen_config.amplitudes[0], gen_config.baseline, gen_config.noise, PORT);
+}
+
+int main(int argc, char** argv) {
+    int create_fontus_data = 0;
+    float rate = 1;
+    int waveform_length = DEFAULT_WAVEFORM_LENGTH;
+    int pool_size = 0;
+    int batch_size = 64;
+    int farm_size = 0;
+    const char* board_specs[MAX_BOARDS];
+    int num_board_specs = 0;
+    struct option clargs[] = {
+        {"fontus", no_argument, NULL, 'f'},
+        {"rate", required_argument, NULL, 'r'},
+        {"length", required_argument, NULL, 'l'},
+        {"pool", required_argument, NULL, 'p'},
+        {"batch", required_argument, NULL, 'b'},
+        {"encoding", required_argument, NULL, 'e'},
+        {"pulse", required_argument, NULL, 's'},
+        {"pulse-prob", required_argument, NULL, 'P'},
+        {"pulse-width", required_argument, NULL, 'w'},
+        {"amplitude", required_argument, NULL, 'a'},
+        {"baseline", required_argument, NULL, 'B'},
+        {"noise", required_argument, NULL, 'n'},
+        {"farm", required_argument, NULL, 'F'},
+        {"board", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        { 0, 0, 0, 0}};
+
+    int optindex;
+    int opt;
+    while( (opt = getopt_long(argc, argv, "r:l:p:b:e:s:P:w:a:B:n:F:c:fh", clargs, &optindex)) != -1)  {
+        switch(opt) {
+            case 'f':
+                create_fontus_data = 1;
+                break;
+            case 'r':
+                rate = strtof(optarg, NULL);
+                break;
+            case 'l':
+                waveform_length = strtol(optarg, NULL, 0);
+                break;
+            case 'p':
+                pool_size = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch_size = strtol(optarg, NULL, 0);
+                break;
+            case 'e':
+                if(strcmp(optarg, "raw") == 0) {
+                    gen_config.encoding = ENCODING_RAW;
+                }
+                else if(strcmp(optarg, "compressed") == 0) {
+                    gen_config.encoding = ENCODING_COMPRESSED;
+                }
+                else if(strcmp(optarg, "mixed") == 0) {
+                    gen_config.encoding = ENCODING_MIXED;
+                }
+                else {
+                    printf("Unknown encoding '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                if(strcmp(optarg, "none") == 0) {
+                    gen_config.pulse_shape = PULSE_NONE;
+                }
+                else if(strcmp(optarg, "square") == 0) {
+                    gen_config.pulse_shape = PULSE_SQUARE;
+                }
+                else if(strcmp(optarg, "gauss") == 0) {
+                    gen_config.pulse_shape = PULSE_GAUSS;
+                }
+                else if(strcmp(optarg, "pmt") == 0) {
+                    gen_config.pulse_shape = PULSE_PMT;
+                }
+                else {
+                    printf("Unknown pulse shape '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                gen_config.pulse_probability = strtod(optarg, NULL);
+                break;
+            case 'w':
+                gen_config.pulse_width = strtod(optarg, NULL);
+                if(gen_config.pulse_width <= 0) {
+                    printf("Pulse width must be positive\n");
+                    return 1;
+                }
+                break;
+            case 'a':
+                if(parse_amplitudes(optarg)) {
+                    printf("Could not parse amplitudes '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                gen_config.baseline = strtol(optarg, NULL, 0);
+                break;
+            case 'n':
+                gen_config.noise = strtol(optarg, NULL, 0);
+                break;
+            case 'F':
+                farm_size = strtol(optarg, NULL, 0);
+                break;
+            case 'c':
+                if(num_board_specs >= MAX_BOARDS) {
+                    printf("Too many boards\n");
+                    return 1;
+                }
+                board_specs[num_board_specs++] = optarg;
+                break;
+            case 'h':
+            default:
+                print_help_message();
+                return 0; // exit the program
+        }
+    }
+
+    if(waveform_length <= 0 || waveform_length > 0xFFFF) {
+        printf("Invalid waveform length %i\n", waveform_length);
+        return 1;
+    }
+    if(batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+        printf("Batch size must be between 1 and %i\n", MAX_BATCH_SIZE);
+        return 1;
+    }
+
+    if(farm_size > 0 || num_board_specs > 0) {
+        const int num_fontus = (farm_size > 0 && create_fontus_data) ? 1 : 0;
+        int num_ceres = 0;
+        int i;
+        num_boards = num_fontus + farm_size + num_board_specs;
+        if(farm_size < 0 || num_boards > MAX_BOARDS) {
+            printf("Farm can have at most %i boards\n", MAX_BOARDS);
+            return 1;
+        }
+        for(i=0; i<num_boards; i++) {
+            FakeBoard* board = &boards[i];
+            memset(board, 0, sizeof(FakeBoard));
+            snprintf(board->ip, sizeof(board->ip), "127.0.1.%i", i+1);
+            board->port = strtol(PORT, NULL, 0);
+            board->rate = rate;
+            board->length = waveform_length;
+            board->batch_size = batch_size;
+            board->pool_size = pool_size > 0 ? pool_size : DEFAULT_FARM_POOL_SIZE;
+            board->pool_size = board->pool_size < batch_size ? batch_size : board->pool_size;
+            board->device_id = -1; // Filled in below unless the spec gives one
+
+            const char* spec = i < num_fontus ? "fontus" :
+                               i < num_fontus + farm_size ? "ceres" :
+                               board_specs[i - num_fontus - farm_size];
+            if(parse_board_spec(spec, board)) {
+                printf("Invalid board specification '%s'\n", spec);
+                return 1;
+            }
+            if(board->device_id < 0) {
+                board->device_id = board->is_fontus ? 0 : 4 + num_ceres;
+            }
+            num_ceres += board->is_fontus ? 0 : 1;
+        }
+        sigignore(SIGPIPE);
+        return run_farm();
+    }
+
+    EventPool ceres_pool, fontus_pool;
+    if(pool_size > 0) {
+        // Need at least one full batch worth of events in the pool, otherwise
+        // the same event would be patched twice in a single batch
+        pool_size = pool_size < batch_size ? batch_size : pool_size;
+        if(create_event_pool(&ceres_pool, pool_size, 0, waveform_length) ||
+           (create_fontus_data && create_event_pool(&fontus_pool, pool_size, 1, waveform_length))) {
+            printf("Could not allocate memory for %i events\n", pool_size);
+            return 1;
+        }
+        printf("Pre-generated %i events\n", pool_size);
+    }
+
+    sigignore(SIGPIPE);
+
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size;
+    int sockfd = open_listen_socket(NULL, PORT);  // listen on sock_fd
+    if(sockfd < 0) {
         exit(1);
     }
 
@@ -329,9 +1124,12 @@ int main(int argc, char** argv) {
 
     double time_interval = 1e6/rate;
 
-    unsigned char* buffer = malloc((1024*1024));
+    unsigned char* buffer = malloc(CERES_HEADER_SIZE + 16*(4 + 4*waveform_length + 4));
     int count = 0;
     int sent_count = 0;
+    double sent_bytes = 0;
+
+    Pacer pacer = {0, -1};
 
     while(1) {  // main accept() loop
         gettimeofday(&current_time, NULL);
@@ -376,12 +1174,51 @@ int main(int argc, char** argv) {
         double delta_t_print = (current_time.tv_sec - print_update_time.tv_sec)*1e6 + (current_time.tv_usec - print_update_time.tv_usec);
 
         if(delta_t_print > 1e6) {
-            printf("Num Sent = %i\n", sent_count);
+            if(pool_size > 0) {
+                printf("Num Sent = %i, %0.1f MB/s\n", sent_count, sent_bytes*1e-6);
+            }
+            else {
+                printf("Num Sent = %i\n", sent_count);
+            }
             print_update_time = current_time;
             sent_count = 0;
+            sent_bytes = 0;
         }
 
-        if(delta_t_send > time_interval && num_connected_fds > 0) {
+        if(pool_size > 0) {
+            if(num_connected_fds == 0) {
+                pacer.sent = -1;
+                usleep(1000);
+                continue;
+            }
+            // Don't sleep so long that new connections are left hanging
+            int num_due = pacer_events_due(&pacer, rate, batch_size, 1e-3);
+            if(num_due == 0) {
+                continue;
+            }
+
+            uint64_t timeticks = current_time.tv_sec*1e6 + current_time.tv_usec;
+            for(int i=0; i<num_connected_fds; i++) {
+                if(connected_fds[i] < 0) {
+                    continue;
+                }
+                int fontus_connection = create_fontus_data && i==0;
+                int device_id = i + 4 - (create_fontus_data ? 1 : 0);
+                ssize_t nbytes = send_pooled_events(connected_fds[i],
+                                                    fontus_connection ? &fontus_pool : &ceres_pool,
+                                                    count, num_due, timeticks, device_id, NULL, NULL);
+                if(nbytes < 0) {
+                    perror("SEND");
+                    drop_connection(connected_fds, i, &next_available_fd);
+                    continue;
+                }
+                sent_bytes += nbytes;
+            }
+            pacer.sent += num_due;
+            sent_count += num_due;
+            count += num_due;
+        }
+        else if(delta_t_send > time_interval && num_connected_fds > 0) {
             event_rate_time = current_time;
             // Send event
             for(int i =0; i<num_connected_fds; i++) {
@@ -390,12 +1227,12 @@ int main(int argc, char** argv) {
                 }
                 ssize_t nbytes;
                 if(create_fontus_data && i==0) {
-                    nbytes = produce_fontus_data(buffer, count, 400);
+                    nbytes = produce_fontus_data(buffer, count, waveform_length);
                 }
                 else {
                     int channel_number = i+4;
                     channel_number -= create_fontus_data ? 1 : 0;
-                    nbytes = produce_data(buffer, count, channel_number, 400);
+                    nbytes = produce_data(buffer, count, channel_number, waveform_length);
                 }
 
                 ssize_t nsent = 0;
@@ -404,14 +1241,7 @@ int main(int argc, char** argv) {
                     ssize_t bytes = send(connected_fds[i], buffer+nsent, nbytes-nsent, 0);
                     if(bytes <= 0) {
                         perror("SEND");
-                        if(next_available_fd < 0 || i < next_available_fd) {
-                            // Choose the lowest available FD slot
-                            // that way FONTUS will always be the next up if
-                            // FONTUS builder disconnects
-                            next_available_fd = i;
-                        }
-                        close(connected_fds[i]);
-                        connected_fds[i] = -1;
+                        drop_connection(connected_fds, i, &next_available_fd);
                         break;
                     }
                     nsent +=  bytes;
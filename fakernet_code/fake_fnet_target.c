@@ -0,0 +1,846 @@
+/*
+ * fake_fnet_target.c
+ * This program pretends to be the FakerNet UDP register access interface of a
+ * CERES/FONTUS FPGA. It's meant for testing and benchmarking the control path
+ * (fnet_client, kintex_client_server, ceres_server, fnetctrl) without any
+ * hardware.
+ *
+ * It listens on the idempotent control port and a number of "reliable"
+ * channels on the ports just after it, and implements the same protocol the
+ * FPGA does:
+ *  - The reset-arm/reset/disconnect handshake on the reliable channels.
+ *  - Per-channel sequence numbers. A request with the wrong sequence number
+ *    gets the previous response repeated back, and is not performed again.
+ *  - Up to FAKERNET_REG_ACCESS_MAX_ITEMS read/write items per packet.
+ *  - The one-read delay of the AXI bridge, i.e. a read returns the value
+ *    fetched by the previous read (which is why double_read_addr exists).
+ *
+ * Behind that sits a simple model of the AXI register map. Every address acts
+ * like plain memory except the AXI QSPI and AXI IIC peripherals, which have
+ * their FIFOs and status registers modeled. The SPI slaves are modeled as
+ * 24-bit register devices (R/W bit, 15-bit address, 8-bit data) like the LMK
+ * and ADC chips, and the IIC slaves as byte addressed memories.
+ * For CERES the clock wizard always reports locked and the TDC reports where
+ * a sync with a random (but fixed) arrival time and some jitter lands in the
+ * clock period, given the clock wizard's phase, so tdc_align can be tried out.
+ *
+ * Artificial reply latency, jitter, and packet loss can be added to see how
+ * the client copes.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#include <math.h>
+#include "fakernet.h"
+
+#define MAX_CHANNELS 8
+#define MAX_PENDING_REPLIES 1024
+#define REGISTER_MAP_SIZE (1<<16) // Max number of distinct registers that can be stored
+#define REG_ADDR_MASK 0x3FFFFFF
+#define CHANNEL_ACTIVE_TIMEOUT 2.0 // seconds
+#define SIM_FIFO_DEPTH 256
+#define MAX_PACKET_SIZE (sizeof(fakernet_reg_access) + FAKERNET_REG_ACCESS_MAX_ITEMS*sizeof(fakernet_reg_acc_item))
+
+/***************************************************************************/
+// Register map model
+
+typedef struct SimFifo {
+    uint32_t data[SIM_FIFO_DEPTH];
+    int head;
+    int count;
+} SimFifo;
+
+static void fifo_reset(SimFifo* fifo) {
+    fifo->head = 0;
+    fifo->count = 0;
+}
+
+static int fifo_push(SimFifo* fifo, uint32_t value) {
+    if(fifo->count == SIM_FIFO_DEPTH) {
+        return -1;
+    }
+    fifo->data[(fifo->head + fifo->count) % SIM_FIFO_DEPTH] = value;
+    fifo->count += 1;
+    return 0;
+}
+
+static uint32_t fifo_pop(SimFifo* fifo) {
+    uint32_t value;
+    if(fifo->count == 0) {
+        return 0;
+    }
+    value = fifo->data[fifo->head];
+    fifo->head = (fifo->head + 1) % SIM_FIFO_DEPTH;
+    fifo->count -= 1;
+    return value;
+}
+
+// AXI QSPI register offsets, same as in axi_qspi.c
+#define SRR_OFFSET 0x40
+#define SPICR_OFFSET 0x60
+#define SPISR_OFFSET 0x64
+#define SPI_DTR_OFFSET 0x68
+#define SPI_DRR_OFFSET 0x6C
+#define SPISSR_OFFSET 0x70
+#define TR_OCC_OFFSET 0x74
+#define RR_OCC_OFFSET 0x78
+#define QSPI_ADDR_SPAN 0x80
+
+#define SPI_CR_MASTER_INHIBIT (1<<8)
+#define SPI_CR_RX_FIFO_RESET (1<<6)
+#define SPI_CR_TX_FIFO_RESET (1<<5)
+#define SPI_CR_SPI_ENABLE (1<<1)
+
+// AXI IIC register offsets, same as in iic.c
+#define IIC_CR_OFFSET  0x100
+#define IIC_SR_OFFSET  0x104
+#define IIC_TX_FIFO_OFFSET 0x108
+#define IIC_RX_FIFO_OFFSET 0x10C
+#define IIC_TX_FIFO_OCY_OFFSET 0x114
+#define IIC_RX_FIFO_OCY_OFFSET 0x118
+#define IIC_ADDR_SPAN 0x200
+
+#define IIC_TX_START (1<<8)
+#define IIC_TX_STOP (1<<9)
+#define IIC_SR_TX_FIFO_EMPTY (1<<7)
+#define IIC_SR_RX_FIFO_EMPTY (1<<6)
+
+// CERES clock wizard & TDC, same as in ceres_if.c and clock_wiz.c
+#define CERES_CLOCK_WIZ_ADDR 0x600000
+#define CLOCK_WIZ_STATUS_OFFSET 0x4
+#define CLOCK_WIZ_PHASE_OFFSET 0x20C
+#define CERES_TDC_ADDR (0x400000 | (1<<11) | (2*4)) // GPIO input channel 2
+#define TDC_JITTER 0.03 // clock periods
+
+typedef struct SimQSPI {
+    uint32_t base;
+    SimFifo tx;
+    SimFifo rx;
+    uint8_t slave_regs[1<<15]; // Register file of the SPI slave
+} SimQSPI;
+
+typedef struct SimIIC {
+    uint32_t base;
+    SimFifo tx;
+    SimFifo rx;
+    uint8_t memory[128][256]; // [device][register]
+    int device; // Currently addressed device, -1 if none
+    int reading;
+    int reg_pointer;
+    int bytes_written; // Since the last start condition
+} SimIIC;
+
+typedef struct RegEntry {
+    uint32_t addr;
+    uint32_t value;
+    int used;
+} RegEntry;
+
+static RegEntry register_map[REGISTER_MAP_SIZE];
+static int register_map_used = 0;
+static SimQSPI* qspis[16];
+static int num_qspis = 0;
+static SimIIC* iics[4];
+static int num_iics = 0;
+// Value fetched by the most recent read, which gets returned by the next one.
+static uint32_t pending_read_value = 0;
+static int read_delay = 1;
+
+static int model_tdc = 0;
+static double sync_arrival; // Where in the clock period the sync arrives at zero phase shift
+
+static const uint32_t CERES_QSPI_ADDRS[] = {0x100000, 0x100100, 0x100200, 0x100300,
+                                            0x100400, 0x100500, 0x100600};
+static const uint32_t CERES_IIC_ADDRS[] = {0x300000};
+static const uint32_t FONTUS_QSPI_ADDRS[] = {0x400000, 0x500000};
+static const uint32_t FONTUS_IIC_ADDRS[] = {0x100000};
+
+static RegEntry* find_register(uint32_t addr, int create) {
+    uint32_t index = (addr * 2654435761u) % REGISTER_MAP_SIZE;
+    int i;
+    for(i=0; i<REGISTER_MAP_SIZE; i++) {
+        RegEntry* entry = &register_map[(index + i) % REGISTER_MAP_SIZE];
+        if(entry->used && entry->addr == addr) {
+            return entry;
+        }
+        if(!entry->used) {
+            if(!create) {
+                return NULL;
+            }
+            if(register_map_used >= REGISTER_MAP_SIZE - 1) {
+                fprintf(stderr, "Register map is full\n");
+                return NULL;
+            }
+            entry->used = 1;
+            entry->addr = addr;
+            entry->value = 0;
+            register_map_used += 1;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void add_peripherals(int fontus) {
+    const uint32_t* qspi_addrs = fontus ? FONTUS_QSPI_ADDRS : CERES_QSPI_ADDRS;
+    const uint32_t* iic_addrs = fontus ? FONTUS_IIC_ADDRS : CERES_IIC_ADDRS;
+    num_qspis = fontus ? sizeof(FONTUS_QSPI_ADDRS)/sizeof(uint32_t) : sizeof(CERES_QSPI_ADDRS)/sizeof(uint32_t);
+    num_iics = fontus ? sizeof(FONTUS_IIC_ADDRS)/sizeof(uint32_t) : sizeof(CERES_IIC_ADDRS)/sizeof(uint32_t);
+    int i;
+    for(i=0; i<num_qspis; i++) {
+        qspis[i] = calloc(1, sizeof(SimQSPI));
+        qspis[i]->base = qspi_addrs[i];
+    }
+    for(i=0; i<num_iics; i++) {
+        iics[i] = calloc(1, sizeof(SimIIC));
+        iics[i]->base = iic_addrs[i];
+        iics[i]->device = -1;
+    }
+}
+
+// Clock all bytes in the TX FIFO out to the SPI slave. The slave interprets
+// each group of 3 bytes as R/W + 15-bit address, followed by a data byte.
+static void qspi_transfer(SimQSPI* qspi) {
+    while(qspi->tx.count > 0) {
+        uint8_t bytes[3] = {0, 0, 0};
+        int n = qspi->tx.count < 3 ? qspi->tx.count : 3;
+        int i;
+        for(i=0; i<n; i++) {
+            bytes[i] = fifo_pop(&qspi->tx);
+        }
+        int is_read = bytes[0] & 0x80;
+        uint32_t reg = ((bytes[0] & 0x7F) << 8) | bytes[1];
+        if(n == 3 && !is_read) {
+            qspi->slave_regs[reg] = bytes[2];
+        }
+        for(i=0; i<n; i++) {
+            fifo_push(&qspi->rx, (i == 2 && is_read) ? qspi->slave_regs[reg] : 0);
+        }
+    }
+}
+
+static int qspi_access(SimQSPI* qspi, uint32_t offset, int is_write, uint32_t* value) {
+    RegEntry* reg;
+    switch(offset) {
+        case SRR_OFFSET:
+            if(is_write && *value == 0xA) {
+                fifo_reset(&qspi->tx);
+                fifo_reset(&qspi->rx);
+            }
+            return 0;
+        case SPICR_OFFSET:
+            reg = find_register(qspi->base + offset, 1);
+            if(!is_write) {
+                *value = reg ? reg->value : 0;
+                return 0;
+            }
+            if(reg) {
+                reg->value = *value & ~(SPI_CR_RX_FIFO_RESET | SPI_CR_TX_FIFO_RESET);
+            }
+            if(*value & SPI_CR_RX_FIFO_RESET) {
+                fifo_reset(&qspi->rx);
+            }
+            if(*value & SPI_CR_TX_FIFO_RESET) {
+                fifo_reset(&qspi->tx);
+            }
+            if((*value & SPI_CR_SPI_ENABLE) && !(*value & SPI_CR_MASTER_INHIBIT)) {
+                qspi_transfer(qspi);
+            }
+            return 0;
+        case SPISR_OFFSET:
+            if(!is_write) {
+                *value = (qspi->rx.count == 0 ? 0x1 : 0) |
+                         (qspi->rx.count == SIM_FIFO_DEPTH ? 0x2 : 0) |
+                         (qspi->tx.count == 0 ? 0x4 : 0) |
+                         (qspi->tx.count == SIM_FIFO_DEPTH ? 0x8 : 0);
+            }
+            return 0;
+        case SPI_DTR_OFFSET:
+            if(is_write) {
+                fifo_push(&qspi->tx, *value & 0xFF);
+            }
+            return 0;
+        case SPI_DRR_OFFSET:
+            if(!is_write) {
+                *value = fifo_pop(&qspi->rx);
+            }
+            return 0;
+        case TR_OCC_OFFSET:
+            if(!is_write) {
+                *value = qspi->tx.count ? qspi->tx.count - 1 : 0;
+            }
+            return 0;
+        case RR_OCC_OFFSET:
+            if(!is_write) {
+                *value = qspi->rx.count ? qspi->rx.count - 1 : 0;
+            }
+            return 0;
+        default:
+            return -1; // Treat as normal memory
+    }
+}
+
+// Run everything queued in the IIC TX FIFO on the bus
+static void iic_process_tx(SimIIC* iic) {
+    while(iic->tx.count > 0) {
+        uint32_t word = fifo_pop(&iic->tx);
+        if(word & IIC_TX_START) {
+            iic->device = (word >> 1) & 0x7F;
+            iic->reading = word & 0x1;
+            iic->bytes_written = 0;
+            continue;
+        }
+        if(iic->device < 0) {
+            continue;
+        }
+        if(iic->reading) {
+            // For reads the data byte is the number of bytes to read
+            int i;
+            for(i=0; i<(int)(word & 0xFF); i++) {
+                fifo_push(&iic->rx, iic->memory[iic->device][iic->reg_pointer]);
+                iic->reg_pointer = (iic->reg_pointer + 1) & 0xFF;
+            }
+        }
+        else if(iic->bytes_written == 0) {
+            // First byte written is the register address
+            iic->reg_pointer = word & 0xFF;
+            iic->bytes_written += 1;
+        }
+        else {
+            iic->memory[iic->device][iic->reg_pointer] = word & 0xFF;
+            iic->reg_pointer = (iic->reg_pointer + 1) & 0xFF;
+            iic->bytes_written += 1;
+        }
+        if(word & IIC_TX_STOP) {
+            iic->device = -1;
+        }
+    }
+}
+
+static int iic_access(SimIIC* iic, uint32_t offset, int is_write, uint32_t* value) {
+    switch(offset) {
+        case IIC_SR_OFFSET:
+            if(!is_write) {
+                *value = IIC_SR_TX_FIFO_EMPTY | (iic->rx.count == 0 ? IIC_SR_RX_FIFO_EMPTY : 0);
+            }
+            return 0;
+        case IIC_TX_FIFO_OFFSET:
+            if(is_write) {
+                fifo_push(&iic->tx, *value);
+                iic_process_tx(iic);
+            }
+            return 0;
+        case IIC_RX_FIFO_OFFSET:
+            if(!is_write) {
+                *value = fifo_pop(&iic->rx);
+            }
+            return 0;
+        case IIC_TX_FIFO_OCY_OFFSET:
+            if(!is_write) {
+                *value = 0;
+            }
+            return 0;
+        case IIC_RX_FIFO_OCY_OFFSET:
+            if(!is_write) {
+                *value = iic->rx.count ? iic->rx.count - 1 : 0;
+            }
+            return 0;
+        default:
+            return -1; // Treat as normal memory
+    }
+}
+
+// Thermometer code of which quarter of the clock period the sync arrived in
+static uint32_t tdc_read(void) {
+    static const uint32_t codes[] = {14, 12, 8, 0};
+    RegEntry* reg = find_register(CERES_CLOCK_WIZ_ADDR + CLOCK_WIZ_PHASE_OFFSET, 0);
+    double shift = reg ? (reg->value % 360000)/360000.0 : 0;
+    // Box-Muller
+    double u1 = (rand() + 1.0)/(RAND_MAX + 2.0);
+    double u2 = rand()/(RAND_MAX + 1.0);
+    double jitter = TDC_JITTER*sqrt(-2*log(u1))*cos(2*M_PI*u2);
+    double phase = sync_arrival + shift + jitter;
+    phase -= floor(phase);
+    return codes[(int)(phase*4) & 3];
+}
+
+static uint32_t register_read(uint32_t addr) {
+    uint32_t value = 0;
+    RegEntry* reg;
+    int i;
+    addr &= REG_ADDR_MASK;
+    if(model_tdc) {
+        if(addr == CERES_CLOCK_WIZ_ADDR + CLOCK_WIZ_STATUS_OFFSET) {
+            return 1;
+        }
+        if(addr == CERES_TDC_ADDR) {
+            return tdc_read();
+        }
+    }
+    for(i=0; i<num_qspis; i++) {
+        if(addr >= qspis[i]->base && addr < qspis[i]->base + QSPI_ADDR_SPAN) {
+            if(qspi_access(qspis[i], addr - qspis[i]->base, 0, &value) == 0) {
+                return value;
+            }
+        }
+    }
+    for(i=0; i<num_iics; i++) {
+        if(addr >= iics[i]->base && addr < iics[i]->base + IIC_ADDR_SPAN) {
+            if(iic_access(iics[i], addr - iics[i]->base, 0, &value) == 0) {
+                return value;
+            }
+        }
+    }
+    reg = find_register(addr, 0);
+    return reg ? reg->value : 0;
+}
+
+static void register_write(uint32_t addr, uint32_t value) {
+    RegEntry* reg;
+    int i;
+    addr &= REG_ADDR_MASK;
+    for(i=0; i<num_qspis; i++) {
+        if(addr >= qspis[i]->base && addr < qspis[i]->base + QSPI_ADDR_SPAN) {
+            if(qspi_access(qspis[i], addr - qspis[i]->base, 1, &value) == 0) {
+                return;
+            }
+        }
+    }
+    for(i=0; i<num_iics; i++) {
+        if(addr >= iics[i]->base && addr < iics[i]->base + IIC_ADDR_SPAN) {
+            if(iic_access(iics[i], addr - iics[i]->base, 1, &value) == 0) {
+                return;
+            }
+        }
+    }
+    reg = find_register(addr, 1);
+    if(reg) {
+        reg->value = value;
+    }
+}
+
+/***************************************************************************/
+// Protocol handling
+
+typedef struct Channel {
+    int fd;
+    int port;
+    int reliable;
+    int connected;
+    int armed;
+    uint16_t arm_number;
+    uint8_t expected_sequence;
+    double last_access_time;
+    // Last response sent, repeated if a request has the wrong sequence number
+    unsigned char last_response[MAX_PACKET_SIZE];
+    size_t last_response_len;
+} Channel;
+
+typedef struct PendingReply {
+    double due_time;
+    Channel* channel;
+    struct sockaddr_in dest;
+    size_t len;
+    unsigned char data[MAX_PACKET_SIZE];
+} PendingReply;
+
+static Channel channels[MAX_CHANNELS+1];
+static int num_channels = 0;
+static PendingReply* pending_replies;
+static int num_pending = 0;
+
+static double reply_latency = 0; // seconds
+static double reply_jitter = 0; // seconds
+static double loss_probability = 0;
+static int verbose = 0;
+
+static struct {
+    unsigned long long packets;
+    unsigned long long items;
+    unsigned long long repeated;
+    unsigned long long lost;
+    unsigned long long bad;
+} stats;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static double rand_uniform(void) {
+    return rand()/(RAND_MAX + 1.0);
+}
+
+static uint16_t channel_status(void) {
+    uint16_t status = 0;
+    double now = now_seconds();
+    int i;
+    for(i=1; i<num_channels; i++) {
+        const int reliable_index = i-1;
+        if(channels[i].connected) {
+            status |= FAKERBET_STATUS1_UDP_CONNECTED(reliable_index);
+        }
+        if(now - channels[i].last_access_time < CHANNEL_ACTIVE_TIMEOUT) {
+            status |= FAKERBET_STATUS1_UDP_ACTIVE(reliable_index);
+        }
+    }
+    return status;
+}
+
+static void queue_reply(Channel* channel, const struct sockaddr_in* dest, const void* data, size_t len) {
+    if(loss_probability > 0 && rand_uniform() < loss_probability) {
+        stats.lost += 1;
+        return;
+    }
+    if(num_pending == MAX_PENDING_REPLIES) {
+        stats.lost += 1;
+        return;
+    }
+    PendingReply* reply = &pending_replies[num_pending++];
+    reply->due_time = now_seconds() + reply_latency + reply_jitter*rand_uniform();
+    reply->channel = channel;
+    reply->dest = *dest;
+    reply->len = len;
+    memcpy(reply->data, data, len);
+}
+
+// Send any replies whose time has come. Returns the time until the next one
+// is due, or a negative number if there's none waiting.
+static double send_due_replies(void) {
+    double now = now_seconds();
+    double next = -1;
+    int i = 0;
+    while(i < num_pending) {
+        PendingReply* reply = &pending_replies[i];
+        if(reply->due_time <= now) {
+            sendto(reply->channel->fd, reply->data, reply->len, 0,
+                   (struct sockaddr*)&reply->dest, sizeof(reply->dest));
+            pending_replies[i] = pending_replies[--num_pending];
+            continue;
+        }
+        if(next < 0 || reply->due_time - now < next) {
+            next = reply->due_time - now;
+        }
+        i++;
+    }
+    return next;
+}
+
+static void handle_reset_request(Channel* channel, const fakernet_reg_access* request,
+                                 fakernet_reg_access* response) {
+    uint16_t seq = ntohs(request->sequence_request);
+    uint16_t resp = 0;
+    double now = now_seconds();
+
+    if((seq & 0xe000) == FAKERNET_SEQ_REQ_RESET_ARM) {
+        uint16_t key = seq & FAKERNET_SEQ_REQ_ARM_USER_CODE_MASK;
+        if(channel->connected && now - channel->last_access_time < CHANNEL_ACTIVE_TIMEOUT) {
+            // Refuse, someone is actively using this channel
+            resp = ~key & FAKERNET_SEQ_REQ_ARM_USER_CODE_MASK;
+        }
+        else {
+            channel->armed = 1;
+            channel->arm_number = rand() & FAKERNET_SEQ_SEQUENCE_MASK;
+            resp = key | channel->arm_number | (channel->connected ? FAKERNET_SEQ_REQ_CONNECTED : 0);
+        }
+    }
+    else if((seq & 0xe000) == FAKERNET_SEQ_REQ_RESET) {
+        if(channel->armed && (seq & FAKERNET_SEQ_SEQUENCE_MASK) == channel->arm_number) {
+            channel->armed = 0;
+            channel->connected = 1;
+            channel->last_access_time = now;
+            channel->expected_sequence = ((channel->arm_number ^ FAKERNET_SEQ_SEQUENCE_MASK_1ST_XOR) + 1) &
+                                         FAKERNET_SEQ_SEQUENCE_MASK;
+            channel->last_response_len = 0;
+            resp = seq;
+        }
+        else if(channel->connected && (seq & FAKERNET_SEQ_SEQUENCE_MASK) == channel->arm_number) {
+            // Repeated reset request, the response must've gotten lost
+            resp = seq;
+        }
+        else {
+            resp = 0x4400 | (~seq & 0x0003);
+        }
+    }
+    else if((seq & 0xe000) == FAKERNET_SEQ_REQ_DISCONNECT) {
+        channel->connected = 0;
+        channel->armed = 0;
+        resp = seq;
+    }
+    response->sequence_response = htons(resp);
+}
+
+static void perform_accesses(const fakernet_reg_access* request, fakernet_reg_access* response, int num_items) {
+    int i;
+    for(i=0; i<num_items; i++) {
+        uint32_t addr = ntohl(request->items[i].addr);
+        uint32_t data = ntohl(request->items[i].data);
+        uint32_t flags = addr & 0xf0000000;
+        addr &= 0x0fffffff;
+        if(flags == FAKERNET_REG_ACCESS_ADDR_WRITE) {
+            if(!(addr & FAKERNET_REG_ACCESS_ADDR_INTERNAL)) {
+                register_write(addr, data);
+            }
+            response->items[i].addr = htonl(FAKERNET_REG_ACCESS_ADDR_WRITTEN | addr);
+            response->items[i].data = htonl(data);
+        }
+        else if(flags == FAKERNET_REG_ACCESS_ADDR_READ) {
+            uint32_t value = 0;
+            if(!(addr & FAKERNET_REG_ACCESS_ADDR_INTERNAL)) {
+                value = register_read(addr);
+                if(read_delay) {
+                    uint32_t tmp = pending_read_value;
+                    pending_read_value = value;
+                    value = tmp;
+                }
+            }
+            response->items[i].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ_RET | addr);
+            response->items[i].data = htonl(value);
+        }
+        else {
+            // Unknown operation, don't flag it as done
+            response->items[i].addr = htonl(addr);
+            response->items[i].data = htonl(data);
+        }
+    }
+    stats.items += num_items;
+}
+
+static void handle_packet(Channel* channel) {
+    unsigned char buf[MAX_PACKET_SIZE + 4];
+    unsigned char out[MAX_PACKET_SIZE];
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    ssize_t n = recvfrom(channel->fd, buf, sizeof(buf), 0, (struct sockaddr*)&peer, &peer_len);
+    if(n < 0) {
+        if(errno != EINTR && errno != EAGAIN) {
+            perror("recvfrom");
+        }
+        return;
+    }
+    stats.packets += 1;
+    if(loss_probability > 0 && rand_uniform() < loss_probability) {
+        stats.lost += 1;
+        return;
+    }
+    if((size_t)n < sizeof(fakernet_reg_access) || (size_t)n > MAX_PACKET_SIZE ||
+            (n - sizeof(fakernet_reg_access)) % sizeof(fakernet_reg_acc_item)) {
+        stats.bad += 1;
+        return;
+    }
+
+    const fakernet_reg_access* request = (const fakernet_reg_access*)buf;
+    fakernet_reg_access* response = (fakernet_reg_access*)out;
+    const int num_items = (n - sizeof(fakernet_reg_access)) / sizeof(fakernet_reg_acc_item);
+    const uint16_t seq = ntohs(request->sequence_request);
+
+    memset(out, 0, n);
+    response->status_udp_channels = htons(channel_status());
+    response->status_tcp = htons(FAKERNET_STATUS2_TCP_IDLE);
+    response->sequence_request = htons(0);
+
+    if(verbose) {
+        printf("port %i: seq 0x%04x, %i items\n", channel->port, seq, num_items);
+    }
+
+    if(channel->reliable && (seq & 0xe000)) {
+        // Handshake packets never carry any items
+        handle_reset_request(channel, request, response);
+        queue_reply(channel, &peer, out, sizeof(fakernet_reg_access));
+        return;
+    }
+
+    if(channel->reliable) {
+        if(!channel->connected || (seq & FAKERNET_SEQ_SEQUENCE_MASK) != channel->expected_sequence) {
+            // Not for us to perform, send the last response again
+            stats.repeated += 1;
+            if(channel->last_response_len) {
+                queue_reply(channel, &peer, channel->last_response, channel->last_response_len);
+            }
+            return;
+        }
+        channel->expected_sequence = (channel->expected_sequence + 1) & FAKERNET_SEQ_SEQUENCE_MASK;
+        channel->last_access_time = now_seconds();
+    }
+
+    response->sequence_response = htons(seq);
+    perform_accesses(request, response, num_items);
+    if(channel->reliable) {
+        memcpy(channel->last_response, out, n);
+        channel->last_response_len = n;
+    }
+    queue_reply(channel, &peer, out, n);
+}
+
+static int open_channel(Channel* channel, const char* ip, int port, int reliable) {
+    struct sockaddr_in addr;
+    int yes = 1;
+
+    memset(channel, 0, sizeof(Channel));
+    channel->port = port;
+    channel->reliable = reliable;
+    channel->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(channel->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(channel->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = ip ? inet_addr(ip) : htonl(INADDR_ANY);
+    if(bind(channel->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Could not bind to port %i: %s\n", port, strerror(errno));
+        close(channel->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void print_help_message(void) {
+    printf("fake_fnet_target: Pretends to be the FakerNet UDP register interface of an FPGA.\n"
+           "\tusage: fake_fnet_target [--ip addr] [--port port] [--channels N] [--latency us]\n"
+           "\t                        [--jitter us] [--loss p] [--fontus] [--no-read-delay] [--verbose]\n"
+           "\targuments:\n"
+           "\t--ip -i\t\tAddress to listen on (default all).\n"
+           "\t--port -p\tIdempotent control port, reliable channels use the ports after it (default %i).\n"
+           "\t--channels -c\tNumber of reliable channels (default 2, max %i).\n"
+           "\t--latency -l\tDelay before each reply, in micro-seconds.\n"
+           "\t--jitter -j\tAdditional random (uniform) delay before each reply, in micro-seconds.\n"
+           "\t--loss -L\tProbability of losing any single request or reply packet.\n"
+           "\t--fontus -f\tUse the FONTUS register map instead of CERES.\n"
+           "\t--no-read-delay\tReads return the requested register instead of the previous read's value.\n"
+           "\t--verbose -v\tPrint every packet.\n"
+           "Connect to it with e.g. \"fnetctrl 127.0.0.1:%i\".\n",
+           FAKERNET_DEFAULT_CTRL_PORT_BASE, MAX_CHANNELS, FAKERNET_DEFAULT_CTRL_PORT_BASE);
+}
+
+int main(int argc, char** argv) {
+    const char* ip = NULL;
+    int port = FAKERNET_DEFAULT_CTRL_PORT_BASE;
+    int num_reliable = 2;
+    int fontus = 0;
+    int i;
+    struct option clargs[] = {
+        {"ip", required_argument, NULL, 'i'},
+        {"port", required_argument, NULL, 'p'},
+        {"channels", required_argument, NULL, 'c'},
+        {"latency", required_argument, NULL, 'l'},
+        {"jitter", required_argument, NULL, 'j'},
+        {"loss", required_argument, NULL, 'L'},
+        {"fontus", no_argument, NULL, 'f'},
+        {"no-read-delay", no_argument, NULL, 'd'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        { 0, 0, 0, 0}};
+
+    int optindex;
+    int opt;
+    while( (opt = getopt_long(argc, argv, "i:p:c:l:j:L:fdvh", clargs, &optindex)) != -1)  {
+        switch(opt) {
+            case 'i':
+                ip = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 0);
+                break;
+            case 'c':
+                num_reliable = strtol(optarg, NULL, 0);
+                break;
+            case 'l':
+                reply_latency = strtod(optarg, NULL)*1e-6;
+                break;
+            case 'j':
+                reply_jitter = strtod(optarg, NULL)*1e-6;
+                break;
+            case 'L':
+                loss_probability = strtod(optarg, NULL);
+                break;
+            case 'f':
+                fontus = 1;
+                break;
+            case 'd':
+                read_delay = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+            default:
+                print_help_message();
+                return 0;
+        }
+    }
+    if(num_reliable < 0 || num_reliable > MAX_CHANNELS) {
+        printf("Number of channels must be between 0 and %i\n", MAX_CHANNELS);
+        return 1;
+    }
+
+    srand(time(NULL));
+    add_peripherals(fontus);
+    model_tdc = !fontus;
+    sync_arrival = rand()/(RAND_MAX + 1.0);
+    pending_replies = malloc(sizeof(PendingReply)*MAX_PENDING_REPLIES);
+
+    // Channel 0 is the idempotent one, the rest are the reliable channels
+    num_channels = num_reliable + 1;
+    for(i=0; i<num_channels; i++) {
+        if(open_channel(&channels[i], ip, port + i, i > 0)) {
+            return 1;
+        }
+    }
+    printf("Fake %s FakerNet target listening on ports %i-%i\n",
+           fontus ? "FONTUS" : "CERES", port, port + num_channels - 1);
+
+    double last_print = now_seconds();
+    while(1) {
+        fd_set readfds;
+        struct timeval timeout;
+        int max_fd = 0;
+        double wait = send_due_replies();
+
+        // Don't block longer than the stats printing interval
+        wait = (wait < 0 || wait > 1.0) ? 1.0 : wait;
+        timeout.tv_sec = (time_t)wait;
+        timeout.tv_usec = (suseconds_t)((wait - timeout.tv_sec)*1e6);
+
+        FD_ZERO(&readfds);
+        for(i=0; i<num_channels; i++) {
+            FD_SET(channels[i].fd, &readfds);
+            max_fd = channels[i].fd > max_fd ? channels[i].fd : max_fd;
+        }
+        int ret = select(max_fd+1, &readfds, NULL, NULL, &timeout);
+        if(ret < 0 && errno != EINTR) {
+            perror("select");
+            return 1;
+        }
+        if(ret > 0) {
+            for(i=0; i<num_channels; i++) {
+                if(FD_ISSET(channels[i].fd, &readfds)) {
+                    handle_packet(&channels[i]);
+                }
+            }
+        }
+
+        double now = now_seconds();
+        if(now - last_print > 10.0) {
+            printf("%llu packets, %llu items, %llu repeated, %llu lost, %llu bad\n",
+                   stats.packets, stats.items, stats.repeated, stats.lost, stats.bad);
+            last_print = now;
+        }
+    }
+    return 0;
+}
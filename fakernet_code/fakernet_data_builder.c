@@ -11,6 +11,7 @@ Author: Eric Marzec <marzece@gmail.com>
 #include <stdlib.h>
 
 #include "data_builder.h"
+#include "daq_logger.h"
 
 // Prints help string which describes this programs CL args.
 void print_help_message(void) {
@@ -24,7 +25,7 @@ void print_help_message(void) {
 #endif
 
     printf("%s: recieves then combines data from a %s board and publishes it to redis and/or saves it to a file.\n"
-            "\tusage:  %s [--ip fpga-ip] [-o output-filename] [--no-save] [-n num-events] [--dry] [-v] [-q]\n"
+            "\tusage:  %s [--ip fpga-ip] [-o output-filename] [--no-save] [-n num-events] [--dry] [--metrics-port port] [--log-rate " LOG_RATE_OPTION_HELP "] [-v] [-q]\n"
             "\targuments:\n"
             "\t--ip -i\tFPGA IP address to recieve data from. Default is '%s'\n"
             "\t--out -o\tFile to write built data to. Default is '%s'\n"
@@ -33,12 +34,16 @@ void print_help_message(void) {
             "\t--no-save\tDo not save any data to a file. Events are still published to redis.\n"
             "\t--log-file -l\tFilename that log messages should be recorded to. Default '%s'\n"
             "\t--redis-host -r\tHostname for redis DB. Used for publishing data & monitoring stats. Default is '%s'\n"
+            "\t--redis-sock -u\tUnix socket for redis DB. Used for publishing data & monitoring stats. Default is '%s'\n"
+            "\t--broker -b\tSend UDP control requests through the fnet_broker listening on this unix socket.\n"
+            "\t--metrics-port -p\tServe Prometheus metrics on this local TCP port. Default is to not.\n"
+            "\t--log-rate -L\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). Can be given once per level. ERRORs aren't limited by default.\n"
             "\t--verbose -v\tIncrease verbosity. Can be done multiple times.\n"
             "\t--quiet -q\tDecrease verbosity. Can be done multiple times.\n"
             "\t--help -h\tDisplay this message\n",
             program_string, board_string, program_string,
           cfg_default.ip, cfg_default.output_filename, cfg_default.error_filename,
-          cfg_default.redis_host);
+          cfg_default.redis_host, cfg_default.redis_sock);
 }
 
 // Populate configuration from CL args
@@ -51,6 +56,10 @@ struct BuilderConfig make_config_from_args(int argc, char** argv) {
         {"no-save", no_argument, NULL, 's'},
         {"log-file", required_argument, NULL, 'l'},
         {"redis-host", required_argument, NULL, 'r'},
+        {"redis-sock", required_argument, NULL, 'u'},
+        {"broker", required_argument, NULL, 'b'},
+        {"metrics-port", required_argument, NULL, 'p'},
+        {"log-rate", required_argument, NULL, 'L'},
         {"verbose", no_argument, NULL, 'v'},
         {"help", no_argument, NULL, 'h'},
         { 0, 0, 0, 0}};
@@ -58,7 +67,7 @@ struct BuilderConfig make_config_from_args(int argc, char** argv) {
     int opt;
     struct BuilderConfig config = default_builder_config();
     while(!config.exit_now &&
-            ((opt = getopt_long(argc, argv, "o:i:n:r:l:dsvh", clargs, &optindex)) != -1)) {
+            ((opt = getopt_long(argc, argv, "o:i:n:r:u:l:b:p:L:dsvh", clargs, &optindex)) != -1)) {
         switch(opt) {
             case 0:
                 // Should be here if the option (in 'clargs') has the "flag"
@@ -90,6 +99,23 @@ struct BuilderConfig make_config_from_args(int argc, char** argv) {
                 config.redis_host = optarg;
                 printf("Redis host set to '%s'\n", optarg);
                 break;
+            case 'u':
+                config.redis_sock = optarg;
+                printf("Redis socket set to '%s'\n", optarg);
+                break;
+            case 'b':
+                config.broker_sock = optarg;
+                printf("Using fnet_broker at '%s'\n", optarg);
+                break;
+            case 'p':
+                config.metrics_port = atoi(optarg);
+                break;
+            case 'L':
+                if(daq_log_parse_rate_limit(optarg)) {
+                    printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", optarg);
+                    config.exit_now = 1;
+                }
+                break;
             case 'v':
                 // Reduce the threshold on all the verbosity levels
                 config.verbosity += 1;
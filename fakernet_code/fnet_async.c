@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/select.h>
+#include "fnet_async.h"
+
+static void start_next_request(FnetAsyncConn* conn);
+
+static long long attempt_timeout_ms(FnetAsyncConn* conn) {
+    // ae time events have millisecond resolution, round up
+    return (fnet_ctrl_async_attempt_timeout_usec(conn->client) + 999)/1000;
+}
+
+static void delete_timer(FnetAsyncConn* conn) {
+    if(conn->timer_id != -1) {
+        aeDeleteTimeEvent(conn->el, conn->timer_id);
+        conn->timer_id = -1;
+    }
+}
+
+static FnetAsyncRequest* pop_request(FnetAsyncConn* conn) {
+    FnetAsyncRequest* req = conn->queue;
+    if(req) {
+        conn->queue = req->next;
+        if(!conn->queue) {
+            conn->queue_tail = NULL;
+        }
+    }
+    return req;
+}
+
+// Called by fnet_client when the request in flight finishes
+static void request_done(struct fnet_ctrl_client* client, int result, void* privdata) {
+    FnetAsyncConn* conn = privdata;
+    fakernet_reg_acc_item* send;
+    fakernet_reg_acc_item* recv;
+
+    delete_timer(conn);
+    fnet_ctrl_get_send_recv_bufs(client, &send, &recv);
+
+    // Take it off the queue before the callback, the callback is allowed to
+    // submit more requests.
+    FnetAsyncRequest* req = pop_request(conn);
+    if(req) {
+        if(req->done) {
+            req->done(result, recv, req->num_items, req->privdata);
+        }
+        free(req);
+    }
+    start_next_request(conn);
+}
+
+static int timeout_proc(aeEventLoop* el, long long id, void* client_data) {
+    (void) el;
+    (void) id;
+    FnetAsyncConn* conn = client_data;
+
+    conn->timer_id = -1;
+    fnet_ctrl_async_timeout(conn->client);
+    // Still waiting on a re-send (and a new request hasn't already set up its
+    // own timer)
+    if(fnet_ctrl_async_pending(conn->client) && conn->timer_id == -1) {
+        conn->timer_id = aeCreateTimeEvent(conn->el, attempt_timeout_ms(conn), timeout_proc, conn, NULL);
+    }
+    return AE_NOMORE;
+}
+
+static void readable_proc(aeEventLoop* el, int fd, void* client_data, int mask) {
+    (void) el;
+    (void) fd;
+    (void) mask;
+    FnetAsyncConn* conn = client_data;
+    fnet_ctrl_async_recv(conn->client);
+}
+
+static void start_next_request(FnetAsyncConn* conn) {
+    fakernet_reg_acc_item* send;
+    fakernet_reg_acc_item* recv;
+
+    while(conn->queue && !fnet_ctrl_async_pending(conn->client)) {
+        FnetAsyncRequest* req = conn->queue;
+        fnet_ctrl_get_send_recv_bufs(conn->client, &send, &recv);
+        memcpy(send, req->items, sizeof(fakernet_reg_acc_item)*req->num_items);
+
+        if(fnet_ctrl_send_regacc_async(conn->client, req->num_items, request_done, conn) == 0) {
+            delete_timer(conn);
+            conn->timer_id = aeCreateTimeEvent(conn->el, attempt_timeout_ms(conn), timeout_proc, conn, NULL);
+            return;
+        }
+
+        // Couldn't even send it, fail it and move on to the next one
+        printf("%s\n", strerror(errno));
+        pop_request(conn);
+        if(req->done) {
+            req->done(-1, NULL, req->num_items, req->privdata);
+        }
+        free(req);
+    }
+}
+
+FnetAsyncConn* fnet_async_new(aeEventLoop* el, struct fnet_ctrl_client* client) {
+    FnetAsyncConn* conn = malloc(sizeof(FnetAsyncConn));
+    if(!conn) {
+        return NULL;
+    }
+    conn->el = el;
+    conn->client = client;
+    conn->fd = fnet_ctrl_get_fd(client);
+    conn->timer_id = -1;
+    conn->queue = NULL;
+    conn->queue_tail = NULL;
+
+    if(aeCreateFileEvent(el, conn->fd, AE_READABLE, readable_proc, conn) == AE_ERR) {
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void fnet_async_free(FnetAsyncConn* conn) {
+    if(!conn) {
+        return;
+    }
+    fnet_async_flush(conn);
+    aeDeleteFileEvent(conn->el, conn->fd, AE_READABLE);
+    free(conn);
+}
+
+int fnet_async_submit(FnetAsyncConn* conn, const fakernet_reg_acc_item* items, int num_items,
+                      FnetAsyncDoneProc* done, void* privdata) {
+    if(num_items < 0 || num_items > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+        return -1;
+    }
+    FnetAsyncRequest* req = malloc(sizeof(FnetAsyncRequest));
+    if(!req) {
+        return -1;
+    }
+    memcpy(req->items, items, sizeof(fakernet_reg_acc_item)*num_items);
+    req->num_items = num_items;
+    req->done = done;
+    req->privdata = privdata;
+    req->next = NULL;
+
+    if(conn->queue_tail) {
+        conn->queue_tail->next = req;
+    }
+    else {
+        conn->queue = req;
+    }
+    conn->queue_tail = req;
+
+    start_next_request(conn);
+    return 0;
+}
+
+void fnet_async_flush(FnetAsyncConn* conn) {
+    fd_set read_fds;
+    struct timeval timeout;
+    struct timeval start, end;
+    int ret;
+
+    if(!conn) {
+        return;
+    }
+    gettimeofday(&start, NULL);
+    while(conn->queue) {
+        // Waiting happens right here, so the event loop's timer isn't needed
+        delete_timer(conn);
+
+        FD_ZERO(&read_fds);
+        FD_SET(conn->fd, &read_fds);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = fnet_ctrl_async_attempt_timeout_usec(conn->client);
+
+        ret = select(conn->fd + 1, &read_fds, NULL, NULL, &timeout);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret > 0) {
+            fnet_ctrl_async_recv(conn->client);
+        }
+        else {
+            fnet_ctrl_async_timeout(conn->client);
+        }
+    }
+    delete_timer(conn);
+    gettimeofday(&end, NULL);
+    fnet_ctrl_wait_usec += (end.tv_sec - start.tv_sec)*1000000LL + (end.tv_usec - start.tv_usec);
+}
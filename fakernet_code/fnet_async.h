@@ -0,0 +1,44 @@
+#ifndef __FNET_ASYNC__
+#define __FNET_ASYNC__
+#include <inttypes.h>
+#include "ae.h"
+#include "fnet_client.h"
+
+// Non-blocking register access for programs that run an ae event loop (i.e.
+// the servers). Requests get queued per FPGA connection and sent one at a
+// time, the UDP socket is watched by the event loop and re-sends/time-outs
+// are driven by a time event, so nothing blocks while waiting on the FPGA.
+//
+// Request and response items are in network byte order, the same as the
+// buffers from fnet_ctrl_get_send_recv_bufs.
+
+// Called once the request is done. 'result' is the same as the return value
+// of fnet_ctrl_send_recv_regacc, i.e. >= 1 means success. 'recv' is only valid
+// during the callback.
+typedef void FnetAsyncDoneProc(int result, const fakernet_reg_acc_item* recv, int num_items, void* privdata);
+
+typedef struct FnetAsyncRequest {
+    fakernet_reg_acc_item items[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    int num_items;
+    FnetAsyncDoneProc* done;
+    void* privdata;
+    struct FnetAsyncRequest* next;
+} FnetAsyncRequest;
+
+typedef struct FnetAsyncConn {
+    aeEventLoop* el;
+    struct fnet_ctrl_client* client;
+    int fd;
+    long long timer_id; // -1 if there's no time event
+    FnetAsyncRequest* queue; // The head of the queue is the one in flight
+    FnetAsyncRequest* queue_tail;
+} FnetAsyncConn;
+
+FnetAsyncConn* fnet_async_new(aeEventLoop* el, struct fnet_ctrl_client* client);
+void fnet_async_free(FnetAsyncConn* conn);
+int fnet_async_submit(FnetAsyncConn* conn, const fakernet_reg_acc_item* items, int num_items,
+                      FnetAsyncDoneProc* done, void* privdata);
+// Blocks until every queued request is done. Must be called before doing any
+// blocking access (fnet_ctrl_send_recv_regacc) on the same connection.
+void fnet_async_flush(FnetAsyncConn* conn);
+#endif
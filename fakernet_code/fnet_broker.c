@@ -0,0 +1,520 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "ae.h"
+#include "anet.h"
+#include "sds.h"
+#include "fnet_client.h"
+#include "fnet_async.h"
+#include "fnet_broker.h"
+#include "daq_logger.h"
+
+// Owns the reliable UDP access channel to each FPGA and does register accesses
+// for local clients, see fnet_broker.h for the protocol.
+
+#define LOGGER_NAME "fnet_broker"
+#define DEFAULT_REDIS_HOST "127.0.0.1"
+#define LOG_FILENAME "fnet_broker.log"
+#define LOG_MESSAGE_MAX 1024
+#define READ_CHUNK_SIZE (16*1024)
+#define MAX_CLIENTS 1024
+// A request that gets refused (e.g. another process reset the access channel
+// while the broker wasn't using it) wasn't done, so it's safe to reconnect and
+// send it again. Only try that once though.
+#define MAX_ATTEMPTS 2
+// Owner and group only, put whoever needs the broker in its group
+#define SOCK_PERMS 0660
+
+typedef struct BrokerConn {
+    int fd; // -1 once the client has gone away
+    sds inbuf;
+    sds outbuf;
+    int num_pending; // Requests that haven't been answered yet
+} BrokerConn;
+
+typedef struct BrokerRequest {
+    BrokerConn* conn;
+    fakernet_reg_acc_item items[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    int num_items;
+    int attempts;
+    struct BrokerRequest* next;
+} BrokerRequest;
+
+typedef struct Board {
+    char* name;
+    struct fnet_ctrl_client* fnet_client;
+    FnetAsyncConn* async;
+    BrokerRequest* queue;
+    BrokerRequest* queue_tail;
+    BrokerRequest* in_flight; // The requests in the packet that's been sent
+    long long reconnect_timer; // -1 if a reconnect isn't scheduled
+    unsigned long long num_requests;
+    unsigned long long num_packets;
+    struct Board* next;
+} Board;
+
+static aeEventLoop* el = NULL;
+static Board* boards = NULL;
+static const char* sock_path = FNET_BROKER_DEFAULT_SOCK;
+
+static void board_kick(Board* board);
+
+static void free_conn_if_done(BrokerConn* conn) {
+    if(conn->fd == -1 && conn->num_pending == 0) {
+        sdsfree(conn->inbuf);
+        sdsfree(conn->outbuf);
+        free(conn);
+    }
+}
+
+static void close_conn(BrokerConn* conn) {
+    if(conn->fd == -1) {
+        return;
+    }
+    aeDeleteFileEvent(el, conn->fd, AE_READABLE | AE_WRITABLE);
+    close(conn->fd);
+    conn->fd = -1;
+    // Anything still queued will find out the client is gone when it's done
+    free_conn_if_done(conn);
+}
+
+static void write_handler(aeEventLoop* loop, int fd, void* privdata, int mask) {
+    (void) loop;
+    (void) mask;
+    BrokerConn* conn = privdata;
+    ssize_t n = write(fd, conn->outbuf, sdslen(conn->outbuf));
+    if(n < 0) {
+        if(errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        close_conn(conn);
+        return;
+    }
+    sdsrange(conn->outbuf, n, -1);
+    if(sdslen(conn->outbuf) == 0) {
+        aeDeleteFileEvent(el, conn->fd, AE_WRITABLE);
+    }
+}
+
+static void reply_to_request(BrokerRequest* req, int result, const fakernet_reg_acc_item* recv) {
+    BrokerConn* conn = req->conn;
+    FnetBrokerReply reply;
+
+    if(conn->fd != -1) {
+        reply.magic = FNET_BROKER_MAGIC;
+        reply.result = result;
+        reply.num_items = (result > 0 && recv) ? req->num_items : 0;
+
+        int was_empty = sdslen(conn->outbuf) == 0;
+        conn->outbuf = sdscatlen(conn->outbuf, &reply, sizeof(reply));
+        if(reply.num_items) {
+            conn->outbuf = sdscatlen(conn->outbuf, recv, sizeof(fakernet_reg_acc_item)*reply.num_items);
+        }
+        if(was_empty) {
+            // Usually the whole thing fits in the socket buffer right away
+            write_handler(el, conn->fd, conn, AE_WRITABLE);
+            if(conn->fd != -1 && sdslen(conn->outbuf) > 0) {
+                aeCreateFileEvent(el, conn->fd, AE_WRITABLE, write_handler, conn);
+            }
+        }
+    }
+    // Not until now, so the connection can't get freed out from under this
+    conn->num_pending--;
+    free_conn_if_done(conn);
+}
+
+static Board* find_board(const char* name, size_t len) {
+    Board* board;
+    for(board = boards; board; board = board->next) {
+        if(strlen(board->name) == len && memcmp(board->name, name, len) == 0) {
+            return board;
+        }
+    }
+    board = calloc(1, sizeof(Board));
+    if(!board) {
+        return NULL;
+    }
+    board->name = malloc(len+1);
+    if(!board->name) {
+        free(board);
+        return NULL;
+    }
+    memcpy(board->name, name, len);
+    board->name[len] = '\0';
+    board->reconnect_timer = -1;
+    board->next = boards;
+    boards = board;
+    return board;
+}
+
+static void board_disconnect(Board* board) {
+    if(board->async) {
+        fnet_async_free(board->async);
+        board->async = NULL;
+    }
+    if(board->fnet_client) {
+        fnet_ctrl_close(board->fnet_client);
+        board->fnet_client = NULL;
+    }
+}
+
+static int board_connect(Board* board) {
+    const char* err_string = NULL;
+    int reliable = 1;
+
+    board->fnet_client = fnet_ctrl_connect(board->name, reliable, &err_string, NULL);
+    if(!board->fnet_client) {
+        daq_log(LOG_ERROR, "Could not get an access channel to %s: %s", board->name,
+                err_string ? err_string : strerror(errno));
+        return -1;
+    }
+    board->async = fnet_async_new(el, board->fnet_client);
+    if(!board->async) {
+        daq_log(LOG_ERROR, "Could not watch access channel to %s", board->name);
+        board_disconnect(board);
+        return -1;
+    }
+    daq_log(LOG_INFO, "Connected to %s", board->name);
+    return 0;
+}
+
+static void fail_requests(BrokerRequest* req, int result) {
+    while(req) {
+        BrokerRequest* next = req->next;
+        reply_to_request(req, result, NULL);
+        free(req);
+        req = next;
+    }
+}
+
+static int reconnect_proc(aeEventLoop* loop, long long id, void* privdata) {
+    (void) loop;
+    (void) id;
+    Board* board = privdata;
+    board->reconnect_timer = -1;
+    board_disconnect(board);
+    board_kick(board);
+    return AE_NOMORE;
+}
+
+static void batch_done(int result, const fakernet_reg_acc_item* recv, int num_items, void* privdata) {
+    (void) num_items;
+    Board* board = privdata;
+    BrokerRequest* batch = board->in_flight;
+    BrokerRequest* req;
+    int offset = 0;
+
+    board->in_flight = NULL;
+    if(result == -1 && batch && batch->attempts < MAX_ATTEMPTS) {
+        // Put the batch back at the front of the queue and get a new channel.
+        // That can't be done from in here, the FnetAsyncConn is still in use.
+        daq_log(LOG_WARN, "Access to %s was refused, reconnecting", board->name);
+        for(req = batch; req->next; req = req->next);
+        req->next = board->queue;
+        if(!board->queue) {
+            board->queue_tail = req;
+        }
+        board->queue = batch;
+        if(board->reconnect_timer == -1) {
+            board->reconnect_timer = aeCreateTimeEvent(el, 0, reconnect_proc, board, NULL);
+        }
+        return;
+    }
+
+    while(batch) {
+        req = batch;
+        batch = req->next;
+        reply_to_request(req, result, result > 0 ? recv + offset : NULL);
+        offset += req->num_items;
+        free(req);
+    }
+    if(result <= 0) {
+        // Nobody can say if a timed out packet was done or not, so it can't be
+        // re-sent, but the channel's sequence number probably isn't any good
+        // anymore (e.g. the FPGA was reset) so get a new one for what's next.
+        if(board->reconnect_timer == -1) {
+            board->reconnect_timer = aeCreateTimeEvent(el, 0, reconnect_proc, board, NULL);
+        }
+        return;
+    }
+    board_kick(board);
+}
+
+// Sends everything that's queued for the board that fits in one packet, if
+// there isn't already a packet in flight
+static void board_kick(Board* board) {
+    fakernet_reg_acc_item items[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    BrokerRequest* last = NULL;
+    int num_items = 0;
+
+    if(board->in_flight || !board->queue || board->reconnect_timer != -1) {
+        return;
+    }
+    if(!board->async && board_connect(board)) {
+        BrokerRequest* queue = board->queue;
+        board->queue = board->queue_tail = NULL;
+        fail_requests(queue, -1);
+        return;
+    }
+
+    // Requests are never split, so the 1-read latency still works out the
+    // same for each one as if it was sent on its own
+    while(board->queue && num_items + board->queue->num_items <= FAKERNET_REG_ACCESS_MAX_ITEMS) {
+        BrokerRequest* req = board->queue;
+        board->queue = req->next;
+        req->next = NULL;
+        req->attempts++;
+        memcpy(items + num_items, req->items, sizeof(fakernet_reg_acc_item)*req->num_items);
+        num_items += req->num_items;
+        if(last) {
+            last->next = req;
+        }
+        else {
+            board->in_flight = req;
+        }
+        last = req;
+    }
+    if(!board->queue) {
+        board->queue_tail = NULL;
+    }
+    board->num_packets++;
+    if(fnet_async_submit(board->async, items, num_items, batch_done, board)) {
+        batch_done(-1, NULL, num_items, board);
+    }
+}
+
+// Returns 1 if a request was taken off the front of the buffer, 0 if there
+// isn't a whole one yet, -1 if the client sent garbage.
+static int parse_request(BrokerConn* conn) {
+    FnetBrokerRequest header;
+    size_t len = sdslen(conn->inbuf);
+
+    if(len < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, conn->inbuf, sizeof(header));
+    if(header.magic != FNET_BROKER_MAGIC ||
+       header.board_len == 0 || header.board_len >= FNET_BROKER_MAX_BOARD_LEN ||
+       header.num_items == 0 || header.num_items > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+        return -1;
+    }
+    size_t total = sizeof(header) + header.board_len + sizeof(fakernet_reg_acc_item)*header.num_items;
+    if(len < total) {
+        return 0;
+    }
+
+    const char* board_name = conn->inbuf + sizeof(header);
+    Board* board = find_board(board_name, header.board_len);
+    BrokerRequest* req = malloc(sizeof(BrokerRequest));
+    if(!board || !req) {
+        free(req);
+        return -1;
+    }
+    req->conn = conn;
+    req->num_items = header.num_items;
+    req->attempts = 0;
+    req->next = NULL;
+    memcpy(req->items, board_name + header.board_len, sizeof(fakernet_reg_acc_item)*req->num_items);
+    conn->num_pending++;
+    board->num_requests++;
+
+    if(board->queue_tail) {
+        board->queue_tail->next = req;
+    }
+    else {
+        board->queue = req;
+    }
+    board->queue_tail = req;
+
+    sdsrange(conn->inbuf, total, -1);
+    return 1;
+}
+
+static void read_handler(aeEventLoop* loop, int fd, void* privdata, int mask) {
+    (void) loop;
+    (void) mask;
+    BrokerConn* conn = privdata;
+    char buf[READ_CHUNK_SIZE];
+    Board* board;
+    int ret;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if(n <= 0) {
+        close_conn(conn);
+        return;
+    }
+    conn->inbuf = sdscatlen(conn->inbuf, buf, n);
+    while((ret = parse_request(conn)) == 1);
+    if(ret < 0) {
+        daq_log(LOG_WARN, "Malformed request, dropping client");
+        close_conn(conn);
+    }
+    // Kick after parsing everything so requests that came in together can
+    // share a packet
+    for(board = boards; board; board = board->next) {
+        board_kick(board);
+    }
+}
+
+static void accept_handler(aeEventLoop* loop, int fd, void* privdata, int mask) {
+    (void) loop;
+    (void) privdata;
+    (void) mask;
+    char err[ANET_ERR_LEN];
+
+    int cfd = anetUnixAccept(err, fd);
+    if(cfd == ANET_ERR) {
+        daq_log(LOG_WARN, "Accepting client connection: %s", err);
+        return;
+    }
+    BrokerConn* conn = malloc(sizeof(BrokerConn));
+    if(!conn) {
+        close(cfd);
+        return;
+    }
+    conn->fd = cfd;
+    conn->inbuf = sdsempty();
+    conn->outbuf = sdsempty();
+    conn->num_pending = 0;
+    anetNonBlock(NULL, cfd);
+    if(aeCreateFileEvent(el, cfd, AE_READABLE, read_handler, conn) == AE_ERR) {
+        daq_log(LOG_WARN, "Too many clients");
+        close(cfd);
+        sdsfree(conn->inbuf);
+        sdsfree(conn->outbuf);
+        free(conn);
+    }
+}
+
+static void sig_handler(int signum) {
+    (void) signum;
+    if(el) {
+        aeStop(el);
+    }
+}
+
+// Removes a socket left behind by a broker that didn't exit cleanly. Anything
+// that isn't a socket, or a socket another broker is listening on, is left
+// alone and the broker refuses to start.
+static int remove_stale_socket(const char* path) {
+    char err[ANET_ERR_LEN];
+    struct stat st;
+    int fd;
+
+    if(lstat(path, &st) < 0) {
+        if(errno == ENOENT) {
+            return 0;
+        }
+        daq_log(LOG_ERROR, "Could not stat %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if(!S_ISSOCK(st.st_mode)) {
+        daq_log(LOG_ERROR, "%s already exists and isn't a socket", path);
+        return -1;
+    }
+    fd = anetUnixConnect(err, path);
+    if(fd != ANET_ERR) {
+        close(fd);
+        daq_log(LOG_ERROR, "Another broker is already listening on %s", path);
+        return -1;
+    }
+    if(unlink(path) < 0) {
+        daq_log(LOG_ERROR, "Could not remove old socket %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void print_help_message(void) {
+    printf("fnet_broker [--sock path] [--log-rate " LOG_RATE_OPTION_HELP "] [--verbose]\n"
+           "Does register accesses over a reliable access channel for local clients.\n"
+           "\t--sock -s\tUnix socket to listen on, '%s' by default.\n"
+           "\t--log-rate -L\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). ERRORs aren't limited by default.\n"
+           "\t--verbose -v\tPrint debug messages.\n"
+           "\t--help -h\tDisplay this message\n", FNET_BROKER_DEFAULT_SOCK);
+}
+
+int main(int argc, char** argv) {
+    char err[ANET_ERR_LEN];
+    int verbosity_stdout = LOG_INFO;
+    int opt;
+    int optindex;
+    Board* board;
+    struct option clargs[] = {
+        {"sock", required_argument, NULL, 's'},
+        {"log-rate", required_argument, NULL, 'L'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        { 0, 0, 0, 0}};
+
+    while((opt = getopt_long(argc, argv, "s:L:vh", clargs, &optindex)) != -1) {
+        switch(opt) {
+            case 's':
+                sock_path = optarg;
+                break;
+            case 'L':
+                if(daq_log_parse_rate_limit(optarg)) {
+                    printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                verbosity_stdout = LOG_DEBUG;
+                break;
+            case 'h':
+                print_help_message();
+                return 0;
+            default:
+                print_help_message();
+                return 1;
+        }
+    }
+
+    setup_logger(LOGGER_NAME, DEFAULT_REDIS_HOST, LOG_FILENAME,
+                 verbosity_stdout, LOG_INFO, LOG_WARN, LOG_MESSAGE_MAX);
+    the_logger->add_newlines = 1;
+
+    el = aeCreateEventLoop(MAX_CLIENTS);
+    if(!el) {
+        daq_log(LOG_ERROR, "Could not create event loop");
+        return 1;
+    }
+    if(remove_stale_socket(sock_path)) {
+        return 1;
+    }
+    int listen_fd = anetUnixServer(err, (char*)sock_path, SOCK_PERMS, 64);
+    if(listen_fd == ANET_ERR) {
+        daq_log(LOG_ERROR, "Could not listen on %s: %s", sock_path, err);
+        return 1;
+    }
+    anetNonBlock(NULL, listen_fd);
+    if(aeCreateFileEvent(el, listen_fd, AE_READABLE, accept_handler, NULL) == AE_ERR) {
+        daq_log(LOG_ERROR, "Could not watch %s", sock_path);
+        return 1;
+    }
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGPIPE, SIG_IGN);
+    daq_log(LOG_INFO, "Listening on %s", sock_path);
+
+    aeMain(el);
+
+    for(board = boards; board; board = board->next) {
+        daq_log(LOG_INFO, "%s: %llu requests in %llu packets", board->name,
+                board->num_requests, board->num_packets);
+        board_disconnect(board);
+    }
+    close(listen_fd);
+    unlink(sock_path);
+    aeDeleteEventLoop(el);
+    cleanup_logger();
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef __FNET_BROKER__
+#define __FNET_BROKER__
+#include <inttypes.h>
+#include "fakernet.h"
+
+// fnet_broker is a local daemon that owns one reliable (sequenced) UDP access
+// channel per FPGA and does register accesses on it for any number of local
+// processes, which talk to it over a Unix socket.
+// That way the data builders' TCP resets and the servers' writes can't
+// interleave on the shared first port, non-idempotent accesses are only ever
+// done once, and nobody pays the reconnect cost.
+//
+// Requests for the same board are done in the order they arrive. Requests
+// that are waiting while the board is busy get packed into the same UDP
+// packet (up to FAKERNET_REG_ACCESS_MAX_ITEMS items) but never split, so each
+// request still goes out as one contiguous run of accesses.
+//
+// Wire format, all header fields are in host byte order (it's a local
+// socket), the items are in network order same as fnet_ctrl_get_send_recv_bufs:
+//  Request:  FnetBrokerRequest, 'board_len' bytes of the board's hostname
+//            (HOSTNAME or HOSTNAME:PORT, not NUL terminated), 'num_items' items
+//  Reply:    FnetBrokerReply, then 'num_items' items (0 if it failed)
+#define FNET_BROKER_DEFAULT_SOCK "/tmp/fnet_broker.sock"
+#define FNET_BROKER_MAGIC 0x464E4252 // "FNBR"
+#define FNET_BROKER_MAX_BOARD_LEN 256
+
+typedef struct FnetBrokerRequest {
+    uint32_t magic;
+    uint32_t board_len;
+    uint32_t num_items;
+} FnetBrokerRequest;
+
+typedef struct FnetBrokerReply {
+    uint32_t magic;
+    int32_t result; // Same meaning as fnet_ctrl_send_recv_regacc's return value
+    uint32_t num_items;
+} FnetBrokerReply;
+
+// Client side, a blocking connection to the broker for one board
+typedef struct FnetBrokerClient {
+    int fd;
+    char board[FNET_BROKER_MAX_BOARD_LEN];
+    fakernet_reg_acc_item send[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    fakernet_reg_acc_item recv[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    char last_error[256];
+} FnetBrokerClient;
+
+// Returns NULL if the broker isn't running. The broker only connects to the
+// board once the first request for it comes in.
+FnetBrokerClient* fnet_broker_connect(const char* sock_path, const char* board);
+void fnet_broker_close(FnetBrokerClient* client);
+// Same idea as fnet_ctrl_get_send_recv_bufs/fnet_ctrl_send_recv_regacc, fill
+// in 'send', then the responses end up in 'recv'. Returns 1 on success, 0 if
+// the FPGA didn't answer, -1 for any other failure.
+void fnet_broker_get_send_recv_bufs(FnetBrokerClient* client,
+                                    fakernet_reg_acc_item** send,
+                                    fakernet_reg_acc_item** recv);
+int fnet_broker_send_recv_regacc(FnetBrokerClient* client, int num_items);
+const char* fnet_broker_last_error(FnetBrokerClient* client);
+#endif
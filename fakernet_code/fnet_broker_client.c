@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fnet_client.h"
+#include "fnet_broker.h"
+
+static int write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while(len > 0) {
+        // No SIGPIPE if the broker has gone away, just an error
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+FnetBrokerClient* fnet_broker_connect(const char* sock_path, const char* board) {
+    struct sockaddr_un sa;
+    FnetBrokerClient* client;
+
+    if(strlen(board) >= FNET_BROKER_MAX_BOARD_LEN || strlen(sock_path) >= sizeof(sa.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    client = calloc(1, sizeof(FnetBrokerClient));
+    if(!client) {
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(client->fd < 0) {
+        free(client);
+        return NULL;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, sock_path);
+    if(connect(client->fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(client->fd);
+        free(client);
+        return NULL;
+    }
+    strcpy(client->board, board);
+    return client;
+}
+
+void fnet_broker_close(FnetBrokerClient* client) {
+    if(!client) {
+        return;
+    }
+    close(client->fd);
+    free(client);
+}
+
+void fnet_broker_get_send_recv_bufs(FnetBrokerClient* client,
+                                    fakernet_reg_acc_item** send,
+                                    fakernet_reg_acc_item** recv) {
+    if(send) {
+        *send = client->send;
+    }
+    if(recv) {
+        *recv = client->recv;
+    }
+}
+
+int fnet_broker_send_recv_regacc(FnetBrokerClient* client, int num_items) {
+    FnetBrokerRequest request;
+    FnetBrokerReply reply;
+
+    if(num_items <= 0 || num_items > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+        snprintf(client->last_error, sizeof(client->last_error), "Invalid number of items %i", num_items);
+        return -1;
+    }
+    request.magic = FNET_BROKER_MAGIC;
+    request.board_len = strlen(client->board);
+    request.num_items = num_items;
+
+    if(write_all(client->fd, &request, sizeof(request)) ||
+       write_all(client->fd, client->board, request.board_len) ||
+       write_all(client->fd, client->send, sizeof(fakernet_reg_acc_item)*num_items)) {
+        snprintf(client->last_error, sizeof(client->last_error), "Error sending to broker: %s", strerror(errno));
+        return -1;
+    }
+
+    if(read_all(client->fd, &reply, sizeof(reply))) {
+        snprintf(client->last_error, sizeof(client->last_error), "Lost connection to broker");
+        return -1;
+    }
+    if(reply.magic != FNET_BROKER_MAGIC || reply.num_items > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+        snprintf(client->last_error, sizeof(client->last_error), "Malformed reply from broker");
+        return -1;
+    }
+    if(read_all(client->fd, client->recv, sizeof(fakernet_reg_acc_item)*reply.num_items)) {
+        snprintf(client->last_error, sizeof(client->last_error), "Lost connection to broker");
+        return -1;
+    }
+    if(reply.result == 0) {
+        snprintf(client->last_error, sizeof(client->last_error), "FPGA did not respond");
+    }
+    else if(reply.result == FNET_CTRL_ASYNC_RESEND_FAILED) {
+        snprintf(client->last_error, sizeof(client->last_error), "Broker lost the access part way, it may or may not have been done");
+    }
+    else if(reply.result < 0) {
+        snprintf(client->last_error, sizeof(client->last_error), "Broker could not do the access");
+    }
+    return reply.result;
+}
+
+const char* fnet_broker_last_error(FnetBrokerClient* client) {
+    return client->last_error;
+}
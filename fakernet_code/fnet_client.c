@@ -63,6 +63,13 @@ struct fnet_ctrl_client
   /* Statistics. */
   fnet_ctrl_client_stats _stats;
 
+  /* State of an asynchronous request in flight (if _async_pending). */
+  int _async_pending;
+  int _async_num_items;
+  int _async_attempt;
+  fnet_ctrl_async_done_func _async_done;
+  void *_async_privdata;
+
   /* Buffers for send and receive UDP packets. */
   char _buf_send[sizeof (fakernet_reg_access) +
          FAKERNET_REG_ACCESS_MAX_ITEMS *
@@ -721,6 +728,12 @@ struct fnet_ctrl_client *fnet_ctrl_alloc_client(void)
 
   memset(&client->_stats, 0, sizeof (client->_stats));
 
+  client->_async_pending = 0;
+  client->_async_num_items = 0;
+  client->_async_attempt = 0;
+  client->_async_done = NULL;
+  client->_async_privdata = NULL;
+
   return client;
 }
 
@@ -907,8 +920,11 @@ void fnet_ctrl_get_send_recv_bufs(struct fnet_ctrl_client *client,
 
 /*************************************************************************/
 
+__thread long long fnet_ctrl_wait_usec = 0;
+
 int fnet_ctrl_send_recv_regacc(struct fnet_ctrl_client *client, int num_items) {
     fakernet_reg_access *regacc = (fakernet_reg_access *) client->_buf_send;
+    struct timeval t_start, t_end;
     int ret;
 
     regacc->sequence_request =
@@ -916,10 +932,14 @@ int fnet_ctrl_send_recv_regacc(struct fnet_ctrl_client *client, int num_items) {
                     (FAKERNET_SEQ_SEQUENCE_MASK |
                      FAKERNET_SEQ_REQ_ARM_USER_CODE_MASK)));
 
+    gettimeofday(&t_start, NULL);
     ret =
         fnet_send_recv_packet(client, num_items,
                 1 /* resend */, MAX_ATTEMPTS,
                 fnet_check_reg_access_reply);
+    gettimeofday(&t_end, NULL);
+    fnet_ctrl_wait_usec += (t_end.tv_sec - t_start.tv_sec)*1000000LL +
+                           (t_end.tv_usec - t_start.tv_usec);
 
     if (ret >= 1)
         client->_sequence_number++;
@@ -1066,3 +1086,254 @@ fnet_ctrl_client_stats *fnet_ctrl_get_stats(struct fnet_ctrl_client *client)
 }
 
 /*************************************************************************/
+
+int fnet_ctrl_get_fd(struct fnet_ctrl_client *client)
+{
+  return client->_fd;
+}
+
+/*************************************************************************/
+
+/* Asynchronous access.
+ *
+ * Same packet handling as fnet_send_recv_packet() with
+ * fnet_check_reg_access_reply(), but split such that the caller's
+ * event loop does the waiting:
+ *
+ *  fnet_ctrl_send_regacc_async
+ *  +- drain old packets, sendto
+ *  (fd readable)
+ *  fnet_ctrl_async_recv
+ *  +- recvfrom, fnet_check_reg_access_reply
+ *     -> done (1 / -1)
+ *  (timeout)
+ *  fnet_ctrl_async_timeout
+ *  +- sendto (again)
+ *     -> done (0) after MAX_ATTEMPTS
+ */
+
+static void fnet_ctrl_async_finish(struct fnet_ctrl_client *client, int ret)
+{
+  fnet_ctrl_async_done_func done = client->_async_done;
+  void *privdata = client->_async_privdata;
+
+  if (ret >= 1)
+    client->_sequence_number++;
+
+  client->_stats.reg_requests++;
+
+  client->_async_pending = 0;
+  client->_async_done = NULL;
+  client->_async_privdata = NULL;
+
+  /* Called last, the callback may well submit the next request. */
+  if (done)
+    done(client, ret, privdata);
+}
+
+static int fnet_ctrl_async_sendto(struct fnet_ctrl_client *client)
+{
+  size_t len_send =
+    sizeof (fakernet_reg_access) +
+    client->_async_num_items * sizeof (fakernet_reg_acc_item);
+  ssize_t n;
+
+  for ( ; ; )
+    {
+      n = sendto(client->_fd, client->_buf_send, len_send, 0,
+         (struct sockaddr *) &client->_serv_addr,
+         (socklen_t) client->_addrlen);
+
+      if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("sendto");
+      return -1;
+    }
+      return 0;
+    }
+}
+
+int fnet_ctrl_send_regacc_async(struct fnet_ctrl_client *client,
+                int num_items,
+                fnet_ctrl_async_done_func done,
+                void *privdata)
+{
+  fakernet_reg_access *regacc = (fakernet_reg_access *) client->_buf_send;
+  struct sockaddr *recv_addr = (struct sockaddr *) &client->_recv_addr;
+  socklen_t recv_addr_len;
+
+  if (client->_async_pending)
+    {
+      FNET_CTRL_ERROR("Asynchronous request already in flight.");
+      errno = EBUSY;
+      return -1;
+    }
+
+  regacc->status_udp_channels = htons(0);
+  regacc->status_tcp = htons(0);
+  regacc->sequence_response = htons(0);
+  regacc->sequence_request =
+    htons((uint16_t) ((client->_sequence_number) &
+              (FAKERNET_SEQ_SEQUENCE_MASK |
+               FAKERNET_SEQ_REQ_ARM_USER_CODE_MASK)));
+
+  /* Since we only read one packet per send, first make sure there are
+   * no old packets in the queue.
+   */
+  for ( ; ; )
+    {
+      recv_addr_len = (socklen_t) client->_addrlen;
+
+      if (recvfrom(client->_fd, client->_buf_recv,
+           sizeof (client->_buf_recv), MSG_DONTWAIT,
+           recv_addr, &recv_addr_len) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+      FNET_CTRL_DEBUG("dropped old packet before async send");
+    }
+
+  client->_async_num_items = num_items;
+  client->_async_attempt = 0;
+  client->_async_done = done;
+  client->_async_privdata = privdata;
+
+  if (fnet_ctrl_async_sendto(client))
+    {
+      client->_async_done = NULL;
+      client->_async_privdata = NULL;
+      return -1;
+    }
+
+  client->_async_pending = 1;
+  return 0;
+}
+
+int fnet_ctrl_async_recv(struct fnet_ctrl_client *client)
+{
+  struct sockaddr *recv_addr = (struct sockaddr *) &client->_recv_addr;
+  const struct sockaddr_in *addr_in =
+    (const struct sockaddr_in *) &client->_serv_addr;
+  socklen_t recv_addr_len;
+  size_t len_send;
+  ssize_t n;
+  int ret;
+
+  if (!client->_async_pending)
+    {
+      /* Late reply to something that already timed out.  Drop it. */
+      for ( ; ; )
+    {
+      recv_addr_len = (socklen_t) client->_addrlen;
+      n = recvfrom(client->_fd, client->_buf_recv,
+               sizeof (client->_buf_recv), MSG_DONTWAIT,
+               recv_addr, &recv_addr_len);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == -1)
+        return 0;
+    }
+    }
+
+  len_send =
+    sizeof (fakernet_reg_access) +
+    client->_async_num_items * sizeof (fakernet_reg_acc_item);
+
+  for ( ; ; )
+    {
+      recv_addr_len = (socklen_t) client->_addrlen;
+
+      n = recvfrom(client->_fd, client->_buf_recv,
+           sizeof (client->_buf_recv), MSG_DONTWAIT,
+           recv_addr, &recv_addr_len);
+
+      if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("recvfrom");
+      return 0;
+    }
+
+      /* Check that the source address and port is correct. */
+      if (recv_addr_len != client->_addrlen ||
+      recv_addr->sa_family != AF_INET)
+    {
+      FNET_CTRL_DEBUG("wrong/unknown address of async reply");
+      continue;
+    }
+      {
+    struct sockaddr_in *addr_recv_in = (struct sockaddr_in *) recv_addr;
+
+    if (addr_recv_in->sin_addr.s_addr != addr_in->sin_addr.s_addr ||
+        addr_recv_in->sin_port != addr_in->sin_port)
+      {
+        FNET_CTRL_DEBUG("got spurious async reply from "
+                "wrong address/port");
+        continue;
+      }
+      }
+
+      ret = fnet_check_reg_access_reply(client,
+                    client->_buf_send, len_send,
+                    client->_buf_recv, (size_t) n);
+
+      if (ret == 0)
+    {
+      FNET_CTRL_DEBUG("malformed reply");
+      client->_stats.malformed_packet++;
+      continue;
+    }
+
+      fnet_ctrl_async_finish(client, ret < 0 ? -1 : 1);
+      return 1;
+    }
+}
+
+int fnet_ctrl_async_timeout(struct fnet_ctrl_client *client)
+{
+  if (!client->_async_pending)
+    return 0;
+
+  client->_stats.recv_timeout++;
+
+  if (++client->_async_attempt >= MAX_ATTEMPTS)
+    {
+      FNET_CTRL_ERROR("Access failed despite repeated attempts.");
+      errno = ETIMEDOUT;
+      fnet_ctrl_async_finish(client, 0);
+      return 1;
+    }
+
+  FNET_CTRL_DEBUG("async timeout, resend (attempt %d)",
+          client->_async_attempt);
+
+  /* Same sequence number, so the performer does not redo the access
+   * if it was only the response that got lost.
+   */
+  if (fnet_ctrl_async_sendto(client))
+    {
+      fnet_ctrl_async_finish(client, FNET_CTRL_ASYNC_RESEND_FAILED);
+      return 1;
+    }
+  return 0;
+}
+
+int fnet_ctrl_async_pending(struct fnet_ctrl_client *client)
+{
+  return client->_async_pending;
+}
+
+int fnet_ctrl_async_attempt_timeout_usec(struct fnet_ctrl_client *client)
+{
+  (void) client;
+  /* Same as the receive timeout of the blocking access. */
+  return 10000;
+}
+
+/*************************************************************************/
@@ -158,6 +158,66 @@ void fnet_ctrl_get_send_recv_bufs(struct fnet_ctrl_client *client,
 int fnet_ctrl_send_recv_regacc(struct fnet_ctrl_client *client,
 			       int num_items);
 
+/* Total time the calling thread has spent blocked waiting for the FPGA,
+ * in microseconds.  fnet_ctrl_send_recv_regacc() adds to it, and so do
+ * users that wait for asynchronous requests themselves.  The servers use
+ * it to split command latency into UDP wait and processing time.
+ */
+
+extern __thread long long fnet_ctrl_wait_usec;
+
+/*************************************************************************/
+
+/* Asynchronous version of fnet_ctrl_send_recv_regacc(), for use with
+ * an event loop.
+ *
+ * The request is prepared in the same buffers.  The request is sent
+ * right away, after which the caller shall call
+ * fnet_ctrl_async_recv() when the file descriptor (fnet_ctrl_get_fd())
+ * is readable, and fnet_ctrl_async_timeout() each time
+ * fnet_ctrl_async_attempt_timeout_usec() has passed without a reply.
+ * Those retransmit as needed, and finally call @done with the same
+ * result value as fnet_ctrl_send_recv_regacc() would have returned:
+ *
+ *  1          success (responses are in the recv buffer).
+ *  0          failure, no response despite repeated attempts.
+ * -1          failure, refused by performer or socket error.
+ *              The request was not done.
+ * FNET_CTRL_ASYNC_RESEND_FAILED
+ *             failure, a retransmit could not be sent.  The first
+ *             attempt may or may not have been done, so it is not
+ *             safe to send the request again.
+ *
+ * Only one request may be in flight per client.  Blocking calls shall
+ * not be made while a request is in flight.
+ *
+ * Return value of fnet_ctrl_send_regacc_async():
+ *
+ *  0          request sent.
+ * -1          failure.  See errno.  @done will not be called.
+ *
+ * fnet_ctrl_async_recv() and fnet_ctrl_async_timeout() return 1 if
+ * the request finished (and @done was called), otherwise 0.
+ */
+
+#define FNET_CTRL_ASYNC_RESEND_FAILED  -2
+
+typedef void (*fnet_ctrl_async_done_func)(struct fnet_ctrl_client *client,
+					  int result, void *privdata);
+
+int fnet_ctrl_send_regacc_async(struct fnet_ctrl_client *client,
+				int num_items,
+				fnet_ctrl_async_done_func done,
+				void *privdata);
+
+int fnet_ctrl_async_recv(struct fnet_ctrl_client *client);
+
+int fnet_ctrl_async_timeout(struct fnet_ctrl_client *client);
+
+int fnet_ctrl_async_pending(struct fnet_ctrl_client *client);
+
+int fnet_ctrl_async_attempt_timeout_usec(struct fnet_ctrl_client *client);
+
 /*************************************************************************/
 
 /* Perform a UDP control to reset the TCP state.
@@ -36,6 +36,23 @@
 
 const uint32_t FONTUS_SAFE_READ_ADDRESS = TRIGGER_PIPELINE_ADDR;
 
+#define QSPI_FIFO_START 0x68 // TX then RX data registers
+#define QSPI_FIFO_END 0x70
+
+// Registers that only the server writes can be cached, see reg_cache.h
+const RegMapEntry fontus_register_map[] = {
+    {TRIGGER_PIPELINE_ADDR + 0x0,   TRIGGER_PIPELINE_ADDR + 0x4,   REG_RESET},
+    {TRIGGER_PIPELINE_ADDR + 0x8,   TRIGGER_PIPELINE_ADDR + 0x14,  REG_CONFIG}, // Pulser & kicker/LED lengths
+    {TRIGGER_PIPELINE_ADDR + 0x18,  TRIGGER_PIPELINE_ADDR + 0x2C,  REG_CONFIG}, // Auto trigger, multiplicity width, CNGS threshold
+    {TRIGGER_PIPELINE_ADDR + 0x30,  TRIGGER_PIPELINE_ADDR + 0x30C, REG_CONFIG}, // Thresholds, delays, gates, masks & enables
+    {TRIGGER_PIPELINE_ADDR + 0x804, TRIGGER_PIPELINE_ADDR + 0x808, REG_CONFIG}, // Build info
+    {GPIO0_AXI_ADDR,                GPIO0_AXI_ADDR + 0x8,          REG_CONFIG}, // Output ports
+    {RESET_GEN_AXI_ADDR,            RESET_GEN_AXI_ADDR + 0x1000,   REG_RESET},
+    {FONTUS_LMK_AXI_ADDR + QSPI_FIFO_START, FONTUS_LMK_AXI_ADDR + QSPI_FIFO_END, REG_FIFO},
+    {DAC_AXI_ADDR + QSPI_FIFO_START,        DAC_AXI_ADDR + QSPI_FIFO_END,        REG_FIFO},
+    {0, 0, REG_VOLATILE} // Must be last
+};
+
 struct FONTUS_IF {
     AXI_QSPI* lmk;
     AXI_QSPI* dac;
@@ -3,8 +3,10 @@
 #include "server_common.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include "reg_cache.h"
 
 extern ServerCommand fontus_commands[];
 extern const uint32_t FONTUS_SAFE_READ_ADDRESS;
+extern const RegMapEntry fontus_register_map[];
 
 #endif
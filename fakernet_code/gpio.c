@@ -34,3 +34,11 @@ uint32_t write_gpio_value(AXI_GPIO* gpio, int port_number, uint32_t data) {
     uint32_t port_offset = port_number*4;
     return write_addr(gpio->axi_addr, port_offset, data);
 }
+
+int batch_read_gpio_value(RegBatch* batch, AXI_GPIO* gpio, int input_port, int port_number, uint32_t* result) {
+    uint32_t port_offset = port_number*4;
+    if(input_port) {
+        port_offset |= 1<<11;
+    }
+    return reg_batch_read(batch, gpio->axi_addr, port_offset, result);
+}
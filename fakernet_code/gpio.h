@@ -2,6 +2,7 @@
 #define __GPIO__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
 
 typedef struct AXI_GPIO {
     const char* name;
@@ -11,4 +12,5 @@ typedef struct AXI_GPIO {
 AXI_GPIO* new_gpio(const char* name, uint32_t axi_addr);
 uint32_t read_gpio_value(AXI_GPIO* gpio, int output_port, int port_number);
 uint32_t write_gpio_value(AXI_GPIO* gpio, int port_number, uint32_t data);
+int batch_read_gpio_value(RegBatch* batch, AXI_GPIO* gpio, int input_port, int port_number, uint32_t* result);
 #endif
@@ -33,41 +33,38 @@ uint32_t iic_read(AXI_IIC* iic, uint32_t addr) {
     return ret;
 }
 
+int batch_iic_write(RegBatch* batch, AXI_IIC* iic, uint32_t addr, uint32_t data) {
+    return reg_batch_write(batch, iic->axi_addr, addr, data);
+}
+
+int batch_iic_read(RegBatch* batch, AXI_IIC* iic, uint32_t addr, uint32_t* result) {
+    return reg_batch_read(batch, iic->axi_addr, addr, result);
+}
+
 // This is always a single byte read
 uint32_t read_iic_bus(AXI_IIC* iic, uint8_t iic_addr) {
+    RegBatch batch;
+    reg_batch_init(&batch);
 
     // May as well set the RX_FIFO_PIRQ to max (0xF) (PIRQ = Programmable Interrupt btw)
     // If the Rx FIFO reaches the PIRQ value in interrupt (if enabled) is emitted
-    if(iic_write(iic, IIC_PIRQ_OFFSET, 0xF)) {
-        printf("Error with first write to IIC PIRQ reg\n");
-        return 0;
-    }
-
-
-    if(iic_write(iic, IIC_CR_OFFSET, 0x2)) {
-        printf("ERROR with first write to IIC CR\n");
-        return 0;
-
-    }
-    if(iic_write(iic, IIC_CR_OFFSET, 0x9)) {
-        printf("ERROR with second write to IIC CR\n");
-        return 0;
-    }
+    batch_iic_write(&batch, iic, IIC_PIRQ_OFFSET, 0xF);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x2);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x9);
 
     iic_addr = iic_addr & 0xFF;
     uint32_t write_value = iic_addr | 1<<8 | 1<<0; // Set bit8 to send a "start" IIC, bit 0 for a READ
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, write_value)) {
-        printf("ERROR with first write to IIC TX FIFO\n");
-        return 0;
-    }
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, write_value);
 
     // TODO include rw_size here
     write_value = 1<<9 | 1;
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, write_value)) {
-        printf("ERROR with second write to TX FIFO\n");
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, write_value);
+    if(commit_reg_batch(&batch)) {
+        printf("ERROR with writes to IIC for read_iic_bus\n");
         return 0;
-
     }
+    // The read is done separately (not part of the batch) so the IIC core has
+    // time to actually do the bus transaction.
     return iic_read(iic, IIC_RX_FIFO_OFFSET);
 }
 
@@ -81,46 +78,29 @@ uint32_t write_iic_gpio(AXI_IIC* iic, uint32_t value) {
 
 // This is always a single byte write
 uint32_t write_iic_bus(AXI_IIC* iic, uint8_t iic_addr, uint8_t iic_value) {
-    int err_loc = 0;
-    if(iic_write(iic, IIC_PIRQ_OFFSET, 0xF)) {
-        printf("ERROR write_iic_bus_command: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
+    RegBatch batch;
+    reg_batch_init(&batch);
 
-    if(iic_write(iic, IIC_CR_OFFSET, 0x2)) {
-        printf("ERROR write_iic_bus_command: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
-
-    if(iic_write(iic, IIC_CR_OFFSET, 0x9)) {
-        printf("ERROR write_iic_bus_command: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
+    batch_iic_write(&batch, iic, IIC_PIRQ_OFFSET, 0xF);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x2);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x9);
 
     iic_addr = iic_addr & 0xFE; // Make sure bit 0 is unset, indicates a write
     uint32_t write_value = iic_addr | 1<<8; // Set bit8 to send a "start" IIC,
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, write_value)) {
-        printf("ERROR write_iic_bus_command: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, write_value);
 
     write_value = 1<<9 | iic_value;
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, write_value)) {
-        printf("ERROR write_iic_bus_command: %i\n", err_loc);
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, write_value);
+    if(commit_reg_batch(&batch)) {
+        printf("ERROR write_iic_bus_command\n");
         return -1;
     }
     return 0;
 }
 
 uint32_t read_iic_bus_with_reg(AXI_IIC* iic, uint8_t iic_addr, uint32_t reg_addr) {
-    uint8_t err_loc = 0;
     int i;
-    // May as well set the RX_FIFO_PIRQ to max (0xF) (PIRQ = Programmable Interrupt btw)
-    // If the Rx FIFO reaches the PIRQ value in interrupt (if enabled) is emitted
+    RegBatch batch;
 
     if(iic->data_size > 4) {
         printf("Cannot do IIC transaction with data more than 4-bytes, %i-bytes was requested\n", iic->data_size);
@@ -132,60 +112,32 @@ uint32_t read_iic_bus_with_reg(AXI_IIC* iic, uint8_t iic_addr, uint32_t reg_addr
         return 0;
     }
 
-
-    if(iic_write(iic, IIC_PIRQ_OFFSET, 0xF)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
+    reg_batch_init(&batch);
+    // May as well set the RX_FIFO_PIRQ to max (0xF) (PIRQ = Programmable Interrupt btw)
+    // If the Rx FIFO reaches the PIRQ value in interrupt (if enabled) is emitted
+    batch_iic_write(&batch, iic, IIC_PIRQ_OFFSET, 0xF);
 
     // First set the correct bits in the control register.
     // I believe the only necessary one is the IIC Enable bit (perhaps should do a TxReset though)
-    if(iic_write(iic, IIC_CR_OFFSET, 0x2)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
-
-    if(iic_write(iic, IIC_CR_OFFSET, 0x0)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
-
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, (iic_addr & 0xFE) | 1<<8)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x2);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x0);
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, (iic_addr & 0xFE) | 1<<8);
 
     for(i=(iic->reg_addr_size-1); i>= 0; i--) {
         // Grab the relevant byte from the reg_address, top bytes first
         uint8_t addr_val = (reg_addr & (0xFF << (i*8))) >> (i*8);
         printf("%i %u\n", i,  addr_val);
-        if(iic_write(iic, IIC_TX_FIFO_OFFSET, addr_val)) {
-            printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-            return 0;
-        }
+        batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, addr_val);
     }
 
-    err_loc++;
     // Repeated start with read bit set
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, iic_addr | 1<<8 | 1<<0)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, (1<<9) | iic->data_size)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, iic_addr | 1<<8 | 1<<0);
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, (1<<9) | iic->data_size);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x1);
+    if(commit_reg_batch(&batch)) {
+        printf("ERROR read_iic_bus_with_reg_command\n");
         return 0;
     }
-    err_loc++;
-    if(iic_write(iic, IIC_CR_OFFSET, 0x1)) {
-        printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-        return 0;
-    }
-    err_loc++;
 
     uint32_t data_val=0;
     for(i=0; i<iic->data_size; i++) {
@@ -196,48 +148,27 @@ uint32_t read_iic_bus_with_reg(AXI_IIC* iic, uint8_t iic_addr, uint32_t reg_addr
 }
 
 uint32_t write_iic_bus_with_reg(AXI_IIC* iic, uint8_t iic_addr, uint32_t reg_addr, uint32_t reg_value) {
-    uint8_t err_loc = 0;
     int i;
+    RegBatch batch;
+    reg_batch_init(&batch);
 
     // May as well set the RX_FIFO_PIRQ to max (0xF) (PIRQ = Programmable Interrupt btw)
     // If the Rx FIFO reaches the PIRQ value in interrupt (if enabled) is emitted
-    if(iic_write(iic, IIC_PIRQ_OFFSET, 0xF)) {
-        printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
+    batch_iic_write(&batch, iic, IIC_PIRQ_OFFSET, 0xF);
 
     // First set the correct bits in the control register.
     // I believe the only necessary one is the IIC Enable bit (perhaps should do a TxReset though)
-    if(iic_write(iic, IIC_CR_OFFSET, 0x2)) {
-        printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
-    if(iic_write(iic, IIC_CR_OFFSET, 0x0)) {
-        printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
-        return -1;
-    }
-    err_loc++;
-
-    if(iic_write(iic, IIC_TX_FIFO_OFFSET, (iic_addr & 0xFE) | 1<<8) ) {
-        printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
-        return -1;
-
-    }
-    err_loc++;
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x2);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x0);
+    batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, (iic_addr & 0xFE) | 1<<8);
 
     for(i=(iic->reg_addr_size-1); i>= 0; i--) {
         // Grab the relevant byte from the reg_address, top bytes first
         uint8_t addr_val = (reg_addr & (0xFF << (i*8))) >> (i*8);
         printf("Writing 0x%x\n", addr_val);
-        if(iic_write(iic, IIC_TX_FIFO_OFFSET, addr_val)) {
-            printf("ERROR read_iic_bus_with_reg_command: %i\n", err_loc);
-            return 0;
-        }
+        batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, addr_val);
     }
 
-    err_loc++;
     for(i=(iic->data_size-1); i>= 0; i--) {
         // Grab the relevant byte from the reg_value, top bytes first
        //uint32_t val = (reg_value & (0xFF << (i*8))) >> (i*8);
@@ -249,15 +180,12 @@ uint32_t write_iic_bus_with_reg(AXI_IIC* iic, uint8_t iic_addr, uint32_t reg_add
         }
 
         printf("Writing 0x%x\n", val);
-        if(iic_write(iic, IIC_TX_FIFO_OFFSET, val)) {
-            printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
-            return -1;
-        }
+        batch_iic_write(&batch, iic, IIC_TX_FIFO_OFFSET, val);
     }
 
-    err_loc++;
-    if(iic_write(iic, IIC_CR_OFFSET, 0x1) ) {
-        printf("ERROR write_iic_bus_with_reg: %i\n", err_loc);
+    batch_iic_write(&batch, iic, IIC_CR_OFFSET, 0x1);
+    if(commit_reg_batch(&batch)) {
+        printf("ERROR write_iic_bus_with_reg\n");
         return -1;
     }
     return 0;
@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include "fnet_client.h"
+#include "reg_batch.h"
 
 typedef struct AXI_IIC {
     const char* name;
@@ -14,6 +15,8 @@ typedef struct AXI_IIC {
 AXI_IIC* new_iic(const char* name, uint32_t axi_addr, int data_size, int reg_addr_size);
 uint32_t iic_read(AXI_IIC* iic, uint32_t addr);
 int iic_write(AXI_IIC* iic, uint32_t addr, uint32_t data);
+int batch_iic_write(RegBatch* batch, AXI_IIC* iic, uint32_t addr, uint32_t data);
+int batch_iic_read(RegBatch* batch, AXI_IIC* iic, uint32_t addr, uint32_t* result);
 uint32_t read_iic_bus(AXI_IIC* iic, uint8_t iic_addr);
 uint32_t write_iic_bus(AXI_IIC* iic, uint8_t iic_addr, uint8_t iic_value);
 uint32_t read_iic_gpio(AXI_IIC* iic);
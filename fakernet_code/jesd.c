@@ -5,7 +5,7 @@
 #include <unistd.h>
 #include "jesd.h"
 
-#define NUM_CHANNELS                         4
+#define NUM_CHANNELS                         JESD_NUM_LANES
 #define JESD_VERSION_OFFSET                  0x0
 #define JESD_RESET_OFFSET                    0x4
 #define JESD_ILA_SUPPORT_OFFSET              0x8
@@ -26,9 +26,6 @@
 # define JESD_ILA_WIDTH                      0x40
 #define JESD_ILA_ERROR_COUNT_OFFSET          0x24
 
-// SYNC STATUS BIT DEFNs
-#define JESD_SYNC_STATUS_SYNC_BIT 0x1
-#define JESD_SYNC_STATUS_SYSREF_BIT 0x10000
 
 int read_addr(uint32_t, uint32_t, uint32_t*);
 int double_read_addr(uint32_t, uint32_t, uint32_t*);
@@ -79,6 +76,14 @@ uint32_t write_jesd(AXI_JESD* jesd, uint32_t offset, uint32_t data) {
     return write_addr(jesd->axi_addr, offset, data);
 }
 
+int batch_read_jesd(RegBatch* batch, AXI_JESD* jesd, uint32_t offset, uint32_t* result) {
+    return reg_batch_read(batch, jesd->axi_addr, offset, result);
+}
+
+int batch_write_jesd(RegBatch* batch, AXI_JESD* jesd, uint32_t offset, uint32_t data) {
+    return reg_batch_write(batch, jesd->axi_addr, offset, data);
+}
+
 uint32_t jesd_reset(AXI_JESD* jesd) {
     return write_jesd(jesd, JESD_RESET_OFFSET, 0x1);
 }
@@ -111,10 +116,13 @@ uint32_t jesd_error_count(AXI_JESD* jesd, uint32_t *resp, int enable_error_repor
         }
     }
 
+    // Read all the channels in one go
+    RegBatch batch;
+    reg_batch_init(&batch);
     for(i=0; i < NUM_CHANNELS; i++) {
-        resp[i] = read_error_register(jesd, i);
+        batch_read_jesd(&batch, jesd, jesd_ila_offset(i) + JESD_ILA_ERROR_COUNT_OFFSET, &resp[i]);
     }
-    return 0;
+    return commit_reg_batch(&batch);
 }
 
 uint32_t jesd_read_error_rate(AXI_JESD* jesd, uint32_t *resp) {
@@ -127,9 +135,13 @@ uint32_t jesd_read_error_rate(AXI_JESD* jesd, uint32_t *resp) {
     if(!(error_reporting & ERROR_COUNTING_ENABLE)) {
         write_jesd(jesd, JESD_ERROR_REPORTING_OFFSET, error_reporting | ERROR_COUNTING_ENABLE);
     }
-    jesd_error_count(jesd, first, 0);
+    if(jesd_error_count(jesd, first, 0)) {
+        return -1;
+    }
     usleep(500e3);
-    jesd_error_count(jesd, second, 0);
+    if(jesd_error_count(jesd, second, 0)) {
+        return -1;
+    }
 
     for(i=0; i < NUM_CHANNELS; i++) {
         // Don't need to worry aobut rollover, since everything here is a 32-bit
@@ -139,6 +151,29 @@ uint32_t jesd_read_error_rate(AXI_JESD* jesd, uint32_t *resp) {
     return 0;
 }
 
+// Enables the error counters and turns off reporting errors with SYNC, the
+// same way scan_jesd_error_rate.py used to
+int batch_setup_jesd_error_counting(RegBatch* batch, AXI_JESD* jesd) {
+    const int ERROR_COUNTING_ENABLE = 0x1;
+    const int ERROR_SYNC_REPORT_DISABLE = 0x8;
+    return batch_write_jesd(batch, jesd, JESD_ERROR_REPORTING_OFFSET, ERROR_COUNTING_ENABLE | ERROR_SYNC_REPORT_DISABLE);
+}
+
+// 'results' must have room for JESD_NUM_LANES values
+int batch_read_jesd_error_counts(RegBatch* batch, AXI_JESD* jesd, uint32_t* results) {
+    int i;
+    for(i=0; i < NUM_CHANNELS; i++) {
+        if(batch_read_jesd(batch, jesd, jesd_ila_offset(i) + JESD_ILA_ERROR_COUNT_OFFSET, &results[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int batch_read_jesd_sync_status(RegBatch* batch, AXI_JESD* jesd, uint32_t* result) {
+    return batch_read_jesd(batch, jesd, JESD_SYNC_STATUS_OFFSET, result);
+}
+
 uint32_t jesd_is_synced(AXI_JESD* jesd) {
     uint32_t val = read_jesd(jesd, JESD_SYNC_STATUS_OFFSET);
     return (val & JESD_SYNC_STATUS_SYNC_BIT);
@@ -152,17 +187,23 @@ uint32_t read_jesd_buffer_delay(AXI_JESD* jesd) {
     return read_jesd(jesd, JESD_RX_BUFFER_DELAY_OFFSET);
 }
 
-struct ILA_Config_Data read_ila_config(AXI_JESD* jesd, unsigned int channel) {
+// Returns 0 on success, on failure 'ila_config' is left zeroed
+int read_ila_config(AXI_JESD* jesd, unsigned int channel, struct ILA_Config_Data* ila_config) {
     int i;
-    struct ILA_Config_Data ila_config;
-    memset(&ila_config, 0, sizeof(struct ILA_Config_Data));
+    memset(ila_config, 0, sizeof(struct ILA_Config_Data));
 
     uint32_t base = jesd_ila_offset(channel);
     if(!base) {
-        return ila_config;
+        return -1;
     }
+    RegBatch batch;
+    reg_batch_init(&batch);
     for(i=0; i < 13; i++) {
-        ila_config.data[i] = read_jesd(jesd, base + 0x4*i);
+        batch_read_jesd(&batch, jesd, base + 0x4*i, &ila_config->data[i]);
     }
-    return ila_config;
+    if(commit_reg_batch(&batch)) {
+        memset(ila_config, 0, sizeof(struct ILA_Config_Data));
+        return -1;
+    }
+    return 0;
 }
@@ -3,6 +3,13 @@
 #define __JESD__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
+
+#define JESD_NUM_LANES 4
+
+// SYNC STATUS BIT DEFNs
+#define JESD_SYNC_STATUS_SYNC_BIT 0x1
+#define JESD_SYNC_STATUS_SYSREF_BIT 0x10000
 
 typedef struct AXI_JESD {
     const char* name;
@@ -12,6 +19,8 @@ typedef struct AXI_JESD {
 AXI_JESD* new_jesd(const char* name, uint32_t axi_addr);
 uint32_t read_jesd(AXI_JESD* jesd, uint32_t offset);
 uint32_t write_jesd(AXI_JESD* jesd, uint32_t offset, uint32_t data);
+int batch_read_jesd(RegBatch* batch, AXI_JESD* jesd, uint32_t offset, uint32_t* result);
+int batch_write_jesd(RegBatch* batch, AXI_JESD* jesd, uint32_t offset, uint32_t data);
 uint32_t jesd_error_count(AXI_JESD* jesd, uint32_t* results, int enable_error_reporting);
 uint32_t jesd_read_error_rate(AXI_JESD* jesd, uint32_t* results);
 uint32_t jesd_reset(AXI_JESD* jesd);
@@ -20,4 +29,7 @@ uint32_t set_sync_error_reporting(AXI_JESD* jesd, uint32_t state);
 uint32_t read_jesd_buffer_delay(AXI_JESD* jesd);
 uint32_t write_jesd_buffer_delay(AXI_JESD* jesd, uint32_t value);
 uint32_t read_error_register(AXI_JESD* jesd, unsigned int channel);
+int batch_setup_jesd_error_counting(RegBatch* batch, AXI_JESD* jesd);
+int batch_read_jesd_error_counts(RegBatch* batch, AXI_JESD* jesd, uint32_t* results);
+int batch_read_jesd_sync_status(RegBatch* batch, AXI_JESD* jesd, uint32_t* result);
 #endif
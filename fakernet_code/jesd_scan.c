@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "jesd_scan.h"
+
+// Same as generic_sys_reset in ceres_if.c
+#define JESD_RESET_LENGTH 5000
+
+int commit_reg_batch(RegBatch* batch);
+
+static long long now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000LL + tv.tv_usec;
+}
+
+static int parse_values(JesdScanParam* param, const char* str, char* err, size_t err_len) {
+    const char* p = str;
+    char* end;
+
+    param->num_values = 0;
+    while(*p) {
+        uint32_t first = strtoul(p, &end, 0);
+        uint32_t last = first;
+        uint32_t value;
+        if(end == p) {
+            snprintf(err, err_len, "Bad value list '%s'", str);
+            return -1;
+        }
+        p = end;
+        if(*p == '-') {
+            p++;
+            last = strtoul(p, &end, 0);
+            if(end == p || last < first) {
+                snprintf(err, err_len, "Bad range in '%s'", str);
+                return -1;
+            }
+            p = end;
+        }
+        for(value = first; ; value++) {
+            if(param->num_values >= JESD_SCAN_MAX_VALUES) {
+                snprintf(err, err_len, "More than %i values in '%s'", JESD_SCAN_MAX_VALUES, str);
+                return -1;
+            }
+            param->values[param->num_values++] = value;
+            if(value == last) {
+                break;
+            }
+        }
+        if(*p == ',') {
+            p++;
+        }
+        else if(*p) {
+            snprintf(err, err_len, "Bad value list '%s'", str);
+            return -1;
+        }
+    }
+    if(param->num_values == 0) {
+        snprintf(err, err_len, "No values given");
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_param(JesdScanParam* param, const char* spec, char* err, size_t err_len) {
+    const char* p;
+    char* end;
+
+    if(strncmp(spec, "adc:", 4) == 0) {
+        param->type = JESD_SCAN_ADC;
+    }
+    else if(strncmp(spec, "jesd:", 5) == 0) {
+        param->type = JESD_SCAN_JESD;
+    }
+    else {
+        snprintf(err, err_len, "'%s' should start with 'adc:' or 'jesd:'", spec);
+        return -1;
+    }
+    p = strchr(spec, ':') + 1;
+    param->addr = strtoul(p, &end, 0);
+    if(end == p || *end != '=') {
+        snprintf(err, err_len, "'%s' should look like <adc|jesd>:<addr>=<values>", spec);
+        return -1;
+    }
+    return parse_values(param, end+1, err, err_len);
+}
+
+int jesd_scan_init(JesdScan* scan, int num_specs, char** specs, char* err, size_t err_len) {
+    int i;
+    memset(scan, 0, sizeof(JesdScan));
+    if(num_specs < 1 || num_specs > JESD_SCAN_MAX_PARAMS) {
+        snprintf(err, err_len, "Need between 1 and %i parameters", JESD_SCAN_MAX_PARAMS);
+        return -1;
+    }
+    scan->num_points = 1;
+    for(i=0; i<num_specs; i++) {
+        if(parse_param(&scan->params[i], specs[i], err, err_len)) {
+            return -1;
+        }
+        scan->num_points *= scan->params[i].num_values;
+        if(scan->num_points > JESD_SCAN_MAX_POINTS) {
+            snprintf(err, err_len, "More than %i points", JESD_SCAN_MAX_POINTS);
+            return -1;
+        }
+    }
+    scan->num_params = num_specs;
+    return 0;
+}
+
+static int write_settings(JesdScan* scan, int* index, JesdScanTargets* targets) {
+    SpiStep steps[JESD_SCAN_MAX_PARAMS];
+    int status[JESD_SCAN_MAX_PARAMS];
+    SpiProgram program = {steps, 0};
+    SpiTargets spi_targets;
+    RegBatch batch;
+    int i, j;
+
+    reg_batch_init(&batch);
+    for(i=0; i<scan->num_params; i++) {
+        JesdScanParam* param = &scan->params[i];
+        uint32_t value = param->values[index[i]];
+        if(scan->have_last && scan->last_index[i] == index[i]) {
+            continue;
+        }
+        if(param->type == JESD_SCAN_ADC) {
+            memset(&steps[program.num_steps], 0, sizeof(SpiStep));
+            steps[program.num_steps].type = SPI_STEP_WRITE;
+            steps[program.num_steps].device = SPI_DEVICE_ADS;
+            steps[program.num_steps].addr = param->addr;
+            steps[program.num_steps].value = value;
+            program.num_steps++;
+        }
+        else {
+            for(j=0; j<targets->num_jesds; j++) {
+                batch_write_jesd(&batch, targets->jesds[j], param->addr, value);
+            }
+        }
+    }
+
+    if(program.num_steps > 0) {
+        memset(&spi_targets, 0, sizeof(spi_targets));
+        for(j=0; j<targets->num_jesds; j++) {
+            spi_targets.adcs[spi_targets.num_adcs++] = targets->adcs[j];
+        }
+        if(spi_program_run(&program, &spi_targets, status)) {
+            scan->have_last = 0;
+            return -1;
+        }
+    }
+    if(batch.num_accesses > 0 && commit_reg_batch(&batch)) {
+        scan->have_last = 0;
+        return -1;
+    }
+    memcpy(scan->last_index, index, sizeof(int)*scan->num_params);
+    scan->have_last = 1;
+    return 0;
+}
+
+long jesd_scan_step(JesdScan* scan, int point, JesdScanStep step, JesdScanTargets* targets, long dwell_us, JesdScanResult* result) {
+    uint32_t sync_status[JESD_SCAN_MAX_JESDS];
+    int index[JESD_SCAN_MAX_PARAMS];
+    RegBatch batch;
+    int i, j;
+    int rest = point;
+
+    switch(step) {
+    case JESD_SCAN_STEP_WRITE:
+        memset(result, 0, sizeof(JesdScanResult));
+        for(i=scan->num_params-1; i>=0; i--) {
+            index[i] = rest % scan->params[i].num_values;
+            rest /= scan->params[i].num_values;
+            result->values[i] = scan->params[i].values[index[i]];
+        }
+
+        if(write_settings(scan, index, targets)) {
+            return -1;
+        }
+
+        // Reset the links so the new settings take effect
+        reg_batch_init(&batch);
+        batch_reset_gen_do_reset(&batch, targets->reset_gen, targets->jesd_reset_mask, JESD_RESET_LENGTH);
+        if(commit_reg_batch(&batch)) {
+            return -1;
+        }
+        return JESD_SCAN_SETTLE_US;
+
+    case JESD_SCAN_STEP_START:
+        // The reset might've cleared the error reporting settings, so set them
+        // every time, it's in the same packet as the first count anyways.
+        reg_batch_init(&batch);
+        for(j=0; j<targets->num_jesds; j++) {
+            batch_setup_jesd_error_counting(&batch, targets->jesds[j]);
+            batch_read_jesd_error_counts(&batch, targets->jesds[j], result->start_counts[j]);
+        }
+        if(commit_reg_batch(&batch)) {
+            return -1;
+        }
+        result->timestamp_us = now_us();
+        return dwell_us;
+
+    case JESD_SCAN_STEP_FINISH:
+        reg_batch_init(&batch);
+        for(j=0; j<targets->num_jesds; j++) {
+            batch_read_jesd_error_counts(&batch, targets->jesds[j], result->errors[j]);
+            batch_read_jesd_sync_status(&batch, targets->jesds[j], &sync_status[j]);
+        }
+        if(commit_reg_batch(&batch)) {
+            return -1;
+        }
+        result->dwell_us = now_us() - result->timestamp_us;
+
+        for(j=0; j<targets->num_jesds; j++) {
+            for(i=0; i<JESD_NUM_LANES; i++) {
+                // Unsigned subtraction works across a rollover
+                result->errors[j][i] -= result->start_counts[j][i];
+            }
+            if(sync_status[j] & JESD_SYNC_STATUS_SYNC_BIT) {
+                result->sync_mask |= 1<<j;
+            }
+        }
+        result->ok = 1;
+        return 0;
+    }
+    return -1;
+}
+
+int jesd_scan_point(JesdScan* scan, int point, JesdScanTargets* targets, long dwell_us, JesdScanResult* result) {
+    JesdScanStep step;
+    long wait_us;
+
+    for(step=JESD_SCAN_STEP_WRITE; step<=JESD_SCAN_STEP_FINISH; step++) {
+        wait_us = jesd_scan_step(scan, point, step, targets, dwell_us, result);
+        if(wait_us < 0) {
+            return -1;
+        }
+        if(wait_us > 0) {
+            usleep(wait_us);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __JESD_SCAN__
+#define __JESD_SCAN__
+#include <inttypes.h>
+#include <stdlib.h>
+#include "jesd.h"
+#include "reset_gen_if.h"
+#include "spi_program.h"
+
+// Sweeps ADC SPI registers and/or JESD core registers over a grid of values
+// and measures the JESD lane error rate at each point, the server side version
+// of scan_jesd_error_rate.py and friends.
+// Each parameter is given as "<adc|jesd>:<addr>=<values>", where values is a
+// comma separated list of numbers and/or "first-last" ranges, e.g.
+//      adc:0x6A001B=0,32,64,96
+//      jesd:0x30=30-50
+// ADC parameters are written (over SPI) to every ADC being scanned, JESD
+// parameters are written to the JESD core of every ADC being scanned.
+// The grid is every combination of the values, the last parameter changes
+// fastest. At each point only the parameters that changed get written.
+#define JESD_SCAN_MAX_PARAMS 8
+#define JESD_SCAN_MAX_VALUES 256
+#define JESD_SCAN_MAX_POINTS 100000
+#define JESD_SCAN_MAX_JESDS 4
+// How long to let the links come back after the JESD reset before counting
+#define JESD_SCAN_SETTLE_US 100000
+
+typedef enum JesdScanParamType {
+    JESD_SCAN_ADC=0,
+    JESD_SCAN_JESD
+} JesdScanParamType;
+
+typedef struct JesdScanParam {
+    JesdScanParamType type;
+    uint32_t addr;
+    uint32_t values[JESD_SCAN_MAX_VALUES];
+    int num_values;
+} JesdScanParam;
+
+typedef struct JesdScan {
+    JesdScanParam params[JESD_SCAN_MAX_PARAMS];
+    int num_params;
+    int num_points;
+    // What's currently written, so unchanged parameters can be skipped
+    int last_index[JESD_SCAN_MAX_PARAMS];
+    int have_last;
+} JesdScan;
+
+typedef struct JesdScanTargets {
+    AXI_JESD* jesds[JESD_SCAN_MAX_JESDS];
+    AXI_QSPI* adcs[JESD_SCAN_MAX_JESDS]; // adcs[i] feeds jesds[i]
+    int num_jesds;
+    AXI_RESET_GEN* reset_gen;
+    uint32_t jesd_reset_mask; // Reset gen mask for the JESD cores
+} JesdScanTargets;
+
+typedef struct JesdScanResult {
+    int ok;
+    long long timestamp_us; // Unix time the error counting started at
+    long long dwell_us; // How long errors were actually counted for
+    uint32_t values[JESD_SCAN_MAX_PARAMS];
+    uint32_t sync_mask; // Bit i set if jesds[i] was synced at the end
+    uint32_t errors[JESD_SCAN_MAX_JESDS][JESD_NUM_LANES];
+    uint32_t start_counts[JESD_SCAN_MAX_JESDS][JESD_NUM_LANES]; // Used between steps
+} JesdScanResult;
+
+// A grid point is done in steps so the caller can wait out the settling and
+// dwell times without blocking, in order:
+typedef enum JesdScanStep {
+    JESD_SCAN_STEP_WRITE=0, // Write the settings and reset the JESD cores
+    JESD_SCAN_STEP_START,   // Start counting errors
+    JESD_SCAN_STEP_FINISH   // Read the error counts and sync status
+} JesdScanStep;
+
+// Returns 0 on success, otherwise fills in 'err'
+int jesd_scan_init(JesdScan* scan, int num_specs, char** specs, char* err, size_t err_len);
+// Writes the settings for grid point 'point', resets the JESD cores, and
+// counts errors for 'dwell_us' on the active FPGA.
+int jesd_scan_point(JesdScan* scan, int point, JesdScanTargets* targets, long dwell_us, JesdScanResult* result);
+// Does one step of grid point 'point' on the active FPGA, 'result' has to be
+// the same for every step of a point. Returns how many microseconds to wait
+// before the next step, 0 after the last one, or -1 on failure.
+long jesd_scan_step(JesdScan* scan, int point, JesdScanStep step, JesdScanTargets* targets, long dwell_us, JesdScanResult* result);
+#endif
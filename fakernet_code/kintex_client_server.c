@@ -18,6 +18,13 @@
 #include "fontus_if.h"
 #include "resp.h"
 #include "daq_logger.h"
+#include "reg_batch.h"
+#include "fnet_async.h"
+#include "poll_groups.h"
+#include "reg_cache.h"
+#include "reg_block.h"
+#include "tdc_align.h"
+#include "spi_program.h"
 
 #define BUFFER_SIZE 2048
 // The default IP address to try and communicate with FPGA at
@@ -41,6 +48,15 @@ int dummy_mode = 0;
 uint32_t SAFE_READ_ADDRESS;
 
 struct fnet_ctrl_client* fnet_client;
+// For register accesses that shouldn't block the server while waiting on the FPGA
+FnetAsyncConn* fnet_async = NULL;
+// Shadow copy of the config registers, see reg_cache.h
+RegCache* reg_cache = NULL;
+// While an EXEC is running single register writes are held here and go out
+// with the next read or batch, see flush_reg_writes
+static RegBatch deferred_writes;
+static int defer_writes = 0;
+static int deferred_write_failed = 0;
 char* fpga_cli_hint_str = NULL;
 
 char command_buffer[BUFFER_SIZE];
@@ -117,7 +133,11 @@ int read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
         *result = 0xDEADBEEF;
         return 0;
     }
+    if(flush_reg_writes()) {
+        return -1;
+    }
 
+    fnet_async_flush(fnet_async);
     fnet_ctrl_get_send_recv_bufs(fnet_client, &send, &recv);
 
     addr = base + addr;
@@ -147,11 +167,47 @@ int read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
 // A better solution would be to have a super-secret address that says just return
 // whatever the most recent read result was. Then I do a read from the desired address,
 // then I read from that super-secret address
+// With --slow-reads the two reads are done as separate round trips with a
+// sleep in between, the way it used to be done.
 int double_read_addr(uint32_t base, uint32_t addr, uint32_t* result) {
+    if(dummy_mode) {
+        *result = 0xDEADBEEF;
+        return 0;
+    }
+    if(deferred_writes.num_accesses > 0) {
+        // The read has to come after the held back writes, so it might as
+        // well go in the same packet
+        if(deferred_writes.num_accesses < REG_BATCH_MAX_ACCESSES) {
+            reg_batch_read(&deferred_writes, base, addr, result);
+            return flush_reg_writes();
+        }
+        if(flush_reg_writes()) {
+            return -1;
+        }
+    }
+    if(reg_cache_lookup(reg_cache, base + addr, result)) {
+        return 0;
+    }
 
-    read_addr(base, addr, result);
-    usleep(100);
-    return read_addr(SAFE_READ_ADDRESS, 0x0, result);
+    // Do both reads in one packet. The FPGA does them back to back, so there's
+    // no need to wait between them.
+    if(reg_batch_pipelined_reads) {
+        fnet_async_flush(fnet_async);
+        if(reg_read_pipelined(fnet_client, base + addr, SAFE_READ_ADDRESS, result)) {
+            return -1;
+        }
+    }
+    else {
+        if(read_addr(base, addr, result)) {
+            return -1;
+        }
+        usleep(100);
+        if(read_addr(SAFE_READ_ADDRESS, 0x0, result)) {
+            return -1;
+        }
+    }
+    reg_cache_fill(reg_cache, base + addr, *result);
+    return 0;
 }
 
 int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
@@ -160,6 +216,14 @@ int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
 
       if(dummy_mode) { return 0; }
 
+      if(defer_writes) {
+          if(deferred_writes.num_accesses >= REG_BATCH_MAX_ACCESSES && flush_reg_writes()) {
+              return -1;
+          }
+          return reg_batch_write(&deferred_writes, base, addr, data);
+      }
+
+      fnet_async_flush(fnet_async);
       addr = addr+base;
       fnet_ctrl_get_send_recv_bufs(fnet_client, &send, &recv);
 
@@ -172,15 +236,189 @@ int write_addr(uint32_t base, uint32_t addr, uint32_t data) {
       int ret = fnet_ctrl_send_recv_regacc(fnet_client, num_items);
       
       // Pretty sure "ret" will be the number of UDP reg-accs dones
-      if(ret == 0) {
+      if(ret <= 0) {
           printf("ERROR %i\n", ret);
           printf("%s\n", fnet_ctrl_last_error(fnet_client));
           printf("%s\n", strerror(errno));
+          // Might or might not have been written
+          reg_cache_invalidate(reg_cache, addr);
           return -1;
       }
+      reg_cache_write(reg_cache, addr, data);
       return 0;
 }
 
+int commit_reg_batch(RegBatch* batch) {
+    int i;
+    if(dummy_mode) {
+        for(i=0; i<batch->num_accesses; i++) {
+            if(batch->accesses[i].is_read && batch->accesses[i].result) {
+                *(batch->accesses[i].result) = 0xDEADBEEF;
+            }
+        }
+        reg_batch_init(batch);
+        return 0;
+    }
+    if(batch != &deferred_writes && deferred_writes.num_accesses > 0) {
+        // Send the held back writes first, in the same packets if they fit
+        if(reg_batch_append(&deferred_writes, batch) == 0) {
+            reg_batch_init(batch);
+            return flush_reg_writes();
+        }
+        if(flush_reg_writes()) {
+            return -1;
+        }
+    }
+    if(reg_cache_batch_lookup(reg_cache, batch)) {
+        return 0;
+    }
+    fnet_async_flush(fnet_async);
+    // Sending empties the batch
+    int num_accesses = batch->num_accesses;
+    int ret = reg_batch_send(fnet_client, batch, SAFE_READ_ADDRESS);
+    reg_cache_batch_done(reg_cache, batch->accesses, num_accesses, ret == 0);
+    return ret;
+}
+
+int flush_reg_writes(void) {
+    if(deferred_writes.num_accesses == 0) {
+        return 0;
+    }
+    if(commit_reg_batch(&deferred_writes)) {
+        // The commands that made these writes have already said they worked
+        deferred_write_failed = 1;
+        reg_batch_init(&deferred_writes);
+        return -1;
+    }
+    return 0;
+}
+
+static void transaction_begin(client* c) {
+    UNUSED(c);
+    reg_batch_init(&deferred_writes);
+    deferred_write_failed = 0;
+    defer_writes = 1;
+}
+
+static int transaction_end(client* c) {
+    UNUSED(c);
+    flush_reg_writes();
+    defer_writes = 0;
+    return deferred_write_failed;
+}
+
+// State for a read_addr/write_addr that's waiting on the FPGA
+typedef struct AsyncRegCommand {
+    client* c; // Set to NULL if the client disconnects while waiting
+    int is_read;
+    uint32_t addr;
+    uint32_t val;
+    int refs; // The request and async_reg_command each hold one
+    int result;
+    uint32_t value;
+} AsyncRegCommand;
+
+static void async_reg_client_freed(client* c, void* data) {
+    UNUSED(c);
+    // The request is still in flight, so the reply callback frees it
+    ((AsyncRegCommand*)data)->c = NULL;
+}
+
+static void async_reg_finish(AsyncRegCommand* cmd) {
+    if(cmd->c) {
+        if(cmd->result <= 0) {
+            addReplyErrorFormat(cmd->c, "failed to %s value %s FPGA.", cmd->is_read ? "read" : "write", cmd->is_read ? "from" : "to");
+        }
+        else if(cmd->is_read) {
+            addReplyLongLong(cmd->c, cmd->value);
+        }
+        else {
+            addReplyStatus(cmd->c, "OK");
+        }
+        unblockClient(cmd->c);
+    }
+    free(cmd);
+}
+
+static void async_reg_done(int result, const fakernet_reg_acc_item* recv, int num_items, void* privdata) {
+    AsyncRegCommand* cmd = privdata;
+    cmd->result = result;
+    if(result > 0 && cmd->is_read) {
+        // Last item is the safe read, which holds the value (1-read latency)
+        cmd->value = ntohl(recv[num_items-1].data);
+        reg_cache_fill(reg_cache, cmd->addr, cmd->value);
+    }
+    else if(!cmd->is_read) {
+        if(result > 0) {
+            reg_cache_write(reg_cache, cmd->addr, cmd->val);
+        }
+        else {
+            reg_cache_invalidate(reg_cache, cmd->addr);
+        }
+    }
+    if(--cmd->refs == 0) {
+        async_reg_finish(cmd);
+    }
+}
+
+// Sends a single register read or write without waiting for the reply, the
+// client is blocked until the FPGA answers (or the request times out) so the
+// server keeps serving everyone else in the meantime.
+// Returns 0 if the client was taken care of, otherwise the caller should
+// fall back to doing it the blocking way. Inside an EXEC it's always done the
+// blocking way so the replies stay in order.
+static int async_reg_command(client* c, uint32_t addr, uint32_t val, int is_read) {
+    fakernet_reg_acc_item items[2];
+    int num_items = 0;
+    uint32_t value;
+
+    if(dummy_mode || !fnet_async || (is_read && !reg_batch_pipelined_reads) || (c->flags & CLIENT_MULTI)) {
+        return -1;
+    }
+
+    addr &= 0x3FFFFFF; // Only the first 25-bits are valid
+    if(is_read && reg_cache_lookup(reg_cache, addr, &value)) {
+        addReplyLongLong(c, value);
+        return 0;
+    }
+    if(is_read) {
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | addr);
+        items[num_items].data = htonl(0x0);
+        num_items++;
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | (SAFE_READ_ADDRESS & 0x3FFFFFF));
+        items[num_items].data = htonl(0x0);
+        num_items++;
+    }
+    else {
+        items[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_WRITE | addr);
+        items[num_items].data = htonl(val);
+        num_items++;
+    }
+
+    AsyncRegCommand* cmd = malloc(sizeof(AsyncRegCommand));
+    if(!cmd) {
+        return -1;
+    }
+    cmd->c = c;
+    cmd->is_read = is_read;
+    cmd->addr = addr;
+    cmd->val = val;
+    cmd->result = 0;
+    cmd->value = 0;
+    // The request can finish before fnet_async_submit returns (it fails to
+    // send), so the client has to be blocked first and the extra reference
+    // keeps cmd around until this is done with it
+    cmd->refs = 2;
+    blockClient(c, cmd, async_reg_client_freed);
+    if(fnet_async_submit(fnet_async, items, num_items, async_reg_done, cmd)) {
+        async_reg_done(-1, NULL, 0, cmd);
+    }
+    if(--cmd->refs == 0) {
+        async_reg_finish(cmd);
+    }
+    return 0;
+}
+
 void write_addr_command(client* c, int argc, sds* args) {
     UNUSED(argc);
     //write_addr((char*)args[0], 0, args[1]);
@@ -201,7 +439,13 @@ void write_addr_command(client* c, int argc, sds* args) {
         return;
     }
 
-    write_addr(addr, 0, val);
+    if(async_reg_command(c, addr, val, 0) == 0) {
+        return;
+    }
+    if(write_addr(addr, 0, val)) {
+        addReplyError(c, "failed to write value to FPGA.");
+        return;
+    }
     addReplyStatus(c, "OK");
 }
 
@@ -219,6 +463,9 @@ void read_addr_command(client* c, int argc, sds* args) {
         addReplyErrorFormat(c, "'%s' is not a valid number", args[1]);
         return;
     }
+    if(async_reg_command(c, value, 0, 1) == 0) {
+        return;
+    }
     if(double_read_addr(value, 0, &ret)) {
         addReplyError(c, "failed to read value from FPGA.");
         return;
@@ -237,14 +484,39 @@ void sleep_command(client* c, int argc, sds* args) {
         addReplyErrorFormat(c, "'%s' is not a valid number", args[1]);
         return;
     }
+    flush_reg_writes();
     sleep((unsigned int) val);
     addReplyStatus(c, "OK");
 }
 
+// There's only the one board
+uint32_t poll_target_mask(client* c) {
+    UNUSED(c);
+    return 1;
+}
+
+RegCache* active_reg_cache(void) {
+    return reg_cache;
+}
+
+int active_board(void) {
+    return 0;
+}
+
+void set_active_board(int board) {
+    UNUSED(board);
+}
+
 static ServerCommand default_commands[] = {
     {"write_addr", write_addr_command, NULL, 3, 1, 0, 0},
     {"read_addr", read_addr_command, NULL, 2, 1, 0, 0},
     {"sleep",  sleep_command, NULL, 2, 1, 0, 0},
+    {"poll_add", poll_add_command, NULL, -7, 0, 0, 0},
+    {"poll_remove", poll_remove_command, NULL, 2, 0, 0, 0},
+    {"poll_list", poll_list_command, NULL, 1, 0, 0, 0},
+    {"cache_stats", cache_stats_command, NULL, 1, 0, 0, 0},
+    {"invalidate", invalidate_command, NULL, -1, 0, 0, 0},
+    {"read_block", read_block_command, NULL, -3, 0, 0, 0},
     {"", NULL, NULL, 0, 0, 0, 0} // Must be last
 };
 
@@ -274,32 +546,28 @@ ServerCommand* combine_command_tables() {
     return combined_table;
 }
 
-ServerCommand* search_for_command(ServerCommand* table, const char* command_name) {
-    int cmd_index = 0;
-    while(table[cmd_index].func != NULL) {
-        if(strcmp(table[cmd_index].name, command_name) == 0) {
-            break;
-        }
-        cmd_index +=1;
-    }
-    return &(table[cmd_index]);
-}
-
 
 // For arguements with a values
 enum ArgIDs {
     ARG_NONE=0,
     ARG_IP,
-    ARG_PORT
+    ARG_PORT,
+    ARG_SYNC_SERVER,
+    ARG_SPI_PROGRAM_DIR,
+    ARG_LOG_RATE
 };
 
 void print_help_message(const char* name) {
-    printf("usage: %s [--dummy] [--ip] [--port] [--ceres] [--fontus] [--help]\n"
+    printf("usage: %s [--dummy] [--slow-reads] [--ip] [--port] [--ceres] [--fontus] [--sync-server] [--spi-program-dir] [--log-rate " LOG_RATE_OPTION_HELP "] [--help]\n"
             "--ceres \tWill load commands for CERES cannot be used with --fontus flag.\n"
             "--fontus\tWill load commands for FONTUS cannot be used with --ceres flag. Enabled by default.\n"
             "--ip    \tFPGA IP address, 192.168.84.192 by default.\n"
             "--port  \tPort to listen for connections at, 4002 by default.\n"
-            "--dummy \tEnables dummy mode, will pretend to communicate with FPGA without any real commands being sent.\n",
+            "--sync-server\tFONTUS server (HOST:PORT) that tdc_align fires syncs with, " TDC_ALIGN_DEFAULT_SYNC_SERVER " by default.\n"
+            "--spi-program-dir\tDirectory spi_program can load '@' programs from, " SPI_PROGRAM_DEFAULT_DIR " by default.\n"
+            "--dummy \tEnables dummy mode, will pretend to communicate with FPGA without any real commands being sent.\n"
+            "--slow-reads\tDo each register read as two separate round trips, instead of pipelining reads in one packet.\n"
+            "--log-rate\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). Can be given once per level. ERRORs aren't limited by default.\n",
             name);
 }
 
@@ -319,6 +587,18 @@ int main(int argc, char** argv) {
                 else if(strcmp(argv[i], "--port") == 0) {
                     expecting_value = ARG_PORT;
                 }
+                else if(strcmp(argv[i], "--slow-reads") == 0) {
+                    reg_batch_pipelined_reads = 0;
+                }
+                else if(strcmp(argv[i], "--sync-server") == 0) {
+                    expecting_value = ARG_SYNC_SERVER;
+                }
+                else if(strcmp(argv[i], "--spi-program-dir") == 0) {
+                    expecting_value = ARG_SPI_PROGRAM_DIR;
+                }
+                else if(strcmp(argv[i], "--log-rate") == 0) {
+                    expecting_value = ARG_LOG_RATE;
+                }
                 else if(strcmp(argv[i], "--dry") == 0 || strcmp(argv[i], "--dummy") == 0) {
                     printf("DUMMY MODE ENGAGED\n");
                     dummy_mode = 1;
@@ -350,6 +630,18 @@ int main(int argc, char** argv) {
                             printf("Invalid port given, will be using the default port");
                         }
                         break;
+                    case ARG_SYNC_SERVER:
+                        tdc_align_sync_server = argv[i];
+                        break;
+                    case ARG_SPI_PROGRAM_DIR:
+                        spi_program_dir = argv[i];
+                        break;
+                    case ARG_LOG_RATE:
+                        if(daq_log_parse_rate_limit(argv[i])) {
+                            printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", argv[i]);
+                            return 1;
+                        }
+                        break;
                     case ARG_NONE:
                     default:
                         break;
@@ -393,10 +685,13 @@ int main(int argc, char** argv) {
     // Set up command_tables
     SAFE_READ_ADDRESS = CERES_SAFE_READ_ADDRESS;
     board_specific_command_table = ceres_commands;
+    const RegMapEntry* register_map = ceres_register_map;
     if(which_board == FONTUS) {
         SAFE_READ_ADDRESS = FONTUS_SAFE_READ_ADDRESS;
         board_specific_command_table = fontus_commands;
+        register_map = fontus_register_map;
     }
+    reg_cache = reg_cache_new(register_map);
     ServerCommand* commandTable = combine_command_tables();
 
     initServerConfig();
@@ -405,6 +700,21 @@ int main(int argc, char** argv) {
     }
     server_command_table = commandTable;
     initServer();
+    serverSetTransactionHooks(transaction_begin, transaction_end);
+
+    if(!dummy_mode) {
+        fnet_async = fnet_async_new(server.el, fnet_client);
+        if(!fnet_async) {
+            daq_log(LOG_WARN, "Could not set up non-blocking FPGA access, read_addr/write_addr will block");
+        }
+    }
+    poll_groups_init(server.el, DEFAULT_REDIS_HOST, SAFE_READ_ADDRESS);
+    if(!dummy_mode && !fnet_async) {
+        daq_log(LOG_WARN, "Register polling is disabled");
+    }
+    else {
+        poll_groups_add_target(0, fnet_async);
+    }
 
     aeSetBeforeSleepProc(server.el, beforeSleep);
     //aeSetAfterSleepProc(server.el,afterSleep);
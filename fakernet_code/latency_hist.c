@@ -0,0 +1,62 @@
+#include <string.h>
+#include "latency_hist.h"
+
+static int bucket_index(uint32_t value) {
+    int msb;
+    if(value < LATENCY_HIST_SUB_BUCKETS) {
+        return value;
+    }
+    msb = 31 - __builtin_clz(value);
+    // The top LATENCY_HIST_SUB_BITS bits below the leading one pick the sub bucket
+    return (msb - LATENCY_HIST_SUB_BITS + 1)*LATENCY_HIST_SUB_BUCKETS +
+           ((value >> (msb - LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB_BUCKETS-1));
+}
+
+// Largest value that ends up in bucket 'index'
+static long long bucket_upper_edge(int index) {
+    int group = index / LATENCY_HIST_SUB_BUCKETS;
+    long long sub = index % LATENCY_HIST_SUB_BUCKETS;
+    if(group == 0) {
+        return sub;
+    }
+    return ((LATENCY_HIST_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+void latency_hist_reset(LatencyHist* hist) {
+    memset(hist, 0, sizeof(LatencyHist));
+}
+
+void latency_hist_record(LatencyHist* hist, long long usec) {
+    if(usec < 0) {
+        usec = 0;
+    }
+    hist->counts[bucket_index(usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec)]++;
+    hist->count++;
+    hist->total += usec;
+    if(usec > hist->max) {
+        hist->max = usec;
+    }
+}
+
+long long latency_hist_percentile(const LatencyHist* hist, double percentile) {
+    long long needed, seen = 0;
+    long long edge;
+    int i;
+
+    if(hist->count == 0) {
+        return 0;
+    }
+    needed = (long long)(percentile/100.0*hist->count + 0.5);
+    if(needed < 1) {
+        needed = 1;
+    }
+    for(i=0; i<LATENCY_HIST_NUM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen >= needed) {
+            edge = bucket_upper_edge(i);
+            // Never report more than was actually seen
+            return edge < hist->max ? edge : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,27 @@
+#ifndef __LATENCY_HIST__
+#define __LATENCY_HIST__
+#include <inttypes.h>
+
+// Log-linear histogram of latencies in microseconds, the same idea as
+// HdrHistogram. Values below LATENCY_HIST_SUB_BUCKETS get a bucket each, past
+// that every power of 2 is split into LATENCY_HIST_SUB_BUCKETS linear buckets,
+// so percentiles are good to about 1/LATENCY_HIST_SUB_BUCKETS of the value no
+// matter how big it is, and recording is a few shifts and an increment.
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_SUB_BUCKETS (1<<LATENCY_HIST_SUB_BITS)
+// Enough for anything up to 2^32 us, bigger values go in the last bucket
+#define LATENCY_HIST_NUM_BUCKETS ((32 - LATENCY_HIST_SUB_BITS + 1)*LATENCY_HIST_SUB_BUCKETS)
+
+typedef struct LatencyHist {
+    uint32_t counts[LATENCY_HIST_NUM_BUCKETS];
+    long long count;
+    long long total;
+    long long max;
+} LatencyHist;
+
+void latency_hist_reset(LatencyHist* hist);
+void latency_hist_record(LatencyHist* hist, long long usec);
+// Smallest recorded value (rounded up to its bucket's upper edge) that at
+// least 'percentile' percent of the values are at or below, 0 if empty.
+long long latency_hist_percentile(const LatencyHist* hist, double percentile);
+#endif
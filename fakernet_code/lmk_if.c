@@ -23,9 +23,9 @@ uint32_t read_lmk_if(AXI_QSPI* qspi, uint32_t offset) {
     return read_qspi_addr(qspi, offset);
 }
 
-// This write a single data byte to the LMK chip at the given register address/
+// Queues the SPI transaction for a single LMK register access on a batch.
 // If RW is 1 a read operation is performed, if RW is 0  a write operation is done
-uint32_t write_lmk_spi(AXI_QSPI* lmk, uint32_t rw, uint32_t addr, uint32_t data) {
+int batch_write_lmk_spi(RegBatch* batch, AXI_QSPI* lmk, uint32_t rw, uint32_t addr, uint32_t data) {
     // RW is 3 bits and the bottom bits are always zero (pretty sure)
     // so RW only has two valid values.
     rw = rw ? 0x4 : 0x0;
@@ -39,7 +39,16 @@ uint32_t write_lmk_spi(AXI_QSPI* lmk, uint32_t rw, uint32_t addr, uint32_t data)
     uint8_t word_buf[3] = {word1, word2, word3};
     // Bit 0 of the SSR is the LMK select line, pull it low to start SPI data transfer
     uint32_t ssr = 0x0;
-    write_spi(lmk, ssr, word_buf, 3);
+    return batch_write_spi(batch, lmk, ssr, word_buf, 3);
+}
+
+// This write a single data byte to the LMK chip at the given register address/
+// If RW is 1 a read operation is performed, if RW is 0  a write operation is done
+uint32_t write_lmk_spi(AXI_QSPI* lmk, uint32_t rw, uint32_t addr, uint32_t data) {
+    RegBatch batch;
+    reg_batch_init(&batch);
+    batch_write_lmk_spi(&batch, lmk, rw, addr, data);
+    commit_spi_batch(&batch, lmk);
     return 0;
 }
 
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+
+#define METRIC_MAX_FIELDS 5 // Most stream fields one metric turns in to
+#define METRICS_MAX_ARGS (6 + 2*METRIC_MAX_FIELDS*METRICS_MAX)
+#define METRICS_CONN_TIMEOUT_MS 2000 // Scrapers that take longer than this get hung up on
+
+static const double percentiles[] = {50, 90, 99};
+
+static long long now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000LL + tv.tv_usec;
+}
+
+static void close_conn(MetricsConn* conn);
+
+void metrics_init(MetricSet* set, const char* stream, const char* prefix) {
+    int i;
+    memset(set, 0, sizeof(MetricSet));
+    set->stream = stream;
+    set->prefix = prefix;
+    set->listen_fd = -1;
+    for(i=0; i<METRICS_MAX_CONNS; i++) {
+        set->conns[i].fd = -1;
+    }
+    set->last_publish_us = now_us();
+}
+
+void metrics_cleanup(MetricSet* set) {
+    int i;
+    for(i=0; i<set->num_metrics; i++) {
+        free(set->metrics[i].hist);
+    }
+    if(set->listen_fd >= 0) {
+        close(set->listen_fd);
+    }
+    for(i=0; i<METRICS_MAX_CONNS; i++) {
+        close_conn(&set->conns[i]);
+    }
+    set->num_metrics = 0;
+    set->listen_fd = -1;
+}
+
+static Metric* add_metric(MetricSet* set, const char* name, const char* help, MetricType type) {
+    Metric* metric;
+    if(set->num_metrics >= METRICS_MAX) {
+        return NULL;
+    }
+    metric = &set->metrics[set->num_metrics];
+    memset(metric, 0, sizeof(Metric));
+    snprintf(metric->name, METRIC_NAME_MAX, "%s", name);
+    metric->help = help;
+    metric->type = type;
+    if(type == METRIC_HISTOGRAM) {
+        metric->hist = calloc(1, sizeof(LatencyHist));
+        if(!metric->hist) {
+            return NULL;
+        }
+    }
+    set->num_metrics++;
+    return metric;
+}
+
+Metric* metrics_add_counter(MetricSet* set, const char* name, const char* help) {
+    return add_metric(set, name, help, METRIC_COUNTER);
+}
+
+Metric* metrics_add_gauge(MetricSet* set, const char* name, const char* help) {
+    return add_metric(set, name, help, METRIC_GAUGE);
+}
+
+Metric* metrics_add_histogram(MetricSet* set, const char* name, const char* help) {
+    return add_metric(set, name, help, METRIC_HISTOGRAM);
+}
+
+void metric_add(Metric* metric, unsigned long long n) {
+    metric->count += n;
+}
+
+void metric_set_count(Metric* metric, unsigned long long count) {
+    metric->count = count;
+}
+
+void metric_set(Metric* metric, double value) {
+    metric->value = value;
+}
+
+void metric_observe(Metric* metric, long long value) {
+    latency_hist_record(metric->hist, value);
+}
+
+int metrics_publish(MetricSet* set, redisContext* c) {
+    static char fields[2*METRIC_MAX_FIELDS*METRICS_MAX][METRIC_NAME_MAX+8];
+    const char* args[METRICS_MAX_ARGS];
+    size_t arglens[METRICS_MAX_ARGS];
+    int nargs = 0;
+    int nfields = 0;
+    long long now = now_us();
+    double dt = (now - set->last_publish_us)/1e6;
+    redisReply* reply;
+    int ret;
+    int i, j;
+
+#define ADD_ARG(str) do { args[nargs] = (str); arglens[nargs] = strlen(args[nargs]); nargs++; } while(0)
+#define ADD_FIELD(...) do { snprintf(fields[nfields], sizeof(fields[0]), __VA_ARGS__); ADD_ARG(fields[nfields]); nfields++; } while(0)
+
+    ADD_ARG("XADD");
+    ADD_ARG(set->stream);
+    ADD_ARG("MAXLEN");
+    ADD_ARG("~");
+    ADD_ARG(METRICS_STREAM_MAXLEN);
+    ADD_ARG("*");
+    for(i=0; i<set->num_metrics; i++) {
+        Metric* metric = &set->metrics[i];
+        switch(metric->type) {
+            case METRIC_COUNTER:
+                metric->value = dt > 0 ? (metric->count - metric->last_count)/dt : 0;
+                metric->last_count = metric->count;
+                ADD_FIELD("%s", metric->name);
+                ADD_FIELD("%llu", metric->count);
+                ADD_FIELD("%s_per_sec", metric->name);
+                ADD_FIELD("%.1f", metric->value);
+                break;
+            case METRIC_GAUGE:
+                ADD_FIELD("%s", metric->name);
+                ADD_FIELD("%.17g", metric->value);
+                break;
+            case METRIC_HISTOGRAM:
+                ADD_FIELD("%s_count", metric->name);
+                ADD_FIELD("%lli", metric->hist->count);
+                for(j=0; j<(int)(sizeof(percentiles)/sizeof(percentiles[0])); j++) {
+                    ADD_FIELD("%s_p%.0f", metric->name, percentiles[j]);
+                    ADD_FIELD("%lli", latency_hist_percentile(metric->hist, percentiles[j]));
+                }
+                ADD_FIELD("%s_max", metric->name);
+                ADD_FIELD("%lli", metric->hist->max);
+                break;
+        }
+    }
+#undef ADD_FIELD
+#undef ADD_ARG
+    set->last_publish_us = now;
+
+    if(!c) {
+        return -1;
+    }
+    if(redisAppendCommandArgv(c, nargs, args, arglens) != REDIS_OK) {
+        return -1;
+    }
+    if(!(c->flags & REDIS_BLOCK)) {
+        // Send what the socket takes right now, the rest stays in the
+        // context's output buffer for the caller's loop to write out
+        return redisBufferWrite(c, NULL) == REDIS_OK ? 0 : -1;
+    }
+    if(redisGetReply(c, (void**)&reply) != REDIS_OK) {
+        return -1;
+    }
+    ret = reply->type == REDIS_REPLY_ERROR ? -1 : 0;
+    freeReplyObject(reply);
+    return ret;
+}
+
+int metrics_listen(MetricSet* set, int port) {
+    struct sockaddr_in addr;
+    int yes = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 8)) {
+        close(fd);
+        return -1;
+    }
+    if(set->listen_fd >= 0) {
+        close(set->listen_fd);
+    }
+    set->listen_fd = fd;
+    return 0;
+}
+
+static void write_prometheus_text(MetricSet* set, FILE* out) {
+    int i, j;
+    for(i=0; i<set->num_metrics; i++) {
+        Metric* metric = &set->metrics[i];
+        const char* suffix = metric->type == METRIC_COUNTER ? "_total" : "";
+        const char* type = metric->type == METRIC_COUNTER ? "counter" :
+                           metric->type == METRIC_GAUGE ? "gauge" : "summary";
+        if(metric->help) {
+            fprintf(out, "# HELP %s%s%s %s\n", set->prefix, metric->name, suffix, metric->help);
+        }
+        fprintf(out, "# TYPE %s%s%s %s\n", set->prefix, metric->name, suffix, type);
+        switch(metric->type) {
+            case METRIC_COUNTER:
+                fprintf(out, "%s%s_total %llu\n", set->prefix, metric->name, metric->count);
+                break;
+            case METRIC_GAUGE:
+                fprintf(out, "%s%s %.17g\n", set->prefix, metric->name, metric->value);
+                break;
+            case METRIC_HISTOGRAM:
+                for(j=0; j<(int)(sizeof(percentiles)/sizeof(percentiles[0])); j++) {
+                    fprintf(out, "%s%s{quantile=\"%g\"} %lli\n", set->prefix, metric->name,
+                            percentiles[j]/100, latency_hist_percentile(metric->hist, percentiles[j]));
+                }
+                fprintf(out, "%s%s_sum %lli\n", set->prefix, metric->name, metric->hist->total);
+                fprintf(out, "%s%s_count %lli\n", set->prefix, metric->name, metric->hist->count);
+                break;
+        }
+    }
+}
+
+static void close_conn(MetricsConn* conn) {
+    if(conn->fd >= 0) {
+        close(conn->fd);
+    }
+    free(conn->reply);
+    memset(conn, 0, sizeof(MetricsConn));
+    conn->fd = -1;
+}
+
+// The reply is made as soon as the request has been read, so scrapers get
+// the metrics as they were at that moment
+static int make_reply(MetricSet* set, MetricsConn* conn) {
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if(!out) {
+        return -1;
+    }
+    write_prometheus_text(set, out);
+    fclose(out);
+
+    out = open_memstream(&conn->reply, &conn->reply_len);
+    if(!out) {
+        free(body);
+        return -1;
+    }
+    fprintf(out, "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n\r\n", body_len);
+    fwrite(body, 1, body_len, out);
+    fclose(out);
+    free(body);
+    conn->reply_sent = 0;
+    return 0;
+}
+
+// Reads whatever's there without waiting. Don't care what was asked for,
+// just when the request ends. Returns -1 if the connection should be closed.
+static int read_request(MetricSet* set, MetricsConn* conn) {
+    static const char end[] = "\r\n\r\n";
+    char buf[1024];
+    ssize_t n;
+    ssize_t i;
+
+    for(;;) {
+        n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if(n == 0 && conn->reply) {
+            // The scraper is done sending (e.g. it shut down its side after
+            // the request), the reply still has to go out
+            return 0;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        if(conn->reply) {
+            // Already answering, just keep the socket drained so closing it
+            // doesn't reset the connection
+            continue;
+        }
+        for(i=0; i<n && conn->request_end < 4; i++) {
+            conn->request_end = buf[i] == end[conn->request_end] ? conn->request_end + 1 :
+                                buf[i] == end[0] ? 1 : 0;
+        }
+        if(conn->request_end == 4) {
+            return make_reply(set, conn);
+        }
+    }
+}
+
+// Sends as much of the reply as the socket takes. Returns 1 once it's all
+// gone, -1 if the connection should be closed.
+static int send_reply(MetricsConn* conn) {
+    ssize_t n;
+    while(conn->reply_sent < conn->reply_len) {
+        n = send(conn->fd, conn->reply + conn->reply_sent, conn->reply_len - conn->reply_sent,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        conn->reply_sent += n;
+    }
+    return 1;
+}
+
+void metrics_serve(MetricSet* set) {
+    long long now;
+    int i, fd;
+    if(set->listen_fd < 0) {
+        return;
+    }
+    now = now_us();
+    for(i=0; i<METRICS_MAX_CONNS; i++) {
+        MetricsConn* conn = &set->conns[i];
+        if(conn->fd < 0) {
+            fd = accept(set->listen_fd, NULL, NULL);
+            if(fd < 0) {
+                continue;
+            }
+            conn->fd = fd;
+            conn->opened_us = now;
+        }
+        if(read_request(set, conn) < 0 ||
+           (conn->reply && send_reply(conn) != 0) ||
+           now - conn->opened_us > METRICS_CONN_TIMEOUT_MS*1000LL) {
+            close_conn(conn);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef __METRICS__
+#define __METRICS__
+#include "hiredis/hiredis.h"
+#include "latency_hist.h"
+
+// Named counters, gauges and histograms describing what a program is up to.
+// They get published to redis as an entry in a stream with one field per
+// value, so consumers look values up by name and adding a metric doesn't
+// break anybody. They can also be served as Prometheus text on a local TCP
+// port (any request to the port gets the metrics, there's no real HTTP
+// server behind it).
+//
+// Metrics are added once at start up and the returned pointer is held onto,
+// updating one is just a store or an increment.
+//
+// In the stream a counter shows up as 'name' and 'name_per_sec' (the rate
+// since the previous publish), a gauge as 'name' and a histogram as
+// 'name_count', 'name_p50', 'name_p90', 'name_p99' and 'name_max'.
+#define METRICS_MAX 32
+#define METRIC_NAME_MAX 48
+#define METRICS_STREAM_MAXLEN "1000" // Approximate, the stream is trimmed with ~
+#define METRICS_MAX_CONNS 4 // Scrapers being answered at once
+
+typedef enum MetricType {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} MetricType;
+
+typedef struct Metric {
+    char name[METRIC_NAME_MAX];
+    const char* help;
+    MetricType type;
+    unsigned long long count; // Counters
+    unsigned long long last_count; // Counter value at the previous publish
+    double value; // Gauges, or the counter's rate after a publish
+    LatencyHist* hist; // Histograms
+} Metric;
+
+// A scraper connection, answered a bit at a time by metrics_serve
+typedef struct MetricsConn {
+    int fd; // -1 if unused
+    long long opened_us;
+    int request_end; // How much of "\r\n\r\n" has been seen
+    char* reply; // NULL until the request has been read
+    size_t reply_len;
+    size_t reply_sent;
+} MetricsConn;
+
+typedef struct MetricSet {
+    const char* stream; // Redis stream the metrics are published to
+    const char* prefix; // Prepended to each name for Prometheus
+    Metric metrics[METRICS_MAX];
+    int num_metrics;
+    long long last_publish_us;
+    int listen_fd; // -1 if not serving Prometheus text
+    MetricsConn conns[METRICS_MAX_CONNS];
+} MetricSet;
+
+void metrics_init(MetricSet* set, const char* stream, const char* prefix);
+void metrics_cleanup(MetricSet* set);
+// These return NULL if the set is full
+Metric* metrics_add_counter(MetricSet* set, const char* name, const char* help);
+Metric* metrics_add_gauge(MetricSet* set, const char* name, const char* help);
+Metric* metrics_add_histogram(MetricSet* set, const char* name, const char* help);
+
+void metric_add(Metric* metric, unsigned long long n);
+// For counters that are already kept track of somewhere else
+void metric_set_count(Metric* metric, unsigned long long count);
+void metric_set(Metric* metric, double value);
+void metric_observe(Metric* metric, long long value);
+
+// Adds an entry with every metric to the set's stream. For a blocking
+// redisContext the reply is read here. For a non-blocking one this doesn't
+// wait, whatever the socket doesn't take right away is left in the context's
+// output buffer, the caller has to keep calling redisBufferWrite until it's
+// gone and read the reply along with the rest of its replies. Returns 0 on
+// success.
+int metrics_publish(MetricSet* set, redisContext* c);
+// Starts serving Prometheus text on 127.0.0.1:'port'. Returns 0 on success.
+int metrics_listen(MetricSet* set, int port);
+// Answers anybody waiting on the metrics port. Never blocks, whatever can't
+// be read or sent right away is picked up on the next call. Meant to be
+// called every time through the program's main loop.
+void metrics_serve(MetricSet* set);
+#endif
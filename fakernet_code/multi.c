@@ -0,0 +1,164 @@
+/* multi.c - MULTI/EXEC/DISCARD, loosely based on Redis's multi.c.
+ *
+ * After MULTI a client's commands are checked and queued (each one gets a
+ * +QUEUED reply) instead of being run. EXEC runs them back to back and
+ * replies with one array holding each command's reply, DISCARD throws
+ * them away. There's no WATCH, nothing here is a key-value store.
+ *
+ * The point is to let a script send a whole sequence of commands in one
+ * network exchange, and to let the main program hold back the FPGA register
+ * writes the commands make so they go out together (see
+ * serverSetTransactionHooks). Since the writes might not hit the FPGA until
+ * the end of the EXEC, if sending them fails the whole EXEC gets an error
+ * reply instead of the array, even though the commands did run.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "server.h"
+
+void initClientMultiState(client *c) {
+    c->mstate.commands = NULL;
+    c->mstate.count = 0;
+}
+
+void freeClientMultiState(client *c) {
+    int j, i;
+    for (j = 0; j < c->mstate.count; j++) {
+        multiCmd *mc = &c->mstate.commands[j];
+        for (i = 0; i < mc->argc; i++) {
+            sdsfree(mc->argv[i]);
+        }
+        free(mc->argv);
+    }
+    free(c->mstate.commands);
+    initClientMultiState(c);
+}
+
+/* Adds the client's current command to its MULTI queue. The arguments are
+ * copied since the client's argv gets re-used for the next command. */
+static int queueMultiCommand(client *c) {
+    multiCmd *commands, *mc;
+    int j;
+
+    commands = realloc(c->mstate.commands, sizeof(multiCmd)*(c->mstate.count+1));
+    if (!commands) {
+        return C_ERR;
+    }
+    c->mstate.commands = commands;
+    mc = &commands[c->mstate.count];
+    mc->argv = malloc(sizeof(sds)*c->argc);
+    if (!mc->argv) {
+        return C_ERR;
+    }
+    for (j = 0; j < c->argc; j++) {
+        mc->argv[j] = sdsdup(c->argv[j]);
+    }
+    mc->argc = c->argc;
+    mc->cmd = c->cmd;
+    c->mstate.count++;
+    return C_OK;
+}
+
+void discardTransaction(client *c) {
+    freeClientMultiState(c);
+    c->flags &= ~(CLIENT_MULTI|CLIENT_DIRTY_EXEC);
+}
+
+/* Flag the transaction as DIRTY_EXEC so that EXEC will fail.
+ * Should be called every time there is an error while queueing a command. */
+void flagTransaction(client *c) {
+    if (c->flags & CLIENT_MULTI) {
+        c->flags |= CLIENT_DIRTY_EXEC;
+    }
+}
+
+/* Called by processCommand() for every command a client in MULTI sends,
+ * other than the transaction commands themselves. */
+void queueCommandReply(client *c) {
+    if (queueMultiCommand(c) == C_ERR) {
+        flagTransaction(c);
+        addReplyError(c, "Out of memory queueing command");
+        return;
+    }
+    addReplyStatus(c, "QUEUED");
+}
+
+int isTransactionCommand(ServerCommand *cmd) {
+    return cmd->func == multiCommand || cmd->func == execCommand || cmd->func == discardCommand;
+}
+
+void multiCommand(client *c, int argc, sds *argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    if (c->flags & CLIENT_MULTI) {
+        addReplyError(c, "MULTI calls can not be nested");
+        return;
+    }
+    c->flags |= CLIENT_MULTI;
+    addReplyStatus(c, "OK");
+}
+
+void discardCommand(client *c, int argc, sds *argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    if (!(c->flags & CLIENT_MULTI)) {
+        addReplyError(c, "DISCARD without MULTI");
+        return;
+    }
+    discardTransaction(c);
+    addReplyStatus(c, "OK");
+}
+
+void execCommand(client *c, int argc, sds *argv) {
+    int j;
+    int orig_argc;
+    sds *orig_argv;
+    ServerCommand *orig_cmd;
+    clientReplyPosition start;
+    int failed = 0;
+    UNUSED(argc);
+    UNUSED(argv);
+
+    if (!(c->flags & CLIENT_MULTI)) {
+        addReplyError(c, "EXEC without MULTI");
+        return;
+    }
+    if (c->flags & CLIENT_DIRTY_EXEC) {
+        addReplyError(c, "EXECABORT Transaction discarded because of previous errors.");
+        discardTransaction(c);
+        return;
+    }
+
+    /* Exec all the queued commands. CLIENT_MULTI stays set while they run,
+     * commands that would normally block (or reply later) must check for it
+     * and do their work right away instead, otherwise the replies would end
+     * up out of order. */
+    getReplyPosition(c, &start);
+    orig_argv = c->argv;
+    orig_argc = c->argc;
+    orig_cmd = c->cmd;
+    addReplyLongLongWithPrefix(c, c->mstate.count, '*');
+    if (server.transaction_begin) {
+        server.transaction_begin(c);
+    }
+    for (j = 0; j < c->mstate.count; j++) {
+        c->argc = c->mstate.commands[j].argc;
+        c->argv = c->mstate.commands[j].argv;
+        c->cmd = c->mstate.commands[j].cmd;
+        call(c, CMD_CALL_FULL);
+    }
+    if (server.transaction_end) {
+        failed = server.transaction_end(c);
+    }
+    c->argv = orig_argv;
+    c->argc = orig_argc;
+    c->cmd = orig_cmd;
+
+    if (failed) {
+        /* The replies said the writes were done, take them back */
+        truncateReplies(c, &start);
+        addReplyError(c, "EXECFAILED Register writes held back during EXEC could not be sent, the FPGA state is unknown");
+    }
+    discardTransaction(c);
+}
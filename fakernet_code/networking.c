@@ -220,6 +220,34 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
     addReplyString(c, "\r\n");
 }
 
+/* Remembers how much output is queued for the client, so everything added
+ * after this point can be taken back with truncateReplies(). Nothing gets
+ * written to the socket in between as long as we don't return to the event
+ * loop. */
+void getReplyPosition(client *c, clientReplyPosition *pos) {
+    listNode *ln = listLast(c->reply);
+    pos->bufpos = c->bufpos;
+    pos->reply_len = listLength(c->reply);
+    pos->tail_used = ln ? ((clientReplyBlock*)listNodeValue(ln))->used : 0;
+}
+
+void truncateReplies(client *c, const clientReplyPosition *pos) {
+    listNode *ln;
+    clientReplyBlock *o;
+
+    while (listLength(c->reply) > pos->reply_len) {
+        ln = listLast(c->reply);
+        o = listNodeValue(ln);
+        c->reply_bytes -= o->size;
+        free(o);
+        listDelNode(c->reply, ln);
+    }
+    if ((ln = listLast(c->reply)) != NULL) {
+        ((clientReplyBlock*)listNodeValue(ln))->used = pos->tail_used;
+    }
+    c->bufpos = pos->bufpos;
+}
+
 void readQueryFromClient(connection *conn) {
     client *c = connGetPrivateData(conn);
     int nread, readlen;
@@ -351,7 +379,7 @@ void processInputBuffer(client *c) {
     while(c->qb_pos < sdslen(c->querybuf)) {
 
         /* Immediately abort if the client is in the middle of something. */
-        //if (c->flags & CLIENT_BLOCKED) break;
+        if (c->flags & CLIENT_BLOCKED) break;
 
         /* Don't process more buffers from clients that have already pending
          * commands to execute in c->argv. */
@@ -679,10 +707,11 @@ client *createClient(connection *conn) {
     c->obuf_soft_limit_reached_time = 0;
     c->client_list_node = NULL;
     c->server_data = NULL;
+    c->blocked_cmd = NULL;
     if (conn) {
         linkClient(c);
     }
-    //initClientMultiState(c);
+    initClientMultiState(c);
     return c;
 }
 
@@ -837,12 +866,20 @@ void freeClient(client *c) {
         if(c->bfree) {
             c->bfree(c, c->blocking_data);
         }
+        // It never finished, so there's nothing to record
+        c->blocked_cmd = NULL;
         unblockClient(c);
     }
+    if (c->flags & CLIENT_UNBLOCKED) {
+        ln = listSearchKey(server.unblocked_clients,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.unblocked_clients,ln);
+    }
 
     /* Free data structures. */
     listRelease(c->reply);
     freeClientArgv(c);
+    freeClientMultiState(c);
 
     /* Unlink the client: this will close the socket, remove the I/O
      * handlers, and remove references of the client from different
@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "hiredis/hiredis.h"
+#include "poll_groups.h"
+#include "daq_logger.h"
+
+#define AXI_ADDR_MASK 0x3FFFFFF // Only the first 25-bits are valid
+#define REDIS_PORT 6379
+#define REDIS_RECONNECT_PERIOD_MS 5000
+// Two fields per register plus "XADD stream MAXLEN ~ N *" and device_id & time
+#define MAX_XADD_ARGS (6 + 2*2 + 2*POLL_MAX_REGS)
+
+typedef struct PollTarget {
+    int device_id;
+    FnetAsyncConn* conn;
+    int disabled;
+} PollTarget;
+
+// Where in a request's response a group's registers are
+typedef struct PollSegment {
+    PollGroup* group;
+    unsigned int generation;
+    int first_item;
+} PollSegment;
+
+// One packet's worth of registers, from one or more groups, for one board
+typedef struct PollRequest {
+    int target;
+    fakernet_reg_acc_item items[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    int num_items;
+    PollSegment segments[POLL_MAX_GROUPS];
+    int num_segments;
+} PollRequest;
+
+static PollGroup groups[POLL_MAX_GROUPS];
+static PollTarget targets[POLL_MAX_TARGETS];
+static int num_targets = 0;
+static aeEventLoop* poll_el = NULL;
+static long long tick_timer_id = -1;
+static uint32_t poll_safe_read_addr = 0;
+
+static const char* poll_redis_host = NULL;
+static redisContext* poll_redis = NULL;
+static long long last_redis_attempt_ms = 0;
+
+static const char* decode_names[] = {"raw", "delta", "rate"};
+
+static long long poll_now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static void poll_redis_connect(void) {
+    long long now_ms = poll_now_us()/1000;
+    if(poll_redis || !poll_redis_host) {
+        return;
+    }
+    if(now_ms - last_redis_attempt_ms < REDIS_RECONNECT_PERIOD_MS) {
+        return;
+    }
+    last_redis_attempt_ms = now_ms;
+    poll_redis = redisConnectNonBlock(poll_redis_host, REDIS_PORT);
+    if(poll_redis && poll_redis->err) {
+        daq_log(LOG_WARN, "Poll groups could not connect to redis: %s", poll_redis->errstr);
+        redisFree(poll_redis);
+        poll_redis = NULL;
+    }
+}
+
+// Same approach as the daq_logger, append the command and flush the output
+// buffer, throwing away whatever replies have come back in the meantime.
+static void poll_redis_send(int argc, const char** argv, const size_t* argvlen) {
+    redisReply* reply = NULL;
+    int done = 0;
+
+    poll_redis_connect();
+    if(!poll_redis) {
+        return;
+    }
+    do {
+        if(redisBufferRead(poll_redis) == REDIS_ERR) {
+            break;
+        }
+        if(redisGetReply(poll_redis, (void**)&reply) == REDIS_ERR) {
+            break;
+        }
+        if(reply && reply->type == REDIS_REPLY_ERROR) {
+            daq_log(LOG_WARN, "Poll group XADD failed: %s", reply->str);
+        }
+        freeReplyObject(reply);
+    } while(reply);
+
+    redisAppendCommandArgv(poll_redis, argc, argv, argvlen);
+    do {
+        if(redisBufferWrite(poll_redis, &done) == REDIS_ERR) {
+            daq_log(LOG_WARN, "Lost connection to redis, poll results will be dropped until it's back");
+            redisFree(poll_redis);
+            poll_redis = NULL;
+            return;
+        }
+    } while(!done);
+}
+
+static void publish_group(PollGroup* group, int target, const uint32_t* values, long long now_us) {
+    const char* argv[MAX_XADD_ARGS];
+    size_t argvlen[MAX_XADD_ARGS];
+    char maxlen_str[32];
+    char device_str[16];
+    char time_str[32];
+    char field_strs[POLL_MAX_REGS][16];
+    char value_strs[POLL_MAX_REGS][32];
+    int argc = 0;
+    int i;
+
+    if(group->decode != POLL_DECODE_RAW && !group->have_prev[target]) {
+        // Nothing to compare against yet
+        memcpy(group->prev_values[target], values, sizeof(uint32_t)*group->num_regs);
+        group->prev_time_us[target] = now_us;
+        group->have_prev[target] = 1;
+        return;
+    }
+
+    double dt = (now_us - group->prev_time_us[target])/1e6;
+    for(i=0; i<group->num_regs; i++) {
+        // Unsigned subtraction, so this works across a counter rolling over
+        uint32_t delta = values[i] - group->prev_values[target][i];
+        switch(group->decode) {
+            case POLL_DECODE_DELTA:
+                snprintf(value_strs[i], sizeof(value_strs[i]), "%u", delta);
+                break;
+            case POLL_DECODE_RATE:
+                snprintf(value_strs[i], sizeof(value_strs[i]), "%.6g", dt > 0 ? delta/dt : 0.0);
+                break;
+            case POLL_DECODE_RAW:
+            default:
+                snprintf(value_strs[i], sizeof(value_strs[i]), "%u", values[i]);
+                break;
+        }
+        snprintf(field_strs[i], sizeof(field_strs[i]), "0x%x", group->addrs[i]);
+    }
+    memcpy(group->prev_values[target], values, sizeof(uint32_t)*group->num_regs);
+    group->prev_time_us[target] = now_us;
+
+    snprintf(maxlen_str, sizeof(maxlen_str), "%ld", group->maxlen);
+    snprintf(device_str, sizeof(device_str), "%i", targets[target].device_id);
+    snprintf(time_str, sizeof(time_str), "%lld.%06lld", now_us/1000000, now_us%1000000);
+
+    argv[argc++] = "XADD";
+    argv[argc++] = group->stream;
+    argv[argc++] = "MAXLEN";
+    argv[argc++] = "~";
+    argv[argc++] = maxlen_str;
+    argv[argc++] = "*";
+    argv[argc++] = "device_id";
+    argv[argc++] = device_str;
+    argv[argc++] = "time";
+    argv[argc++] = time_str;
+    for(i=0; i<group->num_regs; i++) {
+        argv[argc++] = field_strs[i];
+        argv[argc++] = value_strs[i];
+    }
+    for(i=0; i<argc; i++) {
+        argvlen[i] = strlen(argv[i]);
+    }
+    poll_redis_send(argc, argv, argvlen);
+}
+
+static void poll_request_done(int result, const fakernet_reg_acc_item* recv, int num_items, void* privdata) {
+    PollRequest* req = privdata;
+    uint32_t values[POLL_MAX_REGS];
+    long long now_us = poll_now_us();
+    int i, j;
+    (void) num_items;
+
+    for(i=0; i<req->num_segments; i++) {
+        PollSegment* seg = &req->segments[i];
+        PollGroup* group = seg->group;
+        if(!group->in_use || group->generation != seg->generation) {
+            // Removed (or replaced) while the request was out
+            continue;
+        }
+        group->in_flight_mask &= ~(1<<req->target);
+        group->num_polls++;
+        if(result <= 0) {
+            group->num_errors++;
+            continue;
+        }
+        for(j=0; j<group->num_regs; j++) {
+            if(recv) {
+                // 1-read latency, each read's value is in the next item's response
+                values[j] = ntohl(recv[seg->first_item + j + 1].data);
+            }
+            else {
+                values[j] = 0xDEADBEEF;
+            }
+        }
+        publish_group(group, req->target, values, now_us);
+    }
+    free(req);
+}
+
+static void send_poll_request(PollRequest* req) {
+    if(req->num_items == 0) {
+        free(req);
+        return;
+    }
+    // Trailing read to collect the last register's value
+    req->items[req->num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | (poll_safe_read_addr & AXI_ADDR_MASK));
+    req->items[req->num_items].data = htonl(0x0);
+    req->num_items++;
+
+    if(!targets[req->target].conn) {
+        // Dummy mode
+        poll_request_done(1, NULL, req->num_items, req);
+        return;
+    }
+    if(fnet_async_submit(targets[req->target].conn, req->items, req->num_items, poll_request_done, req)) {
+        poll_request_done(-1, NULL, req->num_items, req);
+    }
+}
+
+static PollRequest* new_poll_request(int target) {
+    PollRequest* req = malloc(sizeof(PollRequest));
+    if(req) {
+        req->target = target;
+        req->num_items = 0;
+        req->num_segments = 0;
+    }
+    return req;
+}
+
+static int poll_tick(aeEventLoop* el, long long id, void* client_data) {
+    (void) el;
+    (void) id;
+    (void) client_data;
+    long long now_ms = poll_now_us()/1000;
+    int i, t, j;
+
+    for(t=0; t<num_targets; t++) {
+        PollRequest* req = NULL;
+        if(targets[t].disabled) {
+            continue;
+        }
+        for(i=0; i<POLL_MAX_GROUPS; i++) {
+            PollGroup* group = &groups[i];
+            if(!group->in_use || !(group->target_mask & (1<<t)) || now_ms < group->next_due_ms) {
+                continue;
+            }
+            if(group->in_flight_mask & (1<<t)) {
+                // Board hasn't answered the last one yet, skip this period
+                continue;
+            }
+            // Pack every due group in to as few packets as possible, leaving
+            // room for the trailing safe read.
+            if(req && req->num_items + group->num_regs + 1 > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+                send_poll_request(req);
+                req = NULL;
+            }
+            if(!req) {
+                req = new_poll_request(t);
+                if(!req) {
+                    break;
+                }
+            }
+            PollSegment* seg = &req->segments[req->num_segments++];
+            seg->group = group;
+            seg->generation = group->generation;
+            seg->first_item = req->num_items;
+            for(j=0; j<group->num_regs; j++) {
+                req->items[req->num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | (group->addrs[j] & AXI_ADDR_MASK));
+                req->items[req->num_items].data = htonl(0x0);
+                req->num_items++;
+            }
+            group->in_flight_mask |= (1<<t);
+        }
+        if(req) {
+            send_poll_request(req);
+        }
+    }
+
+    // Schedule the next poll for everything that was due
+    for(i=0; i<POLL_MAX_GROUPS; i++) {
+        PollGroup* group = &groups[i];
+        if(group->in_use && now_ms >= group->next_due_ms) {
+            group->next_due_ms += group->period_ms;
+            if(group->next_due_ms <= now_ms) {
+                // Fell behind, don't try and catch up
+                group->next_due_ms = now_ms + group->period_ms;
+            }
+        }
+    }
+    return POLL_TICK_MS;
+}
+
+void poll_groups_init(aeEventLoop* el, const char* redis_host, uint32_t safe_read_addr) {
+    memset(groups, 0, sizeof(groups));
+    poll_el = el;
+    poll_redis_host = redis_host;
+    poll_safe_read_addr = safe_read_addr;
+}
+
+int poll_groups_add_target(int device_id, FnetAsyncConn* conn) {
+    if(num_targets >= POLL_MAX_TARGETS) {
+        return -1;
+    }
+    targets[num_targets].device_id = device_id;
+    targets[num_targets].conn = conn;
+    targets[num_targets].disabled = 0;
+    return num_targets++;
+}
+
+int poll_groups_add_disabled_target(int device_id) {
+    int target = poll_groups_add_target(device_id, NULL);
+    if(target >= 0) {
+        targets[target].disabled = 1;
+    }
+    return target;
+}
+
+static PollGroup* find_group(const char* name) {
+    int i;
+    for(i=0; i<POLL_MAX_GROUPS; i++) {
+        if(groups[i].in_use && strcmp(groups[i].name, name) == 0) {
+            return &groups[i];
+        }
+    }
+    return NULL;
+}
+
+void poll_add_command(client* c, int argc, sds* argv) {
+    PollGroup* group;
+    long long period_ms;
+    long maxlen;
+    uint32_t target_mask;
+    uint32_t addrs[POLL_MAX_REGS];
+    int num_regs = argc - 6;
+    int decode = -1;
+    char* end;
+    int i;
+
+    if(!poll_el) {
+        addReplyError(c, "Polling is not available");
+        return;
+    }
+    if(sdslen(argv[1]) >= POLL_NAME_MAX || sdslen(argv[4]) >= POLL_NAME_MAX) {
+        addReplyErrorFormat(c, "Poll group and stream names must be shorter than %i characters", POLL_NAME_MAX);
+        return;
+    }
+    period_ms = strtoll(argv[2], &end, 0);
+    if(*end != '\0' || period_ms < POLL_TICK_MS) {
+        addReplyErrorFormat(c, "'%s' is not a valid period, must be at least %i ms", argv[2], POLL_TICK_MS);
+        return;
+    }
+    for(i=0; i<(int)(sizeof(decode_names)/sizeof(decode_names[0])); i++) {
+        if(strcasecmp(argv[3], decode_names[i]) == 0) {
+            decode = i;
+        }
+    }
+    if(decode < 0) {
+        addReplyErrorFormat(c, "Unknown decode rule '%s', must be raw, delta, or rate", argv[3]);
+        return;
+    }
+    maxlen = strtol(argv[5], &end, 0);
+    if(*end != '\0' || maxlen <= 0) {
+        addReplyErrorFormat(c, "'%s' is not a valid MAXLEN", argv[5]);
+        return;
+    }
+    if(num_regs > POLL_MAX_REGS) {
+        addReplyErrorFormat(c, "Too many registers, max is %i", POLL_MAX_REGS);
+        return;
+    }
+    for(i=0; i<num_regs; i++) {
+        addrs[i] = strtoul(argv[6+i], &end, 0);
+        if(*end != '\0' || end == argv[6+i]) {
+            addReplyErrorFormat(c, "'%s' is not a valid address", argv[6+i]);
+            return;
+        }
+    }
+    target_mask = poll_target_mask(c);
+    if(target_mask == 0) {
+        addReplyError(c, "No board to poll, set the active XEM(s) first");
+        return;
+    }
+
+    // Re-adding a group replaces it
+    group = find_group(argv[1]);
+    if(!group) {
+        for(i=0; i<POLL_MAX_GROUPS; i++) {
+            if(!groups[i].in_use) {
+                group = &groups[i];
+                break;
+            }
+        }
+    }
+    if(!group) {
+        addReplyErrorFormat(c, "Too many poll groups, max is %i", POLL_MAX_GROUPS);
+        return;
+    }
+
+    unsigned int generation = group->generation + 1;
+    memset(group, 0, sizeof(PollGroup));
+    group->generation = generation;
+    group->in_use = 1;
+    strcpy(group->name, argv[1]);
+    strcpy(group->stream, argv[4]);
+    group->maxlen = maxlen;
+    group->decode = decode;
+    group->period_ms = period_ms;
+    group->next_due_ms = poll_now_us()/1000;
+    memcpy(group->addrs, addrs, sizeof(uint32_t)*num_regs);
+    group->num_regs = num_regs;
+    group->target_mask = target_mask;
+
+    if(tick_timer_id == -1) {
+        tick_timer_id = aeCreateTimeEvent(poll_el, POLL_TICK_MS, poll_tick, NULL, NULL);
+    }
+    poll_redis_connect();
+    daq_log(LOG_INFO, "Added poll group '%s', %i registers every %lld ms to stream '%s'",
+            group->name, group->num_regs, group->period_ms, group->stream);
+    addReplyStatus(c, "OK");
+}
+
+void poll_remove_command(client* c, int argc, sds* argv) {
+    UNUSED(argc);
+    PollGroup* group = find_group(argv[1]);
+    if(!group) {
+        addReplyErrorFormat(c, "No poll group named '%s'", argv[1]);
+        return;
+    }
+    // Any request that's still out will see the group is gone
+    group->in_use = 0;
+    daq_log(LOG_INFO, "Removed poll group '%s'", group->name);
+    addReplyStatus(c, "OK");
+}
+
+// Replies with one array per group:
+// name, period_ms, decode, stream, maxlen, target mask, num polls, num errors, registers...
+void poll_list_command(client* c, int argc, sds* argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    int num_groups = 0;
+    int i, j;
+    for(i=0; i<POLL_MAX_GROUPS; i++) {
+        num_groups += groups[i].in_use;
+    }
+    addReplyLongLongWithPrefix(c, num_groups, '*');
+    for(i=0; i<POLL_MAX_GROUPS; i++) {
+        PollGroup* group = &groups[i];
+        if(!group->in_use) {
+            continue;
+        }
+        addReplyLongLongWithPrefix(c, 8 + group->num_regs, '*');
+        addReplyBulkCBuffer(c, group->name, strlen(group->name));
+        addReplyLongLong(c, group->period_ms);
+        addReplyBulkCBuffer(c, decode_names[group->decode], strlen(decode_names[group->decode]));
+        addReplyBulkCBuffer(c, group->stream, strlen(group->stream));
+        addReplyLongLong(c, group->maxlen);
+        addReplyLongLong(c, group->target_mask);
+        addReplyLongLong(c, group->num_polls);
+        addReplyLongLong(c, group->num_errors);
+        for(j=0; j<group->num_regs; j++) {
+            addReplyLongLong(c, group->addrs[j]);
+        }
+    }
+}
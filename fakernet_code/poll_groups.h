@@ -0,0 +1,72 @@
+#ifndef __POLL_GROUPS__
+#define __POLL_GROUPS__
+#include <inttypes.h>
+#include "ae.h"
+#include "server.h"
+#include "fnet_async.h"
+
+// Server side register polling.
+// Clients register named "poll groups", a list of registers that get read
+// every 'period' milliseconds. The registers of every group that's due are
+// packed in to one (pipelined) UDP request per board, done without blocking the
+// server, and the results get XADD'd to a redis stream with a MAXLEN.
+// Commands:
+//      poll_add <name> <period_ms> <raw|delta|rate> <stream> <maxlen> <addr> [<addr> ...]
+//      poll_remove <name>
+//      poll_list
+// The decode rule says what gets written to the stream for each register,
+// either the raw value, the change since the previous poll, or the change
+// per second. Each stream entry has the fields "device_id", "time", then one
+// field per register named by its address in hex.
+#define POLL_MAX_GROUPS 32
+#define POLL_MAX_REGS 64
+#define POLL_MAX_TARGETS 16
+#define POLL_NAME_MAX 64
+#define POLL_TICK_MS 10
+
+typedef enum PollDecode {
+    POLL_DECODE_RAW=0,
+    POLL_DECODE_DELTA,
+    POLL_DECODE_RATE
+} PollDecode;
+
+typedef struct PollGroup {
+    int in_use;
+    unsigned int generation; // Bumped every time the slot is re-used
+    char name[POLL_NAME_MAX];
+    char stream[POLL_NAME_MAX];
+    long maxlen;
+    PollDecode decode;
+    long long period_ms;
+    long long next_due_ms;
+    uint32_t addrs[POLL_MAX_REGS];
+    int num_regs;
+    uint32_t target_mask; // Which boards to poll
+    uint32_t in_flight_mask; // Boards with a request outstanding
+    // Previous reading for each board, for the delta & rate decode rules
+    int have_prev[POLL_MAX_TARGETS];
+    uint32_t prev_values[POLL_MAX_TARGETS][POLL_MAX_REGS];
+    long long prev_time_us[POLL_MAX_TARGETS];
+    unsigned long long num_polls;
+    unsigned long long num_errors;
+} PollGroup;
+
+// 'redis_host' is where the streams get written to, TCP on the default port.
+void poll_groups_init(aeEventLoop* el, const char* redis_host, uint32_t safe_read_addr);
+// Boards have to be added in the same order as the bits the main program's
+// poll_target_mask() uses. 'conn' can be NULL (dummy mode), then every
+// register reads as 0xDEADBEEF.
+int poll_groups_add_target(int device_id, FnetAsyncConn* conn);
+// For a board that can't be polled (no connection to it), so the boards
+// after it keep their place. Groups never poll it.
+int poll_groups_add_disabled_target(int device_id);
+
+void poll_add_command(client* c, int argc, sds* argv);
+void poll_remove_command(client* c, int argc, sds* argv);
+void poll_list_command(client* c, int argc, sds* argv);
+
+// Which targets (bit i is the i'th target added) a client's poll_add should
+// apply to, zero if it can't poll right now. Should be provided by the "main"
+// program.
+uint32_t poll_target_mask(client* c);
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "reg_batch.h"
+
+#define AXI_ADDR_MASK 0x3FFFFFF // Only the first 25-bits are valid
+
+// Set to zero to go back to sending each read on its own, with a safe read
+// after it, and to the old two round trip double_read_addr.
+int reg_batch_pipelined_reads = 1;
+
+void reg_batch_init(RegBatch* batch) {
+    batch->num_accesses = 0;
+    batch->overflow = 0;
+}
+
+static RegAccess* reg_batch_next(RegBatch* batch) {
+    if(batch->num_accesses >= REG_BATCH_MAX_ACCESSES) {
+        printf("Too many register accesses in one batch, max is %i\n", REG_BATCH_MAX_ACCESSES);
+        batch->overflow = 1;
+        return NULL;
+    }
+    return &(batch->accesses[batch->num_accesses++]);
+}
+
+int reg_batch_write(RegBatch* batch, uint32_t base, uint32_t offset, uint32_t data) {
+    RegAccess* access = reg_batch_next(batch);
+    if(!access) {
+        return -1;
+    }
+    access->addr = (base + offset) & AXI_ADDR_MASK;
+    access->data = data;
+    access->result = NULL;
+    access->is_read = 0;
+    return 0;
+}
+
+int reg_batch_read(RegBatch* batch, uint32_t base, uint32_t offset, uint32_t* result) {
+    RegAccess* access = reg_batch_next(batch);
+    if(!access) {
+        return -1;
+    }
+    access->addr = (base + offset) & AXI_ADDR_MASK;
+    access->data = 0;
+    access->result = result;
+    access->is_read = 1;
+    // If the read never happens this is what the caller sees, same as what
+    // read_qspi_addr, read_jesd, etc. return on failure.
+    if(result) {
+        *result = -1;
+    }
+    return 0;
+}
+
+int reg_batch_append(RegBatch* batch, const RegBatch* other) {
+    if(batch->overflow || other->overflow ||
+       batch->num_accesses + other->num_accesses > REG_BATCH_MAX_ACCESSES) {
+        return -1;
+    }
+    memcpy(&batch->accesses[batch->num_accesses], other->accesses, sizeof(RegAccess)*other->num_accesses);
+    batch->num_accesses += other->num_accesses;
+    return 0;
+}
+
+// Send the first 'num_items' of the client's send buffer and copy the read
+// values out of the response
+static int send_items(struct fnet_ctrl_client* client, int num_items, uint32_t** results) {
+    fakernet_reg_acc_item *send;
+    fakernet_reg_acc_item *recv;
+    int i;
+
+    fnet_ctrl_get_send_recv_bufs(client, &send, &recv);
+    int ret = fnet_ctrl_send_recv_regacc(client, num_items);
+    if(ret <= 0) {
+        printf("ERROR %i\n", ret);
+        const char* last_error = fnet_ctrl_last_error(client);
+        if(last_error) {
+            printf("%s\n", last_error);
+        }
+        printf("%s\n", strerror(errno));
+        return -1;
+    }
+    for(i=0; i<num_items; i++) {
+        if(results[i]) {
+            *results[i] = ntohl(recv[i].data);
+        }
+    }
+    return 0;
+}
+
+// Queue a read of the safe address in the packet. Its response holds the
+// value of the read before it.
+static void add_safe_read(fakernet_reg_acc_item* send, uint32_t** results, int* num_items,
+                          uint32_t safe_read_addr, uint32_t* result) {
+    send[*num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | safe_read_addr);
+    send[*num_items].data = htonl(0x0);
+    results[*num_items] = result;
+    (*num_items)++;
+}
+
+// Pack the batch in to as few UDP packets as possible and send them.
+// The batch is emptied afterwards (whether or not it succeeded).
+// Returns 0 on success.
+//
+// The M_AXI bridge has a 1-read latency, the response to each read holds the
+// value of the read before it. So a run of reads A, B, C is sent as
+// A, B, C, SAFE and the values are taken from the responses to B, C and SAFE.
+// A run of reads always ends with the safe read in the same packet, before any
+// write and before the packet ends.
+int reg_batch_send(struct fnet_ctrl_client* client, RegBatch* batch, uint32_t safe_read_addr) {
+    fakernet_reg_acc_item *send;
+    fakernet_reg_acc_item *recv;
+    // For each item in the packet, where its response value should go
+    uint32_t* results[FAKERNET_REG_ACCESS_MAX_ITEMS];
+    // Non-zero if the last item in the packet is a read whose value hasn't
+    // been collected yet, and where that value should go.
+    int read_pending = 0;
+    uint32_t* pending_result = NULL;
+    int num_items = 0;
+    int ret = 0;
+    int i;
+
+    if(batch->overflow) {
+        // Don't send half of what the caller wanted
+        reg_batch_init(batch);
+        return -1;
+    }
+
+    fnet_ctrl_get_send_recv_bufs(client, &send, &recv);
+    safe_read_addr &= AXI_ADDR_MASK;
+
+    for(i=0; i<batch->num_accesses; i++) {
+        const RegAccess* access = &(batch->accesses[i]);
+        const int pipelined = access->is_read && read_pending && reg_batch_pipelined_reads;
+        int items_needed;
+
+        if(access->is_read) {
+            // The read plus room for the safe read that ends the run, and if
+            // it can't join the current run the safe read that ends that one
+            items_needed = pipelined ? 2 : 2 + read_pending;
+        }
+        else {
+            items_needed = 1 + read_pending;
+        }
+
+        if(num_items + items_needed > FAKERNET_REG_ACCESS_MAX_ITEMS) {
+            if(read_pending) {
+                add_safe_read(send, results, &num_items, safe_read_addr, pending_result);
+                read_pending = 0;
+            }
+            if(send_items(client, num_items, results)) {
+                ret = -1;
+                goto DONE;
+            }
+            num_items = 0;
+        }
+
+        if(read_pending && !pipelined) {
+            add_safe_read(send, results, &num_items, safe_read_addr, pending_result);
+            read_pending = 0;
+        }
+
+        if(access->is_read) {
+            send[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | access->addr);
+            send[num_items].data = htonl(0x0);
+            // This read's response is the previous read's value
+            results[num_items] = read_pending ? pending_result : NULL;
+            num_items++;
+            read_pending = 1;
+            pending_result = access->result;
+        }
+        else {
+            send[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_WRITE | access->addr);
+            send[num_items].data = htonl(access->data);
+            results[num_items] = NULL;
+            num_items++;
+        }
+    }
+    if(read_pending) {
+        add_safe_read(send, results, &num_items, safe_read_addr, pending_result);
+    }
+    if(num_items > 0 && send_items(client, num_items, results)) {
+        ret = -1;
+    }
+
+DONE:
+    reg_batch_init(batch);
+    return ret;
+}
+
+// Reads a single register using one packet (the read followed by a read of the
+// safe address). This is what double_read_addr uses.
+int reg_read_pipelined(struct fnet_ctrl_client* client, uint32_t addr, uint32_t safe_read_addr, uint32_t* result) {
+    fakernet_reg_acc_item *send;
+    fakernet_reg_acc_item *recv;
+    uint32_t* results[2];
+    int num_items = 0;
+
+    fnet_ctrl_get_send_recv_bufs(client, &send, &recv);
+
+    send[num_items].addr = htonl(FAKERNET_REG_ACCESS_ADDR_READ | (addr & AXI_ADDR_MASK));
+    send[num_items].data = htonl(0x0);
+    results[num_items] = NULL;
+    num_items++;
+    add_safe_read(send, results, &num_items, safe_read_addr & AXI_ADDR_MASK, result);
+
+    return send_items(client, num_items, results);
+}
@@ -0,0 +1,56 @@
+#ifndef __REG_BATCH__
+#define __REG_BATCH__
+#include <inttypes.h>
+#include <stdlib.h>
+#include "fnet_client.h"
+
+// A sequence of register reads and writes that gets sent to the FPGA in as
+// few UDP packets as possible, instead of one round trip per register.
+// Accesses are performed in the order they're queued.
+// Usage:
+//      RegBatch batch;
+//      reg_batch_init(&batch);
+//      reg_batch_write(&batch, base, offset, value);
+//      reg_batch_read(&batch, base, offset, &result);
+//      commit_reg_batch(&batch); // 'result' is valid after this returns
+#define REG_BATCH_MAX_ACCESSES 512
+
+typedef struct RegAccess {
+    uint32_t addr; // AXI address, i.e. base + offset
+    uint32_t data; // Value to write, unused for reads
+    uint32_t* result; // Where to put the read value, unused for writes
+    int is_read;
+} RegAccess;
+
+typedef struct RegBatch {
+    RegAccess accesses[REG_BATCH_MAX_ACCESSES];
+    int num_accesses;
+    int overflow; // Set if more accesses were queued than fit in the batch
+} RegBatch;
+
+void reg_batch_init(RegBatch* batch);
+int reg_batch_write(RegBatch* batch, uint32_t base, uint32_t offset, uint32_t data);
+int reg_batch_read(RegBatch* batch, uint32_t base, uint32_t offset, uint32_t* result);
+// Adds all of 'other's accesses to the end of 'batch'. Returns -1 (and
+// leaves 'batch' alone) if they don't all fit.
+int reg_batch_append(RegBatch* batch, const RegBatch* other);
+int reg_batch_send(struct fnet_ctrl_client* client, RegBatch* batch, uint32_t safe_read_addr);
+int reg_read_pipelined(struct fnet_ctrl_client* client, uint32_t addr, uint32_t safe_read_addr, uint32_t* result);
+
+// If non-zero (the default) consecutive reads share one trailing read of the
+// safe address and single reads take one packet instead of two.
+extern int reg_batch_pipelined_reads;
+
+// Sends the batch to the active FPGA then empties it so it can be re-used.
+// Returns 0 on success. Should be provided by the "main" program, the same as
+// read_addr & write_addr.
+int commit_reg_batch(RegBatch* batch);
+
+// While a MULTI/EXEC transaction runs the main program holds back single
+// register writes so they can go out together with the next read or batch
+// (see serverSetTransactionHooks). This sends anything that's being held
+// back. Code that needs time to pass between two writes, like a reset pulse
+// done with usleep, should call it before sleeping. Returns 0 on success.
+// Provided by the "main" program.
+int flush_reg_writes(void);
+#endif
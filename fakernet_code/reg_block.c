@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include "reg_block.h"
+
+// Checked in 64 bits so a big count or stride can't wrap back around to
+// the start of the register space
+static int block_fits(uint32_t addr, uint32_t count, uint32_t stride) {
+    return count > 0 && (uint64_t)addr + (uint64_t)(count-1)*stride <= REG_BLOCK_ADDR_MASK;
+}
+
+int reg_block_read(uint32_t addr, uint32_t count, uint32_t stride, uint32_t* values) {
+    RegBatch batch;
+    uint32_t i = 0;
+
+    if(!block_fits(addr, count, stride)) {
+        return -1;
+    }
+    while(i < count) {
+        reg_batch_init(&batch);
+        while(i < count && batch.num_accesses < REG_BATCH_MAX_ACCESSES) {
+            reg_batch_read(&batch, addr + i*stride, 0, &values[i]);
+            i++;
+        }
+        if(commit_reg_batch(&batch)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parse_uint(sds arg, uint32_t* value) {
+    char* end;
+    *value = strtoul(arg, &end, 0);
+    return (end == arg || *end != '\0') ? -1 : 0;
+}
+
+void read_block_command(client* c, int argc, sds* argv) {
+    uint32_t addr, count;
+    uint32_t stride = 4;
+    uint32_t* values;
+    uint32_t i;
+
+    if(argc > 4) {
+        addReplyError(c, "Usage: read_block <addr> <count> [stride]");
+        return;
+    }
+    if(parse_uint(argv[1], &addr)) {
+        addReplyErrorFormat(c, "'%s' is not a valid address", argv[1]);
+        return;
+    }
+    if(parse_uint(argv[2], &count) || count == 0 || count > REG_BLOCK_MAX_COUNT) {
+        addReplyErrorFormat(c, "Count must be between 1 and %i", REG_BLOCK_MAX_COUNT);
+        return;
+    }
+    if(argc == 4 && parse_uint(argv[3], &stride)) {
+        addReplyErrorFormat(c, "'%s' is not a valid stride", argv[3]);
+        return;
+    }
+    if(!block_fits(addr, count, stride)) {
+        addReplyErrorFormat(c, "Block runs past the last register address (0x%X)", REG_BLOCK_ADDR_MASK);
+        return;
+    }
+
+    values = malloc(sizeof(uint32_t)*count);
+    if(!values) {
+        addReplyError(c, "Out of memory");
+        return;
+    }
+    if(reg_block_read(addr, count, stride, values)) {
+        addReplyError(c, "failed to read block from FPGA.");
+        free(values);
+        return;
+    }
+    for(i=0; i<count; i++) {
+        values[i] = htonl(values[i]);
+    }
+    addReplyBulkCBuffer(c, values, sizeof(uint32_t)*count);
+    free(values);
+}
@@ -0,0 +1,26 @@
+#ifndef __REG_BLOCK__
+#define __REG_BLOCK__
+#include <inttypes.h>
+#include "server.h"
+#include "reg_batch.h"
+
+// Reading a block of registers in one command, for ILA captures, FIFO dumps
+// and the like, where one read_addr per word is way too slow.
+// Command:
+//      read_block <addr> <count> [stride]
+// Reads 'count' registers starting at 'addr', 'stride' bytes apart (default
+// 4, 0 reads the same register 'count' times, e.g. to drain a FIFO). The
+// reads are batched, REG_BATCH_MAX_ACCESSES per commit_reg_batch. The reply
+// is one bulk string of the values packed as 32-bit big-endian words, or an
+// error if any of the reads failed.
+// The reads hold up the server (and are done one XEM after another), so the
+// count is kept to what can be read in a few tens of ms. Bigger dumps should
+// be done in pieces.
+#define REG_BLOCK_MAX_COUNT (1<<14) // 64 kB of reply
+#define REG_BLOCK_ADDR_MASK 0x3FFFFFF // Highest register address
+
+// Reads the block in to 'values', in host byte order. Returns 0 on success,
+// -1 if a read failed or the block runs past the last register address.
+int reg_block_read(uint32_t addr, uint32_t count, uint32_t stride, uint32_t* values);
+void read_block_command(client* c, int argc, sds* argv);
+#endif
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reg_cache.h"
+
+#define AXI_ADDR_MASK 0x3FFFFFF
+
+RegCache* reg_cache_new(const RegMapEntry* map) {
+    RegCache* cache = calloc(1, sizeof(RegCache));
+    if(cache) {
+        cache->map = map;
+    }
+    return cache;
+}
+
+void reg_cache_free(RegCache* cache) {
+    free(cache);
+}
+
+RegClass reg_cache_class(RegCache* cache, uint32_t addr) {
+    const RegMapEntry* entry;
+    if(!cache || !cache->map) {
+        return REG_VOLATILE;
+    }
+    addr &= AXI_ADDR_MASK;
+    for(entry = cache->map; entry->end != 0; entry++) {
+        if(addr >= entry->start && addr < entry->end) {
+            return entry->reg_class;
+        }
+    }
+    return REG_VOLATILE;
+}
+
+// Open addressing, slots are never given back so a probe can stop at the
+// first unused one.
+static RegCacheEntry* find_entry(RegCache* cache, uint32_t addr, int create) {
+    uint32_t hash = ((addr >> 2) * 2654435761u) & (REG_CACHE_SIZE - 1);
+    int i;
+    for(i=0; i<REG_CACHE_SIZE; i++) {
+        RegCacheEntry* entry = &cache->entries[(hash + i) & (REG_CACHE_SIZE - 1)];
+        if(entry->in_use && entry->addr == addr) {
+            return entry;
+        }
+        if(!entry->in_use) {
+            if(!create) {
+                return NULL;
+            }
+            entry->in_use = 1;
+            entry->addr = addr;
+            entry->valid = 0;
+            return entry;
+        }
+    }
+    // Full, just don't cache it
+    return NULL;
+}
+
+int reg_cache_lookup(RegCache* cache, uint32_t addr, uint32_t* value) {
+    RegCacheEntry* entry;
+    if(!cache) {
+        return 0;
+    }
+    addr &= AXI_ADDR_MASK;
+    if(reg_cache_class(cache, addr) != REG_CONFIG) {
+        cache->uncached++;
+        return 0;
+    }
+    entry = find_entry(cache, addr, 0);
+    if(entry && entry->valid) {
+        cache->hits++;
+        *value = entry->value;
+        return 1;
+    }
+    cache->misses++;
+    return 0;
+}
+
+static void store(RegCache* cache, uint32_t addr, uint32_t value) {
+    RegCacheEntry* entry = find_entry(cache, addr, 1);
+    if(entry) {
+        if(!entry->valid) {
+            cache->num_valid++;
+        }
+        entry->value = value;
+        entry->valid = 1;
+    }
+}
+
+void reg_cache_fill(RegCache* cache, uint32_t addr, uint32_t value) {
+    if(!cache) {
+        return;
+    }
+    addr &= AXI_ADDR_MASK;
+    if(reg_cache_class(cache, addr) == REG_CONFIG) {
+        store(cache, addr, value);
+    }
+}
+
+void reg_cache_write(RegCache* cache, uint32_t addr, uint32_t value) {
+    if(!cache) {
+        return;
+    }
+    addr &= AXI_ADDR_MASK;
+    cache->writes++;
+    switch(reg_cache_class(cache, addr)) {
+        case REG_CONFIG:
+            store(cache, addr, value);
+            break;
+        case REG_RESET:
+            reg_cache_invalidate_all(cache);
+            break;
+        case REG_VOLATILE:
+        case REG_FIFO:
+        default:
+            break;
+    }
+}
+
+void reg_cache_invalidate(RegCache* cache, uint32_t addr) {
+    RegCacheEntry* entry;
+    if(!cache) {
+        return;
+    }
+    entry = find_entry(cache, addr & AXI_ADDR_MASK, 0);
+    if(entry && entry->valid) {
+        entry->valid = 0;
+        cache->num_valid--;
+        cache->invalidations++;
+    }
+}
+
+void reg_cache_invalidate_all(RegCache* cache) {
+    int i;
+    if(!cache) {
+        return;
+    }
+    for(i=0; i<REG_CACHE_SIZE; i++) {
+        cache->entries[i].valid = 0;
+    }
+    cache->invalidations += cache->num_valid;
+    cache->num_valid = 0;
+}
+
+int reg_cache_batch_lookup(RegCache* cache, RegBatch* batch) {
+    int i;
+    uint32_t value;
+    if(!cache || batch->overflow || batch->num_accesses == 0) {
+        return 0;
+    }
+    for(i=0; i<batch->num_accesses; i++) {
+        const RegAccess* access = &batch->accesses[i];
+        if(!access->is_read || reg_cache_class(cache, access->addr) != REG_CONFIG) {
+            return 0;
+        }
+        RegCacheEntry* entry = find_entry(cache, access->addr, 0);
+        if(!entry || !entry->valid) {
+            return 0;
+        }
+    }
+    for(i=0; i<batch->num_accesses; i++) {
+        reg_cache_lookup(cache, batch->accesses[i].addr, &value);
+        if(batch->accesses[i].result) {
+            *(batch->accesses[i].result) = value;
+        }
+    }
+    reg_batch_init(batch);
+    return 1;
+}
+
+void reg_cache_batch_done(RegCache* cache, const RegAccess* accesses, int num_accesses, int ok) {
+    int i;
+    if(!cache) {
+        return;
+    }
+    for(i=0; i<num_accesses; i++) {
+        const RegAccess* access = &accesses[i];
+        if(!access->is_read) {
+            if(ok) {
+                reg_cache_write(cache, access->addr, access->data);
+            }
+            else {
+                // Don't know if it made it or not
+                reg_cache_invalidate(cache, access->addr);
+            }
+        }
+        else if(ok && access->result) {
+            reg_cache_fill(cache, access->addr, *(access->result));
+        }
+    }
+}
+
+void cache_stats_command(client* c, int argc, sds* argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    RegCache* cache = active_reg_cache();
+    if(!cache) {
+        addReplyError(c, "No register cache");
+        return;
+    }
+    addReplyLongLongWithPrefix(c, 6, '*');
+    addReplyLongLong(c, cache->hits);
+    addReplyLongLong(c, cache->misses);
+    addReplyLongLong(c, cache->uncached);
+    addReplyLongLong(c, cache->writes);
+    addReplyLongLong(c, cache->invalidations);
+    addReplyLongLong(c, cache->num_valid);
+}
+
+void invalidate_command(client* c, int argc, sds* argv) {
+    RegCache* cache = active_reg_cache();
+    char* end;
+    if(argc > 2) {
+        addReplyError(c, "Usage: invalidate [addr]");
+        return;
+    }
+    if(argc == 2) {
+        uint32_t addr = strtoul(argv[1], &end, 0);
+        if(*end != '\0' || end == argv[1]) {
+            addReplyErrorFormat(c, "'%s' is not a valid address", argv[1]);
+            return;
+        }
+        reg_cache_invalidate(cache, addr);
+    }
+    else {
+        reg_cache_invalidate_all(cache);
+    }
+    addReplyStatus(c, "OK");
+}
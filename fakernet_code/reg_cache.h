@@ -0,0 +1,76 @@
+#ifndef __REG_CACHE__
+#define __REG_CACHE__
+#include <inttypes.h>
+#include "server.h"
+#include "reg_batch.h"
+
+// Per-board shadow copy of the registers only the server writes, so reading
+// back a threshold or mask doesn't cost a double read over UDP.
+// Which registers can be cached comes from a register map, a list of AXI
+// address ranges and what kind of register is in each. Anything not in the
+// map is treated as volatile and is always read from the board.
+// Writes (including batched ones) go through the cache, and successful reads
+// of config registers fill it.
+#define REG_CACHE_SIZE 1024 // Must be a power of 2
+
+typedef enum RegClass {
+    REG_VOLATILE=0, // Status and counters, the FPGA changes these
+    REG_CONFIG,     // Only changes when written by the server, can be cached
+    REG_FIFO,       // Reading pops a value, must never be cached
+    REG_RESET       // Writing resets other registers, drops the whole cache
+} RegClass;
+
+typedef struct RegMapEntry {
+    uint32_t start; // AXI address of the first register
+    uint32_t end;   // One past the last
+    RegClass reg_class;
+} RegMapEntry;
+
+typedef struct RegCacheEntry {
+    uint32_t addr;
+    uint32_t value;
+    int in_use; // The slot has been given to 'addr'
+    int valid;  // 'value' is current
+} RegCacheEntry;
+
+typedef struct RegCache {
+    const RegMapEntry* map; // Terminated by an entry with end == 0
+    RegCacheEntry entries[REG_CACHE_SIZE];
+    int num_valid;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long uncached; // Reads of registers that can't be cached
+    unsigned long long writes;
+    unsigned long long invalidations;
+} RegCache;
+
+RegCache* reg_cache_new(const RegMapEntry* map);
+void reg_cache_free(RegCache* cache);
+RegClass reg_cache_class(RegCache* cache, uint32_t addr);
+// Returns 1 and sets 'value' if 'addr' is cached, 0 otherwise.
+int reg_cache_lookup(RegCache* cache, uint32_t addr, uint32_t* value);
+// Call with the value of every successful read
+void reg_cache_fill(RegCache* cache, uint32_t addr, uint32_t value);
+// Call with every successful write
+void reg_cache_write(RegCache* cache, uint32_t addr, uint32_t value);
+void reg_cache_invalidate(RegCache* cache, uint32_t addr);
+void reg_cache_invalidate_all(RegCache* cache);
+// Fills in the results and empties the batch if it's nothing but reads of
+// cached registers. Returns 1 if it did, otherwise the batch has to be sent.
+int reg_cache_batch_lookup(RegCache* cache, RegBatch* batch);
+// Call after sending a batch. Sending empties the batch, so this takes the
+// accesses and how many there were, 'ok' is whether the send succeeded.
+void reg_cache_batch_done(RegCache* cache, const RegAccess* accesses, int num_accesses, int ok);
+
+// cache_stats
+//      Replies with hits, misses, uncached reads, writes, invalidations, and
+//      the number of cached registers.
+// invalidate [addr]
+//      Drops one register, or everything, from the cache.
+void cache_stats_command(client* c, int argc, sds* argv);
+void invalidate_command(client* c, int argc, sds* argv);
+
+// The cache for the board commands are currently going to, or NULL if there
+// isn't one. Should be provided by the "main" program.
+RegCache* active_reg_cache(void);
+#endif
@@ -50,3 +50,12 @@ uint32_t read_reset_gen_mask(AXI_RESET_GEN *reset_gen) {
 uint32_t reset_gen_do_reset(AXI_RESET_GEN *reset_gen) {
     return write_reset_gen(reset_gen->axi_addr, RESET_GEN_DO_RESET_OFFSET, 1);
 }
+
+// Sets the mask & length and does the reset, all in one batch
+int batch_reset_gen_do_reset(RegBatch* batch, AXI_RESET_GEN *reset_gen, uint32_t mask, uint32_t length) {
+    if(reg_batch_write(batch, reset_gen->axi_addr, RESET_GEN_MASK_OFFSET, mask) ||
+       reg_batch_write(batch, reset_gen->axi_addr, RESET_GEN_LENGTH_OFFSET, length)) {
+        return -1;
+    }
+    return reg_batch_write(batch, reset_gen->axi_addr, RESET_GEN_DO_RESET_OFFSET, 1);
+}
@@ -2,6 +2,7 @@
 #define __RESET_GEN_IF__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
 
 typedef struct AXI_RESET_GEN {
     const char* name;
@@ -14,5 +15,6 @@ uint32_t read_reset_gen_length(AXI_RESET_GEN *reset_gen);
 uint32_t write_reset_gen_mask(AXI_RESET_GEN *reset_gen, uint32_t mask);
 uint32_t read_reset_gen_mask(AXI_RESET_GEN *reset_gen);
 uint32_t reset_gen_do_reset(AXI_RESET_GEN *reset_gen);
+int batch_reset_gen_do_reset(RegBatch* batch, AXI_RESET_GEN *reset_gen, uint32_t mask, uint32_t length);
 #endif
 
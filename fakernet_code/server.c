@@ -14,11 +14,15 @@
 #include <signal.h>
 #include <stdarg.h> // TODO Remove this once _serverPanic & _serverAssert are removed
 #include <stdio.h> // TODO Remove this once _serverPanic & _serverAssert are removed
+#include <ctype.h>
 
 #include "server_common.h"
 #include "server.h"
 #include "ae.h"
 #include "anet.h"
+#include "fnet_client.h"
+#include "latency_hist.h"
+#include "daq_logger.h"
 
 
 /* Output buffer limits presets. */
@@ -28,6 +32,31 @@ clientBufferLimitsConfig clientBufferLimitsDefaults = {0, 0, 0}; /* normal */
 struct Server server;
 ServerCommand* server_command_table;
 ServerCommand send_command_table_command = {"send_command_table", send_command_table, NULL, 1, 0, 0, 0};
+ServerCommand command_stats_command = {"command_stats", command_stats, NULL, -1, 0, 0, 0};
+ServerCommand multi_command = {"multi", multiCommand, NULL, 1, 0, 0, 0};
+ServerCommand exec_command = {"exec", execCommand, NULL, 1, 0, 0, 0};
+ServerCommand discard_command = {"discard", discardCommand, NULL, 1, 0, 0, 0};
+
+// Commands every server has, on top of server_command_table
+static ServerCommand* built_in_commands[] = {&send_command_table_command, &command_stats_command,
+                                             &multi_command, &exec_command, &discard_command};
+#define NUM_BUILT_IN_COMMANDS ((int)(sizeof(built_in_commands)/sizeof(built_in_commands[0])))
+
+// Hash table (open addressing) from command name to command, built once the
+// command table is known, so a lookup doesn't have to strcasecmp its way
+// through a few hundred commands.
+static ServerCommand** command_lookup = NULL;
+static unsigned int command_lookup_mask = 0;
+
+// Latency of each command, split into time spent waiting on the FPGA and the
+// rest. Indexed the same as server_command_table, with the built in commands
+// at the end.
+typedef struct CommandStats {
+    LatencyHist udp_wait;
+    LatencyHist processing;
+} CommandStats;
+static CommandStats* command_stats_table = NULL;
+static int num_table_commands = 0;
 
 // stolen from redis/server.c
 void daemonize(void) {
@@ -66,6 +95,7 @@ void _serverPanic(const char *file, int line, const char *msg, ...) {
     serverLog(LL_WARNING,"!!! Software Failure. Press left mouse button to continue");
     serverLog(LL_WARNING,"Guru Meditation: %s #%s:%d",fmtmsg,file,line);
     serverLog(LL_WARNING,"------------------------------------------------");
+    daq_log_flush();
     *((char*)-1) = 'x';
 }
 
@@ -314,21 +344,177 @@ int listenToPort(int port, int *fds, int *count) {
     return C_OK;
 }
 
-ServerCommand *lookupCommand(sds name) {
-    if(strcasecmp(name, send_command_table_command.name) == 0) {
-        return &send_command_table_command;
+// FNV-1a, case insensitive since command names are
+static unsigned int command_name_hash(const char* name) {
+    unsigned int hash = 2166136261u;
+    while(*name) {
+        hash ^= (unsigned char)tolower((unsigned char)*name++);
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    ServerCommand* command = server_command_table;
-    while(command->func || command->legacy_func) {
-        if(strcasecmp(name, command->name) == 0) {
-            return command;
+static void command_lookup_insert(ServerCommand* command) {
+    unsigned int i = command_name_hash(command->name) & command_lookup_mask;
+    while(command_lookup[i]) {
+        // First one wins if a name is in the table twice, same as a linear search
+        if(strcasecmp(command_lookup[i]->name, command->name) == 0) {
+            return;
         }
+        i = (i + 1) & command_lookup_mask;
+    }
+    command_lookup[i] = command;
+}
+
+static void buildCommandLookup(void) {
+    unsigned int size = 16;
+    int i;
+    ServerCommand* command = server_command_table;
+
+    while(command && (command->func || command->legacy_func)) {
         command++;
     }
+    num_table_commands = server_command_table ? command - server_command_table : 0;
+
+    // Keep it at most half full
+    while(size < 2*(unsigned int)(num_table_commands + NUM_BUILT_IN_COMMANDS)) {
+        size *= 2;
+    }
+    command_lookup = calloc(size, sizeof(ServerCommand*));
+    command_stats_table = calloc(num_table_commands + NUM_BUILT_IN_COMMANDS, sizeof(CommandStats));
+    if(!command_lookup || !command_stats_table) {
+        serverPanic("Can't allocate the command table");
+    }
+    command_lookup_mask = size - 1;
+
+    for(i=0; i<NUM_BUILT_IN_COMMANDS; i++) {
+        command_lookup_insert(built_in_commands[i]);
+    }
+    for(i=0; i<num_table_commands; i++) {
+        command = &server_command_table[i];
+        if(!command->func && (command->nargs - 1 > LEGACY_MAX_INTS || command->nresp > LEGACY_MAX_INTS)) {
+            serverPanic("Command '%s' has more than %i arguments or responses", command->name, LEGACY_MAX_INTS);
+        }
+        command_lookup_insert(command);
+    }
+}
+
+ServerCommand *lookupCommand(sds name) {
+    unsigned int i = command_name_hash(name) & command_lookup_mask;
+    if(!command_lookup) {
+        return NULL;
+    }
+    while(command_lookup[i]) {
+        if(strcasecmp(name, command_lookup[i]->name) == 0) {
+            return command_lookup[i];
+        }
+        i = (i + 1) & command_lookup_mask;
+    }
+    return NULL;
+}
+
+static CommandStats* stats_for_command(ServerCommand* command) {
+    int i;
+    if(command >= server_command_table && command < server_command_table + num_table_commands) {
+        return &command_stats_table[command - server_command_table];
+    }
+    for(i=0; i<NUM_BUILT_IN_COMMANDS; i++) {
+        if(command == built_in_commands[i]) {
+            return &command_stats_table[num_table_commands + i];
+        }
+    }
     return NULL;
 }
 
+static void record_command_stats(ServerCommand* command, long long duration, long long udp_wait) {
+    CommandStats* stats = stats_for_command(command);
+    command->microseconds += duration;
+    command->calls++;
+    if(stats) {
+        latency_hist_record(&stats->udp_wait, udp_wait);
+        latency_hist_record(&stats->processing, duration - udp_wait);
+    }
+}
+
+static ServerCommand* command_at(int index) {
+    return index < num_table_commands ? &server_command_table[index] : built_in_commands[index - num_table_commands];
+}
+
+static long long total_command_time(int index) {
+    return command_stats_table[index].udp_wait.total + command_stats_table[index].processing.total;
+}
+
+static int compare_total_time(const void* a, const void* b) {
+    long long ta = total_command_time(*(const int*)a);
+    long long tb = total_command_time(*(const int*)b);
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+static void add_command_stats_reply(client* c, int index) {
+    CommandStats* stats = &command_stats_table[index];
+    const char* name = command_at(index)->name;
+    addReplyLongLongWithPrefix(c, 8, '*');
+    addReplyBulkCBuffer(c, name, strlen(name));
+    addReplyLongLong(c, stats->processing.count);
+    addReplyLongLong(c, latency_hist_percentile(&stats->udp_wait, 50));
+    addReplyLongLong(c, latency_hist_percentile(&stats->udp_wait, 99));
+    addReplyLongLong(c, stats->udp_wait.max);
+    addReplyLongLong(c, latency_hist_percentile(&stats->processing, 50));
+    addReplyLongLong(c, latency_hist_percentile(&stats->processing, 99));
+    addReplyLongLong(c, stats->processing.max);
+}
+
+// command_stats [command|reset]
+// Replies with one row per command that's been called, the ones that have
+// taken the most time in total first. Each row is
+//   [name, calls, udp_p50, udp_p99, udp_max, proc_p50, proc_p99, proc_max]
+// in microseconds, where udp is the time spent waiting on the FPGA and proc
+// is everything else. Given a command name only that command's row is sent,
+// "reset" clears all the stats.
+void command_stats(client* c, int argc, sds* argv) {
+    int num_commands = num_table_commands + NUM_BUILT_IN_COMMANDS;
+    int* order;
+    int num_called = 0;
+    int i;
+
+    if(argc > 2) {
+        addReplyError(c, "usage: command_stats [command|reset]");
+        return;
+    }
+    if(argc == 2) {
+        ServerCommand* command;
+        if(strcasecmp(argv[1], "reset") == 0) {
+            memset(command_stats_table, 0, sizeof(CommandStats)*num_commands);
+            addReplyStatus(c, "OK");
+            return;
+        }
+        command = lookupCommand(argv[1]);
+        if(!command) {
+            addReplyErrorFormat(c, "unknown command `%s`", (char*)argv[1]);
+            return;
+        }
+        add_command_stats_reply(c, stats_for_command(command) - command_stats_table);
+        return;
+    }
+
+    order = malloc(sizeof(int)*num_commands);
+    if(!order) {
+        addReplyError(c, "Out of memory");
+        return;
+    }
+    for(i=0; i<num_commands; i++) {
+        if(command_stats_table[i].processing.count > 0) {
+            order[num_called++] = i;
+        }
+    }
+    qsort(order, num_called, sizeof(int), compare_total_time);
+    addReplyLongLongWithPrefix(c, num_called, '*');
+    for(i=0; i<num_called; i++) {
+        add_command_stats_reply(c, order[i]);
+    }
+    free(order);
+}
+
 ServerCommand *lookupCommandByCString(char *s) {
     ServerCommand* cmd;
     sds name = sdsnew(s);
@@ -338,6 +524,69 @@ ServerCommand *lookupCommandByCString(char *s) {
     return cmd;
 }
 
+// Pieces of legacy replies that don't depend on the values
+static const char* const legacy_array_headers[LEGACY_MAX_INTS+1] = {
+    "*0\r\n", "*1\r\n", "*2\r\n", "*3\r\n", "*4\r\n", "*5\r\n", "*6\r\n", "*7\r\n", "*8\r\n",
+    "*9\r\n", "*10\r\n", "*11\r\n", "*12\r\n", "*13\r\n", "*14\r\n", "*15\r\n", "*16\r\n"
+};
+#define LEGACY_OK_REPLY "+OK\r\n"
+
+// Writes ":<value>\r\n" to 'dst', returns the length
+static int format_integer_reply(char* dst, uint32_t value) {
+    char digits[10];
+    int num_digits = 0;
+    int len = 0;
+    do {
+        digits[num_digits++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    dst[len++] = ':';
+    while(num_digits) {
+        dst[len++] = digits[--num_digits];
+    }
+    dst[len++] = '\r';
+    dst[len++] = '\n';
+    return len;
+}
+
+// Adds the reply for a legacy command. The whole reply is put together in
+// a local buffer and added in one go, instead of one addReply per value.
+__thread char legacy_error[LEGACY_ERROR_MAX];
+
+// 'err' is the command's legacy_error, can be NULL or empty
+void addReplyLegacy(client *c, ServerCommand *cmd, uint32_t resp, const uint32_t *values, const char *err) {
+    // Each value is at most ':' + 10 digits + CRLF
+    char buf[8 + LEGACY_MAX_INTS*13];
+    int len;
+    int i;
+
+    if(cmd->nresp == 0) {
+        addReplyProto(c, LEGACY_OK_REPLY, sizeof(LEGACY_OK_REPLY)-1);
+    }
+    else if(cmd->nresp == 1) {
+        len = format_integer_reply(buf, resp);
+        addReplyProto(c, buf, len);
+    }
+    else if(resp != 0) {
+        if(err && err[0]) {
+            addReplyError(c, err);
+        }
+        else {
+            addReplyErrorFormat(c, "Error performing command '%s'", cmd->name);
+        }
+    }
+    else {
+        // RESP array is *N\r\n where N is the length of the array, followed
+        // by the elements of the array
+        len = strlen(legacy_array_headers[cmd->nresp]);
+        memcpy(buf, legacy_array_headers[cmd->nresp], len);
+        for(i=0; i<cmd->nresp; i++) {
+            len += format_integer_reply(buf + len, values[i]);
+        }
+        addReplyProto(c, buf, len);
+    }
+}
+
 /* If this function gets called we already read a whole
  * command, arguments are in the client argv/argc fields.
  * processCommand() execute the command or prepare the
@@ -362,23 +611,32 @@ int processCommand(client *c) {
         for (i=1; i < c->argc && sdslen(args) < 128; i++) {
             args = sdscatprintf(args, "`%.*s`, ", 128-(int)sdslen(args), (char*)c->argv[i]);
         }
+        flagTransaction(c);
         addReplyErrorFormat(c, "unknown command `%s`, with args beginning with: %s",
             (char*)c->argv[0], args);
         sdsfree(args);
         return C_OK;
     } else if ((c->cmd->nargs > 0 && c->cmd->nargs != c->argc) || (c->argc < -c->cmd->nargs)) {
+        flagTransaction(c);
         addReplyErrorFormat(c,"wrong number of arguments for '%s' command. Expects: %i, Got: %i",
             c->cmd->name, c->cmd->nargs-1, c->argc-1);
         return C_OK;
     }
 
+    /* Inside MULTI everything but the transaction commands gets queued */
+    if (c->flags & CLIENT_MULTI && !isTransactionCommand(c->cmd)) {
+        queueCommandReply(c);
+        return C_OK;
+    }
+
     /* Exec the command */
     call(c, CMD_CALL_FULL);
     return C_OK;
 }
 
 void call(client *c, int flags) {
-    long long start, duration;
+    long long start, duration, udp_wait;
+    long long wait_start = fnet_ctrl_wait_usec;
     int i;
     ServerCommand *real_cmd = c->cmd;
 
@@ -393,36 +651,22 @@ void call(client *c, int flags) {
         c->cmd->func(c, c->argc, c->argv);
     }
     else {
-        // Use legacy_func
-        int num_ints_needed = real_cmd->nargs > real_cmd->nresp ? real_cmd->nargs : real_cmd->nresp;
-        uint32_t* args_uint = malloc(sizeof(uint32_t)*num_ints_needed);
+        // Use legacy_func. The arguments go in the client's scratch space
+        // (sized for the biggest command when the server starts), so nothing
+        // gets allocated per call.
+        uint32_t* args_uint = c->legacy_args;
         for(i=1; i<real_cmd->nargs; i++) {
             args_uint[i-1] = strtoul(c->argv[i], NULL, 0);
         }
+        legacy_error[0] = '\0';
         uint32_t resp = real_cmd->legacy_func(args_uint);
-        if(real_cmd->nresp == 0) {
-            addReplyStatus(c, "OK");
-        }
-        else if(real_cmd->nresp == 1) {
-            addReplyLongLong(c, (long long)resp);
-        }
-        else {
-            if(resp != 0) {
-                // TODO! need to add low level error string!
-                addReplyErrorFormat(c, "Error performing command '%s'", real_cmd->name);
-            }
-            else {
-                // RESP array is *N\r\n where N is the length of the array, followed
-                // by the elements of the array
-                addReplyLongLongWithPrefix(c, (long long)real_cmd->nresp, '*');
-                for(i=0; i<real_cmd->nresp; i++) {
-                    addReplyLongLong(c, (long long)args_uint[i]);
-                }
-            }
-        }
-        free(args_uint);
+        addReplyLegacy(c, real_cmd, resp, args_uint, legacy_error);
     }
     duration = ustime()-start;
+    udp_wait = fnet_ctrl_wait_usec - wait_start;
+    if(udp_wait > duration) {
+        udp_wait = duration;
+    }
 
     if(flags & CMD_CALL_LOG) {
         serverLog(LL_VERBOSE, "Command %s executed", c->cmd->name);
@@ -434,12 +678,34 @@ void call(client *c, int flags) {
         /* use the real command that was executed (cmd and lastamc) may be
          * different, in case of MULTI-EXEC or re-written commands such as
          * EXPIRE, GEOADD, etc. */
-        real_cmd->microseconds += duration;
-        real_cmd->calls++;
+        if(c->flags & CLIENT_BLOCKED) {
+            // Still waiting on the FPGA (or a builder), the stats get
+            // recorded by commandUnblocked() once it's done
+            c->blocked_cmd = real_cmd;
+            c->blocked_start = start;
+            c->blocked_call_time = duration - udp_wait;
+        }
+        else {
+            record_command_stats(real_cmd, duration, udp_wait);
+        }
     }
     server.stat_numcommands++;
 }
 
+void commandUnblocked(client *c) {
+    long long duration;
+    if(!c->blocked_cmd) {
+        return;
+    }
+    // Time spent blocked counts as waiting, not processing
+    duration = ustime() - c->blocked_start;
+    if(duration < c->blocked_call_time) {
+        duration = c->blocked_call_time;
+    }
+    record_command_stats(c->blocked_cmd, duration, duration - c->blocked_call_time);
+    c->blocked_cmd = NULL;
+}
+
 void initServer(void) {
     int j;
 
@@ -469,6 +735,8 @@ void initServer(void) {
     server.mstime = 0;
     server.ustime =0;
     server.server_call = NULL;
+    server.transaction_begin = NULL;
+    server.transaction_end = NULL;
 
 
     //createSharedObjects();
@@ -517,6 +785,7 @@ void initServer(void) {
     }
 
     server.unblocked_clients = listCreate();
+    buildCommandLookup();
 }
 
 void serverSetCustomCall(ServerCallFunc call_func) {
@@ -526,3 +795,8 @@ void serverSetCustomCall(ServerCallFunc call_func) {
 void serverClearCustomCall() {
     server.server_call = NULL;
 }
+
+void serverSetTransactionHooks(ServerTransactionBeginFunc begin, ServerTransactionEndFunc end) {
+    server.transaction_begin = begin;
+    server.transaction_end = end;
+}
@@ -123,6 +123,26 @@ typedef struct clientBufferLimitsConfig {
 extern clientBufferLimitsConfig clientBufferLimitsDefaults;
 
 
+/* Client MULTI/EXEC state */
+typedef struct multiCmd {
+    sds *argv;
+    int argc;
+    ServerCommand *cmd;
+} multiCmd;
+
+typedef struct multiState {
+    multiCmd *commands;     /* Array of MULTI commands */
+    int count;              /* Total number of MULTI commands */
+} multiState;
+
+/* A point in a client's output, see getReplyPosition() */
+typedef struct clientReplyPosition {
+    int bufpos;
+    unsigned long reply_len;
+    size_t tail_used;
+} clientReplyPosition;
+
+
 typedef struct client {
     uint64_t id;            /* Client incremental unique ID. */
     sds name;               /* Name of client for logging/debugging purposes */
@@ -147,16 +167,24 @@ typedef struct client {
     uint64_t flags;         /* Client flags: CLIENT_* macros. */
     void*  blocking_data;     /* blocking state */
     blockingFreeProc* bfree;
+    ServerCommand* blocked_cmd; /* Command that blocked, its stats are recorded when it's done */
+    long long blocked_start;    /* When that command was called, microseconds */
+    long long blocked_call_time; /* Time spent in call() for it, microseconds */
 
     listNode *client_list_node; /* list node in client list */
 
     void* server_data;
+    uint32_t legacy_args[LEGACY_MAX_INTS]; /* Scratch space for legacy commands */
+    multiState mstate;      /* MULTI/EXEC state */
 
     /* Response buffer */
     int bufpos;
     char buf[PROTO_REPLY_CHUNK_BYTES];
 } client;
 typedef void (*ServerCallFunc)(client *c);
+// Called around the commands of an EXEC, see serverSetTransactionHooks()
+typedef void (*ServerTransactionBeginFunc)(client *c);
+typedef int (*ServerTransactionEndFunc)(client *c);
 
 struct  Server {
     pid_t pid;
@@ -202,17 +230,25 @@ struct  Server {
     clientBufferLimitsConfig client_obuf_limits;
 
     ServerCallFunc server_call;
+    ServerTransactionBeginFunc transaction_begin;
+    ServerTransactionEndFunc transaction_end;
 };
 
 
 extern struct Server server;
 extern ServerCommand* server_command_table;
 void send_command_table(client* c, int argc, sds* argv);
+void command_stats(client* c, int argc, sds* argv);
 
 void daemonize(void);
 void initServerConfig(void);
 void initServer(void);
 void serverSetCustomCall(ServerCallFunc call_func);
+// 'begin' is called before the queued commands of an EXEC are run and
+// 'end' after, if 'end' returns non-zero the EXEC gets an error reply
+// instead of the commands' replies. Meant for holding back FPGA writes
+// until the end of the transaction so they can be sent together.
+void serverSetTransactionHooks(ServerTransactionBeginFunc begin, ServerTransactionEndFunc end);
 long long ustime(void); /* Get linux time microseconds */
 
 void _serverAssert(const char *estr, const char *file, int line);
@@ -228,6 +264,9 @@ int processMultibulkBuffer(client *c);
 int processCommand(client *c);
 int processCommandAndResetClient(client *c);
 void call(client *c, int flags);
+// Records command_stats for a command that blocked its client, called when
+// the client gets unblocked
+void commandUnblocked(client *c);
 
 sds catClientInfoString(sds s, client *client);
 void freeClient(client *c);
@@ -244,6 +283,21 @@ void addReplyStatus(client *c, const char *status);
 void addReplyStatusFormat(client *c, const char *fmt, ...);
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix);
 void addReplyLongLong(client *c, long long ll);
+void addReplyBulkCBuffer(client *c, const void *p, size_t len);
+void addReplyLegacy(client *c, ServerCommand *cmd, uint32_t resp, const uint32_t *values, const char *err);
+void getReplyPosition(client *c, clientReplyPosition *pos);
+void truncateReplies(client *c, const clientReplyPosition *pos);
+
+/* MULTI/EXEC */
+void initClientMultiState(client *c);
+void freeClientMultiState(client *c);
+void discardTransaction(client *c);
+void flagTransaction(client *c);
+void queueCommandReply(client *c);
+int isTransactionCommand(ServerCommand *cmd);
+void multiCommand(client *c, int argc, sds *argv);
+void execCommand(client *c, int argc, sds *argv);
+void discardCommand(client *c, int argc, sds *argv);
 ServerCommand* lookupCommand(sds name);
 ServerCommand* lookupCommandByCString(char *s) ;
 void beforeSleep(struct aeEventLoop *eventLoop);
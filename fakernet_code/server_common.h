@@ -9,8 +9,17 @@ typedef struct client client; // Forward declaration
 // Squelch warnings for unused arguements
 #define UNUSED(V) ((void) V)
 
+// Most arguments (not counting the command name) or responses a legacy
+// command can have, checked when the server starts.
+#define LEGACY_MAX_INTS 16
+
 typedef void (*CLIFunc)(client* c, int argc, sds* argv);
 typedef uint32_t (*LegacyFunc)(uint32_t* args);
+// A multi-value legacy command that fails can put the reason here, it's sent
+// back instead of the generic error. It's per thread since legacy commands get
+// run on the fan-out threads, and cleared before each call.
+#define LEGACY_ERROR_MAX 256
+extern __thread char legacy_error[LEGACY_ERROR_MAX];
 typedef struct ServerCommand {
     const char* name;
     CLIFunc func;
@@ -21,4 +30,10 @@ typedef struct ServerCommand {
     long long calls; // cumalitive number of calls
 } ServerCommand;
 
+// Which board register accesses go to, for commands that keep working on a
+// board after they return (from a timer). Boards are numbered the same as the
+// bits of poll_target_mask(), -1 is none.
+int active_board(void);
+void set_active_board(int board);
+
 #endif
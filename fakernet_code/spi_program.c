@@ -0,0 +1,472 @@
+#define _GNU_SOURCE // For strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include "spi_program.h"
+#include "lmk_if.h"
+#include "ads_if.h"
+
+// Number of status register reads queued after each transfer. They give the
+// SPI core time to finish shifting the bytes out before the next transfer is
+// queued, the last one is used to check that it actually did.
+#define SETTLE_READS 4
+// RX FIFO reset + the transfer + the settle reads
+#define TRANSFER_ACCESSES (1 + 7 + SETTLE_READS)
+#define MAX_PENDING (REG_BATCH_MAX_ACCESSES / TRANSFER_ACCESSES)
+// How long to wait for a transfer that didn't finish in time
+#define POLL_TRIES 20
+#define POLL_PERIOD_US 1000
+
+#define MAX_LINE_TOKENS 3
+
+typedef struct SpiTransfer {
+    AXI_QSPI* qspi;
+    int is_lmk;
+    uint32_t wmpch; // Only used for ADCs
+    uint32_t addr;
+    uint32_t data;
+    int step;
+    uint32_t status_reg;
+} SpiTransfer;
+
+typedef struct SpiRunState {
+    SpiTransfer pending[MAX_PENDING];
+    int num_pending;
+    int* status;
+} SpiRunState;
+
+static int add_step(SpiProgram* program, int* capacity, SpiStep step) {
+    if(program->num_steps == *capacity) {
+        int new_capacity = *capacity ? 2*(*capacity) : 64;
+        SpiStep* new_steps = realloc(program->steps, sizeof(SpiStep)*new_capacity);
+        if(!new_steps) {
+            return -1;
+        }
+        program->steps = new_steps;
+        *capacity = new_capacity;
+    }
+    program->steps[program->num_steps++] = step;
+    return 0;
+}
+
+// Same rule as configure_adc_and_clock.py, hex if there's an 'x' else decimal
+static int parse_number(const char* token, uint32_t* result) {
+    char* end;
+    int base = strchr(token, 'x') || strchr(token, 'X') ? 16 : 10;
+    *result = strtoul(token, &end, base);
+    return (*end != '\0' || end == token) ? -1 : 0;
+}
+
+const char* spi_program_dir = SPI_PROGRAM_DEFAULT_DIR;
+
+// 'quote' is zero if the text came from a file, then errors only give the line
+static SpiProgram* parse_program(const char* text, size_t len, int quote, char* err, size_t err_len) {
+    SpiProgram* program = calloc(1, sizeof(SpiProgram));
+    SpiStepDevice device = SPI_DEVICE_NONE;
+    int capacity = 0;
+    int auto_pause = 0;
+    int line_num = 0;
+    size_t pos = 0;
+
+    if(!program) {
+        snprintf(err, err_len, "Out of memory");
+        return NULL;
+    }
+
+    while(pos < len) {
+        char line[256];
+        char* tokens[MAX_LINE_TOKENS];
+        char* comment;
+        char* save;
+        char* tok;
+        int num_tokens = 0;
+        size_t line_len = 0;
+        SpiStep step;
+
+        line_num++;
+        while(pos < len && text[pos] != '\n') {
+            if(line_len < sizeof(line) - 1) {
+                line[line_len++] = text[pos];
+            }
+            pos++;
+        }
+        pos++; // Skip the newline
+        line[line_len] = '\0';
+
+        if((comment = strstr(line, "//"))) {
+            *comment = '\0';
+        }
+        if(strstr(line, "LMK")) {
+            device = SPI_DEVICE_LMK;
+            continue;
+        }
+        if(strstr(line, "ADS")) {
+            device = SPI_DEVICE_ADS;
+            continue;
+        }
+        for(tok = strtok_r(line, " \t\r", &save); tok; tok = strtok_r(NULL, " \t\r", &save)) {
+            if(num_tokens == MAX_LINE_TOKENS) {
+                break;
+            }
+            tokens[num_tokens++] = tok;
+        }
+        if(num_tokens == 0) {
+            continue;
+        }
+        if(num_tokens > 2) {
+            snprintf(err, err_len, "Line %i: too many values", line_num);
+            goto error;
+        }
+
+        memset(&step, 0, sizeof(step));
+        step.line = line_num;
+        step.device = device;
+        if(num_tokens == 1) {
+            // The only instructions without a value
+            if(strcasecmp(tokens[0], "pause") == 0) {
+                step.type = SPI_STEP_PAUSE;
+            }
+            else if(strcasecmp(tokens[0], "reset") == 0) {
+                step.type = SPI_STEP_RESET;
+            }
+            else {
+                if(quote) {
+                    snprintf(err, err_len, "Line %i: '%s' isn't valid", line_num, tokens[0]);
+                }
+                else {
+                    snprintf(err, err_len, "Line %i: isn't a valid instruction", line_num);
+                }
+                goto error;
+            }
+        }
+        else if(strcasestr(tokens[0], "sleep")) {
+            char* end;
+            step.type = SPI_STEP_SLEEP;
+            step.sleep_seconds = strtod(tokens[1], &end);
+            if(*end != '\0' || step.sleep_seconds < 0) {
+                if(quote) {
+                    snprintf(err, err_len, "Line %i: '%s' isn't a valid sleep time", line_num, tokens[1]);
+                }
+                else {
+                    snprintf(err, err_len, "Line %i: isn't a valid sleep time", line_num);
+                }
+                goto error;
+            }
+        }
+        else if(strcasestr(tokens[0], "auto-pause")) {
+            auto_pause = (strcasecmp(tokens[1], "start") == 0 || strcasecmp(tokens[1], "on") == 0);
+            continue;
+        }
+        else {
+            step.type = SPI_STEP_WRITE;
+            if(parse_number(tokens[0], &step.addr) || parse_number(tokens[1], &step.value)) {
+                if(quote) {
+                    snprintf(err, err_len, "Line %i: '%s %s' isn't a valid register write", line_num, tokens[0], tokens[1]);
+                }
+                else {
+                    snprintf(err, err_len, "Line %i: isn't a valid register write", line_num);
+                }
+                goto error;
+            }
+            if(device == SPI_DEVICE_NONE) {
+                snprintf(err, err_len, "Line %i: register write before any LMK or ADS line", line_num);
+                goto error;
+            }
+        }
+
+        if(add_step(program, &capacity, step)) {
+            snprintf(err, err_len, "Out of memory");
+            goto error;
+        }
+        if(step.type == SPI_STEP_WRITE && auto_pause) {
+            step.type = SPI_STEP_PAUSE;
+            if(add_step(program, &capacity, step)) {
+                snprintf(err, err_len, "Out of memory");
+                goto error;
+            }
+        }
+    }
+    return program;
+
+error:
+    spi_program_free(program);
+    return NULL;
+}
+
+SpiProgram* spi_program_parse(const char* text, size_t len, char* err, size_t err_len) {
+    return parse_program(text, len, 1, err, err_len);
+}
+
+// Fills in 'path' (PATH_MAX long) with where 'filename' really is, after
+// following any links, as long as that's inside spi_program_dir
+static int resolve_program_path(const char* filename, char* path, char* err, size_t err_len) {
+    char dir[PATH_MAX];
+    char joined[2*PATH_MAX];
+    size_t dir_len;
+
+    if(!realpath(spi_program_dir, dir)) {
+        snprintf(err, err_len, "Program directory '%s' doesn't exist", spi_program_dir);
+        return -1;
+    }
+    snprintf(joined, sizeof(joined), "%s/%s", dir, filename);
+    if(!realpath(joined, path)) {
+        snprintf(err, err_len, "Could not open '%s'", filename);
+        return -1;
+    }
+    dir_len = strlen(dir);
+    if(strncmp(path, dir, dir_len) != 0 || (dir_len > 1 && path[dir_len] != '/')) {
+        snprintf(err, err_len, "'%s' isn't in the program directory", filename);
+        return -1;
+    }
+    return 0;
+}
+
+SpiProgram* spi_program_load(const char* filename, char* err, size_t err_len) {
+    SpiProgram* program;
+    char path[PATH_MAX];
+    char* text;
+    long len;
+    FILE* f;
+
+    if(resolve_program_path(filename, path, err, err_len)) {
+        return NULL;
+    }
+    f = fopen(path, "r");
+    if(!f) {
+        snprintf(err, err_len, "Could not open '%s'", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = malloc(len > 0 ? len : 1);
+    if(!text || fread(text, 1, len, f) != (size_t)len) {
+        snprintf(err, err_len, "Could not read '%s'", filename);
+        free(text);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    program = parse_program(text, len, 0, err, err_len);
+    free(text);
+    return program;
+}
+
+void spi_program_free(SpiProgram* program) {
+    if(!program) {
+        return;
+    }
+    free(program->steps);
+    free(program);
+}
+
+static void queue_transfer(RegBatch* batch, SpiTransfer* transfer) {
+    int i;
+    // Each transfer clocks 3 bytes in to the RX FIFO, rather than popping
+    // them all back out just throw them away.
+    batch_reset_spi_rx_fifo(batch, transfer->qspi);
+    if(transfer->is_lmk) {
+        batch_write_lmk_spi(batch, transfer->qspi, 0, transfer->addr, transfer->data);
+    }
+    else {
+        batch_write_adc_spi(batch, transfer->qspi, transfer->wmpch, transfer->addr, transfer->data);
+    }
+    for(i=0; i<SETTLE_READS; i++) {
+        batch_read_qspi_status(batch, transfer->qspi, &transfer->status_reg);
+    }
+}
+
+static int wait_for_tx_empty(AXI_QSPI* qspi) {
+    int i;
+    uint32_t status;
+    for(i=0; i<POLL_TRIES; i++) {
+        status = read_qspi_status(qspi);
+        if(status == 0xFFFFFFFF) {
+            // read_qspi_addr's error value
+            return SPI_STEP_COMM_ERROR;
+        }
+        if(status & SPI_SR_TX_EMPTY) {
+            return SPI_STEP_OK;
+        }
+        usleep(POLL_PERIOD_US);
+    }
+    return SPI_STEP_TIMEOUT;
+}
+
+static void set_status(SpiRunState* state, int step, int status) {
+    // Keep the first error a step had
+    if(state->status[step] == SPI_STEP_OK) {
+        state->status[step] = status;
+    }
+}
+
+// Sends one transfer on its own and waits for it to finish shifting out
+static int send_transfer_and_wait(SpiTransfer* transfer) {
+    RegBatch batch;
+    reg_batch_init(&batch);
+    queue_transfer(&batch, transfer);
+    if(commit_reg_batch(&batch)) {
+        return SPI_STEP_COMM_ERROR;
+    }
+    if(transfer->status_reg & SPI_SR_TX_EMPTY) {
+        return SPI_STEP_OK;
+    }
+    return wait_for_tx_empty(transfer->qspi);
+}
+
+// Sends every pending transfer. Normally that's one batch. If a transfer
+// was still shifting out when the next one's writes went out, then it might
+// have been garbled, so it and everything after it get re-sent one at a
+// time, waiting for each to finish before the next.
+static void flush_transfers(SpiRunState* state) {
+    RegBatch batch;
+    int status;
+    int i;
+
+    reg_batch_init(&batch);
+    for(i=0; i<state->num_pending; i++) {
+        queue_transfer(&batch, &state->pending[i]);
+    }
+    if(commit_reg_batch(&batch)) {
+        for(i=0; i<state->num_pending; i++) {
+            set_status(state, state->pending[i].step, SPI_STEP_COMM_ERROR);
+        }
+        state->num_pending = 0;
+        return;
+    }
+
+    for(i=0; i<state->num_pending; i++) {
+        if(!(state->pending[i].status_reg & SPI_SR_TX_EMPTY)) {
+            break;
+        }
+    }
+    for(; i<state->num_pending; i++) {
+        // Let whatever's still going on this SPI core finish first
+        status = wait_for_tx_empty(state->pending[i].qspi);
+        if(status == SPI_STEP_OK) {
+            status = send_transfer_and_wait(&state->pending[i]);
+        }
+        set_status(state, state->pending[i].step, status);
+    }
+
+    // Each transfer's first write clears SPE for the one before it on the
+    // same SPI core, that leaves the last one on each core. They've all
+    // finished by now.
+    reg_batch_init(&batch);
+    for(i=0; i<state->num_pending; i++) {
+        int j;
+        for(j=i+1; j<state->num_pending && state->pending[j].qspi != state->pending[i].qspi; j++) {
+        }
+        if(j == state->num_pending) {
+            batch_spi_disable(&batch, state->pending[i].qspi);
+        }
+    }
+    commit_reg_batch(&batch);
+    state->num_pending = 0;
+}
+
+static void add_transfer(SpiRunState* state, AXI_QSPI* qspi, int is_lmk, int step,
+                         uint32_t wmpch, uint32_t addr, uint32_t data) {
+    if(state->num_pending == MAX_PENDING) {
+        flush_transfers(state);
+    }
+    SpiTransfer* transfer = &state->pending[state->num_pending++];
+    transfer->qspi = qspi;
+    transfer->is_lmk = is_lmk;
+    transfer->step = step;
+    transfer->wmpch = wmpch;
+    transfer->addr = addr;
+    transfer->data = data;
+    transfer->status_reg = 0;
+}
+
+// Turns an ADS54J register address in to the SPI transfers needed to write it,
+// (the same as program_adc in configure_adc_and_clock.py).
+static void add_adc_write(SpiRunState* state, AXI_QSPI* adc, int step, uint32_t addr, uint32_t value) {
+    if(addr < 0xF00) {
+        // General registers
+        add_transfer(state, adc, 0, step, 0x0, addr, value);
+    }
+    else if(addr > 0xF00 && addr < 0xF000) {
+        // Analog registers
+        uint32_t page_addr = (addr & 0xFF00) >> 8;
+        uint32_t reg_addr = addr & 0xFF;
+        add_transfer(state, adc, 0, step, 0x0, 0x11, page_addr);
+        add_transfer(state, adc, 0, step, 0x0, reg_addr, value);
+    }
+    else {
+        // Digital registers
+        uint32_t page_addr = (addr & 0xFFFF00) >> 8;
+        uint32_t page_addr1 = page_addr & 0xFF;
+        uint32_t page_addr2 = (page_addr & 0xFF00) >> 8;
+        uint32_t reg_addr = addr & 0xFF;
+        uint32_t wmpch = page_addr2 >> 4;
+        // if setting CH bit is set, remove it for writting the address
+        page_addr2 &= 0xEF;
+        add_transfer(state, adc, 0, step, 0x4, 0x3, page_addr1);
+        add_transfer(state, adc, 0, step, 0x4, 0x4, page_addr2);
+        add_transfer(state, adc, 0, step, wmpch, reg_addr, value);
+        add_transfer(state, adc, 0, step, wmpch | 0x1, reg_addr, value);
+    }
+}
+
+int spi_program_run(SpiProgram* program, SpiTargets* targets, int* status) {
+    SpiRunState* state = malloc(sizeof(SpiRunState));
+    int ret = 0;
+    int i, j;
+
+    if(!state) {
+        for(i=0; i<program->num_steps; i++) {
+            status[i] = SPI_STEP_COMM_ERROR;
+        }
+        return -1;
+    }
+    state->num_pending = 0;
+    state->status = status;
+
+    for(i=0; i<program->num_steps; i++) {
+        SpiStep* step = &program->steps[i];
+        status[i] = SPI_STEP_OK;
+        switch(step->type) {
+            case SPI_STEP_WRITE:
+                if(step->device == SPI_DEVICE_LMK) {
+                    for(j=0; j<targets->num_lmks; j++) {
+                        add_transfer(state, targets->lmks[j], 1, i, 0, step->addr, step->value);
+                    }
+                }
+                else {
+                    for(j=0; j<targets->num_adcs; j++) {
+                        add_adc_write(state, targets->adcs[j], i, step->addr, step->value);
+                    }
+                }
+                break;
+            case SPI_STEP_SLEEP:
+                flush_transfers(state);
+                flush_reg_writes();
+                usleep((useconds_t)(step->sleep_seconds*1e6));
+                break;
+            case SPI_STEP_PAUSE:
+                flush_transfers(state);
+                break;
+            case SPI_STEP_RESET:
+                flush_transfers(state);
+                if(targets->reset && targets->reset(targets->reset_data)) {
+                    status[i] = SPI_STEP_COMM_ERROR;
+                }
+                break;
+        }
+    }
+    flush_transfers(state);
+    free(state);
+
+    for(i=0; i<program->num_steps; i++) {
+        if(status[i] != SPI_STEP_OK) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
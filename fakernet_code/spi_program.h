@@ -0,0 +1,81 @@
+#ifndef __SPI_PROGRAM__
+#define __SPI_PROGRAM__
+#include <inttypes.h>
+#include <stdlib.h>
+#include "axi_qspi.h"
+
+// Runs a whole LMK/ADS register program (the same format as the files in
+// configs/) in as few UDP round trips as possible.
+// The format is one instruction per line, '//' starts a comment:
+//      LMK04828            Lines containing LMK or ADS select the device the
+//      ADS54Jxx_ANALOG     following register writes go to
+//      <addr> <value>      Register write, hex if it has an 'x' else decimal
+//      sleep <seconds>
+//      pause               Wait for every write before it to finish
+//      reset               Hard reset the ADCs
+//      auto-pause <start|on|stop|off>  Put a pause after every register write
+// "pause" is interactive in configure_adc_and_clock.py, here it's just a sync
+// point.
+#define SPI_PROGRAM_MAX_DEVICES 4
+// Where programs loaded by file name have to be, the servers' --spi-program-dir
+#define SPI_PROGRAM_DEFAULT_DIR "configs"
+
+extern const char* spi_program_dir;
+
+// Per-step status
+#define SPI_STEP_OK 0
+#define SPI_STEP_TIMEOUT -1 // An SPI transfer didn't finish
+#define SPI_STEP_COMM_ERROR -2 // Couldn't talk to the FPGA
+
+typedef enum SpiStepType {
+    SPI_STEP_WRITE=0,
+    SPI_STEP_SLEEP,
+    SPI_STEP_PAUSE,
+    SPI_STEP_RESET
+} SpiStepType;
+
+typedef enum SpiStepDevice {
+    SPI_DEVICE_NONE=0,
+    SPI_DEVICE_LMK,
+    SPI_DEVICE_ADS
+} SpiStepDevice;
+
+typedef struct SpiStep {
+    SpiStepType type;
+    SpiStepDevice device;
+    uint32_t addr;
+    uint32_t value;
+    double sleep_seconds;
+    int line; // Line number in the program text, for error messages
+} SpiStep;
+
+typedef struct SpiProgram {
+    SpiStep* steps;
+    int num_steps;
+} SpiProgram;
+
+// The devices a program gets written to. Every LMK step is written to all the
+// 'lmks' and every ADS step to all the 'adcs'. 'reset' gets called for reset
+// steps, it can be NULL.
+typedef struct SpiTargets {
+    AXI_QSPI* lmks[SPI_PROGRAM_MAX_DEVICES];
+    int num_lmks;
+    AXI_QSPI* adcs[SPI_PROGRAM_MAX_DEVICES];
+    int num_adcs;
+    int (*reset)(void* privdata);
+    void* reset_data;
+} SpiTargets;
+
+// Both return NULL and fill in 'err' if the program isn't valid.
+// spi_program_load only opens files inside spi_program_dir ('filename' is
+// relative to it) and its errors don't quote the file, so clients can't use
+// it to read whatever the server can.
+SpiProgram* spi_program_parse(const char* text, size_t len, char* err, size_t err_len);
+SpiProgram* spi_program_load(const char* filename, char* err, size_t err_len);
+void spi_program_free(SpiProgram* program);
+
+// Runs the program on the active FPGA. 'status' must have room for
+// program->num_steps values, each gets one of the SPI_STEP_* codes.
+// Returns 0 if every step succeeded.
+int spi_program_run(SpiProgram* program, SpiTargets* targets, int* status);
+#endif
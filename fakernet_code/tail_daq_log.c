@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include "hiredis/hiredis.h"
 
 #define KNRM  "\x1B[0m"
@@ -21,6 +25,50 @@
 #define MESSAGE_TV_USEC_BIT 0x10
 #define MESSAGE_VALID_MASK (MESSAGE_LOGGER_ID_BIT | MESSAGE_TAG_BIT | MESSAGE_MESSAGE_BIT | MESSAGE_TV_SEC_BIT)
 
+#define LOG_STREAM "daq_log"
+// How many messages to ask for at once. It grows while replies come back
+// full (i.e. the tail is behind) and shrinks back when it's caught up.
+#define MIN_COUNT 50
+// daq_logger trims the stream to about 500 (XADD MAXLEN ~ 500), asking for
+// more than that never gets more
+#define MAX_COUNT 500
+#define POLL_TIMEOUT_MS 500 // Just so Ctrl-C gets noticed
+#define MAX_ID_LEN 64
+
+// Reads the stream past 'ARGV[1]' the same way XREAD does, but only
+// returns the messages at or above a level and from one logger, so
+// filtered out messages never get sent over. Returns
+// {last ID looked at, number of messages looked at, messages}.
+// A start ID of '$' just looks up the newest ID. Scripts can't block so
+// when there's nothing new the tail waits with XREAD and then runs this.
+static const char* filter_script =
+    "local start = ARGV[1]\n"
+    "if start == '$' then\n"
+    "    local newest = redis.call('XREVRANGE', KEYS[1], '+', '-', 'COUNT', 1)\n"
+    "    return {newest[1] and newest[1][1] or '0-0', 0, {}}\n"
+    "end\n"
+    "local entries = redis.call('XRANGE', KEYS[1], start, '+', 'COUNT', ARGV[2])\n"
+    "local min_tag = tonumber(ARGV[3])\n"
+    "local logger = ARGV[4]\n"
+    "local out = {}\n"
+    "local last = ''\n"
+    "for _, entry in ipairs(entries) do\n"
+    "    local fields = entry[2]\n"
+    "    local keep = true\n"
+    "    last = entry[1]\n"
+    "    for i = 1, #fields, 2 do\n"
+    "        if fields[i] == 'tag' then\n"
+    "            keep = keep and (tonumber(fields[i+1]) or 0) >= min_tag\n"
+    "        elseif fields[i] == 'logger_ID' and logger ~= '' then\n"
+    "            keep = keep and fields[i+1] == logger\n"
+    "        end\n"
+    "    end\n"
+    "    if keep then\n"
+    "        out[#out+1] = entry\n"
+    "    end\n"
+    "end\n"
+    "return {last, #entries, out}\n";
+
 typedef struct DAQMessage {
     const char* message_id;
     const char* logger_id;
@@ -61,6 +109,115 @@ void logit(const char* restrict format, ...) {
     fflush(stdout);
 }
 
+static int key_is(const redisReply* key, const char* name, size_t len) {
+    return key->len == len && memcmp(key->str, name, len) == 0;
+}
+
+// Pulls the fields out of one stream entry and prints it if it's complete.
+// daq_logger always sends the fields in the same order, but don't count on it.
+static void print_message(const redisReply* entry) {
+    static time_t last_sec = -1;
+    static char time_buffer[128];
+    redisReply* kv_reply = entry->element[1];
+    DAQMessage message;
+    int message_valid = 0;
+    size_t j;
+
+    message.message_id = entry->element[0]->str;
+    for(j=0; j+1<kv_reply->elements; j+=2) {
+        const redisReply* key = kv_reply->element[j];
+        const char* value = kv_reply->element[j+1]->str;
+        switch(key->len) {
+            case 3:
+                if(key_is(key, "tag", 3)) {
+                    message.tag = strtol(value, NULL, 10);
+                    message_valid |= MESSAGE_TAG_BIT;
+                }
+                break;
+            case 6:
+                if(key_is(key, "tv_sec", 6)) {
+                    message.tv.tv_sec = strtoll(value, NULL, 10);
+                    message_valid |= MESSAGE_TV_SEC_BIT;
+                }
+                break;
+            case 7:
+                if(key_is(key, "message", 7)) {
+                    message.message = value;
+                    message_valid |= MESSAGE_MESSAGE_BIT;
+                }
+                else if(key_is(key, "tv_usec", 7)) {
+                    message.tv.tv_usec = strtoll(value, NULL, 10);
+                    message_valid |= MESSAGE_TV_USEC_BIT;
+                }
+                break;
+            case 9:
+                if(key_is(key, "logger_ID", 9)) {
+                    message.logger_id = value;
+                    message_valid |= MESSAGE_LOGGER_ID_BIT;
+                }
+                break;
+        }
+    }
+    if((message_valid & MESSAGE_VALID_MASK) != MESSAGE_VALID_MASK) {
+        return;
+    }
+
+    // Messages come in bursts from the same second, only format the time once
+    if(message.tv.tv_sec != last_sec) {
+        struct tm local_time;
+        localtime_r(&message.tv.tv_sec, &local_time);
+        strftime(time_buffer, sizeof(time_buffer), "%x %X", &local_time);
+        last_sec = message.tv.tv_sec;
+    }
+    const char* tag_str = (message.tag > 0 && message.tag < NUM_TAGS) ? tag_to_str[message.tag] : "???";
+    printf("%s  [%s] [%s]: %s\n", tag_str, time_buffer,  message.logger_id, message.message);
+}
+
+// XRANGE's start is inclusive, so to carry on after 'id' start at the next one
+static void next_id(const char* id, char* next) {
+    char* end;
+    unsigned long long ms = strtoull(id, &end, 10);
+    unsigned long long seq = *end == '-' ? strtoull(end+1, NULL, 10) : 0;
+    snprintf(next, MAX_ID_LEN, "%llu-%llu", ms, seq+1);
+}
+
+static void set_id(char* dest, const redisReply* id) {
+    size_t len = id->len < MAX_ID_LEN ? id->len : MAX_ID_LEN-1;
+    memcpy(dest, id->str, len);
+    dest[len] = '\0';
+}
+
+// Waits until the connection can be read, or written if 'for_write'.
+// Returns 0 if it can, 1 on timeout (or a signal), -1 on error.
+static int wait_for_redis(const redisContext* redis, int for_write, int timeout_ms) {
+    struct pollfd pfd;
+    int ret;
+    pfd.fd = redis->fd;
+    pfd.events = for_write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    ret = poll(&pfd, 1, timeout_ms);
+    if(ret < 0) {
+        return errno == EINTR ? 1 : -1;
+    }
+    if(ret == 0) {
+        return 1;
+    }
+    return (pfd.revents & (POLLERR | POLLNVAL)) ? -1 : 0;
+}
+
+static int send_pending(redisContext* redis) {
+    int done = 0;
+    while(!done) {
+        if(redisBufferWrite(redis, &done) == REDIS_ERR) {
+            return -1;
+        }
+        if(!done && wait_for_redis(redis, 1, POLL_TIMEOUT_MS) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 redisContext* create_redis_conn(const char* hostname) {
     logit("Opening Redis Connection\n");
 
@@ -71,38 +228,58 @@ redisContext* create_redis_conn(const char* hostname) {
         redisFree(c);
         return NULL;
     }
+    // The connect finishes once the socket is writable
+    if(wait_for_redis(c, 1, 5000) != 0) {
+        logit("Could not connect to redis at %s\n", hostname);
+        redisFree(c);
+        return NULL;
+    }
     return c;
 }
 
 enum ArgValues {
     REDIS_HOST_ARG,
+    LEVEL_ARG,
+    LOGGER_ARG,
     ARG_NONE
 };
 
 void print_help_message(void) {
     printf("tail_daq_log: Prints log messages recieved from the various DAQ servers & processes.\n"
-            "\tusage: tail_daq_log [--host host] [--help]\n"
+            "\tusage: tail_daq_log [--host host] [--level level] [--logger logger-id] [--help]\n"
             "\targuments:\n"
             "\t--host -h\tRedis database IP address. Log messages are transmitted from this database.\n"
+            "\t--level -l\tOnly show messages at this level or above (debug, info, warn or error).\n"
+            "\t--logger -i\tOnly show messages from this logger (e.g. ceres_server).\n"
             "\t--help   \tPrint this message & exit.\n");
 }
 
+static int parse_level(const char* arg) {
+    int i;
+    static const char* names[] = {"", "debug", "info", "warn", "error"};
+    for(i=1; i<NUM_TAGS; i++) {
+        if(strcasecmp(arg, names[i]) == 0) {
+            return i;
+        }
+    }
+    return atoi(arg);
+}
+
 int main(int argc, char** argv) {
     const char* redis_host = "127.0.0.1";
-    const char* get_messages_command = "XREAD BLOCK 0 COUNT 50 streams daq_log %s";
-    char latest_id[256];
-    //strcpy(latest_id, "0");
-    strcpy(latest_id, "$");
-    size_t i,j;
-    char time_buffer[128];
-    struct tm* local_time;
+    const char* logger_filter = "";
+    int min_level = 0;
+    int filtered;
+    char latest_id[MAX_ID_LEN] = "$";
+    char start_id[MAX_ID_LEN];
+    char count_str[16];
+    char level_str[16];
+    int count = MIN_COUNT;
+    int waiting = 0; // Set while a XREAD is waiting for new messages
+    size_t i;
     redisReply* reply = NULL;
-    int done;
-
-    // Sleep for 0.2 seconds each loop to reduce CPU load
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = (long)2e8; // 0.2s;
+    redisReply* entries;
+    size_t num_looked_at;
 
     // Parse command line args
     enum ArgValues expecting_value = ARG_NONE;
@@ -111,113 +288,153 @@ int main(int argc, char** argv) {
             if(expecting_value == REDIS_HOST_ARG) {
                 redis_host = argv[i];
             }
+            else if(expecting_value == LEVEL_ARG) {
+                min_level = parse_level(argv[i]);
+            }
+            else if(expecting_value == LOGGER_ARG) {
+                logger_filter = argv[i];
+            }
             expecting_value = ARG_NONE;
         }
         else {
             if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--host") == 0) {
                 expecting_value = REDIS_HOST_ARG;
             }
+            if(strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--level") == 0) {
+                expecting_value = LEVEL_ARG;
+            }
+            if(strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--logger") == 0) {
+                expecting_value = LOGGER_ARG;
+            }
             if(strcmp(argv[i], "--help") == 0) {
                 print_help_message();
                 return 0;
             }
         }
     }
+    // Without any filtering plain XREAD does the job
+    filtered = min_level > 1 || logger_filter[0];
+    snprintf(level_str, sizeof(level_str), "%i", min_level);
 
     // TODO, use sigaction insteal of signal
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
     redisContext* redis = create_redis_conn(redis_host);
-     // This sleep is here to make sure the non-blocking connect actually happens
-     // it'd be better to just check that the FD is writable though...
-    nanosleep(&sleep_time, NULL);
     if(!redis) { return 1; }
 
-    redisAppendCommand(redis, get_messages_command, latest_id);
     while(loop) {
-        if(reply) {
-            freeReplyObject(reply);
-            reply = NULL;
-            redisAppendCommand(redis, get_messages_command, latest_id);
+        // Ask for the next batch
+        snprintf(count_str, sizeof(count_str), "%i", count);
+        if(!filtered) {
+            redisAppendCommand(redis, "XREAD BLOCK 0 COUNT %s STREAMS %s %s", count_str, LOG_STREAM, latest_id);
         }
-
-        if(redisBufferWrite(redis, &done) == REDIS_ERR) {
+        else if(waiting) {
+            redisAppendCommand(redis, "XREAD BLOCK 0 COUNT 1 STREAMS %s %s", LOG_STREAM, latest_id);
+        }
+        else {
+            if(strcmp(latest_id, "$") == 0) {
+                strcpy(start_id, latest_id);
+            }
+            else {
+                next_id(latest_id, start_id);
+            }
+            redisAppendCommand(redis, "EVAL %s 1 %s %s %s %s %s", filter_script, LOG_STREAM,
+                               start_id, count_str, level_str, logger_filter);
+        }
+        if(send_pending(redis)) {
             // Not sure how this ought to be handled probably should disconnect
             // and setup some system to try and re-connect
             printf("I think redis got disconnected...exiting\n");
             return 1;
         }
 
-        if(redisBufferRead(redis) == REDIS_ERR) {
-            printf("Error while getting redis reply...exiting\n");
-            return 1;
+        // Wait for the reply
+        reply = NULL;
+        while(loop && !reply) {
+            if(redisGetReply(redis, (void**)&reply) == REDIS_ERR) {
+                printf("Error while handling redis reply...exiting\n");
+                return 1;
+            }
+            if(reply) {
+                break;
+            }
+            switch(wait_for_redis(redis, 0, POLL_TIMEOUT_MS)) {
+                case 0:
+                    if(redisBufferRead(redis) == REDIS_ERR) {
+                        printf("Error while getting redis reply...exiting\n");
+                        return 1;
+                    }
+                    break;
+                case 1:
+                    break;
+                default:
+                    printf("I think redis got disconnected...exiting\n");
+                    return 1;
+            }
         }
-        if(redisGetReply(redis, (void**)&reply) == REDIS_ERR) {
-            printf("Error while handling redis reply...exiting\n");
-            return 1;
+        if(!reply) {
+            break;
         }
-
-        if(!reply || reply->type != REDIS_REPLY_ARRAY) {
-            nanosleep(&sleep_time, NULL);
-            continue;
+        if(reply->type == REDIS_REPLY_ERROR) {
+            printf("Error from redis: %s\n", reply->str);
+            freeReplyObject(reply);
+            return 1;
         }
 
         // From here on out no checks are done against the the reply data, if you've
         // made it here the reply SHOULD be well formatted as a stream response.
         // So the rest of the reply handling code will assume it is in fact well formatted.
-
-        // 2nd level of reply is 2 element array where element 1 is the stream name ("daq_log"),
-        // element two is an array. Here the 2nd level gets skipped over.
-        // 3rd level of reply is N length array each element of the array
-        // should be a log message
-        redisReply* reply3 = reply->element[0]->element[1];
-
-        for(i=0; i< reply3->elements; i++) {
-            redisReply* message_reply = reply3->element[i];
-            DAQMessage message;
-            int message_valid = 0;
-
+        if(!filtered || waiting) {
+            // 2nd level of reply is 2 element array where element 1 is the stream name ("daq_log"),
+            // element two is an array. Here the 2nd level gets skipped over.
+            // 3rd level of reply is N length array each element of the array
+            // should be a log message
             // 4th level of reply is a 2 element array first element is the stream item ID
             // 2nd element is the message contents
-            message.message_id = message_reply->element[0]->str;
-
             // 5th (and final) level of reply is a 2N element array of key-value pairs
             // that is the actual contents of the message
-            redisReply* kv_reply = message_reply->element[1];
-            for(j=0; j<kv_reply->elements; j+=2) {
-                const char* key = kv_reply->element[j]->str;
-                const char* value = kv_reply->element[j+1]->str;
-                if(strcmp(key, "logger_ID") == 0) {
-                    message.logger_id = value;
-                    message_valid |= 0x1;
-                }
-                else if(strcmp(key, "message") == 0) {
-                    message.message = value;
-                    message_valid |= 0x2;
-                }
-                else if(strcmp(key, "tag") == 0) {
-                    message.tag = strtol(value, NULL, 10);
-                    message_valid |= 0x4;
-                }
-                else if(strcmp(key, "tv_sec") == 0) {
-                    message.tv.tv_sec = strtoll(value, NULL, 10);
-                    message_valid |= 0x8;
-                }
-                else if(strcmp(key, "tv_usec") == 0) {
-                    message.tv.tv_usec = strtoll(value, NULL, 10);
-                    message_valid |= 0x10;
-                }
+            if(reply->type != REDIS_REPLY_ARRAY) {
+                freeReplyObject(reply);
+                continue;
             }
-
-            if((message_valid & MESSAGE_VALID_MASK) == MESSAGE_VALID_MASK) {
-                local_time = localtime(&message.tv.tv_sec);
-                strftime(time_buffer, 128, "%x %X", local_time);
-                const char* tag_str = (message.tag > 0 && message.tag < NUM_TAGS) ? tag_to_str[message.tag] : "???";
-                logit("%s  [%s] [%s]: %s\n", tag_str, time_buffer,  message.logger_id, message.message);
+            entries = reply->element[0]->element[1];
+            num_looked_at = entries->elements;
+            if(waiting) {
+                // Something new showed up, go get it (and whatever came after it) filtered
+                waiting = 0;
+                freeReplyObject(reply);
+                continue;
+            }
+            for(i=0; i<entries->elements; i++) {
+                print_message(entries->element[i]);
             }
-            strcpy(latest_id, message.message_id);
+            if(entries->elements) {
+                set_id(latest_id, entries->element[entries->elements-1]->element[0]);
+            }
+        }
+        else {
+            // {last ID looked at, number looked at, [messages]}
+            if(reply->element[0]->len) {
+                set_id(latest_id, reply->element[0]);
+            }
+            num_looked_at = reply->element[1]->integer;
+            entries = reply->element[2];
+            for(i=0; i<entries->elements; i++) {
+                print_message(entries->element[i]);
+            }
+            // Caught up, wait for more
+            waiting = num_looked_at < (size_t)count;
+        }
+        fflush(stdout);
+
+        if(num_looked_at >= (size_t)count && count < MAX_COUNT) {
+            count = count*2 < MAX_COUNT ? count*2 : MAX_COUNT;
+        }
+        else if(num_looked_at < (size_t)count/4 && count > MIN_COUNT) {
+            count = count/2 > MIN_COUNT ? count/2 : MIN_COUNT;
         }
+        freeReplyObject(reply);
     }
 
     redisFree(redis);
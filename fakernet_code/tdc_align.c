@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/time.h>
+#include "hiredis/hiredis.h"
+#include "tdc_align.h"
+
+// How long to wait on the FONTUS server for each sync
+#define SYNC_TIMEOUT_US 500000
+
+int commit_reg_batch(RegBatch* batch);
+
+const char* tdc_align_sync_server = TDC_ALIGN_DEFAULT_SYNC_SERVER;
+
+typedef struct TdcAlignState {
+    TdcAlignTargets* targets;
+    redisContext* sync_conn;
+    uint32_t sync_length;
+    uint32_t base_phases[CLOCK_WIZ_NUM_CLOCKS];
+    int num_samples;
+    char* err;
+    size_t err_len;
+} TdcAlignState;
+
+// Mean TDC reading at one phase shift, as an offset from the target phase
+typedef struct TdcPoint {
+    double error; // Mean TDC phase - 0.5, in clock periods
+    int decided; // Set if it's clear which side of the target 'error' is on
+} TdcPoint;
+
+static long long now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000LL + tv.tv_usec;
+}
+
+// The TDC is a thermometer code of which quarter of the clock period the sync
+// arrived in, returns the middle of that quarter or -1 for a bad code.
+static double tdc_code_to_phase(uint32_t code) {
+    switch(code) {
+        case 0:
+            return 0.875;
+        case 8:
+            return 0.625;
+        case 12:
+            return 0.375;
+        case 14:
+            return 0.125;
+        default:
+            return -1;
+    }
+}
+
+static redisContext* connect_sync_server(char* err, size_t err_len) {
+    char host[256];
+    int port = 4002;
+    struct timeval timeout = {0, SYNC_TIMEOUT_US};
+    redisContext* conn;
+    const char* colon = strrchr(tdc_align_sync_server, ':');
+
+    if(colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - tdc_align_sync_server), tdc_align_sync_server);
+        port = atoi(colon+1);
+    }
+    else {
+        snprintf(host, sizeof(host), "%s", tdc_align_sync_server);
+    }
+    conn = redisConnectWithTimeout(host, port, timeout);
+    if(!conn || conn->err) {
+        snprintf(err, err_len, "Could not connect to sync server %s: %s",
+                 tdc_align_sync_server, conn ? conn->errstr : "out of memory");
+        if(conn) {
+            redisFree(conn);
+        }
+        return NULL;
+    }
+    redisSetTimeout(conn, timeout);
+    return conn;
+}
+
+static int fire_sync(TdcAlignState* state) {
+    redisReply* reply = redisCommand(state->sync_conn, "do_sync %u", state->sync_length);
+    if(!reply) {
+        snprintf(state->err, state->err_len, "Lost connection to sync server: %s", state->sync_conn->errstr);
+        return -1;
+    }
+    if(reply->type == REDIS_REPLY_ERROR) {
+        snprintf(state->err, state->err_len, "Sync server error: %s", reply->str);
+        freeReplyObject(reply);
+        return -1;
+    }
+    freeReplyObject(reply);
+    return 0;
+}
+
+static int set_shift(TdcAlignState* state, uint32_t shift) {
+    uint32_t phases[CLOCK_WIZ_NUM_CLOCKS];
+    uint32_t status = 0;
+    RegBatch batch;
+    long long start;
+    int i;
+
+    for(i=0; i<CLOCK_WIZ_NUM_CLOCKS; i++) {
+        phases[i] = (state->base_phases[i] + shift) % CLOCK_WIZ_FULL_PHASE;
+    }
+    reg_batch_init(&batch);
+    batch_clock_wiz_write_phases(&batch, state->targets->clk_wiz, phases);
+    batch_clock_wiz_read_status(&batch, state->targets->clk_wiz, &status);
+    if(commit_reg_batch(&batch)) {
+        snprintf(state->err, state->err_len, "Could not write clock phase");
+        return -1;
+    }
+
+    start = now_us();
+    while(!(status & CLOCK_WIZ_STATUS_LOCKED_BIT)) {
+        if(now_us() - start > TDC_ALIGN_LOCK_TIMEOUT_US) {
+            snprintf(state->err, state->err_len, "Clock wizard did not lock after phase change");
+            return -1;
+        }
+        batch_clock_wiz_read_status(&batch, state->targets->clk_wiz, &status);
+        if(commit_reg_batch(&batch)) {
+            snprintf(state->err, state->err_len, "Could not read clock wizard status");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Fires syncs and reads the TDC until the mean is at least TDC_ALIGN_Z
+// standard errors from the target, or TDC_ALIGN_MAX_SAMPLES is reached.
+static int sample_point(TdcAlignState* state, uint32_t shift, TdcPoint* point) {
+    uint32_t code, status;
+    double mean = 0, m2 = 0;
+    int n = 0;
+    int num_bad = 0;
+    RegBatch batch;
+
+    if(set_shift(state, shift)) {
+        return -1;
+    }
+
+    while(n < TDC_ALIGN_MAX_SAMPLES) {
+        double phase, delta;
+        if(fire_sync(state)) {
+            return -1;
+        }
+        // Check the lock in the same packet so a sample taken while the
+        // clock wasn't locked gets thrown out
+        reg_batch_init(&batch);
+        batch_read_gpio_value(&batch, state->targets->gpio, 1, state->targets->tdc_channel, &code);
+        batch_clock_wiz_read_status(&batch, state->targets->clk_wiz, &status);
+        if(commit_reg_batch(&batch)) {
+            snprintf(state->err, state->err_len, "Could not read TDC value");
+            return -1;
+        }
+        state->num_samples++;
+
+        phase = tdc_code_to_phase(code);
+        if(phase < 0 || !(status & CLOCK_WIZ_STATUS_LOCKED_BIT)) {
+            if(++num_bad > TDC_ALIGN_MAX_SAMPLES) {
+                snprintf(state->err, state->err_len, "Too many bad TDC readings (last was 0x%x)", code);
+                return -1;
+            }
+            continue;
+        }
+
+        // Welford's running mean & variance
+        n++;
+        delta = (phase - 0.5) - mean;
+        mean += delta/n;
+        m2 += delta*((phase - 0.5) - mean);
+
+        if(n >= TDC_ALIGN_MIN_SAMPLES && fabs(mean) > TDC_ALIGN_Z*sqrt(m2/(n-1)/n)) {
+            break;
+        }
+    }
+    point->error = mean;
+    point->decided = n < TDC_ALIGN_MAX_SAMPLES;
+    return 0;
+}
+
+static int search(TdcAlignState* state, uint32_t resolution, uint32_t* best_shift) {
+    const uint32_t step = CLOCK_WIZ_FULL_PHASE/TDC_ALIGN_COARSE_STEPS;
+    TdcPoint coarse[TDC_ALIGN_COARSE_STEPS];
+    TdcPoint mid_point;
+    uint32_t lo, hi, mid;
+    int lo_positive;
+    int best = -1;
+    double best_sum = 0;
+    int i;
+
+    for(i=0; i<TDC_ALIGN_COARSE_STEPS; i++) {
+        if(sample_point(state, i*step, &coarse[i])) {
+            return -1;
+        }
+    }
+
+    // Find the neighbouring steps the TDC phase goes through 0.5 between.
+    // It also wraps from 1 back to 0 somewhere, that's the pair that's
+    // on opposite sides but far apart.
+    for(i=0; i<TDC_ALIGN_COARSE_STEPS; i++) {
+        TdcPoint* a = &coarse[i];
+        TdcPoint* b = &coarse[(i+1) % TDC_ALIGN_COARSE_STEPS];
+        double sum = fabs(a->error) + fabs(b->error);
+        if((a->error >= 0) == (b->error >= 0) || fabs(a->error - b->error) >= 0.5) {
+            continue;
+        }
+        if(best < 0 || sum < best_sum) {
+            best = i;
+            best_sum = sum;
+        }
+    }
+    if(best < 0) {
+        snprintf(state->err, state->err_len, "TDC phase never crossed 0.5, are syncs being sent?");
+        return -1;
+    }
+
+    lo = best*step;
+    hi = lo + step;
+    lo_positive = coarse[best].error >= 0;
+    if(!coarse[best].decided) {
+        hi = lo;
+    }
+    else if(!coarse[(best+1) % TDC_ALIGN_COARSE_STEPS].decided) {
+        lo = hi;
+    }
+    while(hi - lo > resolution) {
+        mid = lo + (hi - lo)/2;
+        if(sample_point(state, mid, &mid_point)) {
+            return -1;
+        }
+        if(!mid_point.decided) {
+            lo = hi = mid;
+        }
+        else if((mid_point.error >= 0) == lo_positive) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    *best_shift = (lo + (hi - lo)/2) % CLOCK_WIZ_FULL_PHASE;
+    return 0;
+}
+
+int tdc_align_run(TdcAlignTargets* targets, uint32_t sync_length, uint32_t resolution,
+                  TdcAlignResult* result, char* err, size_t err_len) {
+    TdcAlignState state;
+    TdcPoint final_point;
+    RegBatch batch;
+    uint32_t shift = 0;
+    int ret = -1;
+
+    memset(result, 0, sizeof(TdcAlignResult));
+    memset(&state, 0, sizeof(state));
+    state.targets = targets;
+    state.sync_length = sync_length;
+    state.err = err;
+    state.err_len = err_len;
+    if(resolution == 0) {
+        resolution = 1;
+    }
+
+    reg_batch_init(&batch);
+    batch_clock_wiz_read_phases(&batch, targets->clk_wiz, state.base_phases);
+    if(commit_reg_batch(&batch)) {
+        snprintf(err, err_len, "Could not read clock phases");
+        return -1;
+    }
+    state.sync_conn = connect_sync_server(err, err_len);
+    if(!state.sync_conn) {
+        return -1;
+    }
+
+    if(search(&state, resolution, &shift) == 0 &&
+       sample_point(&state, shift, &final_point) == 0) {
+        result->shift = shift;
+        result->phase = final_point.error + 0.5;
+        ret = 0;
+    }
+    else {
+        // Don't leave the clock wherever the search happened to stop
+        char ignored[256];
+        state.err = ignored;
+        state.err_len = sizeof(ignored);
+        set_shift(&state, 0);
+    }
+    result->num_samples = state.num_samples;
+    redisFree(state.sync_conn);
+    return ret;
+}
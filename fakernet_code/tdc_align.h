@@ -0,0 +1,51 @@
+#ifndef __TDC_ALIGN__
+#define __TDC_ALIGN__
+#include <inttypes.h>
+#include <stdlib.h>
+#include "clock_wiz.h"
+#include "gpio.h"
+
+// Shifts a CERES board's clock wizard phase until the FONTUS sync arrives in
+// the middle of the clock period, the server side version of do_tdc_sync.py.
+//
+// The TDC reports which quarter of the clock period the last sync arrived in.
+// Shifting the clock phase moves the sync through the period, the target is
+// the boundary between the 2nd and 3rd quarters (TDC phase 0.5), which is
+// where the TDC reading is most sensitive to the phase. The search is a
+// coarse scan over the whole period to bracket that boundary followed by a
+// bisection. At each phase step syncs are fired and the TDC sampled until
+// it's statistically clear which side of the boundary we're on, or until
+// TDC_ALIGN_MAX_SAMPLES, which means we're sitting on the boundary.
+//
+// Syncs are fired by sending do_sync to the FONTUS server at
+// tdc_align_sync_server ("HOST:PORT"). Each call opens its own connection so
+// several boards can be aligned at once from different threads.
+#define TDC_ALIGN_COARSE_STEPS 8
+#define TDC_ALIGN_MIN_SAMPLES 8
+#define TDC_ALIGN_MAX_SAMPLES 200
+// Number of standard errors the mean has to be away from the boundary
+#define TDC_ALIGN_Z 3.0
+// How long to wait for the clock wizard to lock after a phase change
+#define TDC_ALIGN_LOCK_TIMEOUT_US 100000
+#define TDC_ALIGN_DEFAULT_SYNC_SERVER "127.0.0.1:4002"
+
+extern const char* tdc_align_sync_server;
+
+typedef struct TdcAlignTargets {
+    AXI_CLOCK_WIZ* clk_wiz;
+    AXI_GPIO* gpio;
+    int tdc_channel; // GPIO input channel the TDC value is on
+} TdcAlignTargets;
+
+typedef struct TdcAlignResult {
+    uint32_t shift; // Phase shift that was applied, in thousandths of a degree
+    double phase; // Mean TDC phase at the final setting, 0.5 is ideal
+    int num_samples; // Total number of syncs used
+} TdcAlignResult;
+
+// Runs the search on the active FPGA and leaves its clock at the best phase,
+// or at its original phase if the search failed. Returns 0 on success,
+// otherwise fills in 'err'.
+int tdc_align_run(TdcAlignTargets* targets, uint32_t sync_length, uint32_t resolution,
+                  TdcAlignResult* result, char* err, size_t err_len);
+#endif
@@ -74,6 +74,14 @@ uint32_t write_trig_pipeline_value(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t offset
     return write_addr(tp_axi->axi_addr, offset, data);
 }
 
+int batch_write_trig_pipeline_value(RegBatch* batch, AXI_TRIGGER_PIPELINE* tp_axi, uint32_t offset, uint32_t data) {
+    return reg_batch_write(batch, tp_axi->axi_addr, offset, data);
+}
+
+int batch_read_trig_pipeline_value(RegBatch* batch, AXI_TRIGGER_PIPELINE *tp_axi, uint32_t offset, uint32_t* result) {
+    return reg_batch_read(batch, tp_axi->axi_addr, offset, result);
+}
+
 uint32_t read_multiplicity_width(AXI_TRIGGER_PIPELINE* tp_axi) {
     return read_trig_pipeline_value(tp_axi, TRIG_VAR_COMBINER_MULTIPLICITY_WIDTH);
 }
@@ -487,9 +495,9 @@ uint32_t read_sync_length(AXI_TRIGGER_PIPELINE* tp_axi) {
 
 uint32_t do_sync(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t length) {
     uint32_t word = ((length & 0xFFFF) << 4) | 0x1;
-    uint32_t ret = 0;
-    ret = write_trig_pipeline_value(tp_axi, SYNC_REG_OFFSET, word);
-    if(ret) { return ret;}
+    RegBatch batch;
+    reg_batch_init(&batch);
+    batch_write_trig_pipeline_value(&batch, tp_axi, SYNC_REG_OFFSET, word);
 
     // TODO from looking at the sync_gen RTL code it looks like the SYNC pulse
     // will only be emitted once bit-0 of the register is '1' and will stop
@@ -498,7 +506,8 @@ uint32_t do_sync(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t length) {
     // unintuitive.
     // Unset bit-0
     word &= 0xFFFFE;
-    return write_trig_pipeline_value(tp_axi, SYNC_REG_OFFSET, word);
+    batch_write_trig_pipeline_value(&batch, tp_axi, SYNC_REG_OFFSET, word);
+    return commit_reg_batch(&batch);
 }
 
 uint32_t write_auto_trig_length(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t length) {
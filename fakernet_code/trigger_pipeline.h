@@ -2,6 +2,7 @@
 #define __DATA_PIPELINE__
 #include <inttypes.h>
 #include <stdlib.h>
+#include "reg_batch.h"
 
 typedef struct AXI_TRIGGER_PIPELINE {
     const char* name;
@@ -12,6 +13,8 @@ AXI_TRIGGER_PIPELINE* new_trig_pipeline_if(const char* name, uint32_t axi_addr);
 
 uint32_t write_trig_pipeline_value(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t offset, uint32_t data);
 uint32_t read_trig_pipeline_value(AXI_TRIGGER_PIPELINE *tp_axi, uint32_t offset);
+int batch_write_trig_pipeline_value(RegBatch* batch, AXI_TRIGGER_PIPELINE* tp_axi, uint32_t offset, uint32_t data);
+int batch_read_trig_pipeline_value(RegBatch* batch, AXI_TRIGGER_PIPELINE *tp_axi, uint32_t offset, uint32_t* result);
 uint32_t read_multiplicity_width(AXI_TRIGGER_PIPELINE* tp_axi);
 uint32_t write_multiplicity_width(AXI_TRIGGER_PIPELINE* tp_axi, uint32_t width);
 
@@ -12,6 +12,7 @@
 #include "util.h"
 #include "hiredis/hiredis.h"
 #include "daq_logger.h"
+#include "metrics.h"
 
 #define DATA_FORMAT_VERSION 1
 
@@ -25,8 +26,8 @@
 
 #define QUEUE_LENGTH 100
 #define FONTUS_DEVICE_ID 0
-#define REDIS_UNIX_SOCK_PATH "/var/run/redis/redis-server.sock"
-//#define REDIS_UNIX_SOCK_PATH "/Users/marzece/redis-server.sock"
+#define DEFAULT_REDIS_UNIX_SOCK_PATH "/var/run/redis/redis-server.sock"
+//#define DEFAULT_REDIS_UNIX_SOCK_PATH "/Users/marzece/redis-server.sock"
 #define REDIS_OUT_DATA_BUF_SIZE (64*1024*1024)
 #define DEFAULT_FILE_SIZE_THRESHOLD (1024*1024*1024ULL) // 1GB
 
@@ -124,8 +125,29 @@ typedef struct ProcessingStats {
     double start_time; // In microseconds (since Epoch start)
     double uptime; // In microseconds
     unsigned int pid; // PID for this program
+    unsigned long long bytes_written; // To disk
+    unsigned long long bytes_published; // To redis
 } ProcessingStats;
 
+// What gets published from ProcessingStats, see metrics.h
+typedef struct ZipperMetrics {
+    MetricSet set;
+    Metric* run_number;
+    Metric* sub_run_number;
+    Metric* event_count;
+    Metric* trigger_id;
+    Metric* latest_timestamp;
+    Metric* max_delta_t;
+    Metric* fontus_delta_t;
+    Metric* device_mask;
+    Metric* events_waiting;
+    Metric* bytes_written;
+    Metric* bytes_published;
+    Metric* event_bytes;
+    Metric* pid;
+    Metric* uptime;
+} ZipperMetrics;
+
 void initialize_processing_stats(ProcessingStats* stats) {
     if(!stats) {
         return;
@@ -144,6 +166,27 @@ void initialize_processing_stats(ProcessingStats* stats) {
     stats->start_time = tv.tv_sec*1e6 + tv.tv_usec;
     stats->uptime = 0;
     stats->pid = getpid();
+    stats->bytes_written = 0;
+    stats->bytes_published = 0;
+}
+
+void initialize_metrics(ZipperMetrics* metrics) {
+    MetricSet* set = &metrics->set;
+    metrics_init(set, "zipper_stats", "zipper_");
+    metrics->run_number = metrics_add_gauge(set, "run_number", "Current run number");
+    metrics->sub_run_number = metrics_add_gauge(set, "sub_run_number", "Current sub-run number");
+    metrics->event_count = metrics_add_counter(set, "event_count", "Events built since the zipper started");
+    metrics->trigger_id = metrics_add_gauge(set, "trigger_id", "Most recent event's trigger ID");
+    metrics->latest_timestamp = metrics_add_gauge(set, "latest_timestamp", "Most recent event's clock timestamp");
+    metrics->max_delta_t = metrics_add_gauge(set, "max_delta_t", "Largest timestamp difference within an event since the last update");
+    metrics->fontus_delta_t = metrics_add_gauge(set, "fontus_delta_t", "FONTUS timestamp minus the latest CERES timestamp");
+    metrics->device_mask = metrics_add_gauge(set, "device_mask", "Devices that make up a complete event");
+    metrics->events_waiting = metrics_add_gauge(set, "events_waiting", "Complete events waiting to be saved");
+    metrics->bytes_written = metrics_add_counter(set, "bytes_written", "Bytes of events written to disk");
+    metrics->bytes_published = metrics_add_counter(set, "bytes_published", "Bytes of events published to redis");
+    metrics->event_bytes = metrics_add_histogram(set, "event_bytes", "Size of each saved event");
+    metrics->pid = metrics_add_gauge(set, "pid", "PID of the zipper");
+    metrics->uptime = metrics_add_gauge(set, "uptime", "Seconds since the zipper started");
 }
 
 redisContext* create_redis_conn(const char* redis_hostname, int port) {
@@ -505,42 +548,24 @@ int send_event_to_redis(redisContext* redis, int event_id) {
     return  arglens[2];
 }
 
-void redis_publish_stats(redisContext* c, const ProcessingStats* stats) {
+void redis_publish_stats(redisContext* c, ZipperMetrics* metrics, const ProcessingStats* stats) {
     if(!c || !stats) {
         return;
     }
-    size_t arglens[3];
-    const char* args[3];
-    int done = 0;
-    char buf[2048];
-
-    // Use a a Stream instead of a pub-sub for this?
-    // Or maybe just a key-value store?
-    args[0] = "PUBLISH";
-    arglens[0] = strlen(args[0]);
-
-    args[1] = "zipper_stats";
-    arglens[1] = strlen(args[1]);
-
-    arglens[2] = snprintf(buf, 2048, "%lli %lli %u %u %llu %llu %lli %u %i %i %i",
-                                                          stats->run_number,
-                                                          stats->sub_run_number,
-                                                          stats->event_count,
-                                                          stats->trigger_id,
-                                                          stats->latest_timestamp,
-                                                          stats->max_delta_t,
-                                                          stats->fontus_delta_t,
-                                                          stats->device_mask,
-                                                          stats->events_waiting,
-                                                          stats->pid,
-                                                          (int)(stats->uptime/1e6));
-
-    args[2] = buf;
-    redisAppendCommandArgv(c, 3,  args,  arglens);
-    // TODO should I add some loop counter so I don't get stuck here?
-    while(!done) {
-        redisBufferWrite(c, &done);
-    }
+    metric_set(metrics->run_number, stats->run_number);
+    metric_set(metrics->sub_run_number, stats->sub_run_number);
+    metric_set_count(metrics->event_count, stats->event_count);
+    metric_set(metrics->trigger_id, stats->trigger_id);
+    metric_set(metrics->latest_timestamp, stats->latest_timestamp);
+    metric_set(metrics->max_delta_t, stats->max_delta_t);
+    metric_set(metrics->fontus_delta_t, stats->fontus_delta_t);
+    metric_set(metrics->device_mask, stats->device_mask);
+    metric_set(metrics->events_waiting, stats->events_waiting);
+    metric_set_count(metrics->bytes_written, stats->bytes_written);
+    metric_set_count(metrics->bytes_published, stats->bytes_published);
+    metric_set(metrics->pid, stats->pid);
+    metric_set(metrics->uptime, (int)(stats->uptime/1e6));
+    metrics_publish(&metrics->set, c);
 }
 
 int wait_for_redis_readable(const redisContext* r, int timeout) {
@@ -687,16 +712,19 @@ void evaluate_event_stats(ProcessingStats* stats, const uint32_t event_id) {
 
 void print_help_string(void) {
     printf("zipper: recieves then combines data from CERES & FONTUS data builders via redis DB.\n"
-            "\tusage:  zipper [-o filename] [-m event_mask] [-l log-filename] [--rate rate] [--run-mode] [-v] [-q]\n"
+            "\tusage:  zipper [-o filename] [-m event_mask] [-l log-filename] [-u redis-socket] [--rate rate] [--metrics-port port] [--log-rate " LOG_RATE_OPTION_HELP "] [--run-mode] [-v] [-q]\n"
             "\targuments:\n"
             "\t--out -o\tFile to write built data to. Default is '%s'\n"
             "\t--mask -m\tBit mask corresponding to a complete event. Default 0x%llX.\n"
             "\t--log-file -l\tFilename that log messages should be recorded to. Default '%s'\n"
+            "\t--redis-sock -u\tUnix socket of the redis DB that data is recieved from. Default '%s'\n"
             "\t--rate -r\tMax publish rate in Hz. [NOT IMPLEMENTED!]\n"
+            "\t--metrics-port -p\tServe Prometheus metrics on this local TCP port. Default is to not.\n"
+            "\t--log-rate -L\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). Can be given once per level. ERRORs aren't limited by default.\n"
             "\t--verbose -v\tIncrease verbosity. Can be done multiple times.\n"
             "\t--quiet -q\tDecrease verbosity. Can be done multiple times.\n"
             "\t--run-mode\tOperate in run-mode. Will recieve run updates from redis. Default off\n",
-          DEFAULT_DATA_OUT_FILE, DEFAULT_EVENT_MASK, DEFAULT_LOG_FILENAME);
+          DEFAULT_DATA_OUT_FILE, DEFAULT_EVENT_MASK, DEFAULT_LOG_FILENAME, DEFAULT_REDIS_UNIX_SOCK_PATH);
 }
 
 // Helper function, calculates the difference between two timevals in micro-seconds
@@ -722,15 +750,19 @@ int main(int argc, char** argv) {
     int print_status_bytes_sent = 0;
     unsigned long long bytes_in_file = 0;
     int nbytes_written;
+    int nbytes_published;
     RunInfo run_info;
     int resume_last_run = 0;
     struct timeval redis_update_time, event_rate_time, byte_sent_time, current_time;
     const char* MDAQ_FN_PREFIX = "jsns2_mdaq";
     const char* file_name_template = "%s.r%06i.f%06i.dat";
     const char* log_filename = DEFAULT_LOG_FILENAME;
+    const char* redis_sock_path = DEFAULT_REDIS_UNIX_SOCK_PATH;
     char buffer[128];
     double last_status_update_time = 0;
+    int metrics_port = 0;
     ProcessingStats stats;
+    ZipperMetrics metrics;
 
     run_info.run_number = -1;
     run_info.sub_run = 0;
@@ -744,13 +776,16 @@ int main(int argc, char** argv) {
                               {"mask", required_argument, NULL, 'm'},
                               {"run-mode", no_argument, &arg_run_mode, 1},
                               {"log-file", required_argument, NULL, 'l'},
+                              {"redis-sock", required_argument, NULL, 'u'},
                               {"verbose", no_argument, NULL, 'v'},
                               {"rate", required_argument, NULL, 'r'},
+                              {"metrics-port", required_argument, NULL, 'p'},
+                              {"log-rate", required_argument, NULL, 'L'},
                               {"help", no_argument, NULL, 'h'},
                               { 0, 0, 0, 0}};
     int optindex;
     int opt;
-    while((opt = getopt_long(argc, argv, "o:m:r:l:vq", clargs, &optindex)) != -1) {
+    while((opt = getopt_long(argc, argv, "o:m:r:l:u:p:L:vq", clargs, &optindex)) != -1) {
         switch(opt) {
             case 0:
                 // Should be here if the option has the "flag" set
@@ -787,6 +822,19 @@ int main(int argc, char** argv) {
                 printf("Log file set to %s\n", optarg);
                 log_filename = optarg;
                 break;
+            case 'u':
+                printf("Redis socket set to %s\n", optarg);
+                redis_sock_path = optarg;
+                break;
+            case 'p':
+                metrics_port = atoi(optarg);
+                break;
+            case 'L':
+                if(daq_log_parse_rate_limit(optarg)) {
+                    printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", optarg);
+                    return 0;
+                }
+                break;
             case 'h':
                 print_help_string();
                 return 0;
@@ -820,6 +868,10 @@ int main(int argc, char** argv) {
 
     initialize_processing_stats(&stats);
     stats.device_mask = COMPLETE_EVENT_MASK;
+    initialize_metrics(&metrics);
+    if(metrics_port && metrics_listen(&metrics.set, metrics_port)) {
+        daq_log(LOG_ERROR, "Could not serve metrics on port %i: %s", metrics_port, strerror(errno));
+    }
 
     FILE* fout = fopen(output_filename, "ab");
     if(!fout) {
@@ -830,21 +882,21 @@ int main(int argc, char** argv) {
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
 
-    data_redis = create_redis_unix_conn(REDIS_UNIX_SOCK_PATH, 0);
+    data_redis = create_redis_unix_conn(redis_sock_path, 0);
     if(!data_redis) {
         daq_log(LOG_ERROR, "Could not connect to redis for receiving data");
         return 1;
     }
 
 
-    publish_redis = create_redis_unix_conn(REDIS_UNIX_SOCK_PATH, 1);
+    publish_redis = create_redis_unix_conn(redis_sock_path, 1);
     if(!publish_redis) {
         daq_log(LOG_ERROR, "Could not connect to redis for publishing data");
     }
 
     // Connect to redis so I can get run info
     if(run_mode) {
-        run_info_redis = create_redis_unix_conn(REDIS_UNIX_SOCK_PATH, 1);
+        run_info_redis = create_redis_unix_conn(redis_sock_path, 1);
         if(!run_info_redis) {
             daq_log(LOG_ERROR, "Could not connect to redis for run info. Will be using default run 0.");
         }
@@ -952,6 +1004,10 @@ int main(int argc, char** argv) {
                 freeReplyObject(reply);
             } while(reply);
         }
+        // Finish sending anything metrics_publish left buffered
+        if(publish_redis) {
+            redisBufferWrite(publish_redis, NULL);
+        }
 
         if(event_ready_queue.events_available) {
             event_id = pop_complete_event_id();
@@ -963,7 +1019,9 @@ int main(int argc, char** argv) {
                 delta_t = calculate_delta_t(current_time, redis_update_time);
                 delta_t /= 1e6;
                 if(delta_t > 1.0/publish_rate && bytes_sent < DEFAULT_PUBLISH_MAX_SIZE/10.) {
-                    bytes_sent += send_event_to_redis(publish_redis, event_id);
+                    nbytes_published = send_event_to_redis(publish_redis, event_id);
+                    bytes_sent += nbytes_published;
+                    stats.bytes_published += nbytes_published;
                     redis_update_time = current_time;
                 }
             }
@@ -974,6 +1032,8 @@ int main(int argc, char** argv) {
             }
 
             bytes_in_file += nbytes_written;
+            stats.bytes_written += nbytes_written;
+            metric_observe(metrics.event_bytes, nbytes_written);
             free_event(event_id);
 
             // Check if it's time to change to a new sub-run
@@ -1034,18 +1094,20 @@ int main(int argc, char** argv) {
             stats.run_number = run_info.run_number;
             stats.sub_run_number = run_info.sub_run;
 
-            redis_publish_stats(publish_redis, &stats);
+            redis_publish_stats(publish_redis, &metrics, &stats);
 
             stats.max_delta_t = 0;
             stats.fontus_delta_t = 0;
             last_status_update_time = stats.uptime;
         }
+        metrics_serve(&metrics.set);
     }
     // Clean up
     fclose(fout);
     redisFree(data_redis);
     redisFree(publish_redis);
     redisFree(run_info_redis);
+    metrics_cleanup(&metrics.set);
     daq_log(LOG_WARN, "Bye\n");
     return 0;
 }
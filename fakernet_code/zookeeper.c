@@ -11,6 +11,10 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <getopt.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#endif
 #include "server_common.h"
 #include "server.h"
 #include "daq_logger.h"
@@ -26,6 +30,17 @@
 #define LOG_FILENAME "zoo_keeper_server.log"
 #define LOG_MESSAGE_MAX 1024
 
+// Builder supervision, see supervise_builders()
+#define SUPERVISE_PERIOD_MS 100
+#define HEALTH_CHECK_PERIOD_MS 1000 // How often an idle builder gets sent a CMD_NUMBUILT
+#define DEFAULT_HANG_TIMEOUT_MS 30000 // A builder that doesn't answer for this long gets killed
+#define STOP_TIMEOUT_MS 2000 // Time between the SIGTERM and the SIGKILL for stop_builder
+#define RESTART_BACKOFF_MIN_MS 250
+#define RESTART_BACKOFF_MAX_MS 30000
+#define HEALTHY_UPTIME_MS 60000 // A builder that ran this long gets restarted right away
+#define MAX_STANDBY 4
+#define DEFAULT_NUM_STANDBY 1
+
 int verbosity_stdout = LOG_INFO;
 int verbosity_file = LOG_INFO;
 int verbosity_redis = LOG_WARN;
@@ -35,6 +50,11 @@ char command_buffer[BUFFER_SIZE];
 char resp_buffer[BUFFER_SIZE];
 static volatile int end_main_loop = 0;
 int start_data_builder = -1;
+int standby_index = -1; // In a standby process, which of the standbys it is
+long long hang_timeout_ms = DEFAULT_HANG_TIMEOUT_MS;
+long long stall_timeout_ms = 0; // Restart builders whose event count doesn't go up for this long, 0 to not
+int num_standby = DEFAULT_NUM_STANDBY;
+int sigchld_fd = -1;
 
 // Linked list for keeping of track of IO commands that have been requested and
 // the client that requested them.
@@ -53,8 +73,27 @@ typedef struct IPC_Pipe {
     int c2p_pipe[2]; // Child to parent pipe
     ManagerIOList* cmd_list;
     void* buffer[PIPE_BUFFER_SIZE];
+
+    // Supervision
+    int wanted; // Set between start_builder and stop_builder, the builder gets restarted if it exits
+    client* stop_client; // Client waiting for the builder to exit
+    long long kill_at_ms; // When to SIGKILL a builder that was asked to stop, 0 if it wasn't
+    long long started_ms;
+    long long restart_at_ms; // When to restart an exited builder, 0 if it isn't going to be
+    long long restart_backoff_ms;
+    int num_restarts;
+    long long cmd_sent_ms; // When the command at the top of cmd_list was sent
+    long long last_check_ms;
+    int num_built; // From the last health check
+    long long last_progress_ms; // Last time num_built went up
 } IPC_Pipe;
 IPC_Pipe pipes[MAX_NUM_BUILDERS];
+// Processes that are forked and waiting to be told which device to build
+// for, so getting a builder going doesn't wait on a fork.
+IPC_Pipe standbys[MAX_STANDBY];
+// Each builder keeps its state here, so status commands don't have to go
+// through the pipes. Mapped before anything is forked so every builder gets it.
+BuilderStatus* builder_statuses = NULL;
 #define READ_PIPE_IDX 0
 #define WRITE_PIPE_IDX 1
 
@@ -103,14 +142,22 @@ void sig_handler(int dummy) {
     exit(0);
 }
 
+static long long now_ms(void) {
+    return ustime()/1000;
+}
+
+// Closes the parent's ends of the pipes and fails any commands that were
+// waiting on the builder. The process itself gets taken care of by
+// reap_children().
 void clean_up_child_process_pipes(IPC_Pipe* pipe) {
-    pipe->device_index = -1;
-    pipe->child_pid = 0;
-    pipe->parent_pid = 0;
     int write_pipe = pipe->p2c_pipe[WRITE_PIPE_IDX];
     int read_pipe = pipe->c2p_pipe[READ_PIPE_IDX];
-    aeDeleteFileEvent(server.el, read_pipe, AE_READABLE);
-    aeDeleteFileEvent(server.el, write_pipe, AE_WRITABLE);
+    if(read_pipe >= 0) {
+        aeDeleteFileEvent(server.el, read_pipe, AE_READABLE);
+    }
+    if(write_pipe >= 0) {
+        aeDeleteFileEvent(server.el, write_pipe, AE_WRITABLE);
+    }
 
     // If there's any remaining commands that haven't been processed,
     // remove them, and send an error to their client.
@@ -125,8 +172,12 @@ void clean_up_child_process_pipes(IPC_Pipe* pipe) {
         free(this_cmd);
     }
 
-    close(write_pipe);
-    close(read_pipe);
+    if(write_pipe >= 0) {
+        close(write_pipe);
+    }
+    if(read_pipe >= 0) {
+        close(read_pipe);
+    }
 
     pipe->p2c_pipe[0] = -1;
     pipe->p2c_pipe[1] = -1;
@@ -144,6 +195,112 @@ ssize_t send_manager_command_now(int fd, ManagerIO cmd) {
     return nbytes;
 }
 
+static void send_top_command(IPC_Pipe* pipe) {
+    pipe->cmd_sent_ms = now_ms();
+    send_manager_command_now(pipe->p2c_pipe[WRITE_PIPE_IDX], pipe->cmd_list->io_cmd);
+}
+
+static void note_progress(IPC_Pipe* pipe, int num_built, long long now) {
+    if(num_built != pipe->num_built) {
+        pipe->num_built = num_built;
+        pipe->last_progress_ms = now;
+    }
+}
+
+static const char* builder_name(IPC_Pipe* pipe) {
+    static char name[32];
+    if(pipe >= standbys && pipe < standbys + MAX_STANDBY) {
+        snprintf(name, sizeof(name), "Standby %i", (int)(pipe - standbys));
+    }
+    else {
+        snprintf(name, sizeof(name), "Builder %i", (int)(pipe - pipes));
+    }
+    return name;
+}
+
+// Sets everything up in a newly forked child so it can get out of the event
+// loop and go off to be a data builder. Only ever called from the top of
+// supervise_builders(), so the only thing left of the parent's event loop
+// iteration is its other timers, and those get deleted here.
+static void become_child(IPC_Pipe* this_pipe) {
+    sigset_t mask;
+    long long id;
+    int i;
+
+    cleanup_logger();
+    close(STDOUT_FILENO); // Get rid of printf output
+    server.el->stop = 1;
+    for(id=0; id<server.el->timeEventNextId; id++) {
+        aeDeleteTimeEvent(server.el, id);
+    }
+    close(this_pipe->c2p_pipe[READ_PIPE_IDX]);
+    close(this_pipe->p2c_pipe[WRITE_PIPE_IDX]);
+    this_pipe->c2p_pipe[READ_PIPE_IDX] = -1;
+    this_pipe->p2c_pipe[WRITE_PIPE_IDX] = -1;
+    this_pipe->child_pid = getpid();
+
+    // The other builders' pipes would otherwise be held open by this one
+    for(i=0; i<MAX_NUM_BUILDERS + MAX_STANDBY; i++) {
+        IPC_Pipe* other = i < MAX_NUM_BUILDERS ? &pipes[i] : &standbys[i - MAX_NUM_BUILDERS];
+        if(other == this_pipe || !other->child_pid) {
+            continue;
+        }
+        if(other->c2p_pipe[READ_PIPE_IDX] >= 0) {
+            close(other->c2p_pipe[READ_PIPE_IDX]);
+            other->c2p_pipe[READ_PIPE_IDX] = -1;
+        }
+        if(other->p2c_pipe[WRITE_PIPE_IDX] >= 0) {
+            close(other->p2c_pipe[WRITE_PIPE_IDX]);
+            other->p2c_pipe[WRITE_PIPE_IDX] = -1;
+        }
+    }
+    if(sigchld_fd >= 0) {
+        close(sigchld_fd);
+        sigchld_fd = -1;
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+// Forks a child process with a pair of pipes to talk to it. Returns the
+// child's PID in the parent, 0 in the child, or -1 if it didn't work.
+static pid_t fork_child(IPC_Pipe* this_pipe) {
+    pid_t child_pid;
+    if(pipe(this_pipe->p2c_pipe)) {
+        return -1;
+    }
+    if(pipe(this_pipe->c2p_pipe)) {
+        close(this_pipe->p2c_pipe[0]);
+        close(this_pipe->p2c_pipe[1]);
+        this_pipe->p2c_pipe[0] = this_pipe->p2c_pipe[1] = -1;
+        return -1;
+    }
+    this_pipe->parent_pid = getpid();
+    this_pipe->cmd_list = NULL;
+    child_pid = fork();
+    if(child_pid < 0) {
+        close(this_pipe->p2c_pipe[0]);
+        close(this_pipe->p2c_pipe[1]);
+        close(this_pipe->c2p_pipe[0]);
+        close(this_pipe->c2p_pipe[1]);
+        this_pipe->p2c_pipe[0] = this_pipe->p2c_pipe[1] = -1;
+        this_pipe->c2p_pipe[0] = this_pipe->c2p_pipe[1] = -1;
+        return -1;
+    }
+    if(!child_pid) {
+        become_child(this_pipe);
+        return 0;
+    }
+
+    this_pipe->child_pid = child_pid;
+    close(this_pipe->c2p_pipe[WRITE_PIPE_IDX]);
+    close(this_pipe->p2c_pipe[READ_PIPE_IDX]);
+    this_pipe->c2p_pipe[WRITE_PIPE_IDX] = -1;
+    this_pipe->p2c_pipe[READ_PIPE_IDX] = -1;
+    return child_pid;
+}
+
 // This process handles receive data from any of the fork'd child processes.
 // In general data should be received whenver there was a command set to request
 // data. But if the child process dies this process will get run with "read" returning
@@ -169,23 +326,28 @@ void child_read_proc(aeEventLoop* el, int fd, void* client_data, int mask) {
     if(nbyte == 0) {
         // Indicates the end of the file
         // Indicates the child process closed its end of the pipe
-        // That should mean that the child process is finished
-
-        // TODO if this ever gets called and the child did not actually exit
-        // that will cause this to hang. Perhaps I should set the "no hang" option
-        // in waitpid or something, then maybe call "kill"
+        // That should mean that the child process is finished.
+        // Make sure it is, reap_children() takes it from there once it's gone.
+        daq_log(LOG_WARN, "%s (PID=%i) closed its pipe", builder_name(this_pipe), this_pipe->child_pid);
         kill(this_pipe->child_pid, SIGKILL);
-        waitpid(this_pipe->child_pid, NULL, 0);
         clean_up_child_process_pipes(this_pipe);
         return;
     }
     else if(nbyte < 0) {
         // I have no idea why this would happen.
         daq_log(LOG_ERROR, "Read error: %s\n", strerror(errno));
+        return;
+    }
+    if(this_cmd == NULL) {
+        return;
     }
 
     // TODO should check the received command matches the one speciefied in the queue
 
+    if(this_cmd->io_cmd.command == CMD_NUMBUILT) {
+        note_progress(this_pipe, recv_cmd.arg, now_ms());
+    }
+
     client* c = this_cmd->client;
     // If 'c' is NULL it indicates the client disconnected.
     if(c) {
@@ -201,7 +363,7 @@ void child_read_proc(aeEventLoop* el, int fd, void* client_data, int mask) {
 
     // Send the next request to the child process (if there are any)
     if(this_pipe->cmd_list) {
-        send_manager_command_now(this_pipe->p2c_pipe[WRITE_PIPE_IDX], this_pipe->cmd_list->io_cmd);
+        send_top_command(this_pipe);
         // TODO, in principle the child process could have crashed/died between
         // the above read and now. I need to check for errors here.
         // From testing it works out okay so maybe I don't need to do anything
@@ -221,7 +383,7 @@ void send_manager_command_async(client* c, IPC_Pipe* pipe, ManagerIO cmd) {
     // command to the child process
     if(!pipe->cmd_list) {
         pipe->cmd_list = this_cmd;
-        send_manager_command_now(pipe->p2c_pipe[WRITE_PIPE_IDX], cmd);
+        send_top_command(pipe);
     }
     else {
         // If the command list is not empty, add it to the list.
@@ -234,6 +396,287 @@ void send_manager_command_async(client* c, IPC_Pipe* pipe, ManagerIO cmd) {
     }
 }
 
+// Hands 'device_id' to a standby process, if there is one. Returns 0 if
+// there wasn't one.
+static int assign_standby(int device_id) {
+    IPC_Pipe* builder = &pipes[device_id];
+    ManagerIO assignment;
+    int i;
+    for(i=0; i<MAX_STANDBY; i++) {
+        IPC_Pipe* standby = &standbys[i];
+        if(!standby->child_pid || standby->c2p_pipe[READ_PIPE_IDX] < 0) {
+            continue;
+        }
+        builder->child_pid = standby->child_pid;
+        builder->parent_pid = standby->parent_pid;
+        builder->p2c_pipe[WRITE_PIPE_IDX] = standby->p2c_pipe[WRITE_PIPE_IDX];
+        builder->c2p_pipe[READ_PIPE_IDX] = standby->c2p_pipe[READ_PIPE_IDX];
+        builder->p2c_pipe[READ_PIPE_IDX] = -1;
+        builder->c2p_pipe[WRITE_PIPE_IDX] = -1;
+        builder->cmd_list = NULL;
+        standby->child_pid = 0;
+        standby->p2c_pipe[WRITE_PIPE_IDX] = -1;
+        standby->c2p_pipe[READ_PIPE_IDX] = -1;
+
+        assignment.command = CMD_ASSIGN_DEVICE;
+        assignment.arg = device_id;
+        send_manager_command_now(builder->p2c_pipe[WRITE_PIPE_IDX], assignment);
+        return 1;
+    }
+    return 0;
+}
+
+// Sets up the parent's side of a builder that just got going
+static void builder_started(IPC_Pipe* builder, const char* how) {
+    long long now = now_ms();
+    daq_log(LOG_WARN, "Started Data Builder %i, PID=%i (%s)", builder->device_index, builder->child_pid, how);
+
+    builder->started_ms = now;
+    builder->restart_at_ms = 0;
+    builder->kill_at_ms = 0;
+    builder->cmd_sent_ms = 0;
+    builder->last_check_ms = now;
+    builder->last_progress_ms = now;
+    builder->num_built = 0;
+    // Once the child process is running, create a file event that will respond
+    // whenever the child sends data from it's end of the pipe.
+    aeCreateFileEvent(server.el, builder->c2p_pipe[READ_PIPE_IDX], AE_READABLE, child_read_proc, (void*)builder);
+}
+
+// Gets a builder going for 'device_id' from a standby if there is one.
+// Otherwise it's queued for supervise_builders() to fork, forking anywhere
+// else would leave the new builder finishing whatever the parent's event
+// loop was in the middle of. Returns 1 if the builder is running now.
+static int start_from_standby(int device_id) {
+    IPC_Pipe* builder = &pipes[device_id];
+    builder->device_index = device_id;
+    if(builder_statuses) {
+        builder_status_clear(&builder_statuses[device_id]);
+    }
+    if(assign_standby(device_id)) {
+        builder_started(builder, "standby");
+        return 1;
+    }
+    builder->restart_at_ms = now_ms();
+    return 0;
+}
+
+// Gets a queued builder going, forking a new one if there's no standby.
+// Only called from the top of supervise_builders(). Returns 1 in a newly
+// forked builder, which has to get out of the event loop, otherwise 0.
+static int launch_builder(int device_id) {
+    IPC_Pipe* builder = &pipes[device_id];
+    pid_t child_pid;
+
+    if(start_from_standby(device_id)) {
+        return 0;
+    }
+    child_pid = fork_child(builder);
+    if(child_pid < 0) {
+        daq_log(LOG_ERROR, "Could not fork data builder %i: %s", device_id, strerror(errno));
+        builder->restart_at_ms = now_ms() + RESTART_BACKOFF_MIN_MS;
+        return 0;
+    }
+    if(!child_pid) {
+        start_data_builder = device_id;
+        return 1;
+    }
+    builder_started(builder, "fork");
+    return 0;
+}
+
+// Keeps num_standby standby processes around. Returns 1 in a new standby.
+static int replenish_standbys(void) {
+    int i;
+    int have = 0;
+    for(i=0; i<MAX_STANDBY; i++) {
+        have += standbys[i].child_pid ? 1 : 0;
+    }
+    for(i=0; i<MAX_STANDBY && have < num_standby; i++) {
+        pid_t child_pid;
+        if(standbys[i].child_pid) {
+            continue;
+        }
+        child_pid = fork_child(&standbys[i]);
+        if(child_pid < 0) {
+            daq_log(LOG_ERROR, "Could not fork a standby builder: %s", strerror(errno));
+            return 0;
+        }
+        if(!child_pid) {
+            standby_index = i;
+            return 1;
+        }
+        have++;
+    }
+    return 0;
+}
+
+static void describe_exit(int status, char* buf, size_t len) {
+    if(WIFEXITED(status)) {
+        snprintf(buf, len, "exited with status %i", WEXITSTATUS(status));
+    }
+    else if(WIFSIGNALED(status)) {
+        snprintf(buf, len, "was killed by signal %i (%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
+    }
+    else {
+        snprintf(buf, len, "stopped (status 0x%x)", status);
+    }
+}
+
+// Cleans up after a builder that exited, and restarts it if nobody asked
+// for it to stop.
+static void builder_exited(IPC_Pipe* builder, int status) {
+    char how[128];
+    long long now = now_ms();
+    int device_id = builder - pipes;
+
+    describe_exit(status, how, sizeof(how));
+    clean_up_child_process_pipes(builder);
+    builder->child_pid = 0;
+    builder->parent_pid = 0;
+    builder->kill_at_ms = 0;
+    if(builder->stop_client) {
+        addReplyStatus(builder->stop_client, "OK");
+        unblockClient(builder->stop_client);
+        builder->stop_client = NULL;
+    }
+    if(!builder->wanted) {
+        daq_log(LOG_WARN, "Data Builder %i %s", device_id, how);
+        return;
+    }
+
+    // Restart right away if it had been running fine for a while, otherwise
+    // back off so a builder that can't start doesn't spin
+    if(now - builder->started_ms >= HEALTHY_UPTIME_MS) {
+        builder->restart_backoff_ms = 0;
+    }
+    else if(builder->restart_backoff_ms < RESTART_BACKOFF_MIN_MS) {
+        builder->restart_backoff_ms = RESTART_BACKOFF_MIN_MS;
+    }
+    else {
+        builder->restart_backoff_ms *= 2;
+        if(builder->restart_backoff_ms > RESTART_BACKOFF_MAX_MS) {
+            builder->restart_backoff_ms = RESTART_BACKOFF_MAX_MS;
+        }
+    }
+    builder->num_restarts++;
+    builder->restart_at_ms = now + builder->restart_backoff_ms;
+    daq_log(LOG_ERROR, "Data Builder %i %s, restarting it in %lli ms (restart #%i)",
+            device_id, how, builder->restart_backoff_ms, builder->num_restarts);
+    if(builder->restart_backoff_ms == 0) {
+        start_from_standby(device_id);
+    }
+}
+
+// Collects every child that has exited
+static void reap_children(void) {
+    int status;
+    pid_t pid;
+    int i;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for(i=0; i<MAX_NUM_BUILDERS; i++) {
+            if(pipes[i].child_pid == pid) {
+                builder_exited(&pipes[i], status);
+                break;
+            }
+        }
+        for(i=0; i<MAX_STANDBY; i++) {
+            if(standbys[i].child_pid == pid) {
+                char how[128];
+                describe_exit(status, how, sizeof(how));
+                daq_log(LOG_ERROR, "Standby builder (PID=%i) %s", pid, how);
+                clean_up_child_process_pipes(&standbys[i]);
+                standbys[i].child_pid = 0;
+                break;
+            }
+        }
+    }
+}
+
+#ifdef __linux__
+void sigchld_proc(aeEventLoop* el, int fd, void* client_data, int mask) {
+    UNUSED(el);
+    UNUSED(client_data);
+    UNUSED(mask);
+    struct signalfd_siginfo info;
+    while(read(fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    reap_children();
+}
+#endif
+
+// Runs every SUPERVISE_PERIOD_MS. Checks on each builder through its pipe,
+// kills ones that stopped answering (or stopped building events, if
+// stall_timeout_ms is set), restarts ones that exited, and keeps the
+// standbys topped up. Anything that dies gets queued for a restart by
+// builder_exited().
+//
+// This is the only place builders and standbys get forked, and it's done
+// first so a new child has nothing of the parent's left to do.
+int supervise_builders(aeEventLoop* el, long long id, void* client_data) {
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(client_data);
+    long long now;
+    int i;
+
+    // Normally SIGCHLD gets here first
+    reap_children();
+    now = now_ms();
+    for(i=0; i<MAX_NUM_BUILDERS; i++) {
+        IPC_Pipe* builder = &pipes[i];
+        if(!builder->child_pid && builder->wanted && builder->restart_at_ms && now >= builder->restart_at_ms) {
+            if(launch_builder(i)) {
+                return AE_NOMORE;
+            }
+        }
+    }
+    if(replenish_standbys()) {
+        return AE_NOMORE;
+    }
+
+    for(i=0; i<MAX_NUM_BUILDERS; i++) {
+        IPC_Pipe* builder = &pipes[i];
+        if(!builder->child_pid) {
+            continue;
+        }
+        if(builder->kill_at_ms) {
+            if(now >= builder->kill_at_ms) {
+                daq_log(LOG_WARN, "Data Builder %i didn't stop, killing it", i);
+                kill(builder->child_pid, SIGKILL);
+                builder->kill_at_ms = 0;
+            }
+            continue;
+        }
+        if(builder->cmd_list && now - builder->cmd_sent_ms > hang_timeout_ms) {
+            daq_log(LOG_ERROR, "Data Builder %i hasn't answered in %lli ms, killing it", i, now - builder->cmd_sent_ms);
+            kill(builder->child_pid, SIGKILL);
+            builder->cmd_sent_ms = now;
+            continue;
+        }
+        if(builder_statuses) {
+            BuilderStatus status;
+            if(builder_status_read(&builder_statuses[i], &status) == 0 && status.seq) {
+                note_progress(builder, status.event_count, now);
+            }
+        }
+        if(stall_timeout_ms && builder->wanted && now - builder->last_progress_ms > stall_timeout_ms) {
+            daq_log(LOG_ERROR, "Data Builder %i hasn't built an event in %lli ms, killing it", i, now - builder->last_progress_ms);
+            kill(builder->child_pid, SIGKILL);
+            builder->last_progress_ms = now;
+            continue;
+        }
+        if(!builder->cmd_list && now - builder->last_check_ms >= HEALTH_CHECK_PERIOD_MS) {
+            ManagerIO cmd;
+            cmd.command = CMD_NUMBUILT;
+            cmd.arg = 0;
+            send_manager_command_async(NULL, builder, cmd);
+            builder->last_check_ms = now;
+        }
+    }
+    return SUPERVISE_PERIOD_MS;
+}
+
 void start_builder_command(client* c, int argc, sds* argv) {
     (void) argc; // Unused
 
@@ -248,60 +691,62 @@ void start_builder_command(client* c, int argc, sds* argv) {
         addReplyLongLong(c, (long long) -1);
         return;
     }
-    pipe(pipes[device_id].p2c_pipe);
-    pipe(pipes[device_id].c2p_pipe);
-    pipes[device_id].parent_pid = getpid();
-    pipes[device_id].device_index = device_id;
-    pid_t child_pid = fork();
-    if(!child_pid) {
-        // Child process
-        daq_log(LOG_WARN, "Starting Data Builder %lu, PID=%i\n", device_id, getpid());
-        cleanup_logger();
-        close(STDOUT_FILENO); // Get rid of printf output
-        server.el->stop = 1;
-        close(pipes[device_id].c2p_pipe[READ_PIPE_IDX]);
-        close(pipes[device_id].p2c_pipe[WRITE_PIPE_IDX]);
-        pipes[device_id].child_pid = getpid();
-        start_data_builder = device_id;
-        return;
-    }
-
-    // Parent process
-    pipes[device_id].child_pid = child_pid;
-    close(pipes[device_id].c2p_pipe[WRITE_PIPE_IDX]);
-    close(pipes[device_id].p2c_pipe[READ_PIPE_IDX]);
-    // Once the child process is running, create a file event that will respond
-    // whenever the child sends data from it's end of the pipe.
-    aeCreateFileEvent(server.el, pipes[device_id].c2p_pipe[0], AE_READABLE, child_read_proc, (void*)&(pipes[device_id]));
+    pipes[device_id].wanted = 1;
+    pipes[device_id].restart_backoff_ms = 0;
+    pipes[device_id].num_restarts = 0;
+    // Without a standby it gets forked the next time supervise_builders() runs
+    start_from_standby(device_id);
     addReplyStatus(c, "OK");
 }
 
+void clean_up_stop_client(client* c, void* data) {
+    IPC_Pipe* builder = (IPC_Pipe*)data;
+    if(builder->stop_client == c) {
+        builder->stop_client = NULL;
+    }
+}
+
 void stop_builder_command(client* c, int argc, sds* argv) {
     (void) argv; // Unused
     (void) argc; // Unused
 
-    int status;
     unsigned long device_id = strtoul(c->argv[1], NULL, 0);
     if(device_id >= 32) {
         addReplyErrorFormat(c, "Device ID %lu is not valid.", device_id);
         return;
     }
+    IPC_Pipe* builder = &pipes[device_id];
 
     // First check if the child process actually exists
-    if(!pipes[device_id].child_pid) {
+    if(!builder->child_pid) {
+        // Might be waiting to be restarted, in which case don't
+        if(builder->wanted) {
+            builder->wanted = 0;
+            builder->restart_at_ms = 0;
+            addReplyStatus(c, "OK");
+            return;
+        }
         addReplyLongLong(c, (long long) -1);
         return;
     }
+    if(builder->stop_client) {
+        addReplyError(c, "Builder is already being stopped");
+        return;
+    }
 
-    // TODO, I want to send "SIGTERM" so the child process exits on its own,
-    // but I also need to send SIGKILL if it hasn't exited after a short amount
-    // of time. Should perhaps create a time event to check & kill the process
-    //kill(pipes[device_id].child_pid, SIGKILL);
-    kill(pipes[device_id].child_pid, SIGTERM);
-    // TODO, should somehow make sure waitpid never hangs
-    waitpid(pipes[device_id].child_pid, &status, 0);
-    clean_up_child_process_pipes(&pipes[device_id]);
-    addReplyStatus(c, "OK");
+    // Ask nicely, supervise_builders() sends a SIGKILL if it hasn't exited
+    // after STOP_TIMEOUT_MS. The reply goes out once it's been reaped.
+    builder->wanted = 0;
+    builder->restart_at_ms = 0;
+    builder->kill_at_ms = now_ms() + STOP_TIMEOUT_MS;
+    kill(builder->child_pid, SIGTERM);
+    if(c->flags & CLIENT_MULTI) {
+        // Can't wait inside an EXEC
+        addReplyStatus(c, "OK");
+        return;
+    }
+    builder->stop_client = c;
+    blockClient(c, builder, clean_up_stop_client);
 }
 
 void clean_up_disconnected_client(client* c, void* data) {
@@ -322,7 +767,7 @@ void clean_up_disconnected_client(client* c, void* data) {
         // too computationally expensive.
         ManagerIOList* this_list = pipes[i].cmd_list;
         while(this_list) {
-            if(pipes[i].cmd_list->client->id == c->id) {
+            if(this_list->client && this_list->client->id == c->id) {
                 // If here then we've found a command that was requested by our
                 // client that we need to get rid of. But the correct way to
                 // get rid of a request is a little tricky. The correct way
@@ -337,7 +782,7 @@ void clean_up_disconnected_client(client* c, void* data) {
                 // it'll get handled like normal, just not responded too.
                 // Potentially a waste of resources cause commands that no one
                 // will ever hear get sent, but that's not a big deal probably.
-                pipes[i].cmd_list->client = NULL;
+                this_list->client = NULL;
             }
             this_list = this_list->next;
         }
@@ -393,14 +838,36 @@ void display_headers_command(client* c, int argc, sds* argv) {
     builder_send_command_generic(c, &(pipes[device_id]), cmd);
 }
 
+// Gets a running builder's status out of shared memory. Returns 0 on
+// success, otherwise replies to the client with an error and returns -1.
+static int read_builder_status(client* c, unsigned long device_id, BuilderStatus* status) {
+    if(!pipes[device_id].child_pid) {
+        addReplyError(c, "Requested builder is not running");
+        return -1;
+    }
+    if(builder_status_read(&builder_statuses[device_id], status)) {
+        addReplyError(c, "Could not read the builder's status");
+        return -1;
+    }
+    // Hasn't gotten going yet, has zeros which is the right answer
+    return 0;
+}
+
 void get_num_built_command(client* c, int argc, sds* argv) {
     UNUSED(argc);
     ManagerIO cmd;
+    BuilderStatus status;
     unsigned long device_id = strtoul(argv[1], NULL, 0);
     if(device_id >= 32) {
         addReplyErrorFormat(c, "Device ID %lu is not valid.", device_id);
         return;
     }
+    if(builder_statuses) {
+        if(read_builder_status(c, device_id, &status) == 0) {
+            addReplyLongLong(c, status.event_count);
+        }
+        return;
+    }
 
     cmd.command = CMD_NUMBUILT;
     builder_send_command_generic(c, &(pipes[device_id]), cmd);
@@ -409,16 +876,76 @@ void get_num_built_command(client* c, int argc, sds* argv) {
 void is_builder_reeling_command(client* c, int argc, sds* argv) {
     UNUSED(argc);
     ManagerIO cmd;
+    BuilderStatus status;
     unsigned long device_id = strtoul(argv[1], NULL, 0);
     if(device_id >= 32) {
         addReplyErrorFormat(c, "Device ID %lu is not valid.", device_id);
         return;
     }
+    if(builder_statuses) {
+        if(read_builder_status(c, device_id, &status) == 0) {
+            addReplyLongLong(c, status.reeling);
+        }
+        return;
+    }
 
     cmd.command = CMD_ISREELING;
     builder_send_command_generic(c, &(pipes[device_id]), cmd);
 }
 
+static void add_reply_field(client* c, const char* name, long long value) {
+    addReplyBulkCBuffer(c, name, strlen(name));
+    addReplyLongLong(c, value);
+}
+
+#define NUM_BUILDER_STATS_FIELDS 16
+// Replies with an array holding an entry for each running builder. Each
+// entry is an array of field name/value pairs.
+void get_all_builder_stats_command(client* c, int argc, sds* argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    BuilderStatus status;
+    long long now = ustime();
+    int num_running = 0;
+    int i;
+    if(!builder_statuses) {
+        addReplyError(c, "Builder stats are not available");
+        return;
+    }
+    for(i=0; i<MAX_NUM_BUILDERS; i++) {
+        num_running += pipes[i].child_pid ? 1 : 0;
+    }
+    addReplyLongLongWithPrefix(c, num_running, '*');
+    for(i=0; i<MAX_NUM_BUILDERS; i++) {
+        int ok;
+        if(!pipes[i].child_pid) {
+            continue;
+        }
+        ok = builder_status_read(&builder_statuses[i], &status) == 0 && status.seq;
+        if(!ok) {
+            memset(&status, 0, sizeof(status));
+        }
+        addReplyLongLongWithPrefix(c, 2*NUM_BUILDER_STATS_FIELDS, '*');
+        add_reply_field(c, "builder", i);
+        add_reply_field(c, "pid", pipes[i].child_pid);
+        add_reply_field(c, "restarts", pipes[i].num_restarts);
+        add_reply_field(c, "connected_to_fpga", status.connected_to_fpga);
+        add_reply_field(c, "reeling", status.reeling);
+        add_reply_field(c, "reeling_count", status.reeling_count);
+        add_reply_field(c, "num_built", status.event_count);
+        add_reply_field(c, "trigger_id", status.trigger_id);
+        add_reply_field(c, "device_id", status.device_id);
+        add_reply_field(c, "latest_timestamp", status.latest_timestamp);
+        add_reply_field(c, "bytes_read", status.bytes_read);
+        add_reply_field(c, "bytes_written", status.bytes_written);
+        add_reply_field(c, "ring_used", status.ring_used);
+        add_reply_field(c, "ring_size", status.ring_size);
+        add_reply_field(c, "uptime_ms", (long long)(status.uptime/1000));
+        // -1 if the builder hasn't written its status yet
+        add_reply_field(c, "status_age_ms", ok ? (now - status.update_time_us)/1000 : -1);
+    }
+}
+
 void get_builder_pid_command(client* c, int argc, sds* argv) {
     UNUSED(argc);
     unsigned long device_id = strtoul(argv[1], NULL, 0);
@@ -442,21 +969,12 @@ static ServerCommand commandTable[] = {
     {"get_num_built", get_num_built_command, NULL, 2, 1, 0, 0},
     {"get_builder_pid", get_builder_pid_command, NULL, 2, 1, 0, 0},
     {"get_active_builders", get_active_builders_command, NULL, 1, 1, 0, 0},
+    {"get_all_builder_stats", get_all_builder_stats_command, NULL, 1, 1, 0, 0},
     {"", NULL, NULL, 0, 0, 0, 0} // Must be last
 };
 
-ServerCommand* search_for_command(ServerCommand* table, const char* command_name) {
-    int cmd_index = 0;
-    while(table[cmd_index].func != NULL) {
-        if(strcmp(table[cmd_index].name, command_name) == 0) {
-            break;
-        }
-        cmd_index +=1;
-    }
-    return &(table[cmd_index]);
-}
-
 int server_main(int port) {
+    int i;
 
     // TODO these parameters should be user settable somehow
     setup_logger(LOGGER_NAME, DEFAULT_REDIS_HOST, LOG_FILENAME,
@@ -477,21 +995,78 @@ int server_main(int port) {
     server_command_table = commandTable;
     initServer();
 
+    builder_statuses = builder_status_create(MAX_NUM_BUILDERS);
+    if(!builder_statuses) {
+        daq_log(LOG_WARN, "Could not map shared memory for builder status: %s", strerror(errno));
+    }
+    for(i=0; i<MAX_NUM_BUILDERS + MAX_STANDBY; i++) {
+        IPC_Pipe* this_pipe = i < MAX_NUM_BUILDERS ? &pipes[i] : &standbys[i - MAX_NUM_BUILDERS];
+        this_pipe->device_index = -1;
+        this_pipe->p2c_pipe[0] = this_pipe->p2c_pipe[1] = -1;
+        this_pipe->c2p_pipe[0] = this_pipe->c2p_pipe[1] = -1;
+    }
+#ifdef __linux__
+    // Exited builders get noticed through a signalfd, SIGCHLD has to be
+    // blocked for that to work
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+        sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+    if(sigchld_fd >= 0) {
+        aeCreateFileEvent(server.el, sigchld_fd, AE_READABLE, sigchld_proc, NULL);
+    }
+    else {
+        daq_log(LOG_WARN, "Could not set up signalfd for SIGCHLD, exited builders will be noticed late");
+    }
+#endif
+    // First run sets up the standbys
+    aeCreateTimeEvent(server.el, 1, supervise_builders, NULL, NULL);
+
     aeSetBeforeSleepProc(server.el, beforeSleep);
     //aeSetAfterSleepProc(server.el,afterSleep);
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
 
+    if(start_data_builder >= 0 || standby_index >= 0) {
+        // Forked child, the logger's already been cleaned up
+        return 0;
+    }
     daq_log(LOG_WARN,"Cntrl-C found, quitting");
     cleanup_logger();
     return 0;
 }
 
+// In a standby process, waits for zookeeper to say which device to build
+// for. Returns the device ID or -1 if zookeeper went away.
+static int wait_for_assignment(void) {
+    IPC_Pipe* standby = &standbys[standby_index];
+    ManagerIO assignment;
+    ssize_t nbytes;
+    do {
+        nbytes = read(standby->p2c_pipe[READ_PIPE_IDX], &assignment, sizeof(assignment));
+    } while(nbytes < 0 && errno == EINTR && !end_main_loop);
+    if(nbytes != sizeof(assignment) || assignment.command != CMD_ASSIGN_DEVICE ||
+       assignment.arg < 0 || assignment.arg >= MAX_NUM_BUILDERS) {
+        return -1;
+    }
+    pipes[assignment.arg] = *standby;
+    pipes[assignment.arg].device_index = assignment.arg;
+    return assignment.arg;
+}
+
 void print_help_message(void) {
     printf("zookeeper: runs a server that allows clients to request data builders to be started/stopped and provides monitoring.\n"
-            "\tusage: zookeeper [--port port] [--help]\n"
+            "\tusage: zookeeper [--port port] [--hang-timeout ms] [--stall-timeout ms] [--standby n] [--broker path] [--log-rate " LOG_RATE_OPTION_HELP "] [--help]\n"
             "\targuments:\n"
-            "\t--port -p\tPort for server to listen to connections on.\n");
+            "\t--port -p\tPort for server to listen to connections on.\n"
+            "\t--hang-timeout -t\tKill & restart a builder that doesn't answer a command for this long. Default %i ms.\n"
+            "\t--stall-timeout -s\tKill & restart a builder that doesn't build an event for this long. Default is to not.\n"
+            "\t--standby -n\tNumber of forked builders to keep waiting so starting one is quick. Default %i, at most %i.\n"
+            "\t--broker -b\tHave the builders send UDP control requests through the fnet_broker listening on this unix socket.\n"
+            "\t--log-rate -L\tLimit how often each log message of LEVEL can be written, RATE per second (0 for no limit). Can be given once per level, applies to the builders too. ERRORs aren't limited by default.\n",
+            DEFAULT_HANG_TIMEOUT_MS, DEFAULT_NUM_STANDBY, MAX_STANDBY);
 }
 
 int main(int argc, char** argv) {
@@ -499,16 +1074,22 @@ int main(int argc, char** argv) {
     int i;
     int port = -1; // -1 will go with the default option
     int dry_run = 0;
+    const char* broker_sock = NULL;
     struct option clargs[] = {
         {"port", required_argument, NULL, 'p'},
         {"dry-run", no_argument, NULL, 'd'},
+        {"hang-timeout", required_argument, NULL, 't'},
+        {"stall-timeout", required_argument, NULL, 's'},
+        {"standby", required_argument, NULL, 'n'},
+        {"broker", required_argument, NULL, 'b'},
+        {"log-rate", required_argument, NULL, 'L'},
         //{"verbose", no_argument, NULL, 'v'},
         {"help", no_argument, NULL, 'h'},
         { 0, 0, 0, 0}};
 
     int optindex;
     int opt;
-    while( (opt = getopt_long(argc, argv, "p:dh", clargs, &optindex)) != -1)  {
+    while( (opt = getopt_long(argc, argv, "p:dt:s:n:b:L:h", clargs, &optindex)) != -1)  {
         switch(opt) {
             case 'p':
                 port = strtoul(optarg, NULL, 0);
@@ -516,6 +1097,28 @@ int main(int argc, char** argv) {
             case 'd':
                 dry_run = 1;
                 break;
+            case 't':
+                hang_timeout_ms = strtoll(optarg, NULL, 0);
+                break;
+            case 's':
+                stall_timeout_ms = strtoll(optarg, NULL, 0);
+                break;
+            case 'n':
+                num_standby = strtol(optarg, NULL, 0);
+                if(num_standby < 0 || num_standby > MAX_STANDBY) {
+                    printf("Number of standbys must be between 0 and %i\n", MAX_STANDBY);
+                    return 1;
+                }
+                break;
+            case 'b':
+                broker_sock = optarg;
+                break;
+            case 'L':
+                if(daq_log_parse_rate_limit(optarg)) {
+                    printf("Log rate limit '%s' isn't " LOG_RATE_OPTION_HELP "\n", optarg);
+                    return 1;
+                }
+                break;
             case 'h':
             default:
                 print_help_message();
@@ -525,6 +1128,9 @@ int main(int argc, char** argv) {
     printf("Starting server, listening on port %i\n", port);
     server_main(port);
 
+    if(standby_index >= 0) {
+        start_data_builder = wait_for_assignment();
+    }
     if(start_data_builder >= 0) {
         struct BuilderConfig the_config = default_builder_config();
 
@@ -552,14 +1158,17 @@ int main(int argc, char** argv) {
 
         snprintf(log_filename_buffer, 64, "zookeeper_data_builder_%i.log", builder_id);
         the_config.error_filename = log_filename_buffer;
+        the_config.broker_sock = broker_sock;
         //config.redis_host = DEFAULT_REDIS_HOST;
         the_config.in_pipe = pipes[builder_id].p2c_pipe[READ_PIPE_IDX];
         the_config.out_pipe = pipes[builder_id].c2p_pipe[WRITE_PIPE_IDX];
+        the_config.status = builder_statuses ? &builder_statuses[builder_id] : NULL;
 
-#ifdef __unix__
+#ifdef __linux__
         // Rename the process for easier debugging & inspection
-        snprintf(16, buffer, "zk_db_%i", builder_id);
-        prctl(PR_SET_NAME, buffer);
+        char process_name[16];
+        snprintf(process_name, sizeof(process_name), "zk_db_%i", builder_id);
+        prctl(PR_SET_NAME, process_name);
 #endif
         data_builder_main(the_config);
 
@@ -567,7 +1176,7 @@ int main(int argc, char** argv) {
         free(log_filename_buffer);
         free(log_name);
     }
-    else {
+    else if(standby_index < 0) {
         // Kill all the child processes that are around.
         int status;
         for(i =0; i<MAX_NUM_BUILDERS; i++) {
@@ -577,6 +1186,13 @@ int main(int argc, char** argv) {
                 //clean_up_child_process_pipes(&pipes[i])
             }
         }
+        for(i =0; i<MAX_STANDBY; i++) {
+            if(standbys[i].child_pid > 0) {
+                kill(standbys[i].child_pid, SIGKILL);
+                waitpid(standbys[i].child_pid, &status, 0);
+            }
+        }
+        builder_status_destroy(builder_statuses, MAX_NUM_BUILDERS);
     }
     return 0;
 }
@@ -1,135 +1,95 @@
 import socket
 
 import numpy as np
+import hiredis
 import argparse
-from time import sleep
-from collections import defaultdict
-from fpga_spi import adc_spi, lmk_spi, grab_response, connect_to_local_client, SPI_Device
-from readback_config import write_page_addr, read_reg
-from configure_adc_and_clock import parse_config_file, do_programming
+from ceres_fpga_spi import connect_to_fpga, SPI_Device
+from configure_adc_and_clock import parse_config_file, do_bulk_programming, send_command
 
 
-def replace_instructions(instructions, replacements):
-    new_instructions = instructions.copy()
-    for addr, new_value in replacements:
-        # TODO this is ADS only...maybe someday wanna do this for LMK stuff too
-        index = [i for i, (chip, _addr, _) in enumerate(new_instructions) if 
-                                                    chip=="ADS" and _addr==addr]
-        if( len(index)!= 1):
-            # Just toss an error, I aint got time for this
-            raise Exception("Make sure the instructions have the desired replacement address in them dummkopf")
-        index = index[0]
-        old_val = new_instructions[index]
-        new_line = (old_val[0], old_val[1], new_value)
-        new_instructions[index] = new_line
-    return new_instructions
-
-def do_jesd_reset(server):
-    server[0].write("jesd_sys_reset\n".encode("ascii"))
-    return grab_response(server)
-
-def check_jesd_synced(server, which_adc):
-    if(which_adc == SPI_Device.ADC_A):
-        server[0].write("jesd_a_is_synced\n".encode("ascii"))
-    elif(which_adc == SPI_Device.ADC_B):
-        server[0].write("jesd_b_is_synced\n".encode("ascii"))
-    return grab_response(server)
-
-def setup_jesd_error_stuff(server, which_adc):
-    JESD_ERROR_REPORTING_OFFSET = 0x34
-    # 0x1 enables the error counters
-    # 0x8 disables error reporting with sync
-    error_reporting_value = 0x1 | 0x8
-    command = "jesd_a_write" if which_adc == SPI_Device.ADC_A else "jesd_b_write"
-    command = "%s 0x%x 0x%x\n" % (command, JESD_ERROR_REPORTING_OFFSET, error_reporting_value)
-    server[0].write(command.encode("ascii"))
-    return grab_response(server)
-
-def check_error_rates(server, adcs):
-    count = 5
-    #err_rates = np.zeros(1, [("A", np.float32, 4), ("B", np.float32, 4), ("SYNCA", np.float32), ("SYNCB", np.float32)])
-    err_rates = np.zeros(1, [("A", np.float32, 4), ("SYNCA", np.float32)])
-    for _ in range(count):
-        # First collect the error rates
-        fpga_conn[0].write("read_all_error_rates\r\n".encode("ascii"))
-        err_rates.view(np.float32)[:] = np.array(grab_response(fpga_conn))
-
-    err_rates.view(np.float32)[:] /= float(count)
-    return err_rates
-
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("--adc_a", action="store_true", help="send commands to ADC A")
     parser.add_argument("--adc_b", action="store_true", help="send commands to ADC B")
     parser.add_argument("--adc_c", action="store_true", help="send commands to ADC C")
     parser.add_argument("--adc_d", action="store_true", help="send commands to ADC D")
-    parser.add_argument("--ti", action="store_true", help="send commands to TI/MASADA ADC ")
+    parser.add_argument("--config", type=str, default="configs/HERMES_Config.cfg", help="ADC config to program before scanning")
+    parser.add_argument("--dwell", type=float, default=2.5, help="Seconds to count errors for at each setting")
+    parser.add_argument("--xem-mask", type=str, default=None, help="Mask to indicate which XEMs should be scanned (CERES server only)")
+    parser.add_argument("--port", type=int, default=4002, help="Port to connect to server at")
+    parser.add_argument("--out", type=str, default="scan_data_out_new_suppy.dat", help="File to write the error rates to")
 
     args = parser.parse_args()
 
-    fpga_conn = connect_to_local_client()
-    if not args.ti:
-        adcs = [SPI_Device.ADC_A if args.adc_a else None,
-                SPI_Device.ADC_B if args.adc_b else None,
-                SPI_Device.ADC_C if args.adc_c else None,
-                SPI_Device.ADC_D if args.adc_d else None]
-    else:
-        adcs = [SPI_Device.TI_ADC]
+    adcs = [SPI_Device.ADC_A if args.adc_a else None,
+            SPI_Device.ADC_B if args.adc_b else None,
+            SPI_Device.ADC_C if args.adc_c else None,
+            SPI_Device.ADC_D if args.adc_d else None]
 
-    #adcs = [x for x in adcs if x is not None]
     if not any(adcs):
-        print("Must specify if you want to send to ADC A or B")
+        print("Must specify which ADCs to scan")
         exit()
+    adc_mask = sum([1<<i for i, adc in enumerate(adcs) if adc is not None])
+    adcs = [x for x in adcs if x is not None]
 
-    # TODO, don't hardcode this
-    fn = "lmk_tools/HERMES_Config.cfg"
-    if args.ti:
-        fn = "lmk_tools/MASADA_Config.cfg"
+    fpga_conn = connect_to_fpga(port=args.port)
+    if(args.xem_mask is not None):
+        resp = send_command(fpga_conn, "set_active_xem_mask", int(args.xem_mask, base=0))
+        if(type(resp) == hiredis.ReplyError):
+            print("Error while setting XEM Mask: %s" % str(resp))
+            exit(1)
 
-    with open(fn, 'r') as f:
+    with open(args.config, 'r') as f:
         instructions = parse_config_file(f)
+    with open(args.config, 'rb') as f:
+        program_text = f.read()
+    if not do_bulk_programming(fpga_conn, adcs, program_text, instructions):
+        exit(1)
 
     valid_emphasis_values  = [x<<2 for x in [0, 1, 3, 7, 15, 31, 63]]
     emphasis_addr = [0x6A0012, 0x6A0013]
     swing_addr = 0x6A001B
     valid_swing_values  = [x<<5 for x in [0, 1, 2, 3, 4, 5, 6, 7]]
-    #valid_values = {0x6A0012: valid_emphasis_values, 0x6A0013: valid_emphasis_values,
-    #                0x6A001B: valid_swing_values}
 
-    error_rates = {}
+    # The whole sweep is done by the server, the last parameter changes fastest
+    def param(addr, values):
+        return "adc:0x%X=%s" % (addr, ",".join([str(x) for x in values]))
+    params = [param(swing_addr, valid_swing_values),
+              param(emphasis_addr[0], valid_emphasis_values),
+              param(emphasis_addr[1], valid_emphasis_values)]
+
+    print("Scanning %i settings" % (len(valid_swing_values)*len(valid_emphasis_values)**2))
+    resp = send_command(fpga_conn, "jesd_scan", adc_mask, int(args.dwell*1000), *params)
+    if(type(resp) == hiredis.ReplyError):
+        print("Scan failed: %s" % str(resp))
+        exit(1)
+    if(args.xem_mask is not None):
+        # One reply per XEM, keyed by XEM index in the output
+        xem_mask = int(args.xem_mask, base=0)
+        xems = [i for i in range(32) if (xem_mask & (1<<i))]
+    else:
+        xems = [None]
+        resp = [resp]
 
-    for adc in adcs:
-        if adc is None:
+    error_rates = {}
+    for xem, xem_resp in zip(xems, resp):
+        if(type(xem_resp) == hiredis.ReplyError):
+            print("Scan failed on XEM %s: %s" % (str(xem), str(xem_resp)))
             continue
-        setup_jesd_error_stuff(fpga_conn, adc)
-    setup_jesd_error_stuff(fpga_conn, SPI_Device.ADC_B)
-
-    print("Main loop")
-    for swing in valid_swing_values:
-        for emph_a in valid_emphasis_values:
-            for emph_b in valid_emphasis_values:
-            ## LOOP OVER ALL VALUES
-                print("Swing = ", swing)
-                print("emph_a = ", emph_a)
-                print("emph_b = ", emph_b)
-                key = (swing, emph_a, emph_b)
-                new_instructions = replace_instructions(instructions, [(emphasis_addr[0], emph_a),
-                                                                       (emphasis_addr[1], emph_b),
-                                                                       (swing_addr, swing)])
-                do_programming(fpga_conn, adcs, new_instructions)
-                do_jesd_reset(fpga_conn)
-
-                error_rates[key] = check_error_rates(fpga_conn, adcs)
-
-                if(check_jesd_synced(fpga_conn, SPI_Device.ADC_A) == 0):
-                    error_rates[key]["A"][:] = np.inf
-                    error_rates[key]["SYNCA"] = np.inf
-                    print("A not synced")
-
-                if(check_jesd_synced(fpga_conn, SPI_Device.ADC_B) == 0):
-                    error_rates[key]["B"][:] = np.inf
-                    error_rates[key]["SYNCB"] = np.inf
-                    print("B not synced")
-
-    with open("scan_data_out_new_suppy.dat", "w") as fout:
+        for row in xem_resp:
+            if(type(row) == hiredis.ReplyError):
+                print(str(row))
+                continue
+            timestamp, dwell_us, swing, emph_a, emph_b, sync_mask = row[:6]
+            errors = np.array(row[6:], dtype=np.float32)/(dwell_us/1e6)
+            key = (swing, emph_a, emph_b) if xem is None else (xem, swing, emph_a, emph_b)
+            error_rates[key] = {}
+            for i, adc in enumerate(adcs):
+                rates = errors[4*i:4*i+4]
+                if not (sync_mask & (1<<i)):
+                    rates[:] = np.inf
+                    print("%s not synced at %s" % (adc.name, str(key)))
+                error_rates[key][adc.name] = rates
+
+    with open(args.out, "w") as fout:
         fout.write(str(error_rates))